@@ -0,0 +1,9 @@
+#!/bin/sh
+# 示例CGI脚本: 访问 /cgi/hello.sh 输出CGI环境变量和请求体
+printf 'Content-Type: text/plain\r\n\r\n'
+echo "Hello from $SCRIPT_NAME"
+env | grep -E '^(REQUEST_|QUERY_|PATH_INFO|SCRIPT_|CONTENT_|HTTP_|REMOTE_|SERVER_|GATEWAY_)' | sort
+if [ -n "$CONTENT_LENGTH" ]; then
+    echo "body:"
+    head -c "$CONTENT_LENGTH"
+fi
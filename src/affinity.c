@@ -0,0 +1,102 @@
+#define _GNU_SOURCE // cpu_set_t pthread_setaffinity_np
+#include "server.h"
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+
+static int cpu_list[AFFINITY_MAX_CPUS];
+static int cpu_count;           // 0表示不绑定
+static cpu_set_t original;      // 启动时进程可以用的CPU
+
+int affinity_parse(const char *list, int *cpus, int max) {
+	int n = 0;
+	if (strcmp(list, "auto") == 0) {
+		cpu_set_t set;
+		if (sched_getaffinity(0, sizeof(set), &set) == -1) return -1;
+		for (int c = 0; c < CPU_SETSIZE && n < max; c++) {
+			if (CPU_ISSET(c, &set)) cpus[n++] = c;
+		}
+		return n;
+	}
+	for (const char *p = list; *p;) {
+		char *end;
+		long first = strtol(p, &end, 10), last = first;
+		if (end == p || first < 0 || first >= AFFINITY_MAX_CPUS) return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last >= AFFINITY_MAX_CPUS) return -1;
+		}
+		for (long c = first; c <= last; c++) {
+			if (n == max) return -1;
+			cpus[n++] = (int)c;
+		}
+		if (*end == ',') end++;
+		else if (*end) return -1;
+		p = end;
+	}
+	return n;
+}
+
+int affinity_init(void) {
+	if (sched_getaffinity(0, sizeof(original), &original) == -1) CPU_ZERO(&original);
+	if (!server_options.cpus) return 0;
+	cpu_count = affinity_parse(server_options.cpus, cpu_list, AFFINITY_MAX_CPUS);
+	if (cpu_count <= 0) {
+		log_error("bad cpus: %s", server_options.cpus);
+		return -1;
+	}
+	if (server_options.loops > 1 && server_options.loops > cpu_count) {
+		log_warn("%d event loops on %d CPU(s), connections are not steered by CPU", server_options.loops, cpu_count);
+	}
+	return 0;
+}
+
+int affinity_steering(void) {
+	return server_options.loops > 1 && server_options.loops <= cpu_count;
+}
+
+void affinity_pin(int loop) {
+	if (cpu_count == 0) return;
+	int cpu = cpu_list[loop % cpu_count];
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		log_warn("event loop %d: cannot pin to CPU %d: %s", loop, cpu, strerror(err));
+		return;
+	}
+	unsigned int now_cpu = 0, node = 0;
+	syscall(SYS_getcpu, &now_cpu, &node, NULL);
+	log_info("event loop %d pinned to CPU %d (NUMA node %u)", loop, cpu, node);
+}
+
+void affinity_attach(const int *fds, int count) {
+	// 内核6.1以后组里没有程序时 也先选SO_INCOMING_CPU和收包CPU相同的socket 程序挂不上时还有这一层
+	for (int k = 0; k < count; k++) {
+		int cpu = cpu_list[k % cpu_count];
+		if (setsockopt(fds[k], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+			log_warn("SO_INCOMING_CPU failed: %s", strerror(errno));
+		}
+	}
+	// A = 收包的CPU 是某个循环绑定的CPU时返回这个循环的下标 否则按CPU取模
+	// 返回值是socket在组里的下标 按加入的顺序 即fds中的顺序
+	struct sock_filter code[2 * MAX_LOOPS + 3];
+	int n = 0;
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (int k = 0; k < count; k++) {
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu_list[k % cpu_count], 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, k);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+	struct sock_fprog prog = { .len = n, .filter = code };
+	if (setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		log_warn("SO_ATTACH_REUSEPORT_CBPF failed, connections are spread by hash: %s", strerror(errno));
+	}
+}
+
+void affinity_reset(void) {
+	if (cpu_count > 0 && CPU_COUNT(&original) > 0) sched_setaffinity(0, sizeof(original), &original);
+}
@@ -0,0 +1,27 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+// 事件循环绑定CPU 新连接按收包的CPU交给绑定在那个CPU上的事件循环
+// 配置项cpus为空时都不做 auto表示启动时进程可以用的所有CPU 否则是CPU列表 如"0-3,8,10"
+// 事件循环k绑定列表中第k个CPU(循环比CPU多时从头再来) 绑定之后才分配它的客户端数组和缓冲区
+// 内核在第一次写的时候从当前CPU所在的NUMA节点分配物理页 这些内存就都在本地节点上
+// 循环个数不超过CPU个数时 每个TCP监听地址为每个循环各开一个socket(同一个SO_REUSEPORT组)
+// 挂一个CBPF程序按收到SYN的CPU选socket 网卡队列的中断绑定到同一组CPU时 一个连接从收包到处理都在同一个核上
+
+#define MAX_LOOPS 64 // 事件循环线程数上限
+#define AFFINITY_MAX_CPUS 1024 // cpus中CPU编号的上限 同CPU_SETSIZE
+
+// 解析CPU列表 写到cpus 返回CPU个数 格式错误或者编号超出范围返回-1
+int affinity_parse(const char *list, int *cpus, int max);
+// 按server_options.cpus初始化 记下进程原来可以用的CPU 在打开监听socket之前调用 失败返回-1
+int affinity_init(void);
+// 是否每个事件循环各开一个监听socket 按CPU分流
+int affinity_steering(void);
+// 调用线程绑定到事件循环loop的CPU 没有配置cpus时什么都不做
+void affinity_pin(int loop);
+// 同一个监听地址的一组socket fds[k]给事件循环k 设置SO_INCOMING_CPU并挂上分流程序
+void affinity_attach(const int *fds, int count);
+// fork出的子进程(CGI脚本 升级后的新进程)恢复进程原来可以用的CPU 异步信号安全
+void affinity_reset(void);
+
+#endif
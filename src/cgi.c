@@ -0,0 +1,414 @@
+#define _GNU_SOURCE // pipe2
+#include "cgi.h"
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdint.h>
+
+#define CGI_HEADER_MAX 4096 // 转换后的响应头最大长度
+
+char CGI_ROOT[4096];
+
+// 每个脚本当前运行的进程数 只在启动和结束CGI时访问 用一把锁保护即可
+typedef struct{
+    char name[CGI_NAME_MAX];
+    int running;
+} CgiScript;
+
+static CgiScript scripts[CGI_MAX_SCRIPTS];
+static int script_count;
+static pthread_mutex_t script_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 占用脚本的一个并发名额 返回脚本下标 已满返回-1
+static int script_acquire(const char *name, int max_per_script) {
+    int idx = -1;
+    pthread_mutex_lock(&script_lock);
+    for (int i = 0; i < script_count; i++) {
+        if (strcmp(scripts[i].name, name) == 0) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx == -1 && script_count < CGI_MAX_SCRIPTS) {
+        idx = script_count++;
+        snprintf(scripts[idx].name, sizeof(scripts[idx].name), "%s", name);
+    }
+    if (idx != -1 && scripts[idx].running >= max_per_script) idx = -1;
+    if (idx != -1) scripts[idx].running++;
+    pthread_mutex_unlock(&script_lock);
+    return idx;
+}
+
+static void script_release(int idx) {
+    pthread_mutex_lock(&script_lock);
+    scripts[idx].running--;
+    pthread_mutex_unlock(&script_lock);
+}
+
+int cgi_match(const HttpRequest *req) {
+    size_t len = strlen(CGI_PREFIX);
+    return req->uri_len > len && memcmp(req->uri, CGI_PREFIX, len) == 0;
+}
+
+// ----------------------环境变量-----------------------
+
+// 追加"name=value" value长度为value_len 放不下时丢弃
+static void env_add(CgiEnv *env, const char *name, const char *value, size_t value_len) {
+    size_t name_len = strlen(name);
+    if (env->count == CGI_ENV_MAX || env->len + name_len + value_len + 2 > CGI_ENV_BUF) return;
+    char *var = env->buf + env->len;
+    memcpy(var, name, name_len);
+    var[name_len] = '=';
+    memcpy(var + name_len + 1, value, value_len);
+    var[name_len + 1 + value_len] = '\0';
+    env->len += name_len + value_len + 2;
+    env->vars[env->count++] = var;
+}
+
+static void env_add_str(CgiEnv *env, const char *name, const char *value) {
+    env_add(env, name, value, strlen(value));
+}
+
+// 每个请求头导出为HTTP_<名字> 名字转大写 '-'换成'_'
+// Content-Length/Content-Type已经有对应的变量 认证信息按RFC 3875的建议不导出
+// Proxy头不导出 否则成为HTTP_PROXY 脚本里的HTTP库会把它当作代理设置(httpoxy)
+static void env_add_headers(CgiEnv *env, const char *head, size_t head_len) {
+    const char *p = head, *end = head + head_len;
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol) return;
+    for (p = eol + 1; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1) {
+        const char *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+        const char *colon = memchr(p, ':', line_end - p);
+        size_t name_len = colon ? (size_t)(colon - p) : 0;
+        if (name_len == 0 || name_len > 64) continue;
+        if ((name_len == 14 && strncasecmp(p, "Content-Length", 14) == 0) ||
+            (name_len == 12 && strncasecmp(p, "Content-Type", 12) == 0) ||
+            (name_len == 13 && strncasecmp(p, "Authorization", 13) == 0) ||
+            (name_len == 19 && strncasecmp(p, "Proxy-Authorization", 19) == 0) ||
+            (name_len == 5 && strncasecmp(p, "Proxy", 5) == 0)) continue;
+        char name[72] = "HTTP_";
+        for (size_t i = 0; i < name_len; i++) {
+            char c = p[i];
+            name[5 + i] = c == '-' ? '_' : (c >= 'a' && c <= 'z') ? c - 32 : c;
+        }
+        name[5 + name_len] = '\0';
+        const char *v = colon + 1;
+        while (v < line_end && (*v == ' ' || *v == '\t')) v++;
+        env_add(env, name, v, line_end - v);
+    }
+}
+
+int cgi_build_env(CgiEnv *env, const CgiRequest *creq, size_t prefix_len, char script_name[CGI_NAME_MAX]) {
+    const HttpRequest *req = creq->req;
+    const char *uri_end = req->uri + req->uri_len;
+    const char *name = req->uri + prefix_len;
+    const char *query = memchr(name, '?', uri_end - name);
+    const char *path_end = query ? query : uri_end;
+    const char *path_info = memchr(name, '/', path_end - name);
+    const char *name_end = path_info ? path_info : path_end;
+    size_t name_len = name_end - name;
+    if (name_len == 0 || name_len >= CGI_NAME_MAX) return -1;
+    memcpy(script_name, name, name_len);
+    script_name[name_len] = '\0';
+
+    // RFC 3875 第4.1节的变量
+    char num[32];
+    env->count = 0;
+    env->len = 0;
+    env_add_str(env, "GATEWAY_INTERFACE", "CGI/1.1");
+    env_add_str(env, "SERVER_SOFTWARE", "liso/1.1");
+    env_add_str(env, "SERVER_PROTOCOL", "HTTP/1.1");
+    const HeaderValue *host = &req->headers[HEADER_HOST];
+    if (host->len) {
+        const char *colon = memchr(host->value, ':', host->len);
+        env_add(env, "SERVER_NAME", host->value, colon ? (size_t)(colon - host->value) : host->len);
+    } else {
+        env_add_str(env, "SERVER_NAME", "localhost");
+    }
+    snprintf(num, sizeof(num), "%d", creq->server_port);
+    env_add_str(env, "SERVER_PORT", num);
+    env_add(env, "REQUEST_METHOD", req->method, req->method_len);
+    env_add(env, "REQUEST_URI", req->uri, req->uri_len);
+    env_add(env, "SCRIPT_NAME", req->uri, name_end - req->uri);
+    env_add(env, "PATH_INFO", path_info ? path_info : "", path_info ? (size_t)(path_end - path_info) : 0);
+    env_add(env, "QUERY_STRING", query ? query + 1 : "", query ? (size_t)(uri_end - query - 1) : 0);
+    env_add_str(env, "REMOTE_ADDR", creq->remote_addr);
+    snprintf(num, sizeof(num), "%d", creq->remote_port);
+    env_add_str(env, "REMOTE_PORT", num);
+    if (creq->content_length > 0) {
+        snprintf(num, sizeof(num), "%lld", (long long)creq->content_length);
+        env_add_str(env, "CONTENT_LENGTH", num);
+    }
+    const HeaderValue *type = &req->headers[HEADER_CONTENT_TYPE];
+    if (type->len) env_add(env, "CONTENT_TYPE", type->value, type->len);
+    // 不属于RFC 3875 但php-fpm等FastCGI程序靠它找到脚本
+    char filename[sizeof(CGI_ROOT) + CGI_NAME_MAX + 1];
+    snprintf(filename, sizeof(filename), "%s/%s", CGI_ROOT, script_name);
+    env_add_str(env, "SCRIPT_FILENAME", filename);
+    env_add_str(env, "PATH", "/usr/local/bin:/usr/bin:/bin");
+    env_add_headers(env, creq->head, creq->head_len);
+    env->vars[env->count] = NULL;
+    return 0;
+}
+
+// ----------------------进程管理-----------------------
+
+int cgi_spawn(const CgiRequest *creq, int max_per_script, CgiProcess *proc) {
+    // /cgi/<脚本名>[/PATH_INFO][?QUERY_STRING]
+    CgiEnv env;
+    char script_name[CGI_NAME_MAX];
+    if (cgi_build_env(&env, creq, strlen(CGI_PREFIX), script_name) == -1) return -1;
+    char script_path[sizeof(CGI_ROOT) + CGI_NAME_MAX + 1];
+    snprintf(script_path, sizeof(script_path), "%s/%s", CGI_ROOT, script_name);
+    struct stat st;
+    if (stat(script_path, &st) == -1 || !S_ISREG(st.st_mode) || access(script_path, X_OK) == -1) return -1;
+
+    int script = script_acquire(script_name, max_per_script);
+    if (script == -1) return -2;
+
+    // 两根管道都带O_CLOEXEC 子进程dup2到0/1后的副本不受影响
+    int in_pipe[2], out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) == -1) {
+        script_release(script);
+        return -3;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        script_release(script);
+        return -3;
+    }
+
+    char *argv[] = { script_path, NULL };
+    pid_t pid = fork();
+    if (pid == 0) {
+        // 子进程 只调用异步信号安全的函数
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL); // 服务器忽略了SIGPIPE 脚本需要默认行为
+        sigset_t none; // 屏蔽字会跨execve保留 服务器屏蔽了SIGHUP/SIGUSR2 脚本不应该继承
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        affinity_reset(); // 不和事件循环挤在同一个CPU上
+        if (chdir(CGI_ROOT) == -1) _exit(127);
+        execve(script_path, argv, env.vars);
+        _exit(127);
+    }
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    if (pid == -1) {
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        script_release(script);
+        return -3;
+    }
+    fcntl(in_pipe[1], F_SETFL, fcntl(in_pipe[1], F_GETFL) | O_NONBLOCK);
+    fcntl(out_pipe[0], F_SETFL, fcntl(out_pipe[0], F_GETFL) | O_NONBLOCK);
+    proc->pid = pid;
+    proc->in_fd = in_pipe[1];
+    proc->out_fd = out_pipe[0];
+    proc->script = script;
+    return 0;
+}
+
+// 管道已经关闭但还没回收的脚本 每个事件循环各一份 cgi_reap从超时检查里不阻塞地回收
+// 脚本退出之前一直占着并发名额 卡在不可中断睡眠里的脚本也不会拖住事件循环
+typedef struct{
+    pid_t pid;
+    int script;
+    int killed;
+    uint64_t deadline_ns;   // 过了还没退出就SIGKILL
+} CgiExiting;
+
+static __thread CgiExiting *exiting;
+static __thread int exiting_count, exiting_cap;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// 子进程已经退出(或者已经被回收)时释放并发名额 返回1
+static int try_reap(pid_t pid, int script) {
+    if (waitpid(pid, NULL, WNOHANG) == 0) return 0;
+    script_release(script);
+    return 1;
+}
+
+void cgi_release(CgiProcess *proc, int kill_now) {
+    if (proc->in_fd != -1) close(proc->in_fd);
+    if (proc->out_fd != -1) close(proc->out_fd);
+    proc->in_fd = proc->out_fd = -1;
+    if (proc->pid > 0) {
+        if (kill_now) kill(proc->pid, SIGKILL);
+        if (!try_reap(proc->pid, proc->script)) {
+            if (exiting_count == exiting_cap) {
+                int cap = exiting_cap ? exiting_cap * 2 : 16;
+                CgiExiting *grown = realloc(exiting, cap * sizeof(*grown));
+                if (!grown) {// 没有内存记下它 只能杀掉 留下僵尸进程也不阻塞
+                    kill(proc->pid, SIGKILL);
+                    script_release(proc->script);
+                    proc->pid = 0;
+                    return;
+                }
+                exiting = grown;
+                exiting_cap = cap;
+            }
+            exiting[exiting_count++] = (CgiExiting){
+                .pid = proc->pid,
+                .script = proc->script,
+                .killed = kill_now,
+                .deadline_ns = now_ns() + CGI_EXIT_GRACE_MS * 1000000ull,
+            };
+        }
+    }
+    proc->pid = 0;
+}
+
+int cgi_exiting(void) {
+    return exiting_count;
+}
+
+void cgi_reap(void) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < exiting_count;) {
+        CgiExiting *e = &exiting[i];
+        if (try_reap(e->pid, e->script)) {
+            exiting[i] = exiting[--exiting_count];
+            continue;
+        }
+        if (!e->killed && now >= e->deadline_ns) {
+            kill(e->pid, SIGKILL);
+            e->killed = 1;
+        }
+        i++;
+    }
+}
+
+// ----------------------响应头转换-----------------------
+
+static const char *reason_phrase(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+static int name_is(const char *name, size_t len, const char *s) {
+    return len == strlen(s) && strncasecmp(name, s, len) == 0;
+}
+
+int cgi_translate_header(char *buf, size_t *buf_len, size_t cap, int *keep_alive, int *status,
+                         off_t *body_len, int *chunked) {
+    size_t len = *buf_len;
+    // 先找到空行 脚本可能只用\n换行
+    const char *p = buf, *end = buf + len;
+    size_t head_len = 0;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) break;
+        if (eol == p || (eol == p + 1 && *p == '\r')) {
+            head_len = eol + 1 - buf;
+            break;
+        }
+        p = eol + 1;
+    }
+    if (head_len == 0) return len + CGI_HEADER_RESERVE >= cap ? -1 : 0;
+
+    char head[CGI_HEADER_MAX];
+    size_t out = 0;
+    int code = 0, has_location = 0;
+    const char *reason = NULL;
+    size_t reason_len = 0;
+    off_t content_length = -1;
+    // 透传的响应头先写在最前面 最后再把状态行等拼到前面
+    char fields[CGI_HEADER_MAX];
+    size_t fields_len = 0;
+    for (p = buf; p < buf + head_len; ) {
+        const char *eol = memchr(p, '\n', buf + head_len - p);
+        const char *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+        if (line_end == p) break;
+        const char *colon = memchr(p, ':', line_end - p);
+        if (!colon || colon == p) return -1;
+        size_t name_len = colon - p;
+        const char *v = colon + 1;
+        while (v < line_end && (*v == ' ' || *v == '\t')) v++;
+        size_t v_len = line_end - v;
+        if (name_is(p, name_len, "Status")) {
+            // "Status: 404 Not Found"
+            if (v_len < 3) return -1;
+            code = (v[0] - '0') * 100 + (v[1] - '0') * 10 + (v[2] - '0');
+            if (code < 100 || code > 599) return -1;
+            reason = v + 3;
+            while (reason < line_end && *reason == ' ') reason++;
+            reason_len = line_end - reason;
+        } else if (!name_is(p, name_len, "Connection") && !name_is(p, name_len, "Transfer-Encoding")) {
+            if (name_is(p, name_len, "Location")) has_location = 1;
+            if (name_is(p, name_len, "Content-Length")) {
+                content_length = 0;
+                for (size_t i = 0; i < v_len; i++) {
+                    if (v[i] < '0' || v[i] > '9') return -1;
+                    content_length = content_length * 10 + (v[i] - '0');
+                }
+            }
+            if (fields_len + (line_end - p) + 2 > sizeof(fields)) return -1;
+            memcpy(fields + fields_len, p, line_end - p);
+            fields_len += line_end - p;
+            memcpy(fields + fields_len, "\r\n", 2);
+            fields_len += 2;
+        }
+        p = eol + 1;
+    }
+    if (code == 0) code = has_location ? 302 : 200;
+    if (!reason || reason_len == 0) {
+        reason = reason_phrase(code);
+        reason_len = strlen(reason);
+    }
+    // 没有Content-Length时响应体按分块编码发送 不允许分块(HEAD)或者连接本来就要关闭时靠关闭连接标识响应结束
+    if (content_length >= 0 || !*keep_alive || code < 200 || code == 204 || code == 304) *chunked = 0;
+    if (content_length < 0 && !*chunked) *keep_alive = 0;
+
+    char date[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %.*s\r\nServer: liso/1.1\r\nDate: %s\r\n",
+                     code, (int)reason_len, reason, date);
+    if (n < 0 || (size_t)n + fields_len + 64 > sizeof(head)) return -1;
+    out = n;
+    memcpy(head + out, fields, fields_len);
+    out += fields_len;
+    if (*chunked) out += snprintf(head + out, sizeof(head) - out, "Transfer-Encoding: chunked\r\n");
+    out += snprintf(head + out, sizeof(head) - out, "Connection: %s\r\n\r\n", *keep_alive ? "keep-alive" : "close");
+
+    size_t body = len - head_len;
+    if (out + body > cap) return -1;
+    memmove(buf + out, buf + head_len, body);
+    memcpy(buf, head, out);
+    *buf_len = out + body;
+    *status = code;
+    *body_len = content_length;
+    return 1;
+}
@@ -0,0 +1,72 @@
+#ifndef CGI_H
+#define CGI_H
+#include <sys/types.h>
+#include "request.h"
+
+#define CGI_PREFIX "/cgi/"      // 以此开头的URI交给CGI脚本处理
+#define CGI_DIR_NAME "cgi-bin"  // 脚本目录 在可执行文件所在目录下
+#define CGI_MAX_PER_SCRIPT 8    // 每个脚本默认最多同时运行的进程数
+#define CGI_TIMEOUT_MS 10000    // 默认超时 从启动脚本到输出结束
+#define CGI_MAX_SCRIPTS 128     // 记录并发数的脚本个数上限
+#define CGI_NAME_MAX 128        // 脚本名最大长度
+#define CGI_HEADER_RESERVE 256  // 转换成HTTP响应头时额外需要的空间
+#define CGI_EXIT_GRACE_MS 5000  // 输出结束后脚本退出的宽限时间 过了还没退出才SIGKILL
+
+extern char CGI_ROOT[4096];
+
+// 一个正在运行的CGI进程 in_fd/out_fd是父进程一端 都是非阻塞的 -1表示已关闭
+typedef struct{
+    pid_t pid;      // 0表示没有进程
+    int in_fd;      // 写入子进程stdin
+    int out_fd;     // 读取子进程stdout
+    int script;     // 在脚本表中的下标 用于并发计数
+} CgiProcess;
+
+// 启动CGI时需要的请求信息
+typedef struct{
+    const HttpRequest *req;
+    const char *head;       // 原始请求头 用来导出所有HTTP_*变量
+    size_t head_len;
+    const char *remote_addr;
+    int remote_port;
+    int server_port;
+    off_t content_length;
+} CgiRequest;
+
+#define CGI_ENV_MAX 64      // 环境变量个数上限 超出的请求头不再导出
+#define CGI_ENV_BUF 8192    // 环境变量字符串的总长度上限
+
+// "NAME=value"形式的环境变量 vars以NULL结尾 可以直接交给execve
+typedef struct{
+    char *vars[CGI_ENV_MAX + 1];
+    int count;
+    char buf[CGI_ENV_BUF];
+    size_t len;
+} CgiEnv;
+
+// URI是否以CGI_PREFIX开头
+int cgi_match(const HttpRequest *req);
+// 按RFC 3875构造脚本的环境变量 FastCGI的PARAMS也用它
+// URI形如<prefix><脚本名>[/PATH_INFO][?QUERY_STRING] prefix_len是前缀的长度
+// 脚本名为空或过长返回-1 成功时把脚本名写入script_name
+int cgi_build_env(CgiEnv *env, const CgiRequest *creq, size_t prefix_len, char script_name[CGI_NAME_MAX]);
+// fork/exec脚本 按RFC 3875设置环境变量 stdin/stdout接到非阻塞管道上
+// 成功返回0 脚本不存在返回-1(404) 脚本并发数已满返回-2(503) 其他失败返回-3(500)
+int cgi_spawn(const CgiRequest *creq, int max_per_script, CgiProcess *proc);
+// 关闭管道 不阻塞地回收子进程 退出后释放并发计数
+// kill_now(超时 客户端断开)时先SIGKILL 否则输出已经正常结束 给脚本CGI_EXIT_GRACE_MS自己退出
+// 没能马上回收的进程记在调用线程上 由cgi_reap继续回收
+void cgi_release(CgiProcess *proc, int kill_now);
+// 调用线程上还没回收的脚本个数 不为0时事件循环要定期调用cgi_reap
+int cgi_exiting(void);
+void cgi_reap(void);
+
+// 把buf开头脚本输出的CGI响应头(Status/Location/Content-Type...)原地替换成HTTP/1.1响应头
+// 返回0表示头还不完整 1表示转换完成 -1表示格式错误或放不下
+// *status为响应状态码 *body_len为Content-Length(没有时为-1)
+// 调用前*chunked表示是否允许分块编码 脚本没有给出Content-Length时能分块就加上Transfer-Encoding: chunked
+// 返回后*chunked表示响应体是否要分块发送 不能分块时*keep_alive置0 靠关闭连接结束响应
+int cgi_translate_header(char *buf, size_t *buf_len, size_t cap, int *keep_alive, int *status,
+                         off_t *body_len, int *chunked);
+
+#endif
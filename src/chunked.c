@@ -0,0 +1,194 @@
+#include "chunked.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+enum{
+    CHUNK_SIZE,         // 块大小(十六进制)
+    CHUNK_EXT,          // 块扩展 ;name=value 直接跳过
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,      // 块数据后的\r\n
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,      // trailer行的开头 空行表示消息结束
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_DONE
+};
+
+void chunk_scanner_init(ChunkScanner *s) {
+    s->state = CHUNK_SIZE;
+    s->size = 0;
+    s->digits = 0;
+}
+
+int chunk_done(const ChunkScanner *s) {
+    return s->state == CHUNK_DONE;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// 块大小这一行结束 大小为0时后面是trailer
+static int size_line_end(ChunkScanner *s) {
+    if (s->digits == 0) return -1;
+    s->state = s->size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    return 0;
+}
+
+ssize_t chunk_scan(ChunkScanner *s, const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && s->state != CHUNK_DONE) {
+        char c = p[i];
+        switch (s->state) {
+        case CHUNK_SIZE: {
+            int v = hex_value(c);
+            if (v >= 0) {
+                if (++s->digits > 15) return -1; // 大小超过off_t能表示的范围
+                s->size = s->size * 16 + v;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                s->state = CHUNK_EXT;
+            } else if (c == '\r') {
+                s->state = CHUNK_SIZE_LF;
+            } else if (c == '\n') {
+                if (size_line_end(s) == -1) return -1;
+            } else {
+                return -1;
+            }
+            i++;
+            break;
+        }
+        case CHUNK_EXT: {
+            const char *eol = memchr(p + i, '\n', len - i);
+            if (!eol) return len;
+            i = eol - p + 1;
+            if (size_line_end(s) == -1) return -1;
+            break;
+        }
+        case CHUNK_SIZE_LF:
+            if (c != '\n' || size_line_end(s) == -1) return -1;
+            i++;
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i < (size_t)s->size ? len - i : (size_t)s->size;
+            i += n;
+            s->size -= n;
+            if (s->size == 0) s->state = CHUNK_DATA_CR;
+            break;
+        }
+        case CHUNK_DATA_CR:
+        case CHUNK_DATA_LF:
+            if (c == '\r' && s->state == CHUNK_DATA_CR) {
+                s->state = CHUNK_DATA_LF;
+            } else if (c == '\n') {
+                s->state = CHUNK_SIZE;
+                s->digits = 0;
+            } else {
+                return -1;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\r') s->state = CHUNK_TRAILER_LF;
+            else if (c == '\n') s->state = CHUNK_DONE;
+            else s->state = CHUNK_TRAILER_LINE;
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE: {
+            const char *eol = memchr(p + i, '\n', len - i);
+            if (!eol) return len;
+            i = eol - p + 1;
+            s->state = CHUNK_TRAILER;
+            break;
+        }
+        case CHUNK_TRAILER_LF:
+            if (c != '\n') return -1;
+            s->state = CHUNK_DONE;
+            i++;
+            break;
+        }
+    }
+    return i;
+}
+
+// ----------------------分块编码的写端-----------------------
+
+void chunk_writer_init(ChunkWriter *w) {
+    w->head_len = w->head_sent = 0;
+    w->left = 0;
+    w->started = 0;
+    w->finished = 0;
+}
+
+// 块头和数据一次sendmsg 返回写出的总字节数
+static ssize_t send_parts(int fd, ChunkWriter *w, const char *data, size_t len) {
+    struct iovec iov[2];
+    int n = 0;
+    if (w->head_sent < w->head_len) {
+        iov[n].iov_base = w->head + w->head_sent;
+        iov[n].iov_len = w->head_len - w->head_sent;
+        n++;
+    }
+    if (len) {
+        iov[n].iov_base = (void *)data;
+        iov[n].iov_len = len;
+        n++;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t chunk_send(int fd, ChunkWriter *w, const char *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (w->left == 0) {// 开始新的一块 数据里已有的部分都算进这一块
+            w->left = len - done;
+            w->head_len = snprintf(w->head, sizeof(w->head), "%s%zx\r\n", w->started ? "\r\n" : "", w->left);
+            w->head_sent = 0;
+            w->started = 1;
+        }
+        ssize_t n = send_parts(fd, w, data + done, w->left);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        size_t head_rest = w->head_len - w->head_sent;
+        if ((size_t)n <= head_rest) {
+            w->head_sent += n;
+            if ((size_t)n < head_rest) break; // 块头都没写完 内核缓冲区满了
+            continue;
+        }
+        w->head_sent = w->head_len;
+        n -= head_rest;
+        w->left -= n;
+        done += n;
+    }
+    if (done == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+int chunk_finish(int fd, ChunkWriter *w) {
+    if (!w->finished) {
+        w->head_len = snprintf(w->head, sizeof(w->head), "%s0\r\n\r\n", w->started ? "\r\n" : "");
+        w->head_sent = 0;
+        w->finished = 1;
+    }
+    while (w->head_sent < w->head_len) {
+        ssize_t n = send_parts(fd, w, NULL, 0);
+        if (n == -1) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        w->head_sent += n;
+    }
+    return 1;
+}
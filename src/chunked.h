@@ -0,0 +1,37 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+#include <sys/types.h>
+
+// 跟踪分块编码(Transfer-Encoding: chunked)消息的边界 数据原样转发 只需要知道消息在哪里结束
+typedef struct{
+    int state;
+    off_t size;     // 当前块还剩的字节数
+    int digits;     // 当前块大小已经读到的十六进制位数
+} ChunkScanner;
+
+void chunk_scanner_init(ChunkScanner *s);
+// 扫描p开头的len个字节 返回属于这条消息的字节数 消息结束时可能小于len 格式错误返回-1
+ssize_t chunk_scan(ChunkScanner *s, const char *p, size_t len);
+// 最后一个块和trailer都已经扫描完
+int chunk_done(const ChunkScanner *s);
+
+// 长度未知的响应体按分块编码发出去 块头和数据用iovec一起写 数据不复制
+// 上一块结尾的\r\n放在下一块块头的前面 每块只需要块头和数据两段
+#define CHUNK_HEAD_MAX 32   // "\r\n" + 十六进制长度 + "\r\n" 或者结束块"\r\n0\r\n\r\n"
+
+typedef struct{
+    char head[CHUNK_HEAD_MAX];
+    size_t head_len, head_sent;  // 当前块头还没发完的部分是head[head_sent, head_len)
+    size_t left;                 // 当前块还没发出去的数据字节数
+    int started;                 // 已经发过至少一块 下一块头前面要补上一块结尾的\r\n
+    int finished;                // 结束块已经生成
+} ChunkWriter;
+
+void chunk_writer_init(ChunkWriter *w);
+// 把data开头的len字节按分块编码发给fd 当前块没发完时data必须从这一块没发出去的字节开始
+// 返回发出去的数据字节数(不含块头) 发不动时可能是0 出错返回-1(EAGAIN表示发不动)
+ssize_t chunk_send(int fd, ChunkWriter *w, const char *data, size_t len);
+// 数据都发完后发送结束块 返回1表示发完 0表示需要等可写 -1表示出错
+int chunk_finish(int fd, ChunkWriter *w);
+
+#endif
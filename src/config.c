@@ -0,0 +1,371 @@
+#include "server.h"
+#include <stddef.h>
+#include <ctype.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdarg.h>
+
+static const ServerOptions defaults = {
+	.buf_size = BUF_SIZE,
+	.max_pipeline = MAX_PIPELINE_REQUESTS,
+	.max_clients = MAX_CLIENTS,
+	.max_events = MAX_EVENTS,
+	.accept_batch = ACCEPT_BATCH,
+	.splice = 1,
+	.h2 = 1,
+	.cgi_max_per_script = CGI_MAX_PER_SCRIPT,
+	.cgi_timeout_ms = CGI_TIMEOUT_MS,
+	.fcgi_conns = FCGI_CONNS,
+	.fcgi_reqs_per_conn = FCGI_REQS_PER_CONN,
+	.fcgi_timeout_ms = FCGI_TIMEOUT_MS,
+	.proxy_timeout_ms = PROXY_TIMEOUT_MS,
+	.drain_timeout_ms = DRAIN_TIMEOUT_MS,
+	.out_high = OUT_HIGH_WATER,
+	.out_low = OUT_LOW_WATER,
+	.port = ECHO_PORT,
+	.backlog = LISTEN_BACKLOG,
+	.defer_accept = DEFER_ACCEPT_SECS,
+	.loops = 1,
+	.io_threads = IO_THREADS,
+	.cpu_threads = TASK_THREADS,
+	.fcgi_socket = FCGI_SOCKET_PATH,
+	.proxy_balance = "round-robin",
+	.mime_types = MIME_TYPES_FILE,
+	.log_level = "info",
+	.log_format = "common",
+};
+
+ServerOptions server_config = defaults;
+
+// 启动时的命令行 重新加载时再用一次
+static int saved_argc;
+static char **saved_argv;
+static int running;     // 启动完成后错误写到错误日志 之前写到stderr
+
+typedef enum{
+	CONFIG_INT,
+	CONFIG_BOOL,    // 0/1 on/off yes/no true/false
+	CONFIG_STR      // 空串存为NULL
+} config_type;
+
+typedef struct{
+	const char *name;
+	const char *env;
+	config_type type;
+	size_t offset;      // 在ServerOptions中的偏移
+	long min, max;      // CONFIG_INT的取值范围
+	int reload;         // SIGHUP时可以直接生效 其余的要重启或者升级(SIGUSR2)
+	const char *help;
+} ConfigItem;
+
+#define INT_ITEM(name, env, field, min, max, reload, help) \
+	{ name, env, CONFIG_INT, offsetof(ServerOptions, field), min, max, reload, help }
+#define BOOL_ITEM(name, env, field, reload, help) \
+	{ name, env, CONFIG_BOOL, offsetof(ServerOptions, field), 0, 1, reload, help }
+#define STR_ITEM(name, env, field, reload, help) \
+	{ name, env, CONFIG_STR, offsetof(ServerOptions, field), 0, 0, reload, help }
+
+static const ConfigItem items[] = {
+	INT_ITEM("port", "LISO_PORT", port, 1, 65535, 0, "port for the default dual-stack listener"),
+	STR_ITEM("listen", "LISO_LISTEN", listen, 0, "listen endpoints, e.g. \"*:9999 nodelay,127.0.0.1:8080 backlog=512\""),
+	STR_ITEM("unix", "LISO_UNIX", unix_listen, 0, "extra Unix socket listeners, e.g. \"/tmp/liso.sock,@liso\""),
+	STR_ITEM("root", "LISO_ROOT", root, 0, "static file directory (default: <binary dir>/static_site)"),
+	INT_ITEM("buf_size", "LISO_BUF_SIZE", buf_size, 2048, 1 << 20, 0, "per-connection read/write buffer, also the request size limit"),
+	INT_ITEM("max_clients", "LISO_MAX_CLIENTS", max_clients, 1, 1 << 20, 0, "connections per event loop"),
+	INT_ITEM("max_events", "LISO_MAX_EVENTS", max_events, 1, 1 << 16, 0, "events returned by one epoll_wait"),
+	INT_ITEM("max_pipeline", "LISO_MAX_PIPELINE", max_pipeline, 1, 1 << 16, 1, "pipelined requests handled per connection per loop pass"),
+	INT_ITEM("accept_batch", "LISO_ACCEPT_BATCH", accept_batch, 1, 1 << 16, 1, "connections accepted per listener wakeup"),
+	INT_ITEM("backlog", "LISO_BACKLOG", backlog, 1, INT_MAX, 0, "default listen backlog"),
+	INT_ITEM("defer_accept", "LISO_DEFER_ACCEPT", defer_accept, 0, 3600, 0, "default TCP_DEFER_ACCEPT seconds, 0 disables"),
+	INT_ITEM("loops", "LISO_LOOPS", loops, 1, MAX_LOOPS, 0, "event loop threads"),
+	STR_ITEM("cpus", "LISO_CPUS", cpus, 0, "pin event loops to these CPUs, e.g. \"0-3,8\" or auto, and steer connections by the CPU that received them"),
+	INT_ITEM("io_threads", "LISO_IO_THREADS", io_threads, 0, IO_MAX_THREADS, 0, "threads for blocking open/stat/read, 0 runs them on the event loop"),
+	INT_ITEM("cpu_threads", "LISO_CPU_THREADS", cpu_threads, 0, TASK_MAX_THREADS, 0, "work-stealing threads for CPU-heavy work such as rendering metrics, 0 runs it on the event loop"),
+	INT_ITEM("warmup_max_size", "LISO_WARMUP_MAX_SIZE", warmup_max_size, 0, INT_MAX, 0, "read files up to this size under root into the page cache at startup, 0 disables"),
+	INT_ITEM("cgi_max", "LISO_CGI_MAX", cgi_max_per_script, 1, 1 << 16, 1, "concurrent processes per CGI script"),
+	INT_ITEM("cgi_timeout_ms", "LISO_CGI_TIMEOUT_MS", cgi_timeout_ms, 1, INT_MAX, 1, "CGI timeout"),
+	STR_ITEM("fcgi_socket", "LISO_FCGI_SOCKET", fcgi_socket, 0, "FastCGI worker socket, empty disables"),
+	INT_ITEM("fcgi_conns", "LISO_FCGI_CONNS", fcgi_conns, 1, FCGI_MAX_CONNS, 0, "FastCGI connections per event loop"),
+	INT_ITEM("fcgi_reqs", "LISO_FCGI_REQS", fcgi_reqs_per_conn, 1, FCGI_MAX_REQS, 0, "requests multiplexed per FastCGI connection"),
+	INT_ITEM("fcgi_timeout_ms", "LISO_FCGI_TIMEOUT_MS", fcgi_timeout_ms, 1, INT_MAX, 1, "FastCGI timeout"),
+	STR_ITEM("proxy", "LISO_PROXY", proxy, 0, "reverse proxy routes, e.g. \"/api/=127.0.0.1:8081;/app/=unix:/tmp/app.sock\""),
+	STR_ITEM("proxy_balance", "LISO_PROXY_BALANCE", proxy_balance, 0, "round-robin or least-conn"),
+	INT_ITEM("proxy_timeout_ms", "LISO_PROXY_TIMEOUT_MS", proxy_timeout_ms, 1, INT_MAX, 1, "reverse proxy timeout"),
+	INT_ITEM("drain_timeout_ms", "LISO_DRAIN_TIMEOUT_MS", drain_timeout_ms, 0, INT_MAX, 1, "how long shutdown waits for responses in progress, 0 waits forever"),
+	INT_ITEM("ip_conns", "LISO_IP_CONNS", ip_conns, 0, INT_MAX, 1, "concurrent connections per client IP, 0 is unlimited"),
+	INT_ITEM("ip_rate", "LISO_IP_RATE", ip_rate, 0, INT_MAX, 1, "requests per second per client IP, 0 is unlimited"),
+	INT_ITEM("ip_burst", "LISO_IP_BURST", ip_burst, 0, INT_MAX, 1, "requests a client IP may send at once, 0 means ip_rate"),
+	INT_ITEM("ip_bandwidth", "LISO_IP_BANDWIDTH", ip_bandwidth, 0, INT_MAX, 1, "response bytes per second per client IP, 0 is unlimited"),
+	INT_ITEM("out_high", "LISO_OUT_HIGH", out_high, 0, INT_MAX, 1, "stop reading requests from a connection with this many bytes queued to send, 0 disables"),
+	INT_ITEM("out_low", "LISO_OUT_LOW", out_low, 1, INT_MAX, 1, "resume reading once its send queue is below this"),
+	BOOL_ITEM("splice", "LISO_SPLICE", splice, 1, "relay bodies with splice"),
+	BOOL_ITEM("h2", "LISO_H2", h2, 1, "accept cleartext HTTP/2"),
+	BOOL_ITEM("mmap", "LISO_MMAP", mmap, 1, "send static files from shared mmap mappings instead of copying through the buffer"),
+	INT_ITEM("zerocopy_min", "LISO_ZEROCOPY_MIN", zerocopy_min, 0, INT_MAX, 1, "with mmap, send at least this many file bytes with MSG_ZEROCOPY, 0 disables"),
+	STR_ITEM("mime_types", "LISO_MIME_TYPES", mime_types, 1, "mime.types file"),
+	STR_ITEM("log_level", "LISO_LOG_LEVEL", log_level, 1, "error|warn|info|debug"),
+	STR_ITEM("log_format", "LISO_LOG_FORMAT", log_format, 0, "common|combined|json"),
+};
+#define ITEM_COUNT (sizeof(items) / sizeof(items[0]))
+
+// 启动前写到stderr 运行中(重新加载时)写到错误日志
+static void config_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void config_error(const char *fmt, ...) {
+	char msg[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (running) log_error("%s", msg);
+	else fprintf(stderr, "%s\n", msg);
+}
+
+// 名字中的-和_等价
+static const ConfigItem *find_item(const char *name, size_t len) {
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		const char *n = items[i].name;
+		size_t k = 0;
+		while (k < len && n[k] && (n[k] == name[k] || (n[k] == '_' && name[k] == '-'))) k++;
+		if (k == len && n[k] == '\0') return &items[i];
+	}
+	return NULL;
+}
+
+// 设置opts中的一项 value的内存由调用者保证一直有效 from用于错误信息
+static int set_item(ServerOptions *opts, const ConfigItem *item, const char *value, const char *from) {
+	void *field = (char *)opts + item->offset;
+	if (item->type == CONFIG_STR) {
+		*(const char **)field = value[0] ? value : NULL;
+		return 0;
+	}
+	long v;
+	if (item->type == CONFIG_BOOL) {
+		if (!strcmp(value, "1") || !strcasecmp(value, "on") || !strcasecmp(value, "yes") || !strcasecmp(value, "true")) {
+			v = 1;
+		} else if (!strcmp(value, "0") || !strcasecmp(value, "off") || !strcasecmp(value, "no") || !strcasecmp(value, "false")) {
+			v = 0;
+		} else {
+			config_error("%s: %s expects on/off, got \"%s\"", from, item->name, value);
+			return -1;
+		}
+	} else {
+		char *end;
+		errno = 0;
+		v = strtol(value, &end, 10);
+		if (end == value || *end || errno == ERANGE || v < item->min || v > item->max) {
+			config_error("%s: %s expects an integer in [%ld, %ld], got \"%s\"",
+						 from, item->name, item->min, item->max, value);
+			return -1;
+		}
+	}
+	*(int *)field = (int)v;
+	return 0;
+}
+
+static char *trim(char *s) {
+	while (isspace((unsigned char)*s)) s++;
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+	return s;
+}
+
+static int load_file(ServerOptions *opts, const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		config_error("%s: %s", path, strerror(errno));
+		return -1;
+	}
+	char line[CONFIG_LINE_MAX], from[CONFIG_LINE_MAX + 32];
+	int lineno = 0, ret = 0;
+	while (ret == 0 && fgets(line, sizeof(line), f)) {
+		lineno++;
+		snprintf(from, sizeof(from), "%s:%d", path, lineno);
+		if (!strchr(line, '\n') && !feof(f)) {
+			config_error("%s: line too long", from);
+			ret = -1;
+			break;
+		}
+		char *p = trim(line);
+		if (*p == '\0' || *p == '#') continue;
+		char *eq = strchr(p, '=');
+		if (!eq) {
+			config_error("%s: expected name = value", from);
+			ret = -1;
+			break;
+		}
+		*eq = '\0';
+		char *name = trim(p), *value = trim(eq + 1);
+		const ConfigItem *item = find_item(name, strlen(name));
+		if (!item) {
+			config_error("%s: unknown option \"%s\"", from, name);
+			ret = -1;
+		} else if (item->type == CONFIG_STR && value[0] && !(value = strdup(value))) {
+			ret = -1;
+		} else {
+			ret = set_item(opts, item, value, from);
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+static void usage(const char *prog) {
+	printf("usage: %s [-c file] [--dump-config] [--name=value ...]\n"
+		   "Options can also come from a config file (name = value per line) or LISO_NAME environment\n"
+		   "variables. The command line overrides the environment, which overrides the file.\n"
+		   "SIGHUP re-reads them; options marked * apply at once, the rest need an upgrade (SIGUSR2).\n\n", prog);
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		printf("  --%-18s %-22s %c %s\n", items[i].name, items[i].env, items[i].reload ? '*' : ' ', items[i].help);
+	}
+}
+
+// 字符串格式的值和配置项之间的关系在这里统一检查 启动时就报错 不等到用的时候才发现
+static int validate(const ServerOptions *opts) {
+	if (opts->out_high > 0 && opts->out_low > opts->out_high) {
+		config_error("out_low (%d) must not be above out_high (%d)", opts->out_low, opts->out_high);
+		return -1;
+	}
+	int cpus[AFFINITY_MAX_CPUS];
+	if (opts->cpus && affinity_parse(opts->cpus, cpus, AFFINITY_MAX_CPUS) <= 0) {
+		config_error("bad cpus: %s", opts->cpus);
+		return -1;
+	}
+	if (log_parse_level(opts->log_level ? opts->log_level : "") == -1) {
+		config_error("bad log_level: %s", opts->log_level ? opts->log_level : "");
+		return -1;
+	}
+	if (log_parse_format(opts->log_format ? opts->log_format : "") == -1) {
+		config_error("bad log_format: %s", opts->log_format ? opts->log_format : "");
+		return -1;
+	}
+	if (proxy_parse_balance(opts->proxy_balance ? opts->proxy_balance : "") == -1) {
+		config_error("bad proxy_balance: %s", opts->proxy_balance ? opts->proxy_balance : "");
+		return -1;
+	}
+	if (!opts->mime_types) {
+		config_error("mime_types must not be empty");
+		return -1;
+	}
+	return 0;
+}
+
+// 按配置文件的格式输出所有配置项的当前值
+static void config_dump(FILE *out) {
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		const void *field = (const char *)&server_config + items[i].offset;
+		if (items[i].type == CONFIG_STR) {
+			const char *s = *(const char *const *)field;
+			fprintf(out, "%s = %s\n", items[i].name, s ? s : "");
+		} else {
+			fprintf(out, "%s = %d\n", items[i].name, *(const int *)field);
+		}
+	}
+}
+
+// 从默认值开始依次应用配置文件 环境变量和命令行 结果写到opts
+static int load_all(ServerOptions *opts, int argc, char *argv[]) {
+	*opts = defaults;
+	// 先找配置文件 命令行上的其他选项要覆盖它
+	const char *file = getenv("LISO_CONFIG");
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--config")) {
+			if (i + 1 == argc) {
+				config_error("%s needs a file", argv[i]);
+				return -1;
+			}
+			file = argv[++i];
+		} else if (!strncmp(argv[i], "--config=", 9)) {
+			file = argv[i] + 9;
+		}
+	}
+	if (file && file[0] && load_file(opts, file) == -1) return -1;
+
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		const char *value = getenv(items[i].env);
+		if (value && set_item(opts, &items[i], value, items[i].env) == -1) return -1;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (!strcmp(arg, "-c") || !strcmp(arg, "--config")) {
+			i++;
+			continue;
+		}
+		if (!strncmp(arg, "--config=", 9) || !strcmp(arg, "--dump-config")) continue;
+		if (strncmp(arg, "--", 2) != 0) {
+			config_error("unexpected argument \"%s\" (try --help)", arg);
+			return -1;
+		}
+		const char *name = arg + 2, *eq = strchr(name, '=');
+		size_t name_len = eq ? (size_t)(eq - name) : strlen(name);
+		const ConfigItem *item = find_item(name, name_len);
+		if (!item) {
+			config_error("unknown option \"%.*s\" (try --help)", (int)name_len, name);
+			return -1;
+		}
+		const char *value = eq ? eq + 1 : NULL;
+		if (!value) {
+			if (i + 1 == argc) {
+				config_error("--%s needs a value", item->name);
+				return -1;
+			}
+			value = argv[++i];
+		}
+		if (set_item(opts, item, value, "command line") == -1) return -1;
+	}
+	return validate(opts);
+}
+
+int config_load(int argc, char *argv[]) {
+	int dump = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (!strcmp(argv[i], "--dump-config")) dump = 1;
+	}
+	if (load_all(&server_config, argc, argv) == -1) return -1;
+	if (dump) {
+		config_dump(stdout);
+		return 1;
+	}
+	saved_argc = argc;
+	saved_argv = argv;
+	running = 1;
+	return 0;
+}
+
+int config_reload(void) {
+	ServerOptions fresh;
+	if (load_all(&fresh, saved_argc, saved_argv) == -1) {
+		log_error("config reload failed, keeping the current configuration");
+		return -1;
+	}
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		const ConfigItem *item = &items[i];
+		char *cur = (char *)&server_config + item->offset, *next = (char *)&fresh + item->offset;
+		int changed;
+		if (item->type == CONFIG_STR) {
+			const char *a = *(const char **)cur, *b = *(const char **)next;
+			changed = (a == NULL) != (b == NULL) || (a && strcmp(a, b) != 0);
+		} else {
+			changed = *(int *)cur != *(int *)next;
+		}
+		if (!changed) continue;
+		if (!item->reload) {
+			log_warn("config: %s changed, it takes effect after a binary upgrade (SIGUSR2)", item->name);
+			continue;
+		}
+		// 事件循环线程同时在读 整个字段一次写入 读到的要么是旧值要么是新值
+		if (item->type == CONFIG_STR) {
+			__atomic_store_n((const char **)cur, *(const char **)next, __ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n((int *)cur, *(int *)next, __ATOMIC_RELAXED);
+		}
+		log_info("config: %s reloaded", item->name);
+	}
+	log_set_level(log_parse_level(server_options.log_level));
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// 启动参数 server_config的每个字段对应一个配置项 同一个名字可以写在
+//   配置文件:   name = value 每行一项 #开头的行是注释
+//   环境变量:   LISO_NAME=value
+//   命令行:     --name=value 或 --name value 名字中的_也可以写成-
+// 后面的覆盖前面的 默认值 < 配置文件(-c/--config或LISO_CONFIG) < 环境变量 < 命令行
+// 字符串值为空表示不启用(如fcgi_socket)
+
+#define CONFIG_LINE_MAX 4096    // 配置文件一行的最大长度
+
+// 读取全部来源并校验 出错时原因写到stderr返回-1
+// 打印了帮助(-h/--help)或者最终的配置(--dump-config)返回1 成功返回0
+int config_load(int argc, char *argv[]);
+// 用启动时的命令行重新读取全部来源 标记为可以重新加载的项(--help中带*)直接生效
+// 其余有变化的项只写警告日志 出错时保留当前配置返回-1
+int config_reload(void);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef CORO_H
+#define CORO_H
+
+// 无栈协程 把要等事件的处理按步骤从上往下写 仍然跑在非阻塞的事件循环里
+// 协程就是一个普通函数 调用者保存一个Coro(上次挂起处的行号) 每次调用从上次挂起的地方接着执行
+// 挂起只是记下行号并返回 继续只是一次switch跳转 不分配栈 不切换上下文
+// 局部变量在挂起之后不保留 跨过挂起点还要用的值放在调用者的结构体里
+// 协程函数里不能再用switch包住挂起点 一行最多一个挂起点(__LINE__做标号)
+// CO_YIELD展开成do-while 写在它后面的continue/break属于外面的循环
+//   CO_BEGIN(&c->co);
+//   ...
+//   CO_YIELD(&c->co, 0);    // 挂起 返回0 下次调用从这里继续
+//   ...
+//   CO_END(&c->co);         // 执行完 下次调用从头开始
+
+typedef int Coro; // 0表示还没开始
+
+#define CO_BEGIN(co) switch (*(co)) { case 0:
+#define CO_YIELD(co, ret) do { *(co) = __LINE__; return (ret); case __LINE__:; } while (0)
+#define CO_END(co) } *(co) = 0
+#define CO_RESET(co) (*(co) = 0)
+
+#endif
@@ -19,29 +19,73 @@
     fd_to_index是为了防止fd过大导致的Client数组越界
 */
 #include "server.h"
-extern Server server;
 int main(int argc, char *argv[]) {
+	// 在日志线程和事件循环线程创建之前屏蔽SIGHUP/SIGUSR2 统一由主循环的signalfd处理
+	lifecycle_init(argc, argv);
+
+	// 配置文件 环境变量和命令行 校验失败直接退出
+	int ret = config_load(argc, argv);
+	if (ret != 0) return ret == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
 	char *exec_path = argv[0];
     if (realpath(exec_path, ROOT_DIR) != NULL) {
         // 找到最后一个 '/' 并截断（去掉文件名）
         char *last_slash = strrchr(ROOT_DIR, '/');
         if (last_slash != NULL) {
-            *last_slash = '\0';  // 截断到目录部分
+        	*last_slash = '\0';  // 截断到目录部分
+        }
+
+        // 日志写在可执行文件所在目录 级别和格式已经在config_load中校验过
+        log_set_level(log_parse_level(server_options.log_level));
+        if (log_init(ROOT_DIR, log_parse_format(server_options.log_format)) == -1) {
+        	perror("log_init() failed");
+        	return 1;
         }
         
-        // 拼接 "/static_site"
-        strncat(ROOT_DIR, "/static_site", sizeof(ROOT_DIR) - strlen(ROOT_DIR) - 1);
+        // CGI脚本放在可执行文件所在目录的cgi-bin下
+        if (snprintf(CGI_ROOT, sizeof(CGI_ROOT), "%s/%s", ROOT_DIR, CGI_DIR_NAME) >= (int)sizeof(CGI_ROOT)) {
+        	log_error("path too long: %s", ROOT_DIR);
+        	return 1;
+        }
+
+        // 静态文件目录 没有配置root时拼接 "/static_site"
+        if (server_options.root) {
+        	if (realpath(server_options.root, ROOT_DIR) == NULL) {
+        		log_error("bad root %s: %s", server_options.root, strerror(errno));
+        		return 1;
+        	}
+        } else {
+        	strncat(ROOT_DIR, "/static_site", sizeof(ROOT_DIR) - strlen(ROOT_DIR) - 1);
+        }
         
-        printf("Final ROOT_DIR: %s\n", ROOT_DIR);
+        log_info("Final ROOT_DIR: %s", ROOT_DIR);
+
+        // 加载MIME类型表 文件不存在时只使用内置的常用类型
+        int mime_count = mime_load(server_options.mime_types);
+        if (mime_count == -1) {
+        	log_error("mime_load() failed");
+        	return 1;
+        }
+        log_info("Loaded %d mime types from %s", mime_count, server_options.mime_types);
     } else {
         perror("realpath() failed");
         return 1;
     }
 
+	// 反向代理路由表 如proxy = /api/=127.0.0.1:8081,127.0.0.1:8082;/app/=unix:/tmp/app.sock
+	if (server_options.proxy &&
+		proxy_load(server_options.proxy, proxy_parse_balance(server_options.proxy_balance)) == -1) {
+		log_error("bad proxy routes: %s", server_options.proxy);
+		return 1;
+	}
+
+	// 预读静态文件目录 升级启动时旧进程在这期间继续服务
+	fileio_warmup(ROOT_DIR, server_options.warmup_max_size);
+
 	init_server();
-    while (1) {
-        handle_events();
-    }
-    close(*server.sock);
+	// 升级后排空完成 handle_events返回-1
+	while (handle_events() == 0) {}
+	log_info("all connections drained, exiting");
+    listener_close_all();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE // memmem
+#include "server.h"
+#include <sys/un.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define ID_FREE -1      // requestId空闲
+#define ID_ABORTED -2   // 客户端已经不要这个响应了 等worker的END_REQUEST再释放
+
+// 写请求体时给每个requestId预留一条ABORT_REQUEST的空间 中止请求时一定写得进去
+#define FEED_LIMIT (FCGI_OUT_BUF - FCGI_HEADER_LEN * (FCGI_MAX_REQS + 1))
+
+// 到worker的一条持久连接 上面同时进行多个请求 用requestId区分
+typedef struct{
+	int fd;                 // -1表示未连接
+	int connecting;         // 非阻塞connect还没完成
+	int broken;             // 写出错 等下一次事件时关闭 不在调用者的栈上关闭
+	int stalled;            // 当前记录所属客户端的写缓冲区满了 暂停解析和读取
+	int stall_id;
+	int resume;             // 解除暂停后要重新解析in中已有的记录 用EPOLLOUT触发一次事件
+	uint32_t events;        // 当前在epoll中注册的事件
+	int active;             // 占用的requestId个数(包括已中止但还没结束的)
+	int clients[FCGI_MAX_REQS + 1]; // requestId -> 客户端下标 或ID_FREE/ID_ABORTED
+	size_t out_len;
+	size_t in_start, in_len;        // in中未解析的数据是[in_start, in_len)
+	size_t rec_done;                // in_start处的记录已经交给客户端的内容字节数
+	unsigned char out[FCGI_OUT_BUF];
+	unsigned char in[FCGI_IN_BUF];
+} FcgiConn;
+
+// 每个事件循环一个连接池 第一次有FastCGI请求时才分配
+typedef struct{
+	int pending;                // 当前循环中进行中(含排队)的FastCGI请求数
+	int queue[FCGI_QUEUE_MAX];  // 所有连接都满时排队的客户端下标 环形队列
+	int q_head, q_len;
+	int nconns;
+	FcgiConn conns[];
+} FcgiPool;
+
+static __thread FcgiPool *pool;
+
+int fcgi_match(const HttpRequest *req) {
+	size_t len = strlen(FCGI_PREFIX);
+	return server_options.fcgi_socket && req->uri_len > len && memcmp(req->uri, FCGI_PREFIX, len) == 0;
+}
+
+int fcgi_pending(void) {
+	return pool ? pool->pending : 0;
+}
+
+static int client_index(Client *client) {
+	return (int)(client - server.clients);
+}
+
+static void request_end(Client *client) {
+	client->fcgi.active = 0;
+	pool->pending--;
+}
+
+// ----------------------连接-----------------------
+
+// 只有关注的事件变化时才调用epoll_ctl
+static void conn_set_interest(int epoll_fd, FcgiConn *c) {
+	if (c->fd == -1) return;
+	uint32_t events = 0;
+	if (c->connecting || c->broken || c->resume || c->out_len > 0) events |= EPOLLOUT;
+	if (!c->connecting && !c->stalled) events |= EPOLLIN;
+	if (events == c->events) return;
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = c->fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+		log_error("epoll_ctl mod fastcgi failed: %s", strerror(errno));
+		c->broken = 1;
+		return;
+	}
+	c->events = events;
+}
+
+// 非阻塞连接worker 连接池中的槽位ci必须是空闲的
+// 返回0表示连接成功或正在连接 -1表示worker不可用
+static int conn_open(int epoll_fd, int ci) {
+	FcgiConn *c = &pool->conns[ci];
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, server_options.fcgi_socket, sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		log_error("fastcgi socket failed: %s", strerror(errno));
+		return -1;
+	}
+	if (fd >= *server.fd_table_size) {
+		close(fd);
+		return -1;
+	}
+	c->connecting = 0;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		// worker的backlog满了时Unix socket返回EAGAIN 和EINPROGRESS一样等可写
+		if (errno != EINPROGRESS && errno != EAGAIN) {
+			log_warn("fastcgi connect %s failed: %s", server_options.fcgi_socket, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		c->connecting = 1;
+	}
+	struct epoll_event ev;
+	ev.events = c->connecting ? EPOLLOUT : EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		log_error("epoll_ctl add fastcgi failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	c->fd = fd;
+	c->events = ev.events;
+	c->broken = 0;
+	c->stalled = 0;
+	c->resume = 0;
+	c->active = 0;
+	c->out_len = 0;
+	c->in_start = 0;
+	c->in_len = 0;
+	c->rec_done = 0;
+	for (int id = 0; id <= FCGI_MAX_REQS; id++) c->clients[id] = ID_FREE;
+	server.fd_to_index[fd] = FD_INDEX_FCGI(ci);
+	return 0;
+}
+
+// 尽量把out写给worker 出错时只做标记 由连接自己的事件处理函数关闭
+static void conn_write(FcgiConn *c) {
+	if (c->fd == -1 || c->connecting || c->broken) return;
+	size_t off = 0;
+	while (off < c->out_len) {
+		ssize_t n = send(c->fd, c->out + off, c->out_len - off, MSG_NOSIGNAL);
+		if (n > 0) {
+			off += n;
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		c->broken = 1;
+		break;
+	}
+	memmove(c->out, c->out + off, c->out_len - off);
+	c->out_len -= off;
+}
+
+static void conn_put_record(FcgiConn *c, int type, int id, const void *data, size_t len) {
+	fcgi_put_header(c->out + c->out_len, type, id, len, 0);
+	if (len) memcpy(c->out + c->out_len + FCGI_HEADER_LEN, data, len);
+	c->out_len += FCGI_HEADER_LEN + len;
+}
+
+static void fcgi_fail(int epoll_fd, Client *client, int status, const char *response);
+
+// worker断开或协议出错 连接上所有的请求都失败 还没发响应头的返回502
+static void conn_close(int epoll_fd, int ci) {
+	FcgiConn *c = &pool->conns[ci];
+	if (c->fd == -1) return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	server.fd_to_index[c->fd] = -1;
+	close(c->fd);
+	c->fd = -1;
+	// 先把连接恢复成空闲再通知客户端 客户端接着处理pipeline的请求时可能重新用到这个槽位
+	int failed[FCGI_MAX_REQS], nfailed = 0;
+	for (int id = 1; id <= FCGI_MAX_REQS; id++) {
+		if (c->clients[id] >= 0) failed[nfailed++] = c->clients[id];
+		c->clients[id] = ID_FREE;
+	}
+	c->active = 0;
+	for (int i = 0; i < nfailed; i++) {
+		Client *client = &server.clients[failed[i]];
+		client->fcgi.conn = -1;
+		log_warn("fastcgi connection lost: %.*s", (int)client->req.uri_len, client->req.uri);
+		fcgi_fail(epoll_fd, client, 502, bad_gateway);
+	}
+}
+
+// 选一个连接发新请求 优先用空闲的连接 其次新建连接 最后用请求最少的连接
+// 返回连接下标 -1表示所有连接都满了 -2表示连不上worker
+static int conn_pick(int epoll_fd, size_t need) {
+	int best = -1, empty = -1;
+	for (int i = 0; i < pool->nconns; i++) {
+		FcgiConn *c = &pool->conns[i];
+		if (c->fd == -1) {
+			if (empty == -1) empty = i;
+			continue;
+		}
+		// 卡在慢客户端上的连接暂时不分配新请求 否则新请求也要跟着等
+		if (c->broken || c->stalled || c->active >= server_options.fcgi_reqs_per_conn ||
+			c->out_len + need > FEED_LIMIT) continue;
+		if (best == -1 || c->active < pool->conns[best].active) best = i;
+	}
+	if (best != -1 && pool->conns[best].active == 0) return best;
+	if (empty != -1) {
+		if (conn_open(epoll_fd, empty) == 0) return empty;
+		if (best == -1) return -2;
+	}
+	return best;
+}
+
+// ----------------------请求-----------------------
+
+// 把req_buf中已经收到的请求体写成STDIN记录 请求体收完后写一条空的STDIN记录
+static void feed_body(Client *client) {
+	FcgiState *st = &client->fcgi;
+	FcgiConn *c = &pool->conns[st->conn];
+	while (st->body_left > 0) {
+		size_t avail = MIN(client->req_len - client->req_consumed, (size_t)st->body_left);
+		if (avail == 0 || c->out_len + FCGI_HEADER_LEN >= FEED_LIMIT) break;
+		size_t n = MIN(MIN(avail, FCGI_MAX_CONTENT), FEED_LIMIT - c->out_len - FCGI_HEADER_LEN);
+		char *body = client->req_buf + client->req_consumed;
+		conn_put_record(c, FCGI_STDIN, st->id, body, n);
+		memmove(body, body + n, client->req_len - client->req_consumed - n);
+		client->req_len -= n;
+		st->body_left -= n;
+	}
+	if (st->body_left == 0 && !st->stdin_done && c->out_len + FCGI_HEADER_LEN <= FEED_LIMIT) {
+		conn_put_record(c, FCGI_STDIN, st->id, NULL, 0);
+		st->stdin_done = 1;
+	}
+}
+
+// 把请求交给一个连接 BEGIN_REQUEST和PARAMS一次写完 请求体随后边收边写
+// 返回0表示已发出 -1表示所有连接都满了 -2表示连不上worker -3表示URI中没有脚本名
+static int try_begin(int epoll_fd, Client *client) {
+	FcgiState *st = &client->fcgi;
+	CgiRequest creq = {
+		.req = &client->req,
+		.head = client->req_buf,
+		.head_len = client->req.head_len,
+		.remote_addr = client_host(client),
+		.remote_port = client_port(client),
+		.server_port = listeners[client->listener].port,
+		.content_length = st->body_left,
+	};
+	CgiEnv env;
+	char script_name[CGI_NAME_MAX];
+	if (cgi_build_env(&env, &creq, strlen(FCGI_PREFIX), script_name) == -1) return -3;
+
+	// 环境变量"NAME=value"编码成name-value对 总长度不超过一条记录
+	unsigned char params[CGI_ENV_BUF + 8 * CGI_ENV_MAX];
+	size_t plen = 0;
+	for (int i = 0; i < env.count; i++) {
+		const char *var = env.vars[i];
+		const char *eq = strchr(var, '=');
+		size_t name_len = eq - var, value_len = strlen(eq + 1);
+		plen += fcgi_put_length(params + plen, name_len);
+		plen += fcgi_put_length(params + plen, value_len);
+		memcpy(params + plen, var, name_len);
+		memcpy(params + plen + name_len, eq + 1, value_len);
+		plen += name_len + value_len;
+	}
+
+	size_t need = 3 * FCGI_HEADER_LEN + 8 + plen;
+	int ci = conn_pick(epoll_fd, need);
+	if (ci < 0) return ci;
+	FcgiConn *c = &pool->conns[ci];
+	int id = 1;
+	while (c->clients[id] != ID_FREE) id++;
+	c->clients[id] = client_index(client);
+	c->active++;
+	st->conn = ci;
+	st->id = id;
+
+	unsigned char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	conn_put_record(c, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+	conn_put_record(c, FCGI_PARAMS, id, params, plen);
+	conn_put_record(c, FCGI_PARAMS, id, NULL, 0);
+	feed_body(client);
+	conn_write(c);
+	conn_set_interest(epoll_fd, c);
+	return 0;
+}
+
+// 客户端不再需要连接上的这个请求 通知worker中止 requestId等END_REQUEST时再释放
+static void release(int epoll_fd, Client *client) {
+	FcgiState *st = &client->fcgi;
+	if (st->conn == -1) return;
+	FcgiConn *c = &pool->conns[st->conn];
+	if (c->clients[st->id] == client_index(client)) {
+		c->clients[st->id] = ID_ABORTED;
+		if (c->out_len + FCGI_HEADER_LEN <= FCGI_OUT_BUF) conn_put_record(c, FCGI_ABORT_REQUEST, st->id, NULL, 0);
+		if (c->stalled && c->stall_id == st->id) {// 卡住连接的记录不用再交给客户端了
+			c->stalled = 0;
+			c->resume = 1;
+		}
+		conn_write(c);
+		conn_set_interest(epoll_fd, c);
+	}
+	st->conn = -1;
+	st->id = 0;
+}
+
+// worker出错或超时 还没发过响应头时改成错误响应 否则只能关闭连接
+static void fcgi_fail(int epoll_fd, Client *client, int status, const char *response) {
+	FcgiState *st = &client->fcgi;
+	release(epoll_fd, client);
+	st->eof = 1;
+	client->keep_alive = 0;
+	if (client->header_out) {
+		request_end(client);
+		finish_response(epoll_fd, client, 0);
+		return;
+	}
+	set_error_response(client, status, response);
+	st->header_done = 1;
+	if (fcgi_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+}
+
+// 按排队顺序把请求交给有空位的连接
+static void dispatch_queue(int epoll_fd) {
+	while (pool->q_len > 0) {
+		Client *client = &server.clients[pool->queue[pool->q_head]];
+		FcgiState *st = &client->fcgi;
+		// 排队期间客户端断开或超时 槽位可能已经换了主人 这种过期的项直接丢掉
+		if (client->fd != -1 && st->active && st->conn == -1 && !st->eof) {
+			int ret = try_begin(epoll_fd, client);
+			if (ret == -1) return;
+			if (ret == -2) fcgi_fail(epoll_fd, client, 502, bad_gateway);
+		}
+		pool->q_head = (pool->q_head + 1) % FCGI_QUEUE_MAX;
+		pool->q_len--;
+	}
+}
+
+void fcgi_start(Client *client) {
+	FcgiState *st = &client->fcgi;
+	if (!pool) {
+		pool = calloc(1, sizeof(FcgiPool) + server_options.fcgi_conns * sizeof(FcgiConn));
+		if (!pool) {
+			log_error("fastcgi pool alloc failed");
+			set_error_response(client, 500, internal_error);
+			return;
+		}
+		pool->nconns = server_options.fcgi_conns;
+		for (int i = 0; i < pool->nconns; i++) pool->conns[i].fd = -1;
+	}
+	st->conn = -1;
+	st->id = 0;
+	st->stdin_done = 0;
+	st->header_done = 0;
+	st->eof = 0;
+	st->head_only = client->req.method_len == 4 && memcmp(client->req.method, "HEAD", 4) == 0;
+	st->deadline_ns = metrics_now_ns() + (uint64_t)server_options.fcgi_timeout_ms * 1000000ull;
+	client->buf_len = 0;
+	client->file_offset = -1;
+	client->status = 0;
+	st->active = 1;
+	pool->pending++;
+
+	int ret = try_begin(*server.epoll_fd, client);
+	if (ret == 0) return;
+	// 所有连接都满了 先排队 队列也满了说明worker处理不过来 直接拒绝
+	if (ret == -1 && pool->q_len < FCGI_QUEUE_MAX) {
+		pool->queue[(pool->q_head + pool->q_len) % FCGI_QUEUE_MAX] = client_index(client);
+		pool->q_len++;
+		return;
+	}
+	request_end(client);
+	if (ret == -3) {
+		set_error_response(client, 404, not_found);
+	} else if (ret == -1) {
+		log_warn("fastcgi workers saturated: %.*s", (int)client->req.uri_len, client->req.uri);
+		set_error_response(client, 503, service_unavailable);
+	} else {
+		set_error_response(client, 502, bad_gateway);
+	}
+}
+
+void fcgi_detach(int epoll_fd, Client *client) {
+	release(epoll_fd, client);
+	request_end(client);
+}
+
+// 响应头转换完成之前要给HTTP响应头留出空间
+static size_t output_limit(Client *client) {
+	return client->fcgi.header_done ? server_options.buf_size : server_options.buf_size - CGI_HEADER_RESERVE;
+}
+
+int fcgi_pump(int epoll_fd, Client *client) {
+	FcgiState *st = &client->fcgi;
+	int fd = client->fd;
+
+	// 新收到的请求体写给worker
+	if (st->conn != -1 && !st->stdin_done) {
+		FcgiConn *c = &pool->conns[st->conn];
+		feed_body(client);
+		conn_write(c);
+		conn_set_interest(epoll_fd, c);
+	}
+
+	if (!st->header_done && (client->buf_len > 0 || st->eof)) {
+		int chunked = !st->head_only;
+		int ret = cgi_translate_header(client->buf, &client->buf_len, server_options.buf_size, &client->keep_alive,
+									   &client->status, &(off_t){0}, &chunked);
+		if (ret == 0 && st->eof) ret = -1;
+		if (ret == -1) {
+			log_warn("bad fastcgi response: %.*s", (int)client->req.uri_len, client->req.uri);
+			release(epoll_fd, client);
+			set_error_response(client, 502, bad_gateway);
+			client->keep_alive = 0;
+			st->eof = 1;
+			st->header_done = 1;
+		} else if (ret == 1) {
+			st->header_done = 1;
+			if (chunked) start_chunked(client, (char *)memmem(client->buf, client->buf_len, "\r\n\r\n", 4) + 4 - client->buf);
+			if (st->head_only) {// HEAD只要响应头 后面的输出在收到时丢掉
+				char *head_end = memmem(client->buf, client->buf_len, "\r\n\r\n", 4);
+				client->buf_len = head_end + 4 - client->buf;
+			}
+		}
+	}
+
+	if (st->header_done && client->buf_len > 0) {
+		int ret = send_response(client);
+		if (ret == -1) {
+			fcgi_detach(epoll_fd, client);
+			finish_response(epoll_fd, client, 0);
+			return 0;
+		}
+	}
+
+	// 输出全部发完 结束这个请求
+	if (st->eof && st->header_done && client->buf_len == 0) {
+		int ret = send_response_end(client);
+		if (ret == 0) {// 结束块还没发出去
+			set_interest(epoll_fd, client, EPOLLOUT);
+			return 0;
+		}
+		if (st->body_left > 0) client->keep_alive = 0; // 请求体没读完 无法继续解析后面的请求
+		request_end(client);
+		finish_response(epoll_fd, client, ret == 1);
+		return client->fd == fd;
+	}
+
+	// 写缓冲区腾出了空间 让卡在这个客户端上的连接继续
+	if (st->conn != -1) {
+		FcgiConn *c = &pool->conns[st->conn];
+		if (c->stalled && c->stall_id == st->id && client->buf_len < output_limit(client)) {
+			c->stalled = 0;
+			c->resume = 1;
+			conn_set_interest(epoll_fd, c);
+		}
+	}
+	uint32_t events = 0;
+	if (client->req_len < server_options.buf_size) events |= EPOLLIN;
+	if (st->header_done && client->buf_len > 0) events |= EPOLLOUT;
+	set_interest(epoll_fd, client, events);
+	return 0;
+}
+
+// ----------------------worker的输出-----------------------
+
+// 处理in_start处的一条完整记录 客户端写缓冲区放不下时返回0 连接暂停 等客户端发出去再继续
+static int handle_record(int epoll_fd, FcgiConn *c, const FcgiRecord *rec, const unsigned char *content) {
+	if (rec->id == 0 || rec->id > FCGI_MAX_REQS) return 1; // 管理记录和不认识的请求
+	int idx = c->clients[rec->id];
+
+	if (rec->type == FCGI_STDOUT) {
+		while (c->rec_done < rec->content_len && c->clients[rec->id] >= 0) {
+			Client *client = &server.clients[idx];
+			FcgiState *st = &client->fcgi;
+			if (st->eof || (st->header_done && st->head_only)) break; // 已经改成错误响应或者是HEAD
+			size_t limit = output_limit(client);
+			if (client->buf_len >= limit) {
+				c->stalled = 1;
+				c->stall_id = rec->id;
+				return 0;
+			}
+			size_t n = MIN(limit - client->buf_len, rec->content_len - c->rec_done);
+			memcpy(client->buf + client->buf_len, content + c->rec_done, n);
+			client->buf_len += n;
+			c->rec_done += n;
+			if (client->header_out) {// 第一次发送之后新增的字节单独计入在途
+				client->inflight += n;
+				metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, n);
+			}
+			if (fcgi_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+		}
+	} else if (rec->type == FCGI_STDERR) {
+		if (rec->content_len) log_warn("fastcgi stderr: %.*s", (int)rec->content_len, content);
+	} else if (rec->type == FCGI_END_REQUEST) {
+		if (idx == ID_FREE) return 1;
+		c->clients[rec->id] = ID_FREE;
+		c->active--;
+		if (idx >= 0) {
+			Client *client = &server.clients[idx];
+			client->fcgi.conn = -1;
+			client->fcgi.id = 0;
+			if (!client->fcgi.eof) {
+				client->fcgi.eof = 1;
+				if (fcgi_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+			}
+		}
+	}
+	return 1;
+}
+
+// 解析in中已有的记录 然后接着从worker读 直到读空或者暂停
+static void conn_input(int epoll_fd, int ci) {
+	FcgiConn *c = &pool->conns[ci];
+	for (;;) {
+		while (!c->stalled && c->in_len - c->in_start >= FCGI_HEADER_LEN) {
+			FcgiRecord rec;
+			fcgi_get_header(c->in + c->in_start, &rec);
+			if (rec.version != FCGI_VERSION_1) {
+				log_error("fastcgi protocol error: version %d", rec.version);
+				conn_close(epoll_fd, ci);
+				return;
+			}
+			size_t total = FCGI_HEADER_LEN + rec.content_len + rec.padding_len;
+			if (c->in_len - c->in_start < total) break;
+			if (!handle_record(epoll_fd, c, &rec, c->in + c->in_start + FCGI_HEADER_LEN)) break;
+			c->in_start += total;
+			c->rec_done = 0;
+		}
+		if (c->stalled) break;
+		// 剩下不完整的记录移到开头再读
+		memmove(c->in, c->in + c->in_start, c->in_len - c->in_start);
+		c->in_len -= c->in_start;
+		c->in_start = 0;
+		ssize_t n = read(c->fd, c->in + c->in_len, FCGI_IN_BUF - c->in_len);
+		if (n > 0) {
+			c->in_len += n;
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		// worker关闭了连接 空闲的连接下次用到时重连 进行中的请求返回502
+		if (n == -1) log_warn("fastcgi read failed: %s", strerror(errno));
+		conn_close(epoll_fd, ci);
+		return;
+	}
+	conn_set_interest(epoll_fd, c);
+}
+
+void fcgi_handle_conn(int epoll_fd, int ci, uint32_t events) {
+	if (!pool || ci < 0 || ci >= pool->nconns) return;
+	FcgiConn *c = &pool->conns[ci];
+	if (c->fd == -1) return;
+	if (c->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) err = errno;
+		if (err) {
+			log_warn("fastcgi connect %s failed: %s", server_options.fcgi_socket, strerror(err));
+			conn_close(epoll_fd, ci);
+			dispatch_queue(epoll_fd);
+			return;
+		}
+		c->connecting = 0;
+	}
+	c->resume = 0;
+	// 发出积压的记录 腾出空间后继续写各个请求的请求体
+	if (c->out_len > 0) {
+		conn_write(c);
+		for (int id = 1; id <= FCGI_MAX_REQS && c->out_len < FEED_LIMIT; id++) {
+			if (c->clients[id] < 0) continue;
+			Client *client = &server.clients[c->clients[id]];
+			if (client->fcgi.stdin_done) continue;
+			feed_body(client);
+			if (client->req_len < server_options.buf_size) set_interest(epoll_fd, client, client->events | EPOLLIN);
+		}
+		conn_write(c);
+	}
+	if (c->broken || (events & EPOLLERR)) {
+		conn_close(epoll_fd, ci);
+		dispatch_queue(epoll_fd);
+		return;
+	}
+	// 对端关闭时还可能有没读的记录 先读完 读到EOF再关闭
+	conn_input(epoll_fd, ci);
+	dispatch_queue(epoll_fd);
+}
+
+// 检查当前循环中超时的FastCGI请求(包括还在排队的) 只在有请求进行中时调用
+void fcgi_sweep(int epoll_fd) {
+	uint64_t now = metrics_now_ns();
+	for (int i = 0; i < server_options.max_clients && pool->pending > 0; i++) {
+		Client *client = &server.clients[i];
+		if (client->fd == -1 || !client->fcgi.active || client->fcgi.eof) continue;
+		if (now < client->fcgi.deadline_ns) continue;
+		log_warn("fastcgi timeout: %.*s", (int)client->req.uri_len, client->req.uri);
+		fcgi_fail(epoll_fd, client, 504, gateway_timeout);
+	}
+}
@@ -0,0 +1,109 @@
+#ifndef FASTCGI_H
+#define FASTCGI_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FCGI_PREFIX "/fcgi/"                    // 以此开头的URI交给FastCGI worker处理
+#define FCGI_SOCKET_PATH "/tmp/liso_fcgi.sock"  // 默认的worker Unix socket
+#define FCGI_CONNS 4            // 每个事件循环默认到worker的持久连接数
+#define FCGI_MAX_CONNS 64       // 连接数上限
+#define FCGI_REQS_PER_CONN 8    // 每个连接默认同时进行的请求数(多路复用)
+#define FCGI_MAX_REQS 64        // 每个连接同时进行的请求数上限 也是requestId的最大值
+#define FCGI_QUEUE_MAX 256      // 所有连接都满时排队等待的请求数 再多直接返回503
+#define FCGI_TIMEOUT_MS 10000   // 默认超时 从请求发给worker到响应结束
+#define FCGI_OUT_BUF 32768      // 每个连接待写给worker的缓冲区
+#define FCGI_IN_BUF (8 + 65535 + 255) // 每个连接从worker读的缓冲区 正好放下一条最大的记录
+
+// ----------------------FastCGI 1.0 协议-----------------------
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1        // BEGIN_REQUEST的flags 请求结束后worker不关闭连接
+#define FCGI_REQUEST_COMPLETE 0 // END_REQUEST的protocolStatus
+#define FCGI_CANT_MPX_CONN 1
+#define FCGI_OVERLOADED 2
+
+// 解析出的记录头
+typedef struct{
+    int version;
+    int type;
+    int id;                 // requestId 0表示管理记录
+    size_t content_len;
+    size_t padding_len;
+} FcgiRecord;
+
+// 在p处写8字节的记录头
+static inline void fcgi_put_header(unsigned char *p, int type, int id, size_t content_len, size_t padding_len) {
+    p[0] = FCGI_VERSION_1;
+    p[1] = (unsigned char)type;
+    p[2] = (unsigned char)(id >> 8);
+    p[3] = (unsigned char)id;
+    p[4] = (unsigned char)(content_len >> 8);
+    p[5] = (unsigned char)content_len;
+    p[6] = (unsigned char)padding_len;
+    p[7] = 0;
+}
+
+static inline void fcgi_get_header(const unsigned char *p, FcgiRecord *rec) {
+    rec->version = p[0];
+    rec->type = p[1];
+    rec->id = (p[2] << 8) | p[3];
+    rec->content_len = ((size_t)p[4] << 8) | p[5];
+    rec->padding_len = p[6];
+}
+
+// name-value对的长度 小于128用1字节 否则用最高位置1的4字节 返回写入的字节数
+static inline size_t fcgi_put_length(unsigned char *p, size_t len) {
+    if (len < 128) {
+        p[0] = (unsigned char)len;
+        return 1;
+    }
+    p[0] = (unsigned char)((len >> 24) | 0x80);
+    p[1] = (unsigned char)(len >> 16);
+    p[2] = (unsigned char)(len >> 8);
+    p[3] = (unsigned char)len;
+    return 4;
+}
+
+// 读取name-value对的长度 返回读取的字节数 数据不完整返回0
+static inline size_t fcgi_get_length(const unsigned char *p, const unsigned char *end, size_t *len) {
+    if (p >= end) return 0;
+    if (!(p[0] & 0x80)) {
+        *len = p[0];
+        return 1;
+    }
+    if (end - p < 4) return 0;
+    *len = ((size_t)(p[0] & 0x7f) << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+    return 4;
+}
+
+// ----------------------服务端的请求状态-----------------------
+// 一个请求交给FastCGI worker时的状态 active为0表示当前请求不是FastCGI
+// conn为-1表示所有连接都满了 还在排队
+typedef struct{
+    int active;
+    int conn;           // 所在连接在连接池中的下标
+    int id;             // 在连接上的requestId
+    off_t body_left;    // 还没写给worker的请求体字节数
+    int stdin_done;     // 已经发出表示请求体结束的空STDIN记录
+    int header_done;    // buf开头的响应头是否已经转换成HTTP响应头
+    int eof;            // worker已经发来END_REQUEST
+    int head_only;      // HEAD请求 转换完响应头就丢掉后面的输出
+    uint64_t deadline_ns;
+} FcgiState;
+
+#endif
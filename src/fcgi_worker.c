@@ -0,0 +1,386 @@
+/*
+    用来测试和压测FastCGI客户端的worker 不依赖任何库
+    单线程epoll 每个连接上可以同时进行多个请求(FCGI_MPXS_CONNS)
+    -p N 时fork出N个进程共享同一个监听socket
+
+    响应由URI的查询参数控制:
+        size=N      响应体为N个字节 默认返回一段请求信息
+        delay_ms=N  收完请求体后等N毫秒再响应 模拟慢的worker
+        status=N    响应状态码
+
+    用法: ./fcgi_worker [-s socket路径] [-p 进程数]
+*/
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "fastcgi.h"
+
+#define MAX_CONNS 1024
+#define MAX_EVENTS 256
+#define PARAMS_MAX 16384
+#define SIZE_MAX_BODY (64 << 20)
+
+// 一个请求 以requestId为下标存在连接里
+typedef struct{
+    int keep_conn;
+    int params_done;
+    int stdin_done;
+    uint64_t due_ns;        // 非0时表示收完了请求 到这个时间再响应
+    size_t params_len;
+    unsigned char params[PARAMS_MAX];
+    char uri[1024];
+    char query[1024];
+    char method[16];
+    long stdin_bytes;
+} WorkerRequest;
+
+typedef struct{
+    int fd;
+    int closing;            // 没有KEEP_CONN的请求结束后 写完就关闭
+    size_t in_len;
+    unsigned char in[FCGI_IN_BUF];
+    unsigned char *out;
+    size_t out_len, out_cap;
+    WorkerRequest *reqs[FCGI_MAX_REQS + 1];
+} WorkerConn;
+
+static WorkerConn *conns[MAX_CONNS]; // 按fd索引
+static int epoll_fd;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void out_reserve(WorkerConn *c, size_t n) {
+    if (c->out_len + n <= c->out_cap) return;
+    size_t cap = c->out_cap ? c->out_cap : 65536;
+    while (cap < c->out_len + n) cap *= 2;
+    c->out = realloc(c->out, cap);
+    if (!c->out) {
+        perror("realloc");
+        exit(1);
+    }
+    c->out_cap = cap;
+}
+
+// 追加一条记录 内容按8字节对齐补齐
+static void put_record(WorkerConn *c, int type, int id, const void *data, size_t len) {
+    size_t pad = (8 - len % 8) % 8;
+    out_reserve(c, FCGI_HEADER_LEN + len + pad);
+    fcgi_put_header(c->out + c->out_len, type, id, len, pad);
+    c->out_len += FCGI_HEADER_LEN;
+    if (len) memcpy(c->out + c->out_len, data, len);
+    memset(c->out + c->out_len + len, 0, pad);
+    c->out_len += len + pad;
+}
+
+static void put_stdout(WorkerConn *c, int id, const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len > FCGI_MAX_CONTENT - 7 ? FCGI_MAX_CONTENT - 7 : len;
+        put_record(c, FCGI_STDOUT, id, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+static void put_end(WorkerConn *c, int id, int protocol_status) {
+    unsigned char body[8] = { 0, 0, 0, 0, (unsigned char)protocol_status, 0, 0, 0 };
+    put_record(c, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+static void close_conn(WorkerConn *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conns[c->fd] = NULL;
+    for (int id = 0; id <= FCGI_MAX_REQS; id++) free(c->reqs[id]);
+    free(c->out);
+    free(c);
+}
+
+static void update_events(WorkerConn *c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// 返回-1表示连接已关闭
+static int flush_conn(WorkerConn *c) {
+    size_t off = 0;
+    while (off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + off, c->out_len - off, MSG_NOSIGNAL);
+        if (n > 0) {
+            off += n;
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        close_conn(c);
+        return -1;
+    }
+    memmove(c->out, c->out + off, c->out_len - off);
+    c->out_len -= off;
+    if (c->out_len == 0 && c->closing) {
+        close_conn(c);
+        return -1;
+    }
+    update_events(c);
+    return 0;
+}
+
+// 在查询字符串中找name=的值
+static long query_param(const char *query, const char *name, long def) {
+    size_t len = strlen(name);
+    for (const char *p = query; *p; ) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') return atol(p + len + 1);
+        p = strchr(p, '&');
+        if (!p) break;
+        p++;
+    }
+    return def;
+}
+
+static void parse_params(WorkerRequest *r) {
+    const unsigned char *p = r->params, *end = r->params + r->params_len;
+    while (p < end) {
+        size_t name_len, value_len, n;
+        if (!(n = fcgi_get_length(p, end, &name_len))) return;
+        p += n;
+        if (!(n = fcgi_get_length(p, end, &value_len))) return;
+        p += n;
+        if ((size_t)(end - p) < name_len + value_len) return;
+        const char *name = (const char *)p, *value = (const char *)p + name_len;
+        char *dst = NULL;
+        size_t cap = 0;
+        if (name_len == 11 && memcmp(name, "REQUEST_URI", 11) == 0) dst = r->uri, cap = sizeof(r->uri);
+        else if (name_len == 12 && memcmp(name, "QUERY_STRING", 12) == 0) dst = r->query, cap = sizeof(r->query);
+        else if (name_len == 14 && memcmp(name, "REQUEST_METHOD", 14) == 0) dst = r->method, cap = sizeof(r->method);
+        if (dst) {
+            size_t n2 = value_len < cap - 1 ? value_len : cap - 1;
+            memcpy(dst, value, n2);
+            dst[n2] = '\0';
+        }
+        p += name_len + value_len;
+    }
+}
+
+static void respond(WorkerConn *c, int id) {
+    WorkerRequest *r = c->reqs[id];
+    long size = query_param(r->query, "size", -1);
+    long status = query_param(r->query, "status", 200);
+    char *body;
+    size_t body_len;
+    if (size >= 0) {
+        if (size > SIZE_MAX_BODY) size = SIZE_MAX_BODY;
+        body = malloc(size + 1);
+        memset(body, 'x', size);
+        body_len = size;
+    } else {
+        body = malloc(2048);
+        body_len = snprintf(body, 2048, "Hello from fcgi_worker %d\nREQUEST_METHOD: %s\nREQUEST_URI: %s\nSTDIN bytes: %ld\n",
+                            (int)getpid(), r->method, r->uri, r->stdin_bytes);
+    }
+    char head[256];
+    int head_len = snprintf(head, sizeof(head), "Status: %ld\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n",
+                            status, body_len);
+    put_stdout(c, id, head, head_len);
+    put_stdout(c, id, body, body_len);
+    put_record(c, FCGI_STDOUT, id, NULL, 0);
+    put_end(c, id, FCGI_REQUEST_COMPLETE);
+    free(body);
+    if (!r->keep_conn) c->closing = 1;
+    free(r);
+    c->reqs[id] = NULL;
+}
+
+// 请求收完了 按delay_ms立即响应或者等定时器
+static void request_ready(WorkerConn *c, int id) {
+    WorkerRequest *r = c->reqs[id];
+    long delay = query_param(r->query, "delay_ms", 0);
+    if (delay > 0) r->due_ns = now_ns() + (uint64_t)delay * 1000000ull;
+    else respond(c, id);
+}
+
+static void handle_record(WorkerConn *c, const FcgiRecord *rec, const unsigned char *content) {
+    if (rec->type == FCGI_GET_VALUES) {
+        static const char vals[] = "\x0e\x04" "FCGI_MAX_CONNS" "1024"
+                                   "\x0d\x02" "FCGI_MAX_REQS" "64"
+                                   "\x0f\x01" "FCGI_MPXS_CONNS" "1";
+        put_record(c, FCGI_GET_VALUES_RESULT, 0, vals, sizeof(vals) - 1);
+        return;
+    }
+    if (rec->id == 0) {
+        unsigned char body[8] = { (unsigned char)rec->type };
+        put_record(c, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body));
+        return;
+    }
+    if (rec->id > FCGI_MAX_REQS) {
+        if (rec->type == FCGI_BEGIN_REQUEST) put_end(c, rec->id, FCGI_OVERLOADED);
+        return;
+    }
+    WorkerRequest *r = c->reqs[rec->id];
+    switch (rec->type) {
+    case FCGI_BEGIN_REQUEST:
+        if (r) return;
+        r = calloc(1, sizeof(WorkerRequest));
+        r->keep_conn = rec->content_len >= 3 && (content[2] & FCGI_KEEP_CONN);
+        c->reqs[rec->id] = r;
+        break;
+    case FCGI_PARAMS:
+        if (!r || r->params_done) return;
+        if (rec->content_len == 0) {
+            r->params_done = 1;
+            parse_params(r);
+        } else if (r->params_len + rec->content_len <= PARAMS_MAX) {
+            memcpy(r->params + r->params_len, content, rec->content_len);
+            r->params_len += rec->content_len;
+        }
+        break;
+    case FCGI_STDIN:
+        if (!r || r->stdin_done) return;
+        r->stdin_bytes += rec->content_len;
+        if (rec->content_len == 0) {
+            r->stdin_done = 1;
+            request_ready(c, rec->id);
+        }
+        break;
+    case FCGI_ABORT_REQUEST:
+        if (!r) return;
+        put_end(c, rec->id, FCGI_REQUEST_COMPLETE);
+        if (!r->keep_conn) c->closing = 1;
+        free(r);
+        c->reqs[rec->id] = NULL;
+        break;
+    }
+}
+
+// 返回-1表示连接已关闭
+static int read_conn(WorkerConn *c) {
+    for (;;) {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            close_conn(c);
+            return -1;
+        }
+        c->in_len += n;
+        size_t start = 0;
+        while (c->in_len - start >= FCGI_HEADER_LEN) {
+            FcgiRecord rec;
+            fcgi_get_header(c->in + start, &rec);
+            size_t total = FCGI_HEADER_LEN + rec.content_len + rec.padding_len;
+            if (c->in_len - start < total) break;
+            handle_record(c, &rec, c->in + start + FCGI_HEADER_LEN);
+            start += total;
+        }
+        memmove(c->in, c->in + start, c->in_len - start);
+        c->in_len -= start;
+    }
+    return flush_conn(c);
+}
+
+// 响应到期的延迟请求 返回下一次需要醒来的毫秒数 -1表示没有
+static int run_timers(void) {
+    uint64_t now = now_ns(), next = 0;
+    for (int fd = 0; fd < MAX_CONNS; fd++) {
+        WorkerConn *c = conns[fd];
+        if (!c) continue;
+        int responded = 0;
+        for (int id = 1; id <= FCGI_MAX_REQS; id++) {
+            WorkerRequest *r = c->reqs[id];
+            if (!r || !r->due_ns) continue;
+            if (r->due_ns <= now) {
+                respond(c, id);
+                responded = 1;
+            } else if (!next || r->due_ns < next) {
+                next = r->due_ns;
+            }
+        }
+        if (responded) flush_conn(c);
+    }
+    return next ? (int)((next - now) / 1000000 + 1) : -1;
+}
+
+static void serve(int listen_fd) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev, events[MAX_EVENTS];
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    int timeout = -1;
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int cfd;
+                while ((cfd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    if (cfd >= MAX_CONNS) {
+                        close(cfd);
+                        continue;
+                    }
+                    WorkerConn *c = calloc(1, sizeof(WorkerConn));
+                    c->fd = cfd;
+                    conns[cfd] = c;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = cfd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cfd, &ev);
+                }
+                continue;
+            }
+            WorkerConn *c = conns[fd];
+            if (!c) continue;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (read_conn(c) == -1) continue;
+            } else if (events[i].events & EPOLLOUT) {
+                flush_conn(c);
+            }
+        }
+        timeout = run_timers();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = FCGI_SOCKET_PATH;
+    int procs = 1, opt;
+    while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+        if (opt == 's') path = optarg;
+        else if (opt == 'p') procs = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-s socket] [-p processes]\n", argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 1024) == -1) {
+        perror("fcgi_worker: bind/listen");
+        return 1;
+    }
+    printf("fcgi_worker listening on %s (%d process(es))\n", path, procs);
+    fflush(stdout);
+
+    for (int i = 1; i < procs; i++) {
+        if (fork() == 0) {
+            serve(listen_fd);
+            return 0;
+        }
+    }
+    serve(listen_fd);
+    return 0;
+}
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE // preadv2 RWF_NOWAIT
+#include "server.h"
+#include <ftw.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+// 每个事件循环的完成队列 工作线程放入 事件循环取走
+struct IoLoop{
+	pthread_mutex_t lock;
+	FileJob *done;          // 后完成的在前面 取走时反转
+	int event_fd;
+};
+
+// 所有事件循环共用的提交队列
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static FileJob *queue_head, *queue_tail;
+static int thread_count;
+
+static __thread struct IoLoop *io_loop;
+
+void fileio_open(FileJob *job) {
+	char full_path[4096];
+	job->fd = open_request_file(job->path, full_path, sizeof(full_path), &job->st, &job->mime_type);
+	if (job->fd < 0) return;
+	// 直接用fstat的结果 不用再按路径stat一次
+	struct tm tm;
+	gmtime_r(&job->st.st_mtime, &tm);
+	strftime(job->last_modified, sizeof(job->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+static void *worker_main(void *arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head) pthread_cond_wait(&queue_cond, &queue_lock);
+		FileJob *job = queue_head;
+		queue_head = job->next;
+		if (!queue_head) queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (job->op == FILE_JOB_OPEN) {
+			fileio_open(job);
+		} else {
+			job->ret = pread(job->fd, job->dst, job->len, job->off);
+			job->err = job->ret == -1 ? errno : 0;
+		}
+
+		struct IoLoop *loop = job->loop;
+		pthread_mutex_lock(&loop->lock);
+		job->next = loop->done;
+		loop->done = job;
+		pthread_mutex_unlock(&loop->lock);
+		uint64_t one = 1;
+		if (write(loop->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) log_error("fileio wake failed: %s", strerror(errno));
+	}
+	return NULL;
+}
+
+int fileio_init(int threads) {
+	for (int i = 0; i < threads; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, worker_main, NULL) != 0) return -1;
+		pthread_detach(tid);
+		thread_count++;
+	}
+	return 0;
+}
+
+int fileio_enabled(void) {
+	return thread_count > 0;
+}
+
+int fileio_loop_init(int epoll_fd, int *fd_to_index) {
+	if (!fileio_enabled()) return 0;
+	struct IoLoop *loop = calloc(1, sizeof(*loop));
+	if (!loop) return -1;
+	pthread_mutex_init(&loop->lock, NULL);
+	loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->event_fd == -1) return -1;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = loop->event_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev) == -1) return -1;
+	fd_to_index[loop->event_fd] = FD_INDEX_IO;
+	io_loop = loop;
+	return 0;
+}
+
+void fileio_submit(FileJob *job) {
+	job->pending = 1;
+	job->loop = io_loop;
+	job->next = NULL;
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail) queue_tail->next = job;
+	else queue_head = job;
+	queue_tail = job;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+ssize_t fileio_pread(FileJob *job, int fd, char *dst, size_t len, off_t off) {
+	if (!fileio_enabled()) return pread(fd, dst, len, off);
+	// 页缓存命中(绝大多数情况)时和pread一样 只有需要等磁盘时才返回EAGAIN
+	struct iovec iov = { dst, len };
+	ssize_t n = preadv2(fd, &iov, 1, off, RWF_NOWAIT);
+	if (n >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP)) return n;
+	job->op = FILE_JOB_READ;
+	job->fd = fd;
+	job->dst = dst;
+	job->len = len;
+	job->off = off;
+	fileio_submit(job);
+	return IO_PENDING;
+}
+
+FileJob *fileio_completed(void) {
+	uint64_t v;
+	if (read(io_loop->event_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) log_error("fileio eventfd read failed: %s", strerror(errno));
+	pthread_mutex_lock(&io_loop->lock);
+	FileJob *list = io_loop->done;
+	io_loop->done = NULL;
+	pthread_mutex_unlock(&io_loop->lock);
+	FileJob *ordered = NULL;
+	while (list) {
+		FileJob *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+	return ordered;
+}
+
+// nftw的回调没有参数可以传 只在启动时单线程使用
+static struct{
+	long max_size;
+	long files, bytes;        // 全部普通文件
+	long warm_files, warm_bytes;
+	long failed;
+} warmup;
+
+static int warmup_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+	warmup.files++;
+	warmup.bytes += st->st_size;
+	if (st->st_size == 0 || st->st_size > warmup.max_size) return 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		warmup.failed++;
+		return 0;
+	}
+	int err = posix_fadvise(fd, 0, st->st_size, POSIX_FADV_WILLNEED);
+	close(fd);
+	if (err) {
+		warmup.failed++;
+		return 0;
+	}
+	warmup.warm_files++;
+	warmup.warm_bytes += st->st_size;
+	return 0;
+}
+
+void fileio_warmup(const char *root, long max_size) {
+	if (max_size <= 0) return;
+	uint64_t start_ns = metrics_now_ns();
+	memset(&warmup, 0, sizeof(warmup));
+	warmup.max_size = max_size;
+	if (nftw(root, warmup_file, 64, FTW_PHYS) == -1) {
+		log_warn("warmup %s failed: %s", root, strerror(errno));
+		return;
+	}
+	log_info("warmup %s: %ld of %ld files (%ld of %ld bytes, %.1f%%) read ahead in %.1f ms, %ld failed",
+			 root, warmup.warm_files, warmup.files, warmup.warm_bytes, warmup.bytes,
+			 warmup.bytes ? 100.0 * warmup.warm_bytes / warmup.bytes : 100.0,
+			 (metrics_now_ns() - start_ns) / 1e6, warmup.failed);
+}
+
+void fileio_advise_stream(int fd, off_t size) {
+	if (size > server_options.buf_size) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
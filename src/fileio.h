@@ -0,0 +1,63 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// 会阻塞在磁盘上的文件操作(stat/open/pread)交给工作线程池 一次冷缓存的读不会卡住整个事件循环
+// 读之前先在事件循环里用preadv2(RWF_NOWAIT)试一次 数据已经在页缓存里时直接返回 不经过线程
+// 任务完成后挂到提交它的事件循环的完成队列上 通过eventfd唤醒(fd_to_index中为FD_INDEX_IO)
+// 启动时可以先遍历一次静态文件目录(warmup_max_size) 目录项和inode进入内核缓存 小文件提前预读进页缓存
+
+#define IO_THREADS 4        // io_threads的默认值 0表示不启用 所有文件操作在事件循环里同步执行
+#define IO_MAX_THREADS 256
+#define IO_PENDING (-3)     // fileio_pread的返回值 已经交给工作线程
+
+enum{
+    FILE_JOB_OPEN,          // open_request_file + Last-Modified
+    FILE_JOB_READ           // pread
+};
+
+struct IoLoop;
+
+// 一个文件任务 嵌在提交者(Client)里 每个提交者同时最多一个
+// 提交后到事件循环取回之前 工作线程会写结果和dst 提交者不能修改也不能释放它们
+typedef struct FileJob{
+    int op;
+    int pending;            // 已经提交 事件循环还没取回
+    const char *path;       // OPEN: 请求路径
+    int fd;                 // READ: 读的文件 OPEN: 结果 同open_request_file的返回值
+    char *dst;              // READ: 读到这里
+    size_t len;
+    off_t off;
+    ssize_t ret;            // READ: pread的返回值
+    int err;                // READ: 失败时的errno
+    struct stat st;         // OPEN
+    const char *mime_type;
+    char last_modified[64];
+    void *owner;
+    struct IoLoop *loop;    // 提交它的事件循环
+    struct FileJob *next;
+} FileJob;
+
+// 启动threads个工作线程 0表示不启用 失败返回-1
+int fileio_init(int threads);
+// 是否启用了工作线程
+int fileio_enabled(void);
+// 为当前线程的事件循环创建完成队列 注册eventfd 失败返回-1
+int fileio_loop_init(int epoll_fd, int *fd_to_index);
+// 提交job 之后job->pending为1
+void fileio_submit(FileJob *job);
+// 在调用线程上执行OPEN任务 结果写在job里 工作线程用 CPU工作线程生成指标快照也用它
+void fileio_open(FileJob *job);
+// 从fd的off处读len字节到dst 在页缓存里时直接读 否则提交READ任务返回IO_PENDING
+// 没有启用工作线程时同步pread
+ssize_t fileio_pread(FileJob *job, int fd, char *dst, size_t len, off_t off);
+// eventfd可读时调用 取回当前循环所有完成的任务 按完成顺序用next串起来
+FileJob *fileio_completed(void);
+// 遍历root 对不超过max_size字节的普通文件发POSIX_FADV_WILLNEED 预读在后台进行 不等它完成
+// 耗时和覆盖率(预读的文件/字节数占全部的比例)写到日志
+void fileio_warmup(const char *root, long max_size);
+// 要分多次读的文件(比一个缓冲区大)告诉内核是顺序读 加大预读窗口
+void fileio_advise_stream(int fd, off_t size);
+
+#endif
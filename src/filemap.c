@@ -0,0 +1,101 @@
+#include "server.h"
+#include <sys/mman.h>
+
+// 所有事件循环共用 只在查找和增减引用时加锁 send不需要锁
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static FileMap *buckets[FILEMAP_BUCKETS];
+static FileMap *idle_head, *idle_tail; // 头部最久没用
+static int idle_count;
+
+static size_t bucket_of(dev_t dev, ino_t ino) {
+	return ((uint64_t)dev * 31 + (uint64_t)ino) % FILEMAP_BUCKETS;
+}
+
+static void idle_unlink(FileMap *m) {
+	if (m->idle_prev) m->idle_prev->idle_next = m->idle_next;
+	else idle_head = m->idle_next;
+	if (m->idle_next) m->idle_next->idle_prev = m->idle_prev;
+	else idle_tail = m->idle_prev;
+	m->idle_prev = m->idle_next = NULL;
+	idle_count--;
+}
+
+static void hash_unlink(FileMap *m) {
+	FileMap **p = &buckets[bucket_of(m->dev, m->ino)];
+	while (*p != m) p = &(*p)->hash_next;
+	*p = m->hash_next;
+	m->stale = 1;
+}
+
+static void destroy(FileMap *m) {
+	munmap((void *)m->data, m->size);
+	free(m);
+}
+
+FileMap *filemap_get(int fd, const struct stat *st) {
+	if (st->st_size <= 0) return NULL;
+	pthread_mutex_lock(&map_lock);
+	FileMap **p = &buckets[bucket_of(st->st_dev, st->st_ino)];
+	for (FileMap *m = *p; m; m = m->hash_next) {
+		if (m->dev != st->st_dev || m->ino != st->st_ino) continue;
+		if (m->size == (size_t)st->st_size && m->mtime.tv_sec == st->st_mtim.tv_sec &&
+			m->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+			if (m->refs++ == 0) idle_unlink(m);
+			pthread_mutex_unlock(&map_lock);
+			return m;
+		}
+		// 文件被改过 旧映射不再给新请求用 正在用它的连接发完后再解除
+		hash_unlink(m);
+		if (m->refs == 0) {
+			idle_unlink(m);
+			destroy(m);
+		}
+		break;
+	}
+	// mmap本身不读盘 在锁里做 同一个文件不会被映射两次
+	FileMap *m = calloc(1, sizeof(*m));
+	void *data = m ? mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (data == MAP_FAILED) {
+		pthread_mutex_unlock(&map_lock);
+		if (m) log_warn("mmap failed: %s", strerror(errno));
+		free(m);
+		return NULL;
+	}
+	madvise(data, st->st_size, MADV_WILLNEED);
+	m->data = data;
+	m->size = st->st_size;
+	m->dev = st->st_dev;
+	m->ino = st->st_ino;
+	m->mtime = st->st_mtim;
+	m->refs = 1;
+	m->hash_next = *p;
+	*p = m;
+	pthread_mutex_unlock(&map_lock);
+	return m;
+}
+
+void filemap_put(FileMap *m) {
+	pthread_mutex_lock(&map_lock);
+	if (--m->refs > 0) {
+		pthread_mutex_unlock(&map_lock);
+		return;
+	}
+	if (m->stale) {
+		destroy(m);
+		pthread_mutex_unlock(&map_lock);
+		return;
+	}
+	// 放到空闲链表尾部 超过上限时解除最久没用的映射
+	m->idle_prev = idle_tail;
+	if (idle_tail) idle_tail->idle_next = m;
+	else idle_head = m;
+	idle_tail = m;
+	idle_count++;
+	if (idle_count > FILEMAP_IDLE_MAX) {
+		FileMap *old = idle_head;
+		idle_unlink(old);
+		hash_unlink(old);
+		destroy(old);
+	}
+	pthread_mutex_unlock(&map_lock);
+}
@@ -0,0 +1,33 @@
+#ifndef FILEMAP_H
+#define FILEMAP_H
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// 静态文件的共享只读映射 同一个文件只mmap一次 所有事件循环的所有连接直接从映射send
+// 文件内容不再复制到每个连接的buf 按(st_dev, st_ino)查找 大小或修改时间变了就换一个新映射
+// 引用计数为0的映射留在缓存里 超过FILEMAP_IDLE_MAX个时按最久没用的顺序解除映射
+// 文件在发送中途被截断时send返回EFAULT(内核复制时缺页失败) 不会收到SIGBUS
+
+#define FILEMAP_BUCKETS 1024
+#define FILEMAP_IDLE_MAX 256    // 缓存中没有连接在用的映射最多保留的个数
+
+typedef struct FileMap{
+    const char *data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int refs;
+    int stale;                  // 文件已经变了 不在哈希表里 最后一个引用释放时解除映射
+    struct FileMap *hash_next;
+    struct FileMap *idle_prev, *idle_next; // refs为0时在空闲链表中
+} FileMap;
+
+// 取得fd(st为它的fstat结果)的映射 引用计数加1 失败返回NULL 调用方回退到pread
+// 返回后fd可以直接关闭
+FileMap *filemap_get(int fd, const struct stat *st);
+// 释放filemap_get得到的引用
+void filemap_put(FileMap *map);
+
+#endif
@@ -0,0 +1,969 @@
+#define _GNU_SOURCE // memfd_create
+#include "server.h"
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+// 一个流 id为0表示空闲槽位
+// 响应体(文件 指标快照或者回显的请求体)按窗口分成DATA帧 发完最后一帧流就结束
+typedef struct{
+	uint32_t id;
+	int recv_done;          // 对端已经发完(END_STREAM)
+	int responded;          // 已经生成响应头
+	int is_post;
+	int64_t window;         // 发送窗口
+	int status;
+	int file_fd;            // 响应体 -1表示没有
+	off_t file_off, file_left;
+	int body_fd;            // POST请求体写到memfd 收完后作为响应体回显
+	off_t body_len;
+	uint64_t start_ns;
+	off_t bytes_sent;
+	char line[H2_LINE_MAX];
+	size_t line_len;
+	char referer[H2_LOG_FIELD_MAX];
+	size_t referer_len;
+	char user_agent[H2_LOG_FIELD_MAX];
+	size_t user_agent_len;
+} H2Stream;
+
+struct H2Conn{
+	unsigned char in[H2_FRAME_HEADER_LEN + H2_FRAME_MAX]; // 放得下一个最大的帧
+	size_t in_len;
+	size_t preface_left;    // 还没收到的连接前言字节数
+	int settings_received;  // 前言之后的第一个帧必须是SETTINGS
+	int closing;            // 发出了GOAWAY 不再读 输出发完就关闭连接
+	int peer_goaway;        // 对端发了GOAWAY 现有的流结束后关闭连接
+	int draining;           // 服务器在排空 发了NO_ERROR的GOAWAY 和peer_goaway一样等现有的流结束
+	uint32_t last_stream_id;
+	// 正在拼接的头块
+	unsigned char hblock[H2_HEADER_BLOCK_MAX];
+	size_t hb_len;
+	uint32_t hb_stream;
+	int hb_end_stream;
+	int expect_continuation;
+	HpackTable dec, enc;
+	// 流量控制
+	int64_t send_window, recv_window;
+	uint32_t peer_initial_window, peer_max_frame;
+	H2Stream streams[H2_MAX_STREAMS];
+	int active, rr;         // 进行中的流数 下一轮从哪个流开始分帧
+	// 输出 out[0, seg_at)之后发seg_left字节的文件 再发out[seg_at, out_len)
+	unsigned char out[H2_OUT_BUF];
+	size_t out_len, out_sent;
+	int seg_fd, seg_close;  // seg_close为1时发完关闭seg_fd(流已经结束 文件归这一段所有)
+	off_t seg_off;
+	size_t seg_left, seg_at;
+	int blocked;            // 上一次发送遇到EAGAIN 等可写事件
+};
+
+// 解码请求头时收集的信息
+typedef struct{
+	char method[16];
+	size_t method_len;
+	char path[H2_PATH_MAX];
+	size_t path_len;
+	int has_path, has_scheme, too_long;
+	int regular_seen;       // 伪头部必须在普通头部之前
+	int malformed;
+	char referer[H2_LOG_FIELD_MAX];
+	size_t referer_len;
+	char user_agent[H2_LOG_FIELD_MAX];
+	size_t user_agent_len;
+} H2Request;
+
+// Huffman解码后的字符串 解码是同步的 每个循环一份就够
+static __thread char scratch[H2_HEADER_BLOCK_MAX * 2];
+
+int h2_preface(const char *buf, size_t len) {
+	size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+	if (memcmp(buf, H2_PREFACE, n) != 0) return 0;
+	return n == H2_PREFACE_LEN ? 1 : -1;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// ----------------------输出-----------------------
+
+static size_t out_space(H2Conn *c) {
+	return H2_OUT_BUF - c->out_len;
+}
+
+// 已经发出去的部分移走 腾出尾部空间
+static void out_compact(H2Conn *c) {
+	if (c->out_sent == 0) return;
+	memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+	c->out_len -= c->out_sent;
+	if (c->seg_left) c->seg_at -= c->out_sent;
+	c->out_sent = 0;
+}
+
+// 在输出缓冲区中追加一个帧头 返回负载的位置 放不下返回NULL
+static unsigned char *frame_begin(H2Conn *c, size_t len, int type, int flags, uint32_t id) {
+	if (out_space(c) < H2_FRAME_HEADER_LEN + len) out_compact(c);
+	if (out_space(c) < H2_FRAME_HEADER_LEN + len) return NULL;
+	unsigned char *p = c->out + c->out_len;
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	put_u32(p + 5, id & H2_WINDOW_MAX);
+	c->out_len += H2_FRAME_HEADER_LEN + len;
+	return p + H2_FRAME_HEADER_LEN;
+}
+
+static void send_window_update(H2Conn *c, uint32_t id, uint32_t inc) {
+	unsigned char *p = frame_begin(c, 4, H2_WINDOW_UPDATE, 0, id);
+	if (p) put_u32(p, inc);
+}
+
+static void send_goaway(H2Conn *c, uint32_t code) {
+	if (c->closing) return;
+	unsigned char *p = frame_begin(c, 8, H2_GOAWAY, 0, 0);
+	if (p) {
+		put_u32(p, c->last_stream_id);
+		put_u32(p + 4, code);
+	}
+	log_debug("h2 goaway code=%u last_stream=%u", code, c->last_stream_id);
+	c->closing = 1;
+}
+
+// ----------------------流-----------------------
+
+static H2Stream *find_stream(H2Conn *c, uint32_t id) {
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		if (c->streams[i].id == id) return &c->streams[i];
+	}
+	return NULL;
+}
+
+// 流的fd已经没用了 正在被sendfile的那段还要用的话交给这一段 发完再关
+static void release_fd(H2Conn *c, int *fd) {
+	if (*fd == -1) return;
+	if (c->seg_left && c->seg_fd == *fd) c->seg_close = 1;
+	else close(*fd);
+	*fd = -1;
+}
+
+static void stream_free(H2Conn *c, H2Stream *s) {
+	release_fd(c, &s->file_fd);
+	release_fd(c, &s->body_fd);
+	s->id = 0;
+	c->active--;
+}
+
+// 响应的最后一帧已经放进输出缓冲区 记录访问日志
+// 请求还没收完(错误响应或者不需要请求体)时按RFC 9113 8.1再发RST_STREAM(NO_ERROR) 对端不用再上传剩下的请求体
+static void stream_done(Client *client, H2Stream *s) {
+	metrics_observe_since(PHASE_LAST_BYTE, s->start_ns);
+	log_access(client_host(client), s->line, s->line_len, s->status, s->bytes_sent,
+			   s->referer, s->referer_len, s->user_agent, s->user_agent_len);
+	if (!s->recv_done) {
+		unsigned char *p = frame_begin(client->h2, 4, H2_RST_STREAM, 0, s->id);
+		if (p) put_u32(p, H2_NO_ERROR);
+	}
+	stream_free(client->h2, s);
+}
+
+static void send_rst(H2Conn *c, uint32_t id, uint32_t code) {
+	unsigned char *p = frame_begin(c, 4, H2_RST_STREAM, 0, id);
+	if (p) put_u32(p, code);
+	H2Stream *s = find_stream(c, id);
+	if (s) stream_free(c, s);
+}
+
+// 生成响应头 content_length为-1时不发content-length last_modified为NULL时不发
+static void send_headers(Client *client, H2Stream *s, int status, const char *content_type, off_t content_length,
+						 const char *last_modified, int end_stream) {
+	H2Conn *c = client->h2;
+	unsigned char block[1024];
+	char value[32], date_buf[64];
+	size_t cap = sizeof(block), n = hpack_encode_begin(&c->enc, block, cap);
+	int len = snprintf(value, sizeof(value), "%d", status);
+	n += hpack_encode(&c->enc, block + n, cap - n, ":status", value, len, 1);
+	n += hpack_encode(&c->enc, block + n, cap - n, "server", "liso/1.1", 8, 1);
+	get_current_time_rfc1123(date_buf, sizeof(date_buf));
+	n += hpack_encode(&c->enc, block + n, cap - n, "date", date_buf, strlen(date_buf), 1);
+	if (content_type) n += hpack_encode(&c->enc, block + n, cap - n, "content-type", content_type, strlen(content_type), 1);
+	if (content_length != -1) {// 每个响应都不一样 不加入动态表
+		len = snprintf(value, sizeof(value), "%ld", (long)content_length);
+		n += hpack_encode(&c->enc, block + n, cap - n, "content-length", value, len, 0);
+	}
+	if (last_modified) n += hpack_encode(&c->enc, block + n, cap - n, "last-modified", last_modified, strlen(last_modified), 1);
+	unsigned char *p = frame_begin(c, n, H2_HEADERS, H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0), s->id);
+	if (!p) {// 处理帧之前保证了H2_OUT_RESERVE的空间 不会发生
+		log_error("h2 output buffer full");
+		send_goaway(c, H2_INTERNAL_ERROR);
+		return;
+	}
+	memcpy(p, block, n);
+	s->status = status;
+	s->responded = 1;
+	metrics_count_status(status);
+	metrics_observe_since(PHASE_FIRST_BYTE, s->start_ns);
+	if (end_stream) stream_done(client, s);
+}
+
+// 错误响应只有响应头 和HTTP/1.1一样不带响应体
+static void send_error(Client *client, H2Stream *s, int status) {
+	send_headers(client, s, status, NULL, -1, NULL, 1);
+}
+
+static void respond_file(Client *client, H2Stream *s, const char *path, int is_head) {
+	struct stat st;
+	char full_path[H2_PATH_MAX + 4096];
+	const char *mime_type;
+	int fd = open_request_file(path, full_path, sizeof(full_path), &st, &mime_type);
+	if (fd < 0) {
+		send_error(client, s, fd == -1 ? 404 : 500);
+		return;
+	}
+	char last_modified[128];
+	get_file_mod_time_rfc1123(full_path, last_modified, sizeof(last_modified));
+	if (is_head || st.st_size == 0) {
+		close(fd);
+		send_headers(client, s, 200, mime_type, st.st_size, last_modified, 1);
+		return;
+	}
+	s->file_fd = fd;
+	s->file_off = 0;
+	s->file_left = st.st_size;
+	fileio_advise_stream(fd, st.st_size);
+	send_headers(client, s, 200, mime_type, st.st_size, last_modified, 0);
+}
+
+// POST的请求体收完了 原样回显
+static void respond_echo(Client *client, H2Stream *s) {
+	if (s->body_len == 0) {
+		release_fd(client->h2, &s->body_fd);
+		send_headers(client, s, 200, NULL, 0, NULL, 1);
+		return;
+	}
+	s->file_fd = s->body_fd;
+	s->body_fd = -1;
+	s->file_off = 0;
+	s->file_left = s->body_len;
+	send_headers(client, s, 200, NULL, s->body_len, NULL, 0);
+}
+
+// 新的请求 和HTTP/1.1的handle_request做同样的校验
+// 代理 CGI和FastCGI的路由还是只能通过HTTP/1.1访问 返回501
+static void stream_request(Client *client, H2Stream *s, const H2Request *r) {
+	if (rate_request(client->rate_slot, client->listener) == -1) {
+		metrics_inc(COUNTER_RATE_LIMITED, 1);
+		send_error(client, s, 429);
+		return;
+	}
+	if (r->too_long || r->path[0] != '/' || strstr(r->path, "..")) {
+		send_error(client, s, 400);
+		return;
+	}
+	int is_get = r->method_len == 3 && memcmp(r->method, "GET", 3) == 0;
+	int is_head = r->method_len == 4 && memcmp(r->method, "HEAD", 4) == 0;
+	int is_post = r->method_len == 4 && memcmp(r->method, "POST", 4) == 0;
+	HttpRequest req;
+	memset(&req, 0, sizeof(req));
+	req.method = r->method;
+	req.method_len = r->method_len;
+	req.uri = r->path;
+	req.uri_len = r->path_len;
+	if ((!is_get && !is_head && !is_post) || proxy_route(&req) != -1 || fcgi_match(&req) || cgi_match(&req)) {
+		send_error(client, s, 501);
+		return;
+	}
+	if (!is_post) {
+		respond_file(client, s, r->path, is_head);
+		return;
+	}
+	s->is_post = 1;
+	s->body_fd = memfd_create("liso_h2_body", MFD_CLOEXEC);
+	if (s->body_fd == -1) {
+		log_error("memfd_create failed: %s", strerror(errno));
+		send_error(client, s, 500);
+		return;
+	}
+	if (s->recv_done) respond_echo(client, s);
+}
+
+static H2Stream *stream_open(H2Conn *c, uint32_t id) {
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		H2Stream *s = &c->streams[i];
+		if (s->id) continue;
+		memset(s, 0, sizeof(*s));
+		s->id = id;
+		s->window = c->peer_initial_window;
+		s->file_fd = -1;
+		s->body_fd = -1;
+		s->start_ns = metrics_now_ns();
+		c->active++;
+		return s;
+	}
+	return NULL;
+}
+
+static void copy_field(char *dst, size_t *dst_len, size_t cap, const char *src, size_t len) {
+	*dst_len = len < cap ? len : cap;
+	if (*dst_len) memcpy(dst, src, *dst_len);
+}
+
+// ----------------------解析请求头-----------------------
+
+static int name_is(const HpackHeader *h, const char *name) {
+	size_t len = strlen(name);
+	return h->name_len == len && memcmp(h->name, name, len) == 0;
+}
+
+// 每解出一个头调用一次 格式错误只做标记 整个头块必须解完 保持动态表同步
+static int on_header(void *arg, const HpackHeader *h) {
+	H2Request *r = arg;
+	if (h->name_len == 0) {
+		r->malformed = 1;
+		return 0;
+	}
+	if (h->name[0] == ':') {
+		if (r->regular_seen) r->malformed = 1;
+		if (name_is(h, ":method")) {
+			if (r->method_len || h->value_len == 0 || h->value_len >= sizeof(r->method)) r->malformed = 1;
+			else copy_field(r->method, &r->method_len, sizeof(r->method), h->value, h->value_len);
+		} else if (name_is(h, ":path")) {
+			if (r->has_path || h->value_len == 0) r->malformed = 1;
+			else if (h->value_len >= H2_PATH_MAX) r->too_long = 1;
+			else {
+				memcpy(r->path, h->value, h->value_len);
+				r->path[h->value_len] = '\0';
+				r->path_len = h->value_len;
+			}
+			r->has_path = 1;
+		} else if (name_is(h, ":scheme")) {
+			r->has_scheme = 1;
+		} else if (!name_is(h, ":authority")) {
+			r->malformed = 1;
+		}
+		return 0;
+	}
+	r->regular_seen = 1;
+	for (size_t i = 0; i < h->name_len; i++) {
+		if (h->name[i] >= 'A' && h->name[i] <= 'Z') r->malformed = 1;
+	}
+	// HTTP/2中不允许出现的连接相关的头
+	if (name_is(h, "connection") || name_is(h, "keep-alive") || name_is(h, "proxy-connection") ||
+		name_is(h, "transfer-encoding") || name_is(h, "upgrade")) {
+		r->malformed = 1;
+	} else if (name_is(h, "te")) {
+		if (h->value_len != 8 || memcmp(h->value, "trailers", 8) != 0) r->malformed = 1;
+	} else if (name_is(h, "referer")) {
+		copy_field(r->referer, &r->referer_len, sizeof(r->referer), h->value, h->value_len);
+	} else if (name_is(h, "user-agent")) {
+		copy_field(r->user_agent, &r->user_agent_len, sizeof(r->user_agent), h->value, h->value_len);
+	}
+	return 0;
+}
+
+// 头块拼完整了 解码后开始一个新的流(或者是请求体后面的trailer)
+static void headers_complete(Client *client) {
+	H2Conn *c = client->h2;
+	H2Request r;
+	memset(&r, 0, sizeof(r));
+	int rc = hpack_decode(&c->dec, c->hblock, c->hb_len, scratch, sizeof(scratch), on_header, &r);
+	c->expect_continuation = 0;
+	if (rc != 0) {
+		send_goaway(c, H2_COMPRESSION_ERROR);
+		return;
+	}
+	uint32_t id = c->hb_stream;
+	H2Stream *s = find_stream(c, id);
+	if (s) {// 请求体后面的trailer 必须结束这个流
+		if (!c->hb_end_stream || s->recv_done) {
+			send_rst(c, id, H2_PROTOCOL_ERROR);
+			return;
+		}
+		s->recv_done = 1;
+		if (s->is_post && !s->responded) respond_echo(client, s);
+		return;
+	}
+	if (id <= c->last_stream_id) {// 这边已经结束(或者RST)的流上晚到的trailer 头块已经解码过 保持HPACK状态一致 内容丢掉
+		return;
+	}
+	c->last_stream_id = id;
+	if (c->peer_goaway || c->draining) return;
+	s = stream_open(c, id);
+	if (!s) {
+		send_rst(c, id, H2_REFUSED_STREAM);
+		return;
+	}
+	metrics_inc(COUNTER_REQUESTS, 1);
+	s->recv_done = c->hb_end_stream;
+	s->line_len = snprintf(s->line, sizeof(s->line), "%.*s %.*s HTTP/2.0", (int)r.method_len, r.method,
+						   (int)r.path_len, r.path);
+	if (s->line_len >= sizeof(s->line)) s->line_len = sizeof(s->line) - 1;
+	copy_field(s->referer, &s->referer_len, sizeof(s->referer), r.referer, r.referer_len);
+	copy_field(s->user_agent, &s->user_agent_len, sizeof(s->user_agent), r.user_agent, r.user_agent_len);
+	if (r.malformed || !r.method_len || !r.has_path || !r.has_scheme) {
+		send_rst(c, id, H2_PROTOCOL_ERROR);
+		return;
+	}
+	stream_request(client, s, &r);
+}
+
+// ----------------------处理收到的帧-----------------------
+
+// 对端的SETTINGS 升级请求中HTTP2-Settings的内容也走这里 出错返回HTTP/2错误码
+static uint32_t apply_settings(H2Conn *c, const unsigned char *p, size_t len) {
+	if (len % 6) return H2_FRAME_SIZE_ERROR;
+	for (size_t i = 0; i < len; i += 6) {
+		int id = p[i] << 8 | p[i + 1];
+		uint32_t v = get_u32(p + i + 2);
+		switch (id) {
+		case H2_SETTINGS_HEADER_TABLE_SIZE:
+			hpack_encoder_limit(&c->enc, v);
+			break;
+		case H2_SETTINGS_ENABLE_PUSH:
+			if (v > 1) return H2_PROTOCOL_ERROR;
+			break;
+		case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (v > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+			// 已经打开的流按差值调整发送窗口
+			for (int k = 0; k < H2_MAX_STREAMS; k++) {
+				H2Stream *s = &c->streams[k];
+				if (!s->id) continue;
+				s->window += (int64_t)v - c->peer_initial_window;
+				if (s->window > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+			}
+			c->peer_initial_window = v;
+			break;
+		case H2_SETTINGS_MAX_FRAME_SIZE:
+			if (v < H2_FRAME_MAX || v > 0xffffff) return H2_PROTOCOL_ERROR;
+			c->peer_max_frame = v;
+			break;
+		default: // 不认识的设置忽略
+			break;
+		}
+	}
+	return H2_NO_ERROR;
+}
+
+// 去掉HEADERS/DATA的填充(和HEADERS的优先级字段) 出错返回-1
+static int strip_padding(const unsigned char **p, size_t *len, int flags, int priority) {
+	size_t off = 0, pad = 0;
+	if (flags & H2_FLAG_PADDED) {
+		if (*len < 1) return -1;
+		pad = (*p)[0];
+		off = 1;
+	}
+	if (priority) off += 5;
+	if (off + pad > *len) return -1;
+	*p += off;
+	*len -= off + pad;
+	return 0;
+}
+
+static void on_data(Client *client, uint32_t id, int flags, const unsigned char *p, size_t len) {
+	H2Conn *c = client->h2;
+	if (id == 0) {
+		send_goaway(c, H2_PROTOCOL_ERROR);
+		return;
+	}
+	// 填充也算在流量控制里 马上把连接窗口补回来
+	if ((int64_t)len > c->recv_window) {
+		send_goaway(c, H2_FLOW_CONTROL_ERROR);
+		return;
+	}
+	if (len) send_window_update(c, 0, len);
+	size_t frame_len = len;
+	if (strip_padding(&p, &len, flags, 0) == -1) {
+		send_goaway(c, H2_PROTOCOL_ERROR);
+		return;
+	}
+	H2Stream *s = find_stream(c, id);
+	if (!s) {// 已经结束的流(比如响应先发完了)上晚到的DATA丢掉 还没打开过的流是协议错误
+		if (id > c->last_stream_id) send_goaway(c, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (s->recv_done) {
+		send_rst(c, id, H2_STREAM_CLOSED);
+		return;
+	}
+	if (s->body_fd != -1 && len) {
+		if (s->body_len + (off_t)len > H2_BODY_MAX) {
+			send_error(client, s, 500);
+			return;
+		}
+		if (write(s->body_fd, p, len) != (ssize_t)len) {
+			log_error("h2 body write failed: %s", strerror(errno));
+			send_error(client, s, 500);
+			return;
+		}
+		s->body_len += len;
+	}
+	if (flags & H2_FLAG_END_STREAM) {
+		s->recv_done = 1;
+		if (s->is_post && !s->responded) respond_echo(client, s);
+	} else if (frame_len) {
+		send_window_update(c, id, frame_len);
+	}
+}
+
+static void on_window_update(H2Conn *c, uint32_t id, const unsigned char *p, size_t len) {
+	if (len != 4) {
+		send_goaway(c, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+	uint32_t inc = get_u32(p) & H2_WINDOW_MAX;
+	if (id == 0) {
+		if (inc == 0) {
+			send_goaway(c, H2_PROTOCOL_ERROR);
+			return;
+		}
+		c->send_window += inc;
+		if (c->send_window > H2_WINDOW_MAX) send_goaway(c, H2_FLOW_CONTROL_ERROR);
+		return;
+	}
+	H2Stream *s = find_stream(c, id);
+	if (!s) return;
+	if (inc == 0) {
+		send_rst(c, id, H2_PROTOCOL_ERROR);
+		return;
+	}
+	s->window += inc;
+	if (s->window > H2_WINDOW_MAX) send_rst(c, id, H2_FLOW_CONTROL_ERROR);
+}
+
+// 处理一个完整的帧
+static void on_frame(Client *client, int type, int flags, uint32_t id, const unsigned char *p, size_t len) {
+	H2Conn *c = client->h2;
+	if (c->expect_continuation && (type != H2_CONTINUATION || id != c->hb_stream)) {
+		send_goaway(c, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (!c->settings_received && type != H2_SETTINGS) {
+		send_goaway(c, H2_PROTOCOL_ERROR);
+		return;
+	}
+	switch (type) {
+	case H2_DATA:
+		on_data(client, id, flags, p, len);
+		break;
+	case H2_HEADERS:
+		if (id == 0 || id % 2 == 0 || strip_padding(&p, &len, flags, flags & H2_FLAG_PRIORITY) == -1) {
+			send_goaway(c, H2_PROTOCOL_ERROR);
+			break;
+		}
+		memcpy(c->hblock, p, len);
+		c->hb_len = len;
+		c->hb_stream = id;
+		c->hb_end_stream = flags & H2_FLAG_END_STREAM;
+		if (flags & H2_FLAG_END_HEADERS) headers_complete(client);
+		else c->expect_continuation = 1;
+		break;
+	case H2_CONTINUATION:
+		if (!c->expect_continuation) {
+			send_goaway(c, H2_PROTOCOL_ERROR);
+			break;
+		}
+		if (c->hb_len + len > H2_HEADER_BLOCK_MAX) {// 头块太大 没法解码 只能断开
+			send_goaway(c, H2_ENHANCE_YOUR_CALM);
+			break;
+		}
+		memcpy(c->hblock + c->hb_len, p, len);
+		c->hb_len += len;
+		if (flags & H2_FLAG_END_HEADERS) headers_complete(client);
+		break;
+	case H2_PRIORITY: // 按轮转发送 不处理优先级
+		if (id == 0) send_goaway(c, H2_PROTOCOL_ERROR);
+		else if (len != 5) send_rst(c, id, H2_FRAME_SIZE_ERROR);
+		break;
+	case H2_RST_STREAM: {
+		if (id == 0 || id > c->last_stream_id) {
+			send_goaway(c, H2_PROTOCOL_ERROR);
+			break;
+		}
+		if (len != 4) {
+			send_goaway(c, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		H2Stream *s = find_stream(c, id);
+		if (s) stream_free(c, s);
+		break;
+	}
+	case H2_SETTINGS: {
+		if (id != 0) {
+			send_goaway(c, H2_PROTOCOL_ERROR);
+			break;
+		}
+		if (flags & H2_FLAG_ACK) {
+			if (len != 0) send_goaway(c, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		uint32_t err = apply_settings(c, p, len);
+		if (err != H2_NO_ERROR) {
+			send_goaway(c, err);
+			break;
+		}
+		c->settings_received = 1;
+		frame_begin(c, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+		break;
+	}
+	case H2_PING: {
+		if (id != 0) {
+			send_goaway(c, H2_PROTOCOL_ERROR);
+			break;
+		}
+		if (len != 8) {
+			send_goaway(c, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (flags & H2_FLAG_ACK) break;
+		unsigned char *q = frame_begin(c, 8, H2_PING, H2_FLAG_ACK, 0);
+		if (q) memcpy(q, p, 8);
+		break;
+	}
+	case H2_GOAWAY:
+		c->peer_goaway = 1;
+		break;
+	case H2_WINDOW_UPDATE:
+		on_window_update(c, id, p, len);
+		break;
+	case H2_PUSH_PROMISE: // 客户端不能推送
+		send_goaway(c, H2_PROTOCOL_ERROR);
+		break;
+	default: // 不认识的帧类型忽略
+		break;
+	}
+}
+
+// 处理输入缓冲区中完整的帧 输出缓冲区快满时停下 等发出去一部分再继续
+static void parse_frames(Client *client) {
+	H2Conn *c = client->h2;
+	size_t pos = 0;
+	while (!c->closing) {
+		if (c->preface_left) {
+			size_t off = H2_PREFACE_LEN - c->preface_left;
+			size_t n = c->in_len - pos < c->preface_left ? c->in_len - pos : c->preface_left;
+			if (memcmp(c->in + pos, H2_PREFACE + off, n) != 0) {
+				send_goaway(c, H2_PROTOCOL_ERROR);
+				break;
+			}
+			pos += n;
+			c->preface_left -= n;
+			if (c->preface_left) break;
+			continue;
+		}
+		if (c->in_len - pos < H2_FRAME_HEADER_LEN || out_space(c) + c->out_sent < H2_OUT_RESERVE) break;
+		const unsigned char *h = c->in + pos;
+		size_t len = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+		if (len > H2_FRAME_MAX) {
+			send_goaway(c, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (c->in_len - pos < H2_FRAME_HEADER_LEN + len) break;
+		pos += H2_FRAME_HEADER_LEN + len;
+		on_frame(client, h[3], h[4], get_u32(h + 5) & H2_WINDOW_MAX, h + H2_FRAME_HEADER_LEN, len);
+	}
+	c->in_len -= pos;
+	memmove(c->in, c->in + pos, c->in_len);
+}
+
+// ----------------------发送-----------------------
+
+// 轮流给每个有响应体要发的流分一个DATA帧 直到窗口用完或者输出缓冲区放不下
+// 大块的负载不复制 记成一段sendfile 同一时间只有一段 其他流先用小帧
+static int produce(Client *client) {
+	H2Conn *c = client->h2;
+	int added = 0, progress = 1;
+	// 升级时流1的响应体等收到客户端的SETTINGS再发 客户端切换协议之前放不下太多数据
+	if (!c->settings_received) return 0;
+	while (progress && c->send_window > 0) {
+		progress = 0;
+		for (int k = 0; k < H2_MAX_STREAMS && c->send_window > 0; k++) {
+			int i = (c->rr + k) % H2_MAX_STREAMS;
+			H2Stream *s = &c->streams[i];
+			if (!s->id || s->file_fd == -1 || s->window <= 0) continue;
+			int64_t len = s->file_left;
+			if (len > c->peer_max_frame) len = c->peer_max_frame;
+			if (len > s->window) len = s->window;
+			if (len > c->send_window) len = c->send_window;
+			int sendfile_it = len >= H2_SENDFILE_MIN;
+			if (sendfile_it && c->seg_left) continue; // 等前一段发完
+			int end = len == s->file_left;
+			// 走sendfile的帧只有帧头放在缓冲区里 负载长度事后填上
+			unsigned char *p = frame_begin(c, sendfile_it ? 0 : len, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id);
+			if (!p) return added;
+			if (sendfile_it) {
+				p[-9] = len >> 16;
+				p[-8] = len >> 8;
+				p[-7] = len;
+				c->seg_fd = s->file_fd;
+				c->seg_off = s->file_off;
+				c->seg_left = len;
+				c->seg_at = c->out_len;
+				c->seg_close = 0;
+			} else if (pread(s->file_fd, p, len, s->file_off) != len) {
+				// 文件读取错误(或文件被截断) 只能中止这个流
+				log_error("h2 pread failed on stream %u", s->id);
+				c->out_len -= H2_FRAME_HEADER_LEN + len;
+				send_rst(c, s->id, H2_INTERNAL_ERROR);
+				continue;
+			}
+			s->file_off += len;
+			s->file_left -= len;
+			s->window -= len;
+			c->send_window -= len;
+			s->bytes_sent += len;
+			added = progress = 1;
+			c->rr = (i + 1) % H2_MAX_STREAMS;
+			if (end) stream_done(client, s);
+		}
+	}
+	return added;
+}
+
+// 把输出缓冲区和sendfile的那段按顺序发出去 发完了再分新的帧
+// 返回0表示遇到EAGAIN 1表示暂时没有要发的了 -1表示出错
+static int flush(Client *client) {
+	H2Conn *c = client->h2;
+	for (;;) {
+		size_t limit = c->seg_left ? c->seg_at : c->out_len;
+		ssize_t n;
+		if (c->out_sent < limit) {
+			n = send(client->fd, c->out + c->out_sent, limit - c->out_sent, MSG_NOSIGNAL | (c->seg_left ? MSG_MORE : 0));
+			if (n > 0) c->out_sent += n;
+		} else if (c->seg_left) {
+			n = sendfile(client->fd, c->seg_fd, &c->seg_off, c->seg_left);
+			if (n == 0) {
+				log_error("h2 sendfile: file truncated");
+				return -1;
+			}
+			if (n > 0) {
+				c->seg_left -= n;
+				if (c->seg_left == 0 && c->seg_close) {
+					close(c->seg_fd);
+					c->seg_fd = -1;
+				}
+			}
+		} else {
+			c->out_len = c->out_sent = 0;
+			if (!produce(client)) {
+				c->blocked = 0;
+				return 1;
+			}
+			continue;
+		}
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				c->blocked = 1;
+				return 0;
+			}
+			return -1;
+		}
+		metrics_inc(COUNTER_BYTES_SENT, n);
+		rate_sent(client->rate_slot, client->listener, n);
+	}
+}
+
+// ----------------------连接-----------------------
+
+static H2Conn *conn_new(void) {
+	H2Conn *c = calloc(1, sizeof(H2Conn));
+	if (!c) return NULL;
+	c->preface_left = H2_PREFACE_LEN;
+	hpack_table_init(&c->dec, HPACK_TABLE_SIZE);
+	hpack_table_init(&c->enc, HPACK_TABLE_SIZE);
+	c->send_window = H2_DEFAULT_WINDOW;
+	c->recv_window = H2_CONN_WINDOW;
+	c->peer_initial_window = H2_DEFAULT_WINDOW;
+	c->peer_max_frame = H2_FRAME_MAX;
+	c->seg_fd = -1;
+	// 服务器的连接前言: SETTINGS 再把连接级别的接收窗口调大
+	unsigned char *p = frame_begin(c, 6, H2_SETTINGS, 0, 0);
+	p[0] = 0;
+	p[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	put_u32(p + 2, H2_MAX_STREAMS);
+	send_window_update(c, 0, H2_CONN_WINDOW - H2_DEFAULT_WINDOW);
+	return c;
+}
+
+// base64url(不带填充)解码 出错返回-1
+static ssize_t base64url_decode(const char *s, size_t len, unsigned char *out, size_t cap) {
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		char ch = s[i];
+		int v;
+		if (ch >= 'A' && ch <= 'Z') v = ch - 'A';
+		else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+		else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+		else if (ch == '-') v = 62;
+		else if (ch == '_') v = 63;
+		else if (ch == '=') break;
+		else return -1;
+		acc = acc << 6 | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == cap) return -1;
+			out[n++] = acc >> bits;
+		}
+	}
+	return n;
+}
+
+// Connection头中是否有token(逗号分隔 不区分大小写)
+static int connection_has(const HttpRequest *req, const char *token) {
+	const HeaderValue *h = &req->headers[HEADER_CONNECTION];
+	size_t tlen = strlen(token), i = 0;
+	while (i < h->len) {
+		while (i < h->len && (h->value[i] == ' ' || h->value[i] == ',')) i++;
+		size_t start = i;
+		while (i < h->len && h->value[i] != ',') i++;
+		size_t end = i;
+		while (end > start && h->value[end - 1] == ' ') end--;
+		if (end - start == tlen && strncasecmp(h->value + start, token, tlen) == 0) return 1;
+	}
+	return 0;
+}
+
+int h2_upgrade_requested(const HttpRequest *req) {
+	const HeaderValue *settings = &req->headers[HEADER_HTTP2_SETTINGS];
+	if (!header_equals(req, HEADER_UPGRADE, "h2c") || !settings->value || !connection_has(req, "upgrade")) return 0;
+	unsigned char buf[H2_FRAME_MAX];
+	ssize_t n = base64url_decode(settings->value, settings->len, buf, sizeof(buf));
+	return n >= 0 && n % 6 == 0;
+}
+
+int h2_start(Client *client, int upgrade) {
+	H2Conn *c = conn_new();
+	if (!c) return -1;
+	size_t from = 0;
+	if (upgrade) {
+		const HttpRequest *req = &client->req;
+		// 101之后才是服务器的连接前言 把已经放进缓冲区的SETTINGS挪到后面
+		static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+		size_t slen = sizeof(switching) - 1;
+		memmove(c->out + slen, c->out, c->out_len);
+		memcpy(c->out, switching, slen);
+		c->out_len += slen;
+		unsigned char settings[H2_FRAME_MAX];
+		const HeaderValue *h = &req->headers[HEADER_HTTP2_SETTINGS];
+		ssize_t n = base64url_decode(h->value, h->len, settings, sizeof(settings));
+		if (n < 0 || apply_settings(c, settings, n) != H2_NO_ERROR) {
+			free(c);
+			return -1;
+		}
+		client->h2 = c;
+		// 升级的请求是流1 已经半关闭(没有请求体) 101就是对这些设置的确认
+		H2Stream *s = stream_open(c, 1);
+		c->last_stream_id = 1;
+		s->recv_done = 1;
+		copy_field(s->line, &s->line_len, sizeof(s->line), req->line, req->line_len);
+		copy_field(s->referer, &s->referer_len, sizeof(s->referer),
+				   req->headers[HEADER_REFERER].value, req->headers[HEADER_REFERER].len);
+		copy_field(s->user_agent, &s->user_agent_len, sizeof(s->user_agent),
+				   req->headers[HEADER_USER_AGENT].value, req->headers[HEADER_USER_AGENT].len);
+		H2Request r;
+		memset(&r, 0, sizeof(r));
+		copy_field(r.method, &r.method_len, sizeof(r.method) - 1, req->method, req->method_len);
+		memcpy(r.path, req->uri, req->uri_len);
+		r.path[req->uri_len] = '\0';
+		r.path_len = req->uri_len;
+		stream_request(client, s, &r);
+		from = client->req_consumed;
+	}
+	client->h2 = c;
+	// 读缓冲区中剩下的数据(客户端的连接前言和之后的帧)交给HTTP/2处理 HTTP/1.1的状态不再使用
+	c->in_len = client->req_len - from;
+	memcpy(c->in, client->req_buf + from, c->in_len);
+	client->req_len = 0;
+	client->req_consumed = 0;
+	client->responding = 0;
+	client->keep_alive = 1;
+	memset(&client->req, 0, sizeof(client->req));
+	log_debug("Client %s:%d switched to h2 (%s)", client_host(client), client_port(client),
+			  upgrade ? "upgrade" : "prior knowledge");
+	return 0;
+}
+
+void h2_free(Client *client) {
+	H2Conn *c = client->h2;
+	if (!c) return;
+	for (int i = 0; i < H2_MAX_STREAMS; i++) {
+		if (c->streams[i].id) stream_free(c, &c->streams[i]);
+	}
+	if (c->seg_left && c->seg_close) close(c->seg_fd);
+	free(c);
+	client->h2 = NULL;
+}
+
+void h2_drain(int epoll_fd, Client *client) {
+	H2Conn *c = client->h2;
+	if (c->closing || c->draining) return;
+	// 不设置closing 进行中的流还要继续收WINDOW_UPDATE和请求体
+	unsigned char *p = frame_begin(c, 8, H2_GOAWAY, 0, 0);
+	if (p) {
+		put_u32(p, c->last_stream_id);
+		put_u32(p + 4, H2_NO_ERROR);
+	}
+	c->draining = 1;
+	h2_handle(epoll_fd, client, 0);
+}
+
+// 交替处理输入的帧和发送 处理帧产生的输出(ACK 响应头等)需要先发出去才能继续处理
+static int pump(Client *client) {
+	H2Conn *c = client->h2;
+	for (;;) {
+		size_t before = c->in_len;
+		parse_frames(client);
+		if (flush(client) == -1) return -1;
+		if (c->in_len == before || c->blocked) return 0;
+	}
+}
+
+void h2_handle(int epoll_fd, Client *client, uint32_t events) {
+	H2Conn *c = client->h2;
+	int fd = client->fd;
+	if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+		close_client(epoll_fd, server.clients, server.fd_to_index, fd);
+		return;
+	}
+	if (pump(client) == -1) {
+		close_client(epoll_fd, server.clients, server.fd_to_index, fd);
+		return;
+	}
+	if (events & EPOLLIN) {
+		while (!c->closing && c->in_len < sizeof(c->in) && out_space(c) + c->out_sent >= H2_OUT_RESERVE) {
+			ssize_t n = recv(fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+			if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+				close_client(epoll_fd, server.clients, server.fd_to_index, fd);
+				return;
+			}
+			if (n == -1) break;
+			metrics_inc(COUNTER_BYTES_RECV, n);
+			c->in_len += n;
+			if (pump(client) == -1) {
+				close_client(epoll_fd, server.clients, server.fd_to_index, fd);
+				return;
+			}
+			if (c->blocked) break;
+		}
+	}
+	// 发出GOAWAY(或者对端GOAWAY后所有流都结束了)并且输出都发完了 关闭连接
+	int idle = c->out_sent == c->out_len && !c->seg_left;
+	if (idle && (c->closing || ((c->peer_goaway || c->draining) && c->active == 0))) {
+		close_client(epoll_fd, server.clients, server.fd_to_index, fd);
+		return;
+	}
+	uint32_t interest = 0;
+	if (!c->closing && c->in_len < sizeof(c->in) && out_space(c) + c->out_sent >= H2_OUT_RESERVE) interest |= EPOLLIN;
+	if (c->blocked) interest |= EPOLLOUT;
+	set_interest(epoll_fd, client, interest);
+}
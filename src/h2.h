@@ -0,0 +1,72 @@
+#ifndef H2_H
+#define H2_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hpack.h"
+
+// HTTP/2(RFC 9113) 明文的h2c 支持prior knowledge(直接发连接前言)和HTTP/1.1的Upgrade: h2c
+// 一个连接上多个流并发 静态文件和POST回显的响应体按流量控制窗口轮流分帧发送
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" // 客户端连接前言
+#define H2_PREFACE_LEN 24
+#define H2_MAX_STREAMS 32           // SETTINGS_MAX_CONCURRENT_STREAMS 每个连接同时进行的流
+#define H2_FRAME_MAX 16384          // 接收的最大帧负载 即SETTINGS_MAX_FRAME_SIZE的默认值 不修改
+#define H2_DEFAULT_WINDOW 65535     // 初始流量控制窗口
+#define H2_CONN_WINDOW (1 << 24)    // 连接级别的接收窗口 建立连接时用WINDOW_UPDATE调大
+#define H2_HEADER_BLOCK_MAX 16384   // HEADERS+CONTINUATION拼起来的头块上限
+#define H2_OUT_BUF 32768            // 每个连接的输出缓冲区
+#define H2_OUT_RESERVE 2048         // 输出缓冲区剩余空间不够时先不处理新的帧 等发出去一部分
+#define H2_SENDFILE_MIN 4096        // 不小于这个长度的DATA负载用sendfile发送 更小的pread进输出缓冲区
+#define H2_BODY_MAX (64 << 20)      // POST请求体上限 回显前先存在memfd里
+#define H2_PATH_MAX 2083            // 和HTTP/1.1的URI长度上限一致
+#define H2_LINE_MAX 256             // 访问日志中的请求行
+#define H2_LOG_FIELD_MAX 128        // 访问日志中的Referer/User-Agent
+
+// ----------------------帧-----------------------
+#define H2_FRAME_HEADER_LEN 9
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+#define H2_WINDOW_MAX 0x7fffffff
+
+// 连接状态 切换到HTTP/2时才分配 定义在h2.c
+typedef struct H2Conn H2Conn;
+
+// buf开头是否是连接前言 1是 0不是 -1表示到目前为止都一致但还不完整
+int h2_preface(const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,435 @@
+#include "hpack.h"
+#include <string.h>
+#include <sys/types.h>
+
+// RFC 7541 附录A的静态表 下标从1开始
+static const struct{
+	const char *name, *value;
+} static_table[HPACK_STATIC_COUNT] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+// RFC 7541 附录B的Huffman码 下标是符号 256是EOS
+static const uint32_t huff_code[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff,
+};
+static const uint8_t huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+// 码是规范Huffman码: 按(码长, 符号)排序后依次递增 解码时只需要每种码长的个数和排好序的符号
+static const uint8_t huff_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+static const uint16_t huff_sorted[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256,
+};
+
+#define ENTRY_CAP (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+// ----------------------整数和字符串-----------------------
+
+// 带prefix位前缀的整数 返回0成功 -1表示数据不完整或者太大
+static int decode_int(const unsigned char **pp, const unsigned char *end, int prefix, size_t *out) {
+	const unsigned char *p = *pp;
+	if (p >= end) return -1;
+	size_t max = (1u << prefix) - 1;
+	size_t v = *p++ & max;
+	if (v == max) {
+		for (int shift = 0; ; shift += 7) {
+			if (p >= end || shift > 21) return -1; // 超过2^28的长度和下标都不合理
+			v += (size_t)(*p & 0x7f) << shift;
+			if (!(*p++ & 0x80)) break;
+		}
+	}
+	*pp = p;
+	*out = v;
+	return 0;
+}
+
+// 第一个字节的高位是flags 返回写入的字节数 放不下返回0
+static size_t encode_int(unsigned char *out, size_t cap, int prefix, unsigned char flags, size_t v) {
+	size_t max = (1u << prefix) - 1, n = 0;
+	if (cap == 0) return 0;
+	if (v < max) {
+		out[0] = flags | (unsigned char)v;
+		return 1;
+	}
+	out[n++] = flags | (unsigned char)max;
+	v -= max;
+	while (v >= 128) {
+		if (n == cap) return 0;
+		out[n++] = (unsigned char)(v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	if (n == cap) return 0;
+	out[n++] = (unsigned char)v;
+	return n;
+}
+
+// 规范Huffman码逐位解码: 每多读一位 当前码落在这个码长的范围内就得到一个符号
+// 结尾只能是不超过7位的全1填充(EOS的前缀) 返回解码后的长度 出错返回-1
+static ssize_t huff_decode(const unsigned char *p, size_t n, char *out, size_t cap) {
+	size_t len = 0;
+	uint32_t code = 0, first = 0, index = 0;
+	int bits = 0;           // 当前码已经读了多少位
+	uint32_t pad = 0;       // 当前码读到的原始位 检查结尾的填充
+	for (size_t i = 0; i < n; i++) {
+		for (int b = 7; b >= 0; b--) {
+			int bit = (p[i] >> b) & 1;
+			code |= bit;
+			pad = (pad << 1) | bit;
+			bits++;
+			uint32_t count = huff_count[bits];
+			if (code - first < count) {
+				int sym = huff_sorted[index + (code - first)];
+				if (sym == 256 || len == cap) return -1; // 字符串中出现EOS是错误
+				out[len++] = (char)sym;
+				code = first = index = 0;
+				bits = 0;
+				pad = 0;
+				continue;
+			}
+			if (bits == 30) return -1;
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+	}
+	if (bits > 7 || pad != (1u << bits) - 1) return -1;
+	return len;
+}
+
+static size_t huff_length(const char *s, size_t len) {
+	size_t bits = 0;
+	for (size_t i = 0; i < len; i++) bits += huff_len[(unsigned char)s[i]];
+	return (bits + 7) / 8;
+}
+
+// 字符串 Huffman编码更短时用Huffman 返回写入的字节数 放不下返回0
+static size_t encode_string(unsigned char *out, size_t cap, const char *s, size_t len) {
+	size_t hlen = huff_length(s, len);
+	if (hlen >= len) {
+		size_t n = encode_int(out, cap, 7, 0, len);
+		if (n == 0 || n + len > cap) return 0;
+		memcpy(out + n, s, len);
+		return n + len;
+	}
+	size_t n = encode_int(out, cap, 7, 0x80, hlen);
+	if (n == 0 || n + hlen > cap) return 0;
+	uint64_t acc = 0;
+	int bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		acc = (acc << huff_len[c]) | huff_code[c];
+		bits += huff_len[c];
+		while (bits >= 8) {
+			bits -= 8;
+			out[n++] = (unsigned char)(acc >> bits);
+		}
+	}
+	if (bits > 0) out[n++] = (unsigned char)((acc << (8 - bits)) | (0xff >> bits)); // 用EOS的前缀填充
+	return n;
+}
+
+// 字符串字面量 Huffman编码的解码到scratch
+static int decode_string(const unsigned char **pp, const unsigned char *end, char **scratch, size_t *scratch_left,
+						 const char **s, size_t *len) {
+	if (*pp >= end) return -1;
+	int huff = **pp & 0x80;
+	size_t n;
+	if (decode_int(pp, end, 7, &n) == -1 || n > (size_t)(end - *pp)) return -1;
+	if (!huff) {
+		*s = (const char *)*pp;
+		*len = n;
+	} else {
+		ssize_t m = huff_decode(*pp, n, *scratch, *scratch_left);
+		if (m == -1) return -1;
+		*s = *scratch;
+		*len = m;
+		*scratch += m;
+		*scratch_left -= m;
+	}
+	*pp += n;
+	return 0;
+}
+
+// ----------------------动态表-----------------------
+
+void hpack_table_init(HpackTable *t, size_t max_size) {
+	memset(t, 0, sizeof(*t));
+	t->max_size = t->limit = max_size > HPACK_TABLE_SIZE ? HPACK_TABLE_SIZE : max_size;
+}
+
+// i为0表示最新的条目
+static HpackEntry *table_get(HpackTable *t, size_t i) {
+	return &t->ent[(t->oldest + t->count - 1 - i) % ENTRY_CAP];
+}
+
+static void table_evict(HpackTable *t) {
+	HpackEntry *e = &t->ent[t->oldest];
+	t->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+	t->start = e->off + e->name_len + e->value_len;
+	t->oldest = (t->oldest + 1) % ENTRY_CAP;
+	if (--t->count == 0) t->start = t->end = 0;
+}
+
+static void table_resize(HpackTable *t, size_t max_size) {
+	t->max_size = max_size;
+	while (t->size > t->max_size) table_evict(t);
+}
+
+// 加入一个条目 比整个表还大的条目会清空动态表 本身不加入
+static void table_add(HpackTable *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+	size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+	while (t->count > 0 && t->size + size > t->max_size) table_evict(t);
+	if (size > t->max_size) return;
+	if (t->end + name_len + value_len > HPACK_TABLE_SIZE) {// 尾部放不下 整体挪到开头
+		memmove(t->data, t->data + t->start, t->end - t->start);
+		for (int i = 0; i < t->count; i++) t->ent[(t->oldest + i) % ENTRY_CAP].off -= t->start;
+		t->end -= t->start;
+		t->start = 0;
+	}
+	HpackEntry *e = &t->ent[(t->oldest + t->count) % ENTRY_CAP];
+	e->off = t->end;
+	e->name_len = name_len;
+	e->value_len = value_len;
+	memcpy(t->data + t->end, name, name_len);
+	memcpy(t->data + t->end + name_len, value, value_len);
+	t->end += name_len + value_len;
+	t->size += size;
+	t->count++;
+}
+
+// 按下标取出条目 动态表中的名字和值指向表内 下标无效返回-1
+static int table_lookup(HpackTable *t, size_t idx, HpackHeader *h) {
+	if (idx == 0) return -1;
+	if (idx <= HPACK_STATIC_COUNT) {
+		h->name = static_table[idx - 1].name;
+		h->name_len = strlen(h->name);
+		h->value = static_table[idx - 1].value;
+		h->value_len = strlen(h->value);
+		return 0;
+	}
+	idx -= HPACK_STATIC_COUNT + 1;
+	if (idx >= (size_t)t->count) return -1;
+	HpackEntry *e = table_get(t, idx);
+	h->name = t->data + e->off;
+	h->name_len = e->name_len;
+	h->value = t->data + e->off + e->name_len;
+	h->value_len = e->value_len;
+	return 0;
+}
+
+// ----------------------解码-----------------------
+
+int hpack_decode(HpackTable *t, const unsigned char *p, size_t len, char *scratch, size_t scratch_len,
+				 hpack_header_cb cb, void *arg) {
+	const unsigned char *end = p + len;
+	while (p < end) {
+		unsigned char b = *p;
+		char *sc = scratch;
+		size_t sl = scratch_len;
+		HpackHeader h;
+		size_t idx;
+		if (b & 0x80) {// 索引
+			if (decode_int(&p, end, 7, &idx) == -1 || table_lookup(t, idx, &h) == -1) return -1;
+			if (cb(arg, &h) == -1) return -2;
+			continue;
+		}
+		if ((b & 0xe0) == 0x20) {// 动态表大小更新 不能超过我们在SETTINGS中允许的大小
+			if (decode_int(&p, end, 5, &idx) == -1 || idx > t->limit) return -1;
+			table_resize(t, idx);
+			continue;
+		}
+		// 字面量 0x40加入动态表 0x00不加入 0x10永不加入
+		int index = (b & 0x40) != 0;
+		if (decode_int(&p, end, index ? 6 : 4, &idx) == -1) return -1;
+		if (idx) {
+			if (table_lookup(t, idx, &h) == -1) return -1;
+			if (idx > HPACK_STATIC_COUNT) {// 名字在动态表里 加入新条目时可能被淘汰 先复制出来
+				if (h.name_len > sl) return -1;
+				memcpy(sc, h.name, h.name_len);
+				h.name = sc;
+				sc += h.name_len;
+				sl -= h.name_len;
+			}
+		} else if (decode_string(&p, end, &sc, &sl, &h.name, &h.name_len) == -1) {
+			return -1;
+		}
+		if (decode_string(&p, end, &sc, &sl, &h.value, &h.value_len) == -1) return -1;
+		if (cb(arg, &h) == -1) return -2;
+		if (index) table_add(t, h.name, h.name_len, h.value, h.value_len);
+	}
+	return 0;
+}
+
+// ----------------------编码-----------------------
+
+void hpack_encoder_limit(HpackTable *t, size_t limit) {
+	t->limit = limit;
+	if (limit >= t->max_size) return;
+	table_resize(t, limit);
+	t->pending_update = 1;
+}
+
+size_t hpack_encode_begin(HpackTable *t, unsigned char *out, size_t cap) {
+	if (!t->pending_update) return 0;
+	t->pending_update = 0;
+	return encode_int(out, cap, 5, 0x20, t->max_size);
+}
+
+size_t hpack_encode(HpackTable *t, unsigned char *out, size_t cap, const char *name, const char *value,
+					size_t value_len, int index) {
+	size_t name_len = strlen(name), name_idx = 0;
+	for (int i = 0; i < HPACK_STATIC_COUNT; i++) {
+		if (strcmp(static_table[i].name, name) != 0) continue;
+		if (!name_idx) name_idx = i + 1;
+		if (strlen(static_table[i].value) == value_len && memcmp(static_table[i].value, value, value_len) == 0) {
+			return encode_int(out, cap, 7, 0x80, i + 1);
+		}
+	}
+	for (int i = 0; i < t->count; i++) {
+		HpackEntry *e = table_get(t, i);
+		if (e->name_len != name_len || memcmp(t->data + e->off, name, name_len) != 0) continue;
+		if (!name_idx) name_idx = HPACK_STATIC_COUNT + 1 + i;
+		if (e->value_len == value_len && memcmp(t->data + e->off + name_len, value, value_len) == 0) {
+			return encode_int(out, cap, 7, 0x80, HPACK_STATIC_COUNT + 1 + i);
+		}
+	}
+	size_t n = index ? encode_int(out, cap, 6, 0x40, name_idx) : encode_int(out, cap, 4, 0, name_idx);
+	if (n == 0) return 0;
+	if (!name_idx) {
+		size_t k = encode_string(out + n, cap - n, name, name_len);
+		if (k == 0) return 0;
+		n += k;
+	}
+	size_t k = encode_string(out + n, cap - n, value, value_len);
+	if (k == 0) return 0;
+	if (index) table_add(t, name, name_len, value, value_len);
+	return n + k;
+}
@@ -0,0 +1,53 @@
+#ifndef HPACK_H
+#define HPACK_H
+#include <stddef.h>
+#include <stdint.h>
+
+// HPACK(RFC 7541) HTTP/2的头压缩 解码器和编码器各有一张动态表
+
+#define HPACK_TABLE_SIZE 4096   // 动态表大小上限 也是SETTINGS_HEADER_TABLE_SIZE的默认值
+#define HPACK_STATIC_COUNT 61   // 静态表条目数 动态表的下标从62开始
+#define HPACK_ENTRY_OVERHEAD 32 // 每个条目除了名字和值之外额外计算的大小
+
+typedef struct{
+    size_t off;             // 名字在data中的偏移 值紧跟在名字后面
+    size_t name_len, value_len;
+} HpackEntry;
+
+// 动态表 所有条目的名字和值按从旧到新的顺序放在data[start, end)
+// 条目放在ent环形数组里 新条目在前(下标62) 超过max_size时淘汰最旧的
+typedef struct{
+    char data[HPACK_TABLE_SIZE];
+    size_t start, end;
+    HpackEntry ent[HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+    int oldest, count;
+    size_t size, max_size;  // 按RFC计算的当前大小和上限
+    size_t limit;           // 对端允许的上限(解码器)/对端在SETTINGS中给出的上限(编码器)
+    int pending_update;     // 编码器: 下一个头块开头要先发送动态表大小更新
+} HpackTable;
+
+// 解码出的一个头 指针只在回调中有效
+typedef struct{
+    const char *name, *value;
+    size_t name_len, value_len;
+} HpackHeader;
+
+typedef int (*hpack_header_cb)(void *arg, const HpackHeader *h);
+
+void hpack_table_init(HpackTable *t, size_t max_size);
+
+// 解码一个完整的头块 每解出一个头调用一次cb cb返回-1时停止
+// scratch用来放Huffman解码后的字符串 返回0成功 -1表示压缩错误(连接错误COMPRESSION_ERROR) -2表示cb返回了-1
+int hpack_decode(HpackTable *t, const unsigned char *p, size_t len, char *scratch, size_t scratch_len,
+                 hpack_header_cb cb, void *arg);
+
+// 对端通过SETTINGS_HEADER_TABLE_SIZE改变了编码器动态表的上限 下一个头块开头发送大小更新
+void hpack_encoder_limit(HpackTable *t, size_t limit);
+// 每个头块开头调用 有待发送的动态表大小更新时写到out 返回写入的字节数
+size_t hpack_encode_begin(HpackTable *t, unsigned char *out, size_t cap);
+// 编码一个头(名字必须是小写) 和动态表中的条目完全相同时只发下标
+// index为1时加入动态表 适合在多个响应中重复的值 返回写入的字节数 放不下返回0
+size_t hpack_encode(HpackTable *t, unsigned char *out, size_t cap, const char *name, const char *value,
+                    size_t value_len, int index);
+
+#endif
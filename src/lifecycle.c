@@ -0,0 +1,267 @@
+#define _GNU_SOURCE // pipe2
+#include "server.h"
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+atomic_int server_draining;
+static _Atomic uint64_t drain_deadline_ns; // 0表示没有截止时间
+static atomic_int listeners_removed;       // 已经去掉监听socket的循环个数
+
+static char exe_path[PATH_MAX]; // 升级时exec的路径 启动时解析 之后替换同一路径上的文件即可升级
+static char **saved_argv;
+static int upgrade_fd = -1;     // 升级启动时通知旧进程的管道写端
+
+static int signal_fd = -1;      // 只在主循环中注册
+static pid_t upgrade_pid;       // 正在启动的新进程 0表示没有进行中的升级
+static pid_t failed_pid;        // 启动失败但还没回收的新进程 下次升级前再回收
+static int upgrade_wait_fd = -1; // 等新进程就绪的管道读端
+
+static int wake_fds[MAX_LOOPS]; // 每个循环的eventfd 开始排空时逐个写一次
+static atomic_int wake_count;
+static atomic_int loops_running; // 还没退出的事件循环个数
+static __thread int wake_fd = -1;
+static __thread int is_main_loop;
+
+void lifecycle_init(int argc, char *argv[]) {
+	(void)argc;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (!realpath(argv[0], exe_path)) exe_path[0] = '\0';
+	saved_argv = argv;
+
+	const char *fd_env = getenv(UPGRADE_FD_ENV);
+	if (fd_env) {
+		char *end;
+		long fd = strtol(fd_env, &end, 10);
+		if (end != fd_env && *end == '\0' && fd > STDERR_FILENO && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0) upgrade_fd = (int)fd;
+		unsetenv(UPGRADE_FD_ENV);
+	}
+}
+
+static int add_control_fd(int epoll_fd, int *fd_to_index, int fd) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+	fd_to_index[fd] = FD_INDEX_CONTROL;
+	return 0;
+}
+
+int lifecycle_loop_init(int epoll_fd, int *fd_to_index, int main_loop) {
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1 || add_control_fd(epoll_fd, fd_to_index, wake_fd) == -1) return -1;
+	wake_fds[atomic_fetch_add(&wake_count, 1)] = wake_fd;
+	atomic_fetch_add(&loops_running, 1);
+	is_main_loop = main_loop;
+	if (!main_loop) return 0;
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR2);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1 || add_control_fd(epoll_fd, fd_to_index, signal_fd) == -1) return -1;
+	return 0;
+}
+
+void lifecycle_ready(void) {
+	if (upgrade_fd == -1) return;
+	char c = 1;
+	if (write(upgrade_fd, &c, 1) != 1) log_warn("notify old process failed: %s", strerror(errno));
+	close(upgrade_fd);
+	upgrade_fd = -1;
+}
+
+// 唤醒所有事件循环 阻塞在epoll_wait里的循环马上开始检查
+static void wake_all(void) {
+	uint64_t one = 1;
+	int n = atomic_load(&wake_count);
+	for (int i = 0; i < n; i++) {
+		if (write(wake_fds[i], &one, sizeof(one)) == -1 && errno != EAGAIN) log_warn("wake loop failed: %s", strerror(errno));
+	}
+}
+
+void lifecycle_drain(const char *reason) {
+	if (atomic_exchange(&server_draining, 1)) return;
+	int timeout = server_options.drain_timeout_ms;
+	if (timeout > 0) atomic_store(&drain_deadline_ns, metrics_now_ns() + (uint64_t)timeout * 1000000);
+	log_info("draining: %s", reason);
+	wake_all();
+}
+
+int lifecycle_drain_expired(void) {
+	uint64_t deadline = atomic_load_explicit(&drain_deadline_ns, memory_order_relaxed);
+	return deadline && metrics_now_ns() >= deadline;
+}
+
+void lifecycle_listeners_removed(void) {
+	if (atomic_fetch_add(&listeners_removed, 1) + 1 == atomic_load(&wake_count)) listener_close_all();
+}
+
+int lifecycle_loop_done(int empty) {
+	if (!empty) return 0;
+	if (!is_main_loop) {
+		atomic_fetch_sub(&loops_running, 1);
+		return 1;
+	}
+	return atomic_load(&loops_running) == 1;
+}
+
+// SIGHUP 可以在运行中修改的配置直接生效 MIME类型表整体替换 日志文件重新打开
+static void reload(void) {
+	log_info("SIGHUP received, reloading");
+	config_reload();
+	int mime_count = mime_load(server_options.mime_types);
+	if (mime_count == -1) log_error("reload %s failed, keeping the old mime types", server_options.mime_types);
+	else log_info("Loaded %d mime types from %s", mime_count, server_options.mime_types);
+	log_reopen();
+}
+
+// 环境变量去掉上一次升级留下的项 加上监听socket和通知管道
+// 在fork之前准备好 子进程里只调用异步信号安全的函数
+static char **upgrade_env(char *fds_var, char *ready_var) {
+	size_t n = 0;
+	while (environ[n]) n++;
+	char **envp = malloc((n + 3) * sizeof(char *));
+	if (!envp) return NULL;
+	size_t k = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!strncmp(environ[i], LISTEN_FDS_ENV "=", sizeof(LISTEN_FDS_ENV)) ||
+			!strncmp(environ[i], UPGRADE_FD_ENV "=", sizeof(UPGRADE_FD_ENV))) continue;
+		envp[k++] = environ[i];
+	}
+	envp[k++] = fds_var;
+	envp[k++] = ready_var;
+	envp[k] = NULL;
+	return envp;
+}
+
+// SIGUSR2 启动新进程 监听socket在exec时保留 新进程就绪后才开始排空
+static void start_upgrade(int epoll_fd, int *fd_to_index) {
+	if (failed_pid && waitpid(failed_pid, NULL, WNOHANG) != 0) failed_pid = 0;
+	if (upgrade_pid || atomic_load(&server_draining)) {
+		log_warn("SIGUSR2 ignored, an upgrade is already in progress");
+		return;
+	}
+	if (!exe_path[0]) {
+		log_error("upgrade failed: cannot resolve the executable path");
+		return;
+	}
+	char fds_var[sizeof(LISTEN_FDS_ENV) + MAX_LISTENERS * MAX_LOOPS * 12] = LISTEN_FDS_ENV "=";
+	size_t len = strlen(fds_var);
+	for (int i = 0; i < listener_count; i++) {
+		if (listeners[i].fd == -1) continue;
+		for (int k = 0; k < listeners[i].group; k++) {
+			len += snprintf(fds_var + len, sizeof(fds_var) - len, "%s%d", len > sizeof(LISTEN_FDS_ENV) ? "," : "", listeners[i].loop_fd[k]);
+		}
+	}
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+		log_error("upgrade failed: pipe: %s", strerror(errno));
+		return;
+	}
+	char ready_var[sizeof(UPGRADE_FD_ENV) + 12];
+	snprintf(ready_var, sizeof(ready_var), "%s=%d", UPGRADE_FD_ENV, pipe_fds[1]);
+	char **envp = upgrade_env(fds_var, ready_var);
+	if (!envp) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		// 子进程 只调用异步信号安全的函数 要传下去的fd去掉FD_CLOEXEC 屏蔽字恢复为空
+		for (int i = 0; i < listener_count; i++) {
+			if (listeners[i].fd == -1) continue;
+			for (int k = 0; k < listeners[i].group; k++) fcntl(listeners[i].loop_fd[k], F_SETFD, 0);
+		}
+		fcntl(pipe_fds[1], F_SETFD, 0);
+		affinity_reset(); // 主线程绑定了CPU 新进程要按原来的CPU集合重新分配
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execve(exe_path, saved_argv, envp);
+		_exit(127);
+	}
+	free(envp);
+	close(pipe_fds[1]);
+	if (pid == -1) {
+		log_error("upgrade failed: fork: %s", strerror(errno));
+		close(pipe_fds[0]);
+		return;
+	}
+	fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+	if (add_control_fd(epoll_fd, fd_to_index, pipe_fds[0]) == -1) {
+		log_error("upgrade: epoll_ctl failed: %s", strerror(errno));
+		close(pipe_fds[0]);
+		return;
+	}
+	upgrade_pid = pid;
+	upgrade_wait_fd = pipe_fds[0];
+	log_info("SIGUSR2 received, started %s as pid %d", exe_path, (int)pid);
+}
+
+// 新进程写了一个字节表示就绪 没写就关闭管道说明启动失败(退出或者exec失败)
+static void upgrade_result(int epoll_fd, int *fd_to_index) {
+	char c;
+	ssize_t n = read(upgrade_wait_fd, &c, 1);
+	if (n == -1 && errno == EAGAIN) return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, upgrade_wait_fd, NULL);
+	fd_to_index[upgrade_wait_fd] = -1;
+	close(upgrade_wait_fd);
+	upgrade_wait_fd = -1;
+	if (n == 1) {
+		log_info("new process %d is ready", (int)upgrade_pid);
+		listener_disown();
+		lifecycle_drain("upgraded");
+		return;
+	}
+	int status;
+	if (waitpid(upgrade_pid, &status, WNOHANG) == upgrade_pid) {
+		log_error("upgrade failed: new process %d exited with status %d, keep serving", (int)upgrade_pid,
+				  WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+	} else {
+		log_error("upgrade failed: new process %d did not report ready, keep serving", (int)upgrade_pid);
+		failed_pid = upgrade_pid;
+	}
+	upgrade_pid = 0;
+}
+
+void lifecycle_handle(int epoll_fd, int *fd_to_index, int fd) {
+	if (fd == upgrade_wait_fd) {
+		upgrade_result(epoll_fd, fd_to_index);
+		return;
+	}
+	if (fd != signal_fd) {// 唤醒用的eventfd 读掉计数即可
+		uint64_t v;
+		while (read(fd, &v, sizeof(v)) == sizeof(v)) {}
+		return;
+	}
+	struct signalfd_siginfo si;
+	while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+		const char *name = si.ssi_signo == SIGTERM ? "SIGTERM" : "SIGINT";
+		if (si.ssi_signo == SIGHUP) {
+			reload();
+		} else if (si.ssi_signo == SIGUSR2) {
+			start_upgrade(epoll_fd, fd_to_index);
+		} else if (!atomic_load(&server_draining)) {// SIGTERM/SIGINT
+			lifecycle_drain(name);
+		} else {// 排空中又收到一次 截止时间提前到现在
+			log_warn("%s received while draining, closing the remaining connections", name);
+			atomic_store(&drain_deadline_ns, 1);
+			wake_all();
+		}
+	}
+}
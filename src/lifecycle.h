@@ -0,0 +1,42 @@
+#ifndef LIFECYCLE_H
+#define LIFECYCLE_H
+#include <stdatomic.h>
+
+// 运行中的控制 信号由主事件循环通过signalfd处理 不在信号处理函数里做事
+//   SIGTERM/SIGINT: 排空后退出 关闭监听socket 进行中的响应最多再等drain_timeout_ms
+//                   排空中再收到一次时不再等 直接关闭剩下的连接
+//   SIGHUP:  重新读取配置(config_reload) 重新加载MIME类型表 重新打开日志文件
+//   SIGUSR2: 平滑升级 fork+exec当前路径上的可执行文件 监听socket通过LISTEN_FDS_ENV传给新进程
+//            新进程初始化完成后通过管道通知 旧进程停止accept 等进行中的请求和文件传输结束后退出
+//            新进程启动失败时旧进程继续服务
+// 排空(drain)期间空闲的keep-alive连接直接关闭 HTTP/2连接发GOAWAY 其余连接当前响应发完后关闭
+
+#define UPGRADE_FD_ENV "LISO_UPGRADE_FD" // 新进程通知旧进程已经就绪的管道写端
+#define DRAIN_POLL_MS 100                // 排空时epoll_wait的超时 用来检查空闲连接
+#define DRAIN_TIMEOUT_MS 30000           // drain_timeout_ms的默认值
+
+// 不为0时事件循环在排空 处理完已有连接后退出
+extern atomic_int server_draining;
+
+// 在创建任何线程之前调用 屏蔽SIGHUP/SIGUSR2/SIGTERM/SIGINT(之后创建的线程都继承) 记下升级时exec的路径和参数
+// 读取旧进程传来的UPGRADE_FD_ENV
+void lifecycle_init(int argc, char *argv[]);
+// 为当前线程的事件循环注册唤醒用的eventfd 主循环还要注册signalfd
+// 这些fd在fd_to_index中标记为FD_INDEX_CONTROL 失败返回-1
+int lifecycle_loop_init(int epoll_fd, int *fd_to_index, int main_loop);
+// fd_to_index为FD_INDEX_CONTROL的fd有事件
+void lifecycle_handle(int epoll_fd, int *fd_to_index, int fd);
+// 服务器初始化完成 如果是升级启动的通知旧进程
+void lifecycle_ready(void);
+// 开始排空 唤醒所有事件循环 截止时间从现在开始算
+void lifecycle_drain(const char *reason);
+// 排空是否已经超过drain_timeout_ms
+int lifecycle_drain_expired(void);
+// 事件循环已经从epoll中去掉了监听socket 最后一个循环调用时关闭监听socket
+// 之后新连接直接被拒绝 不会在backlog里等到进程退出
+void lifecycle_listeners_removed(void);
+// 排空中的事件循环每轮调用一次 empty表示这个循环已经没有连接和进行中的请求
+// 返回1表示这个循环可以退出 主循环要等其他循环都退出后才返回1
+int lifecycle_loop_done(int empty);
+
+#endif
@@ -0,0 +1,336 @@
+#include "server.h"
+#include <stddef.h>
+#include <limits.h>
+
+Listener listeners[MAX_LISTENERS];
+int listener_count;
+
+// 升级时从旧进程继承的监听socket 按地址分配给配置中的监听项 没有用上的由listener_close_inherited关闭
+static int inherited[MAX_LISTENERS * MAX_LOOPS];
+static int inherited_count = -1; // -1表示还没解析LISTEN_FDS_ENV
+static int disowned;             // socket文件已经交给新进程 关闭时不删除
+
+// 监听地址 bind时使用
+typedef union{
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+	struct sockaddr_un un;
+} ListenAddr;
+
+static int parse_int(const char *s, int *out) {
+	char *end;
+	long v = strtol(s, &end, 10);
+	if (end == s || *end || v < 0 || v > INT_MAX) return -1;
+	*out = (int)v;
+	return 0;
+}
+
+static int parse_unix(const char *path, Listener *l, ListenAddr *addr, socklen_t *addr_len) {
+	size_t len = strlen(path);
+	if (len == 0 || len >= sizeof(addr->un.sun_path) || strcmp(path, "@") == 0) return -1;
+	addr->un.sun_family = AF_UNIX;
+	if (path[0] == '@') {// 抽象命名空间 sun_path以\0开头 长度只算名字本身
+		memcpy(addr->un.sun_path + 1, path + 1, len - 1);
+		*addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+	} else {
+		memcpy(addr->un.sun_path, path, len);
+		*addr_len = sizeof(addr->un);
+	}
+	l->family = AF_UNIX;
+	memcpy(l->path, path, len + 1);
+	snprintf(l->name, sizeof(l->name), "unix:%s", path);
+	return 0;
+}
+
+// 解析"端口" "*:端口" "IPv4:端口" "[IPv6]:端口" 只接受数字地址 返回1表示通配地址(双栈)
+static int parse_inet(const char *s, Listener *l, ListenAddr *addr, socklen_t *addr_len) {
+	char host[INET6_ADDRSTRLEN + 2] = "*";
+	const char *colon = strrchr(s, ':'), *port_str = s;
+	if (colon) {
+		size_t host_len = colon - s;
+		if (host_len >= sizeof(host)) return -1;
+		memcpy(host, s, host_len);
+		host[host_len] = '\0';
+		port_str = colon + 1;
+	}
+	if (parse_int(port_str, &l->port) == -1 || l->port == 0 || l->port > 65535) return -1;
+	char *h = host;
+	size_t h_len = strlen(h);
+	if (h_len >= 2 && h[0] == '[' && h[h_len - 1] == ']') {
+		h[h_len - 1] = '\0';
+		h++;
+	}
+	int wildcard = h[0] == '\0' || strcmp(h, "*") == 0;
+	if (wildcard || inet_pton(AF_INET6, h, &addr->in6.sin6_addr) == 1) {
+		if (wildcard) addr->in6.sin6_addr = in6addr_any;
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_port = htons(l->port);
+		*addr_len = sizeof(addr->in6);
+		l->family = AF_INET6;
+		char ip[INET6_ADDRSTRLEN];
+		inet_ntop(AF_INET6, &addr->in6.sin6_addr, ip, sizeof(ip));
+		snprintf(l->name, sizeof(l->name), "[%s]:%d", ip, l->port);
+		return wildcard;
+	}
+	if (inet_pton(AF_INET, h, &addr->in.sin_addr) != 1) return -1;
+	addr->in.sin_family = AF_INET;
+	addr->in.sin_port = htons(l->port);
+	*addr_len = sizeof(addr->in);
+	l->family = AF_INET;
+	snprintf(l->name, sizeof(l->name), "%s:%d", h, l->port);
+	return 0;
+}
+
+static int parse_option(const char *opt, Listener *l) {
+	const char *eq = strchr(opt, '=');
+	size_t key_len = eq ? (size_t)(eq - opt) : strlen(opt);
+	const char *value = eq ? eq + 1 : NULL;
+#define KEY(k) (key_len == sizeof(k) - 1 && strncmp(opt, k, key_len) == 0)
+	if (KEY("nodelay") && !value) l->nodelay = 1;
+	else if (KEY("v6only") && !value) l->v6only = 1;
+	else if (KEY("backlog") && value) return parse_int(value, &l->backlog);
+	else if (KEY("defer") && value) return parse_int(value, &l->defer_accept);
+	else if (KEY("fastopen") && value) return parse_int(value, &l->fastopen);
+	else if (KEY("rcvbuf") && value) return parse_int(value, &l->rcvbuf);
+	else if (KEY("sndbuf") && value) return parse_int(value, &l->sndbuf);
+	else if (KEY("conns") && value) return parse_int(value, &l->max_conns);
+	else if (KEY("rate") && value) return parse_int(value, &l->rate);
+	else if (KEY("bw") && value) return parse_int(value, &l->bandwidth);
+	else return -1;
+#undef KEY
+	return 0;
+}
+
+static void set_option(Listener *l, int sock, int level, int name, int value, const char *what) {
+	if (setsockopt(sock, level, name, &value, sizeof(value)) == -1) {
+		log_warn("%s on %s failed: %s", what, l->name, strerror(errno));
+	}
+}
+
+static void parse_inherited(void) {
+	inherited_count = 0;
+	const char *list = getenv(LISTEN_FDS_ENV);
+	if (!list) return;
+	char *end;
+	for (const char *p = list; *p && inherited_count < MAX_LISTENERS * MAX_LOOPS; p = *end ? end + 1 : end) {
+		long fd = strtol(p, &end, 10);
+		if (end == p || (*end && *end != ',')) break;
+		int accepting = 0;
+		socklen_t len = sizeof(accepting);
+		// 只接受确实在监听的socket 防止环境变量写错时把别的fd当成监听socket
+		if (fd > STDERR_FILENO && getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == 0 && accepting) {
+			inherited[inherited_count++] = (int)fd;
+		}
+	}
+	unsetenv(LISTEN_FDS_ENV); // CGI脚本和下一次升级不应该再看到
+}
+
+// 找一个地址相同的继承socket 取走后返回fd 没有返回-1
+static int take_inherited(const ListenAddr *addr, socklen_t addr_len) {
+	if (inherited_count == -1) parse_inherited();
+	for (int i = 0; i < inherited_count; i++) {
+		if (inherited[i] == -1) continue;
+		ListenAddr got;
+		socklen_t got_len = sizeof(got);
+		memset(&got, 0, sizeof(got));
+		if (getsockname(inherited[i], &got.sa, &got_len) == -1 || got.sa.sa_family != addr->sa.sa_family) continue;
+		int same;
+		if (addr->sa.sa_family == AF_INET) {
+			same = got.in.sin_port == addr->in.sin_port && got.in.sin_addr.s_addr == addr->in.sin_addr.s_addr;
+		} else if (addr->sa.sa_family == AF_INET6) {
+			same = got.in6.sin6_port == addr->in6.sin6_port &&
+				   memcmp(&got.in6.sin6_addr, &addr->in6.sin6_addr, sizeof(struct in6_addr)) == 0;
+		} else if (addr->un.sun_path[0] == '\0') {// 抽象命名空间 名字可以含\0 按长度比较
+			same = got_len == addr_len && memcmp(got.un.sun_path, addr->un.sun_path, addr_len - offsetof(struct sockaddr_un, sun_path)) == 0;
+		} else {
+			same = strncmp(got.un.sun_path, addr->un.sun_path, sizeof(got.un.sun_path)) == 0;
+		}
+		if (same) {
+			int fd = inherited[i];
+			inherited[i] = -1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+// 创建监听socket 设置选项后bind+listen 升级时直接使用旧进程传下来的同一地址的socket
+// 继承的socket一直在监听 旧进程还没accept的连接留在队列里由新进程接着处理 不会有连接被拒绝
+// reuseport为1时新建的socket设置SO_REUSEPORT 同一地址还可以再打开几个 返回fd 失败返回-1
+static int bind_socket(Listener *l, const ListenAddr *addr, socklen_t addr_len, int reuseport) {
+	int sock = take_inherited(addr, addr_len);
+	if (sock != -1) {
+		fcntl(sock, F_SETFD, FD_CLOEXEC); // exec时清掉了 重新设置 CGI脚本不能继承
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+		if (l->family != AF_UNIX) {
+			if (l->defer_accept > 0) set_option(l, sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, l->defer_accept, "TCP_DEFER_ACCEPT");
+			if (l->nodelay) set_option(l, sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+			if (l->fastopen > 0) set_option(l, sock, IPPROTO_TCP, TCP_FASTOPEN, l->fastopen, "TCP_FASTOPEN");
+		}
+		// 已经在监听的socket再次listen只更新backlog
+		if (listen(sock, l->backlog) == -1) {
+			int err = errno;
+			close(sock);
+			errno = err;
+			return -1;
+		}
+		l->inherited = 1;
+		return sock;
+	}
+	sock = socket(l->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock == -1) return -1;
+	if (l->family == AF_UNIX) {
+		// 上次没有正常退出留下的socket文件 不删除的话bind会失败
+		struct stat st;
+		if (l->path[0] != '@' && stat(l->path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(l->path);
+	} else {
+		// 允许端口复用 避免TCP一直占用端口重启后监听失败
+		set_option(l, sock, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+		if (l->family == AF_INET6) set_option(l, sock, IPPROTO_IPV6, IPV6_V6ONLY, l->v6only, "IPV6_V6ONLY");
+		// 连接建立后客户端发来第一个数据包才唤醒accept 只连接不发数据的客户端不占用槽位
+		if (l->defer_accept > 0) set_option(l, sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, l->defer_accept, "TCP_DEFER_ACCEPT");
+		if (l->nodelay) set_option(l, sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+		// 请求可以跟在SYN里 省掉一个往返
+		if (l->fastopen > 0) set_option(l, sock, IPPROTO_TCP, TCP_FASTOPEN, l->fastopen, "TCP_FASTOPEN");
+		if (reuseport) set_option(l, sock, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+	}
+	// 缓冲区大小要在listen之前设置 握手时据此确定窗口扩大因子
+	if (l->rcvbuf > 0) set_option(l, sock, SOL_SOCKET, SO_RCVBUF, l->rcvbuf, "SO_RCVBUF");
+	if (l->sndbuf > 0) set_option(l, sock, SOL_SOCKET, SO_SNDBUF, l->sndbuf, "SO_SNDBUF");
+	if (bind(sock, &addr->sa, addr_len) == -1 || listen(sock, l->backlog) == -1) {
+		int err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+	return sock;
+}
+
+// 打开l->fd 按CPU分流时再给其余的事件循环各开一个同地址的socket 第一个socket上挂分流程序
+// 组里socket的下标按加入的顺序 升级时旧进程按loop_fd的顺序传下来 新进程按同样的顺序取回
+static int listener_bind(Listener *l, const ListenAddr *addr, socklen_t addr_len) {
+	int steer = l->family != AF_UNIX && affinity_steering();
+	l->fd = l->loop_fd[0] = bind_socket(l, addr, addr_len, steer);
+	if (l->fd == -1) return -1;
+	l->group = 1;
+	if (!steer) return 0;
+	int reuseport = 0;
+	socklen_t len = sizeof(reuseport);
+	if (getsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, &len) == -1 || !reuseport) {// 旧进程没有分流
+		log_warn("%s was inherited without SO_REUSEPORT, connections are not steered by CPU", l->name);
+		return 0;
+	}
+	for (; l->group < server_options.loops; l->group++) {
+		int sock = bind_socket(l, addr, addr_len, 1);
+		if (sock == -1) {
+			int err = errno;
+			for (int k = 0; k < l->group; k++) close(l->loop_fd[k]);
+			l->fd = -1;
+			l->group = 0;
+			errno = err;
+			return -1;
+		}
+		l->loop_fd[l->group] = sock;
+	}
+	affinity_attach(l->loop_fd, l->group);
+	return 0;
+}
+
+// 打开一项 地址后面跟空格分隔的选项
+static int open_entry(char *entry) {
+	if (listener_count == MAX_LISTENERS) {
+		log_error("too many listeners (max %d)", MAX_LISTENERS);
+		return -1;
+	}
+	Listener *l = &listeners[listener_count];
+	memset(l, 0, sizeof(*l));
+	l->fd = -1;
+	l->backlog = server_options.backlog;
+	l->defer_accept = server_options.defer_accept;
+
+	char *save = NULL;
+	char *address = strtok_r(entry, " ", &save);
+	ListenAddr addr;
+	memset(&addr, 0, sizeof(addr));
+	socklen_t addr_len = 0;
+	int wildcard = strncmp(address, "unix:", 5) == 0 ? parse_unix(address + 5, l, &addr, &addr_len)
+	                                                 : parse_inet(address, l, &addr, &addr_len);
+	if (wildcard == -1) {
+		log_error("bad listen address: %s", address);
+		return -1;
+	}
+	for (char *opt = strtok_r(NULL, " ", &save); opt; opt = strtok_r(NULL, " ", &save)) {
+		if (parse_option(opt, l) == -1) {
+			log_error("bad listen option for %s: %s", l->name, opt);
+			return -1;
+		}
+	}
+	if (l->backlog < 1) l->backlog = 1;
+
+	int ret = listener_bind(l, &addr, addr_len);
+	if (ret == -1 && wildcard && errno == EAFNOSUPPORT) {// 内核没有IPv6 通配地址退回0.0.0.0
+		memset(&addr, 0, sizeof(addr));
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons(l->port);
+		addr.in.sin_addr.s_addr = INADDR_ANY;
+		l->family = AF_INET;
+		snprintf(l->name, sizeof(l->name), "0.0.0.0:%d", l->port);
+		ret = listener_bind(l, &addr, sizeof(addr.in));
+	}
+	if (ret == -1) {
+		log_error("bind/listen on %s failed: %s", l->name, strerror(errno));
+		return -1;
+	}
+	listener_count++;
+	return 0;
+}
+
+int listener_open(const char *list) {
+	char buf[LISTEN_SPEC_MAX];
+	if (snprintf(buf, sizeof(buf), "%s", list) >= (int)sizeof(buf)) return -1;
+	char *save = NULL;
+	for (char *p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		while (*p == ' ') p++;
+		if (*p && open_entry(p) == -1) return -1;
+	}
+	return 0;
+}
+
+int listener_open_unix(const char *list) {
+	char buf[LISTEN_SPEC_MAX];
+	if (snprintf(buf, sizeof(buf), "%s", list) >= (int)sizeof(buf)) return -1;
+	char *save = NULL;
+	for (char *p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		while (*p == ' ') p++;
+		if (!*p) continue;
+		char entry[sizeof(((struct sockaddr_un *)0)->sun_path) + 8];
+		if (snprintf(entry, sizeof(entry), "unix:%s", p) >= (int)sizeof(entry) || open_entry(entry) == -1) return -1;
+	}
+	return 0;
+}
+
+void listener_close_inherited(void) {
+	if (inherited_count == -1) parse_inherited();
+	for (int i = 0; i < inherited_count; i++) {
+		if (inherited[i] == -1) continue;
+		log_warn("inherited listening socket fd %d is no longer configured, closing it", inherited[i]);
+		close(inherited[i]);
+		inherited[i] = -1;
+	}
+}
+
+void listener_disown(void) {
+	disowned = 1;
+}
+
+void listener_close_all(void) {
+	for (int i = 0; i < listener_count; i++) {
+		Listener *l = &listeners[i];
+		if (l->fd == -1) continue;
+		for (int k = 1; k < l->group; k++) close(l->loop_fd[k]);
+		close(l->fd);
+		l->fd = -1;
+		if (l->family == AF_UNIX && l->path[0] != '@' && !disowned) unlink(l->path);
+	}
+}
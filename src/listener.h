@@ -0,0 +1,60 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "affinity.h"
+
+#define MAX_LISTENERS 16    // 监听socket个数上限
+#define LISTEN_SPEC_MAX 4096 // 监听地址列表的最大长度
+#define LISTEN_FDS_ENV "LISO_LISTEN_FDS" // 升级时旧进程传给新进程的监听socket 逗号分隔的fd
+
+// 一个监听socket 所有事件循环共享 在每个循环的fd_to_index中标记为FD_INDEX_LISTENER(i)
+// 按CPU分流时(见affinity.h)TCP地址每个事件循环各有一个socket 都在loop_fd中
+// 下面的socket选项都设置在监听socket上 accept出来的连接直接继承 不需要每个连接再调用setsockopt
+typedef struct{
+    int fd;
+    int family;             // AF_INET AF_INET6或AF_UNIX
+    int port;               // TCP端口 CGI/FastCGI的SERVER_PORT Unix socket为0
+    int backlog;            // listen的backlog 默认server_options.backlog
+    int defer_accept;       // TCP_DEFER_ACCEPT的秒数 默认server_options.defer_accept
+    int nodelay;            // TCP_NODELAY
+    int fastopen;           // TCP_FASTOPEN的队列长度 0表示不启用
+    int rcvbuf, sndbuf;     // SO_RCVBUF/SO_SNDBUF 0表示系统默认
+    int v6only;             // IPV6_V6ONLY 0表示[::]同时接受IPv4(双栈)
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)]; // Unix socket路径 抽象命名空间以@开头
+    char name[128];         // 日志中显示的地址
+    int inherited;          // 从旧进程继承 没有重新bind
+    int max_conns;          // 并发连接数上限 0表示不限制 见ratelimit.h
+    int rate;               // 每秒请求数上限
+    int bandwidth;          // 每秒发送字节数上限
+    int group;              // loop_fd中的socket个数 1表示所有事件循环共用fd
+    int loop_fd[MAX_LOOPS]; // 同一个SO_REUSEPORT组 loop_fd[k]给事件循环k loop_fd[0]就是fd
+} Listener;
+
+extern Listener listeners[MAX_LISTENERS];
+extern int listener_count;
+
+// 事件循环loop接受连接的socket
+static inline int listener_fd(const Listener *l, int loop) {
+    return l->group > 1 ? l->loop_fd[loop] : l->fd;
+}
+
+// 按逗号分隔的列表打开监听socket 每一项是地址后面跟空格分隔的选项 如
+// "*:9999 backlog=4096 nodelay,127.0.0.1:8080 fastopen=256 rcvbuf=262144,[::1]:8081 v6only,unix:/tmp/liso.sock"
+// 地址: 端口或*:端口(双栈 没有IPv6时退回0.0.0.0) IPv4:端口 [IPv6]:端口 unix:路径 unix:@名字(抽象命名空间)
+// 选项: backlog=N defer=秒 nodelay fastopen=N rcvbuf=字节 sndbuf=字节 v6only
+//       conns=N rate=每秒请求数 bw=每秒字节数(这个监听socket上所有连接合计的限制)
+// 地址与LISTEN_FDS_ENV中某个继承的socket相同时直接使用它 不重新bind 按CPU分流时一个地址依次取走多个
+// 失败返回-1 已经打开的监听socket不关闭
+int listener_open(const char *list);
+// 监听逗号分隔的Unix socket列表 如"/tmp/liso.sock,@liso" 相当于每一项加上unix:交给listener_open
+// 文件系统中已经存在的同名socket先删除 失败返回-1
+int listener_open_unix(const char *list);
+// 关闭LISTEN_FDS_ENV中没有被配置用上的监听socket 在所有listener_open之后调用
+void listener_close_inherited(void);
+// 监听socket已经交给新进程 之后listener_close_all不再删除socket文件
+void listener_disown(void);
+// 关闭所有监听socket 删除文件系统中的socket文件
+void listener_close_all(void);
+
+#endif
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_MAX_THREADS 64     // 最多注册的生产者线程数
+#define LOG_WRITE_BUF 65536    // 后台线程每批写文件的缓冲区大小
+
+// 记录类型
+enum{
+    LOG_KIND_TEXT,   // 错误日志 text为格式化好的消息
+    LOG_KIND_ACCESS  // 访问日志 text为"host\0request\0referer\0user_agent\0"
+};
+
+// 固定大小的记录 生产者直接格式化到槽位里 不额外分配内存
+typedef struct{
+    uint64_t ts_ns;   // CLOCK_REALTIME
+    uint8_t level;
+    uint8_t kind;
+    uint16_t len;     // text中有效的字节数
+    int status;
+    int64_t bytes;
+    char text[LOG_TEXT_MAX];
+} LogRecord;
+
+// 单生产者单消费者环形缓冲区 生产者是所属的工作线程 消费者是后台刷盘线程
+typedef struct{
+    _Alignas(64) atomic_uint_fast64_t head; // 生产者写入位置
+    _Alignas(64) atomic_uint_fast64_t tail; // 消费者读取位置
+    _Alignas(64) atomic_uint_fast64_t dropped; // 缓冲区满时丢弃的记录数
+    LogRecord slots[LOG_RING_SLOTS];
+} LogRing;
+
+atomic_int log_current_level = LOG_INFO;
+
+static log_format current_format = LOG_FORMAT_COMMON;
+static int access_fd = STDOUT_FILENO;
+static int error_fd = STDERR_FILENO;
+
+static LogRing *rings[LOG_MAX_THREADS];
+static atomic_int ring_count;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread LogRing *tls_ring;
+
+static pthread_t flusher;
+static atomic_int flusher_running;
+static atomic_int reopen_requested;
+static char log_dir[4096];    // log_init时的日志目录 重新打开时使用 空串表示没有日志文件
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+void log_set_level(log_level level) {
+    atomic_store_explicit(&log_current_level, level, memory_order_relaxed);
+}
+
+int log_parse_level(const char *name) {
+    for (int i = 0; i <= LOG_DEBUG; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+int log_parse_format(const char *name) {
+    if (strcasecmp(name, "common") == 0) return LOG_FORMAT_COMMON;
+    if (strcasecmp(name, "combined") == 0) return LOG_FORMAT_COMBINED;
+    if (strcasecmp(name, "json") == 0) return LOG_FORMAT_JSON;
+    return -1;
+}
+
+// 第一次写日志时为当前线程分配环形缓冲区并注册给后台线程
+static LogRing *get_ring(void) {
+    if (tls_ring) return tls_ring;
+    pthread_mutex_lock(&ring_lock);
+    int n = atomic_load(&ring_count);
+    if (n < LOG_MAX_THREADS) {
+        LogRing *ring = calloc(1, sizeof(LogRing));
+        if (ring) {
+            rings[n] = ring;
+            atomic_store_explicit(&ring_count, n + 1, memory_order_release);
+            tls_ring = ring;
+        }
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return tls_ring;
+}
+
+// 取一个空槽位 缓冲区满时返回NULL 调用方直接丢弃这条日志
+static LogRecord *ring_reserve(LogRing *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &ring->slots[head & (LOG_RING_SLOTS - 1)];
+}
+
+static void ring_commit(LogRing *ring) {
+    atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void log_write(log_level level, const char *fmt, ...) {
+    LogRing *ring = get_ring();
+    if (!ring) return;
+    LogRecord *rec = ring_reserve(ring);
+    if (!rec) return;
+
+    rec->ts_ns = realtime_ns();
+    rec->level = level;
+    rec->kind = LOG_KIND_TEXT;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    if (n < 0) n = 0;
+    if (n >= (int)sizeof(rec->text)) n = sizeof(rec->text) - 1;
+    // 去掉结尾的换行 写文件时统一加
+    while (n > 0 && rec->text[n - 1] == '\n') n--;
+    rec->len = n;
+    ring_commit(ring);
+}
+
+// 把长度为n的字符串追加到text中 超出时截断 返回新的长度
+// left是后面还要追加的字段数 给它们每个留一个'\0' 读取时按'\0'分隔不会越过text的末尾
+static size_t pack_field(char *text, size_t len, const char *s, size_t n, size_t left) {
+    size_t room = LOG_TEXT_MAX - len - left;
+    if (!s) n = 0;
+    if (n > room - 1) n = room - 1;
+    memcpy(text + len, s ? s : "", n);
+    text[len + n] = '\0';
+    return len + n + 1;
+}
+
+void log_access(const char *host, const char *request_line, size_t request_line_len,
+                int status, off_t bytes, const char *referer, size_t referer_len,
+                const char *user_agent, size_t user_agent_len) {
+    LogRing *ring = get_ring();
+    if (!ring) return;
+    LogRecord *rec = ring_reserve(ring);
+    if (!rec) return;
+
+    rec->ts_ns = realtime_ns();
+    rec->level = LOG_INFO;
+    rec->kind = LOG_KIND_ACCESS;
+    rec->status = status;
+    rec->bytes = bytes;
+    size_t len = 0;
+    len = pack_field(rec->text, len, host, strlen(host), 3);
+    len = pack_field(rec->text, len, request_line, request_line_len, 2);
+    len = pack_field(rec->text, len, referer, referer_len, 1);
+    len = pack_field(rec->text, len, user_agent, user_agent_len, 0);
+    rec->len = len;
+    ring_commit(ring);
+}
+
+// ----------------------后台刷盘线程-----------------------
+
+typedef struct{
+    int fd;
+    char buf[LOG_WRITE_BUF];
+    size_t len;
+} WriteBuf;
+
+static void wb_flush(WriteBuf *wb) {
+    size_t off = 0;
+    while (off < wb->len) {
+        ssize_t n = write(wb->fd, wb->buf + off, wb->len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // 磁盘出错时丢弃这一批 不能影响服务
+        off += n;
+    }
+    wb->len = 0;
+}
+
+// 保证剩余空间至少能放下一条格式化后的记录
+static void wb_reserve(WriteBuf *wb, size_t need) {
+    if (sizeof(wb->buf) - wb->len < need) wb_flush(wb);
+}
+
+static void wb_printf(WriteBuf *wb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void wb_printf(WriteBuf *wb, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(wb->buf + wb->len, sizeof(wb->buf) - wb->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    size_t room = sizeof(wb->buf) - wb->len;
+    wb->len += (size_t)n < room ? (size_t)n : room - 1;
+}
+
+// JSON字符串转义
+static void wb_json_string(WriteBuf *wb, const char *s) {
+    wb_printf(wb, "\"");
+    for (; *s && sizeof(wb->buf) - wb->len > 8; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') wb_printf(wb, "\\%c", c);
+        else if (c < 0x20) wb_printf(wb, "\\u%04x", c);
+        else wb->buf[wb->len++] = c;
+    }
+    wb_printf(wb, "\"");
+}
+
+static void format_access(WriteBuf *wb, const LogRecord *rec) {
+    const char *host = rec->text;
+    const char *request = host + strlen(host) + 1;
+    const char *referer = request + strlen(request) + 1;
+    const char *user_agent = referer + strlen(referer) + 1;
+    time_t sec = rec->ts_ns / 1000000000ull;
+    struct tm tm;
+    char date[64];
+
+    wb_reserve(wb, 1024);
+    if (current_format == LOG_FORMAT_JSON) {
+        gmtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        wb_printf(wb, "{\"time\":\"%s.%03dZ\",\"remote_addr\":", date,
+                  (int)(rec->ts_ns / 1000000 % 1000));
+        wb_json_string(wb, host);
+        wb_printf(wb, ",\"request\":");
+        wb_json_string(wb, request);
+        wb_printf(wb, ",\"status\":%d,\"bytes\":%lld,\"referer\":", rec->status, (long long)rec->bytes);
+        wb_json_string(wb, referer);
+        wb_printf(wb, ",\"user_agent\":");
+        wb_json_string(wb, user_agent);
+        wb_printf(wb, "}\n");
+        return;
+    }
+    localtime_r(&sec, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    wb_printf(wb, "%s - - [%s] \"%s\" %d ", host, date, request, rec->status);
+    if (rec->bytes > 0) wb_printf(wb, "%lld", (long long)rec->bytes);
+    else wb_printf(wb, "-");
+    if (current_format == LOG_FORMAT_COMBINED) {
+        wb_printf(wb, " \"%s\" \"%s\"", *referer ? referer : "-", *user_agent ? user_agent : "-");
+    }
+    wb_printf(wb, "\n");
+}
+
+static void format_text(WriteBuf *wb, const LogRecord *rec) {
+    time_t sec = rec->ts_ns / 1000000000ull;
+    struct tm tm;
+    char date[64];
+    gmtime_r(&sec, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    wb_reserve(wb, LOG_TEXT_MAX + 128);
+    wb_printf(wb, "[%s.%03dZ] [%s] %.*s\n", date, (int)(rec->ts_ns / 1000000 % 1000),
+              level_names[rec->level], (int)rec->len, rec->text);
+}
+
+// 把所有线程缓冲区里的记录取出来 分别批量写入访问日志和错误日志
+static void drain_rings(WriteBuf *access_wb, WriteBuf *error_wb) {
+    int n = atomic_load_explicit(&ring_count, memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        LogRing *ring = rings[i];
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            const LogRecord *rec = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+            if (rec->kind == LOG_KIND_ACCESS) format_access(access_wb, rec);
+            else format_text(error_wb, rec);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            wb_reserve(error_wb, 128);
+            wb_printf(error_wb, "[warn] log ring full, %lu records dropped\n", (unsigned long)dropped);
+        }
+    }
+    wb_flush(access_wb);
+    wb_flush(error_wb);
+}
+
+static int open_log_file(const char *dir, const char *name, int fallback);
+
+// 在原来的fd上打开同名文件 日志轮转(mv后发SIGHUP)后写到新文件 WriteBuf里的fd不用改
+// 打开失败时继续写旧文件 用的是stdout/stderr时不处理
+static void reopen_file(int fd, const char *name) {
+    if (fd == STDOUT_FILENO || fd == STDERR_FILENO) return;
+    int new_fd = open_log_file(log_dir, name, -1);
+    if (new_fd == -1) return;
+    dup3(new_fd, fd, O_CLOEXEC);
+    close(new_fd);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    static WriteBuf access_wb, error_wb;
+    access_wb.fd = access_fd;
+    error_wb.fd = error_fd;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+    while (atomic_load(&flusher_running)) {
+        drain_rings(&access_wb, &error_wb);
+        // 之前的记录已经写进旧文件 之后的写进新文件
+        if (atomic_exchange(&reopen_requested, 0) && log_dir[0]) {
+            reopen_file(access_fd, LOG_ACCESS_FILE);
+            reopen_file(error_fd, LOG_ERROR_FILE);
+        }
+        nanosleep(&interval, NULL);
+    }
+    drain_rings(&access_wb, &error_wb); // 退出前把剩下的写完
+    return NULL;
+}
+
+static int open_log_file(const char *dir, const char *name, int fallback) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "open log file %s failed: %s, using %s\n", path, strerror(errno),
+                fallback == STDOUT_FILENO ? "stdout" : fallback == STDERR_FILENO ? "stderr" : "the old file");
+        return fallback;
+    }
+    return fd;
+}
+
+int log_init(const char *dir, log_format format) {
+    current_format = format;
+    if (dir) {
+        snprintf(log_dir, sizeof(log_dir), "%s", dir);
+        access_fd = open_log_file(dir, LOG_ACCESS_FILE, STDOUT_FILENO);
+        error_fd = open_log_file(dir, LOG_ERROR_FILE, STDERR_FILENO);
+    }
+    atomic_store(&flusher_running, 1);
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        atomic_store(&flusher_running, 0);
+        return -1;
+    }
+    atexit(log_shutdown);
+    return 0;
+}
+
+void log_reopen(void) {
+    atomic_store(&reopen_requested, 1);
+}
+
+void log_shutdown(void) {
+    if (!atomic_exchange(&flusher_running, 0)) return;
+    pthread_join(flusher, NULL);
+}
@@ -0,0 +1,65 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// 日志级别 数值越大越详细
+typedef enum{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} log_level;
+
+// 访问日志格式
+typedef enum{
+    LOG_FORMAT_COMMON,   // Common Log Format
+    LOG_FORMAT_COMBINED, // Combined Log Format (多出Referer和User-Agent)
+    LOG_FORMAT_JSON      // 每行一个JSON对象
+} log_format;
+
+#define LOG_RING_SLOTS 4096   // 每个线程环形缓冲区的记录数 必须是2的幂
+#define LOG_TEXT_MAX 232      // 单条记录的文本长度上限 超出截断
+#define LOG_FLUSH_INTERVAL_MS 50 // 后台线程刷盘间隔
+#define LOG_ACCESS_FILE "liso_access.log"
+#define LOG_ERROR_FILE "liso_error.log"
+
+extern atomic_int log_current_level;
+
+// 启动后台刷盘线程 dir为日志目录 打开失败时写到stderr
+int log_init(const char *dir, log_format format);
+// 停止后台线程并把剩余记录写完
+void log_shutdown(void);
+// 后台线程写完已有记录后重新打开日志文件 用于日志轮转
+void log_reopen(void);
+// 运行时切换日志级别
+void log_set_level(log_level level);
+// 解析"error"/"warn"/"info"/"debug" 无法识别返回-1
+int log_parse_level(const char *name);
+// 解析"common"/"combined"/"json" 无法识别返回-1
+int log_parse_format(const char *name);
+
+// 写一条错误日志记录 只做一次格式化和一次环形缓冲区写入 不会阻塞
+void log_write(log_level level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// 写一条访问日志记录 时间戳和格式化由后台线程完成
+// request_line/referer/user_agent直接引用请求缓冲区 不需要以\0结尾 可以为NULL
+void log_access(const char *host, const char *request_line, size_t request_line_len,
+                int status, off_t bytes, const char *referer, size_t referer_len,
+                const char *user_agent, size_t user_agent_len);
+
+static inline int log_enabled(log_level level) {
+    return (int)level <= atomic_load_explicit(&log_current_level, memory_order_relaxed);
+}
+
+#define log_error(...) do { if (log_enabled(LOG_ERROR)) log_write(LOG_ERROR, __VA_ARGS__); } while (0)
+#define log_warn(...)  do { if (log_enabled(LOG_WARN))  log_write(LOG_WARN,  __VA_ARGS__); } while (0)
+#define log_info(...)  do { if (log_enabled(LOG_INFO))  log_write(LOG_INFO,  __VA_ARGS__); } while (0)
+// 调试日志只在 make DEBUG=1 时编译进来 否则是if(0)死代码 参数不会求值 只保留格式检查
+#ifdef LISO_DEBUG
+#define log_debug(...) do { if (log_enabled(LOG_DEBUG)) log_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+#else
+#define log_debug(...) do { if (0) log_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+#endif
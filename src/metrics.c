@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+Metrics metrics;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "accept", "header_parse", "file_open", "first_byte", "last_byte"
+};
+static const char *counter_names[COUNTER_COUNT] = {
+    "liso_connections_accepted_total",
+    "liso_connections_rejected_total",
+    "liso_requests_total",
+    "liso_received_bytes_total",
+    "liso_sent_bytes_total",
+    "liso_spliced_bytes_total",
+    "liso_rate_limited_total",
+    "liso_output_paused_total"
+};
+static const char *gauge_names[GAUGE_COUNT] = {
+    "liso_open_connections",
+    "liso_bytes_in_flight",
+    "liso_output_queued_bytes"
+};
+static const char *status_codes[STATUS_COUNT] = {
+    "200", "400", "404", "500", "501", "505", "other"
+};
+
+void metrics_count_status(int status) {
+    metric_status s;
+    switch (status) {
+    case 200: s = STATUS_200; break;
+    case 400: s = STATUS_400; break;
+    case 404: s = STATUS_404; break;
+    case 500: s = STATUS_500; break;
+    case 501: s = STATUS_501; break;
+    case 505: s = STATUS_505; break;
+    default:  s = STATUS_OTHER; break;
+    }
+    atomic_fetch_add_explicit(&metrics.status[s], 1, memory_order_relaxed);
+}
+
+// 输出缓冲 满了就写到fd里
+typedef struct{
+    int fd;
+    char buf[4096];
+    size_t len;
+    int failed;
+} RenderBuf;
+
+static void render_flush(RenderBuf *r) {
+    size_t off = 0;
+    while (off < r->len && !r->failed) {
+        ssize_t n = write(r->fd, r->buf + off, r->len - off);
+        if (n <= 0) r->failed = 1;
+        else off += n;
+    }
+    r->len = 0;
+}
+
+static void render(RenderBuf *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void render(RenderBuf *r, const char *fmt, ...) {
+    // 单行指标不会超过256字节
+    if (sizeof(r->buf) - r->len < 256) render_flush(r);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) r->len += (size_t)n < sizeof(r->buf) - r->len ? (size_t)n : sizeof(r->buf) - r->len - 1;
+}
+
+// 第i个桶的上界(纳秒 包含)
+static uint64_t bucket_upper_ns(int i) {
+    if (i == 0) return 1ull << METRICS_MIN_SHIFT;
+    int msb = METRICS_MIN_SHIFT + ((i - 1) >> METRICS_SUB_BITS);
+    int sub = (i - 1) & ((1 << METRICS_SUB_BITS) - 1);
+    return (1ull << (msb - METRICS_SUB_BITS)) * ((1ull << METRICS_SUB_BITS) + sub + 1);
+}
+
+static void render_histogram(RenderBuf *r, const char *phase, Histogram *h) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        render(r, "liso_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %lu\n",
+               phase, bucket_upper_ns(i) / 1e9, (unsigned long)cumulative);
+    }
+    cumulative += atomic_load_explicit(&h->buckets[METRICS_BUCKETS], memory_order_relaxed);
+    render(r, "liso_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",
+           phase, (unsigned long)cumulative);
+    render(r, "liso_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n",
+           phase, atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9);
+    // count取各桶之和 保证和+Inf桶一致
+    render(r, "liso_phase_duration_seconds_count{phase=\"%s\"} %lu\n",
+           phase, (unsigned long)cumulative);
+}
+
+int metrics_render_fd(void) {
+    int fd = memfd_create("liso_metrics", MFD_CLOEXEC);
+    if (fd == -1) return -1;
+
+    RenderBuf r = { .fd = fd, .len = 0, .failed = 0 };
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        render(&r, "# TYPE %s counter\n%s %lu\n", counter_names[i], counter_names[i],
+               (unsigned long)atomic_load_explicit(&metrics.counters[i], memory_order_relaxed));
+    }
+    render(&r, "# TYPE liso_responses_total counter\n");
+    for (int i = 0; i < STATUS_COUNT; i++) {
+        render(&r, "liso_responses_total{code=\"%s\"} %lu\n", status_codes[i],
+               (unsigned long)atomic_load_explicit(&metrics.status[i], memory_order_relaxed));
+    }
+    for (int i = 0; i < GAUGE_COUNT; i++) {
+        render(&r, "# TYPE %s gauge\n%s %ld\n", gauge_names[i], gauge_names[i],
+               (long)atomic_load_explicit(&metrics.gauges[i], memory_order_relaxed));
+    }
+    render(&r, "# TYPE liso_phase_duration_seconds histogram\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        render_histogram(&r, phase_names[i], &metrics.phases[i]);
+    }
+    render_flush(&r);
+
+    if (r.failed) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
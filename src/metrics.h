@@ -0,0 +1,118 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// 保留的指标URI 以Prometheus文本格式输出
+#define METRICS_URI "/__liso/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+// 直方图按对数-线性分桶: 每个2的幂区间再均分为 2^METRICS_SUB_BITS 个子桶
+// 覆盖 2^METRICS_MIN_SHIFT ns(约1us) 到 2^METRICS_MAX_SHIFT ns(约17s) 超出的计入+Inf
+#define METRICS_SUB_BITS 2
+#define METRICS_MIN_SHIFT 10
+#define METRICS_MAX_SHIFT 34
+#define METRICS_BUCKETS (((METRICS_MAX_SHIFT - METRICS_MIN_SHIFT) << METRICS_SUB_BITS) + 1)
+
+// 请求各阶段的耗时直方图
+typedef enum{
+    PHASE_ACCEPT,        // accept到完成注册
+    PHASE_HEADER_PARSE,  // 收到第一个字节到请求头解析完成
+    PHASE_FILE_OPEN,     // stat/open/fstat
+    PHASE_FIRST_BYTE,    // 收到请求到响应第一个字节发出
+    PHASE_LAST_BYTE,     // 收到请求到响应最后一个字节发出
+    PHASE_COUNT
+} metric_phase;
+
+// 单调递增计数器
+typedef enum{
+    COUNTER_ACCEPTED,    // 接受的连接数
+    COUNTER_REJECTED,    // 因客户端已满被拒绝的连接数
+    COUNTER_REQUESTS,    // 解析出的请求数
+    COUNTER_BYTES_RECV,  // 接收的字节数
+    COUNTER_BYTES_SENT,  // 发送的字节数
+    COUNTER_BYTES_SPLICED, // 经管道splice转发的字节数 不经过用户态
+    COUNTER_RATE_LIMITED,  // 超过限流被拒绝的连接(503)和请求(429)
+    COUNTER_OUTPUT_PAUSED, // 发送队列超过out_high暂停读请求的次数
+    COUNTER_COUNT
+} metric_counter;
+
+// 可增可减的瞬时值
+typedef enum{
+    GAUGE_OPEN_CONNECTIONS, // 当前打开的连接数
+    GAUGE_BYTES_IN_FLIGHT,  // 已生成但还没发送出去的响应字节数
+    GAUGE_OUTPUT_QUEUED,    // 已经交给内核但还没发出去的字节数 每个连接最近一次查看时的值
+    GAUGE_COUNT
+} metric_gauge;
+
+// 按状态码统计的响应数 其余状态码计入 STATUS_OTHER
+typedef enum{
+    STATUS_200,
+    STATUS_400,
+    STATUS_404,
+    STATUS_500,
+    STATUS_501,
+    STATUS_505,
+    STATUS_OTHER,
+    STATUS_COUNT
+} metric_status;
+
+typedef struct{
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS + 1]; // 最后一个是溢出桶(+Inf) 总数取各桶之和
+    atomic_uint_fast64_t sum_ns;
+} Histogram;
+
+typedef struct{
+    Histogram phases[PHASE_COUNT];
+    atomic_uint_fast64_t counters[COUNTER_COUNT];
+    atomic_int_fast64_t gauges[GAUGE_COUNT];
+    atomic_uint_fast64_t status[STATUS_COUNT];
+} Metrics;
+
+extern Metrics metrics;
+
+// 单调时钟 纳秒 (vDSO 不陷入内核)
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// 计算耗时落在哪个桶: 最高位决定区间 其后 METRICS_SUB_BITS 位决定子桶
+// 桶包含上界(和Prometheus的le一致) 所以按ns-1计算 正好等于上界的耗时落在这个桶里
+static inline int metrics_bucket(uint64_t ns) {
+    if (ns <= (1ull << METRICS_MIN_SHIFT)) return 0;
+    ns--;
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= METRICS_MAX_SHIFT) return METRICS_BUCKETS;
+    int sub = (int)(ns >> (msb - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+    return ((msb - METRICS_MIN_SHIFT) << METRICS_SUB_BITS) + sub + 1;
+}
+
+// 以下都是relaxed原子操作 每次只有几纳秒的开销
+static inline void metrics_observe(metric_phase phase, uint64_t ns) {
+    Histogram *h = &metrics.phases[phase];
+    atomic_fetch_add_explicit(&h->buckets[metrics_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+}
+
+// 记录从start_ns到现在的耗时 start_ns为0表示没有开始时间 忽略
+static inline void metrics_observe_since(metric_phase phase, uint64_t start_ns) {
+    if (start_ns) metrics_observe(phase, metrics_now_ns() - start_ns);
+}
+
+static inline void metrics_inc(metric_counter c, uint64_t n) {
+    atomic_fetch_add_explicit(&metrics.counters[c], n, memory_order_relaxed);
+}
+
+static inline void metrics_gauge_add(metric_gauge g, int64_t n) {
+    atomic_fetch_add_explicit(&metrics.gauges[g], n, memory_order_relaxed);
+}
+
+// 按状态码统计响应数
+void metrics_count_status(int status);
+// 把当前指标快照写到一个memfd里 返回可以直接当作文件发送的fd 失败返回-1
+int metrics_render_fd(void);
+
+#endif
@@ -0,0 +1,201 @@
+#include "mime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <ctype.h>
+
+// 开放寻址(线性探测)的哈希表 扩展名直接存放在槽位里 查询时只访问一段连续内存
+typedef struct{
+    char ext[MIME_EXT_MAX]; // 小写的扩展名 空串表示空槽
+    const char *type;       // 指向arena中驻留的Content-Type
+} MimeSlot;
+
+typedef struct{
+    MimeSlot *slots;
+    uint32_t mask;    // 容量-1 容量是2的幂
+    uint32_t count;
+    char *arena;      // 所有不重复的Content-Type字符串 每个只存一份
+    size_t arena_len, arena_cap;
+} MimeTable;
+
+// 没有mime.types时也能正确返回的常用类型
+static const char *builtin_types[][2] = {
+    { "html", "text/html" }, { "htm", "text/html" },
+    { "txt", "text/plain" }, { "css", "text/css" },
+    { "js", "application/javascript" }, { "json", "application/json" },
+    { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" },
+    { "png", "image/png" }, { "gif", "image/gif" },
+    { "svg", "image/svg+xml" }, { "pdf", "application/pdf" },
+    { "ico", "image/x-icon" }, { "webp", "image/webp" },
+    { "xml", "application/xml" }, { "wasm", "application/wasm" },
+};
+
+static _Atomic(MimeTable *) current_table;
+
+// FNV-1a 对已经转成小写的扩展名求哈希
+static uint32_t hash_ext(const char *ext) {
+    uint32_t h = 2166136261u;
+    for (; *ext; ext++) {
+        h ^= (unsigned char)*ext;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 把扩展名转成小写写入out 超长或为空返回-1
+static int fold_ext(const char *ext, size_t len, char out[MIME_EXT_MAX]) {
+    if (len == 0 || len >= MIME_EXT_MAX) return -1;
+    for (size_t i = 0; i < len; i++) out[i] = tolower((unsigned char)ext[i]);
+    out[len] = '\0';
+    return 0;
+}
+
+// 在arena中查找或追加Content-Type 返回它在arena中的偏移
+// 类型数量只有几百个 加载时线性查找即可 查询路径不受影响
+static long intern_type(MimeTable *t, const char *type, size_t len) {
+    for (size_t off = 0; off < t->arena_len; off += strlen(t->arena + off) + 1) {
+        if (strlen(t->arena + off) == len && memcmp(t->arena + off, type, len) == 0) return off;
+    }
+    if (t->arena_len + len + 1 > t->arena_cap) {
+        size_t cap = t->arena_cap ? t->arena_cap * 2 : 4096;
+        while (cap < t->arena_len + len + 1) cap *= 2;
+        char *arena = realloc(t->arena, cap);
+        if (!arena) return -1;
+        t->arena = arena;
+        t->arena_cap = cap;
+    }
+    long off = t->arena_len;
+    memcpy(t->arena + off, type, len);
+    t->arena[off + len] = '\0';
+    t->arena_len += len + 1;
+    return off;
+}
+
+// 收集阶段的临时记录 type存arena偏移 因为arena扩容时地址会变
+typedef struct{
+    char ext[MIME_EXT_MAX];
+    long type_off;
+} MimeEntry;
+
+typedef struct{
+    MimeEntry *items;
+    size_t len, cap;
+} EntryList;
+
+static int add_entry(MimeTable *t, EntryList *list, const char *ext, size_t ext_len,
+                     const char *type, size_t type_len) {
+    MimeEntry e;
+    if (fold_ext(ext, ext_len, e.ext) == -1) return 0; // 超长的扩展名直接忽略
+    e.type_off = intern_type(t, type, type_len);
+    if (e.type_off == -1) return -1;
+    if (list->len == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        MimeEntry *items = realloc(list->items, cap * sizeof(MimeEntry));
+        if (!items) return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->len++] = e;
+    return 0;
+}
+
+// 解析mime.types: 每行"type ext1 ext2 ..." #开头为注释
+static int parse_file(MimeTable *t, EntryList *list, FILE *fp) {
+    char line[1024];
+    const char *sep = " \t\r\n";
+    while (fgets(line, sizeof(line), fp)) {
+        char *save = NULL;
+        char *type = strtok_r(line, sep, &save);
+        if (!type || type[0] == '#') continue;
+        size_t type_len = strlen(type);
+        for (char *ext = strtok_r(NULL, sep, &save); ext; ext = strtok_r(NULL, sep, &save)) {
+            if (ext[0] == '#') break;
+            if (add_entry(t, list, ext, strlen(ext), type, type_len) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+// 插入 同名扩展名后来的覆盖前面的
+static void table_put(MimeTable *t, const char *ext, const char *type) {
+    uint32_t i = hash_ext(ext) & t->mask;
+    while (t->slots[i].ext[0] && strcmp(t->slots[i].ext, ext) != 0) i = (i + 1) & t->mask;
+    if (!t->slots[i].ext[0]) {
+        memcpy(t->slots[i].ext, ext, MIME_EXT_MAX);
+        t->count++;
+    }
+    t->slots[i].type = type;
+}
+
+static void table_free(MimeTable *t) {
+    if (!t) return;
+    free(t->slots);
+    free(t->arena);
+    free(t);
+}
+
+int mime_load(const char *path) {
+    MimeTable *t = calloc(1, sizeof(MimeTable));
+    EntryList list = { NULL, 0, 0 };
+    if (!t) return -1;
+
+    size_t builtin_count = sizeof(builtin_types) / sizeof(builtin_types[0]);
+    for (size_t i = 0; i < builtin_count; i++) {
+        const char *ext = builtin_types[i][0], *type = builtin_types[i][1];
+        if (add_entry(t, &list, ext, strlen(ext), type, strlen(type)) == -1) goto fail;
+    }
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    if (fp) {
+        int ret = parse_file(t, &list, fp);
+        fclose(fp);
+        if (ret == -1) goto fail;
+    }
+
+    // 装载因子不超过0.5 探测链很短
+    uint32_t cap = 64;
+    while (cap < list.len * 2) cap <<= 1;
+    t->slots = calloc(cap, sizeof(MimeSlot));
+    if (!t->slots) goto fail;
+    t->mask = cap - 1;
+    // arena已经不会再变 可以把偏移换成指针了
+    for (size_t i = 0; i < list.len; i++) {
+        table_put(t, list.items[i].ext, t->arena + list.items[i].type_off);
+    }
+    free(list.items);
+
+    // 旧表可能还有其他线程在读 不释放 只有重新加载时才会泄漏一份很小的表
+    atomic_store_explicit(&current_table, t, memory_order_release);
+    return t->count;
+
+fail:
+    free(list.items);
+    table_free(t);
+    return -1;
+}
+
+const char *mime_lookup(const char *filename) {
+    MimeTable *t = atomic_load_explicit(&current_table, memory_order_acquire);
+    const char *slash = strrchr(filename, '/');
+    const char *dot = strrchr(slash ? slash : filename, '.');
+    if (!t || !dot) return MIME_DEFAULT_TYPE;
+
+    // 一次遍历同时转小写和计算哈希
+    char ext[MIME_EXT_MAX];
+    uint32_t h = 2166136261u;
+    size_t len = 0;
+    for (const char *p = dot + 1; *p; p++, len++) {
+        if (len == MIME_EXT_MAX - 1) return MIME_DEFAULT_TYPE;
+        ext[len] = tolower((unsigned char)*p);
+        h ^= (unsigned char)ext[len];
+        h *= 16777619u;
+    }
+    if (len == 0) return MIME_DEFAULT_TYPE;
+    ext[len] = '\0';
+
+    for (uint32_t i = h & t->mask; t->slots[i].ext[0]; i = (i + 1) & t->mask) {
+        if (memcmp(t->slots[i].ext, ext, len + 1) == 0) return t->slots[i].type;
+    }
+    return MIME_DEFAULT_TYPE;
+}
@@ -0,0 +1,16 @@
+#ifndef MIME_H
+#define MIME_H
+
+#define MIME_TYPES_FILE "/etc/mime.types" // 默认的mime.types路径
+#define MIME_DEFAULT_TYPE "application/octet-stream"
+#define MIME_EXT_MAX 16 // 扩展名最大长度(含结尾的\0) 更长的扩展名按未知类型处理
+
+// 从mime.types格式的文件加载类型表 内置的常用类型总是存在 文件中的同名扩展名会覆盖内置项
+// path为NULL或打开失败时只使用内置表 返回加载的扩展名个数 失败返回-1
+// 新表构建完成后整体替换旧表 查询方不需要加锁
+int mime_load(const char *path);
+// 根据文件名的扩展名(不区分大小写)查找Content-Type O(1)
+// 返回的字符串是驻留在表中的 调用方直接引用不需要拷贝 也不要释放
+const char *mime_lookup(const char *filename);
+
+#endif
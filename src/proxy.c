@@ -0,0 +1,784 @@
+#define _GNU_SOURCE // memmem strcasestr
+#include "server.h"
+#include <strings.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <stddef.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// 一个上游地址 host:port或unix:路径 unix:@名字为抽象命名空间
+typedef struct{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char name[128];     // 写日志用
+} ProxyBackend;
+
+// URI前缀 -> backends[first, first + count)
+typedef struct{
+	char prefix[128];
+	size_t prefix_len;
+	int first, count;
+} ProxyRoute;
+
+// 路由表启动时解析 之后所有线程只读
+static ProxyRoute routes[PROXY_MAX_ROUTES];
+static int route_count;
+static ProxyBackend backends[PROXY_MAX_BACKENDS];
+static int backend_count;
+static proxy_balance balance_mode;
+
+// 每个事件循环自己的连接池和计数 上游连接只在创建它的循环中使用 不需要加锁
+typedef struct{
+	int pending;                            // 进行中的代理请求数
+	unsigned rr[PROXY_MAX_ROUTES];          // 轮询位置
+	int active[PROXY_MAX_BACKENDS];         // 正在使用的连接数
+	int idle[PROXY_MAX_BACKENDS][PROXY_IDLE_MAX]; // 空闲连接栈 后放回的先用
+	int idle_count[PROXY_MAX_BACKENDS];
+} ProxyLoop;
+
+static __thread ProxyLoop px_loop;
+
+// 改写响应头用的临时缓冲区 和客户端缓冲区一样大 每个线程第一次用到时分配
+static char *head_scratch(void) {
+	static __thread char *scratch;
+	if (!scratch) scratch = malloc(server_options.buf_size);
+	return scratch;
+}
+
+// ----------------------路由表-----------------------
+
+static int parse_backend(const char *s, ProxyBackend *b) {
+	memset(b, 0, sizeof(*b));
+	snprintf(b->name, sizeof(b->name), "%s", s);
+	if (strncmp(s, "unix:", 5) == 0) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&b->addr;
+		size_t len = strlen(s + 5);
+		if (len == 0 || len >= sizeof(sun->sun_path) || strcmp(s + 5, "@") == 0) return -1;
+		sun->sun_family = AF_UNIX;
+		if (s[5] == '@') {// 抽象命名空间 sun_path以\0开头 长度只算名字本身
+			memcpy(sun->sun_path + 1, s + 6, len - 1);
+			b->addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+			return 0;
+		}
+		strcpy(sun->sun_path, s + 5);
+		b->addr_len = sizeof(*sun);
+		return 0;
+	}
+	// host:port IPv6地址写成[::1]:8080
+	char host[128];
+	const char *colon = strrchr(s, ':');
+	if (!colon || colon == s || (size_t)(colon - s) >= sizeof(host)) return -1;
+	memcpy(host, s, colon - s);
+	host[colon - s] = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host) - 2);
+		host[strlen(host) - 2] = '\0';
+	}
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+	memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+	b->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+int proxy_load(const char *spec, proxy_balance balance) {
+	char buf[4096];
+	if (strlen(spec) >= sizeof(buf)) return -1;
+	strcpy(buf, spec);
+	balance_mode = balance;
+	route_count = 0;
+	backend_count = 0;
+	char *save_route;
+	for (char *tok = strtok_r(buf, ";", &save_route); tok; tok = strtok_r(NULL, ";", &save_route)) {
+		char *eq = strchr(tok, '=');
+		if (!eq || tok[0] != '/' || (size_t)(eq - tok) >= sizeof(routes[0].prefix)) return -1;
+		if (route_count == PROXY_MAX_ROUTES) return -1;
+		ProxyRoute *r = &routes[route_count];
+		r->prefix_len = eq - tok;
+		memcpy(r->prefix, tok, r->prefix_len);
+		r->prefix[r->prefix_len] = '\0';
+		r->first = backend_count;
+		r->count = 0;
+		char *save_backend;
+		for (char *up = strtok_r(eq + 1, ",", &save_backend); up; up = strtok_r(NULL, ",", &save_backend)) {
+			if (backend_count == PROXY_MAX_BACKENDS || parse_backend(up, &backends[backend_count]) == -1) {
+				log_error("bad proxy upstream: %s", up);
+				return -1;
+			}
+			backend_count++;
+			r->count++;
+		}
+		if (r->count == 0) return -1;
+		log_info("proxy %s -> %d upstream(s) (%s)", r->prefix, r->count,
+				 balance == BALANCE_LEAST_CONN ? "least-conn" : "round-robin");
+		route_count++;
+	}
+	return route_count;
+}
+
+int proxy_parse_balance(const char *s) {
+	if (strcasecmp(s, "round-robin") == 0 || strcasecmp(s, "rr") == 0) return BALANCE_ROUND_ROBIN;
+	if (strcasecmp(s, "least-conn") == 0 || strcasecmp(s, "lc") == 0) return BALANCE_LEAST_CONN;
+	return -1;
+}
+
+int proxy_route(const HttpRequest *req) {
+	int best = -1;
+	for (int i = 0; i < route_count; i++) {
+		ProxyRoute *r = &routes[i];
+		if (req->uri_len >= r->prefix_len && memcmp(req->uri, r->prefix, r->prefix_len) == 0 &&
+			(best == -1 || r->prefix_len > routes[best].prefix_len)) best = i;
+	}
+	return best;
+}
+
+int proxy_pending(void) {
+	return px_loop.pending;
+}
+
+// ----------------------上游连接-----------------------
+
+static void request_end(Client *client) {
+	client->proxy.active = 0;
+	px_loop.pending--;
+}
+
+// 按负载均衡方式选一个还没失败过的后端 返回在路由内的偏移 都失败过返回-1
+static int pick_backend(int route, uint64_t tried) {
+	ProxyRoute *r = &routes[route];
+	unsigned start = px_loop.rr[route]++;
+	int best = -1;
+	for (int i = 0; i < r->count; i++) {
+		int off = (start + i) % r->count;
+		if (tried & (1ull << off)) continue;
+		if (balance_mode == BALANCE_ROUND_ROBIN) return off;
+		if (best == -1 || px_loop.active[r->first + off] < px_loop.active[r->first + best]) best = off;
+	}
+	return best;
+}
+
+static void up_set_interest(int epoll_fd, ProxyState *px, uint32_t events) {
+	if (px->fd == -1 || px->events == events) return;
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = px->fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, px->fd, &ev) == -1) {
+		log_error("epoll_ctl mod upstream failed: %s", strerror(errno));
+		return;
+	}
+	px->events = events;
+}
+
+// 归还上游连接 可复用的放回空闲池继续监听(对端关闭时从池里删掉) 否则关闭
+static void upstream_release(int epoll_fd, Client *client, int reuse) {
+	ProxyState *px = &client->proxy;
+	if (px->fd == -1) return;
+	int b = px->backend;
+	px_loop.active[b]--;
+	if (reuse && !px->connecting && px_loop.idle_count[b] < PROXY_IDLE_MAX) {
+		up_set_interest(epoll_fd, px, EPOLLIN);
+		server.fd_to_index[px->fd] = FD_INDEX_PROXY(b);
+		px_loop.idle[b][px_loop.idle_count[b]++] = px->fd;
+	} else {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, px->fd, NULL);
+		server.fd_to_index[px->fd] = -1;
+		close(px->fd);
+	}
+	px->fd = -1;
+}
+
+// 非阻塞连接后端b 返回0表示已连接或正在连接
+static int upstream_connect(int epoll_fd, Client *client, int b) {
+	ProxyState *px = &client->proxy;
+	ProxyBackend *be = &backends[b];
+	int fd = socket(be->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	if (fd >= *server.fd_table_size) {
+		close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	if (be->addr.ss_family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	px->connecting = 0;
+	if (connect(fd, (struct sockaddr *)&be->addr, be->addr_len) == -1) {
+		if (errno != EINPROGRESS && errno != EAGAIN) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		px->connecting = 1;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLOUT;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		close(fd);
+		return -1;
+	}
+	px->fd = fd;
+	px->events = EPOLLOUT;
+	px->backend = b;
+	px->reused = 0;
+	server.fd_to_index[fd] = server.fd_to_index[client->fd];
+	px_loop.active[b]++;
+	return 0;
+}
+
+// 为请求找一个上游连接 优先用空闲池里的连接 连接失败的后端换下一个
+// 返回0表示成功 -1表示路由的所有后端都连不上
+static int upstream_acquire(int epoll_fd, Client *client) {
+	ProxyState *px = &client->proxy;
+	ProxyRoute *r = &routes[px->route];
+	for (;;) {
+		int off = pick_backend(px->route, px->tried);
+		if (off == -1) return -1;
+		int b = r->first + off;
+		if (px_loop.idle_count[b] > 0) {
+			px->fd = px_loop.idle[b][--px_loop.idle_count[b]];
+			px->backend = b;
+			px->connecting = 0;
+			px->reused = 1;
+			server.fd_to_index[px->fd] = server.fd_to_index[client->fd];
+			px->events = EPOLLIN;
+			up_set_interest(epoll_fd, px, EPOLLOUT);
+			px_loop.active[b]++;
+			return 0;
+		}
+		if (upstream_connect(epoll_fd, client, b) == 0) return 0;
+		log_warn("proxy connect %s failed: %s", backends[b].name, strerror(errno));
+		px->tried |= 1ull << off;
+	}
+}
+
+// 空闲池中的连接有事件 说明上游关闭了连接(或者发来了不该有的数据) 从池里删掉
+void proxy_handle_idle(int epoll_fd, int b, int fd) {
+	if (b < 0 || b >= backend_count) return;
+	for (int i = 0; i < px_loop.idle_count[b]; i++) {
+		if (px_loop.idle[b][i] != fd) continue;
+		px_loop.idle[b][i] = px_loop.idle[b][--px_loop.idle_count[b]];
+		break;
+	}
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	server.fd_to_index[fd] = -1;
+	close(fd);
+}
+
+// 非阻塞connect是否完成 返回0表示已连接 1表示还在连接 -1表示失败(errno)
+static int connect_status(ProxyState *px) {
+	ProxyBackend *be = &backends[px->backend];
+	if (connect(px->fd, (struct sockaddr *)&be->addr, be->addr_len) == 0 || errno == EISCONN) return 0;
+	if (errno == EALREADY || errno == EINPROGRESS || errno == EAGAIN) return 1;
+	return -1;
+}
+
+// ----------------------请求头和响应头-----------------------
+
+static int name_is(const char *name, size_t len, const char *s) {
+	return len == strlen(s) && strncasecmp(name, s, len) == 0;
+}
+
+// 逐项转发的头 逐跳(hop-by-hop)的头不转发 Connection由代理自己设置
+static int hop_by_hop(const char *name, size_t len) {
+	return name_is(name, len, "Connection") || name_is(name, len, "Keep-Alive") ||
+		   name_is(name, len, "Proxy-Connection") || name_is(name, len, "Upgrade") ||
+		   name_is(name, len, "TE") || name_is(name, len, "Expect");
+}
+
+// 把转发给上游的请求头写到client->buf 上游连接总是持久连接
+static int build_request_head(Client *client) {
+	HttpRequest *req = &client->req;
+	char *out = client->buf;
+	int n = snprintf(out, server_options.buf_size, "%.*s %.*s HTTP/1.1\r\n", (int)req->method_len, req->method,
+					 (int)req->uri_len, req->uri);
+	size_t len = n;
+	const char *end = client->req_buf + req->head_len;
+	const char *p = memchr(req->line, '\n', end - req->line);
+	for (p = p ? p + 1 : end; p < end; ) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol) break;
+		size_t line_len = (eol > p && eol[-1] == '\r') ? (size_t)(eol - 1 - p) : (size_t)(eol - p);
+		if (line_len == 0) break;
+		const char *colon = memchr(p, ':', line_len);
+		// Transfer-Encoding的请求已经被拒绝 这里再去掉一次 上游连接不会等永远不来的分块
+		if (colon && !hop_by_hop(p, colon - p) && !name_is(p, colon - p, "Transfer-Encoding")) {
+			if (len + line_len + 2 > server_options.buf_size) return -1;
+			memcpy(out + len, p, line_len);
+			memcpy(out + len + line_len, "\r\n", 2);
+			len += line_len + 2;
+		}
+		p = eol + 1;
+	}
+	n = snprintf(out + len, server_options.buf_size - len, "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n",
+				 client_host(client));
+	if (n < 0 || len + n >= server_options.buf_size) return -1;
+	client->proxy.head_len = len + n;
+	client->proxy.head_sent = 0;
+	return 0;
+}
+
+// 新收到的响应体字节交给framing检查 超出响应边界的部分丢掉 返回-1表示分块编码格式错误
+static int account_body(Client *client, size_t start, size_t n) {
+	ProxyState *px = &client->proxy;
+	size_t keep = n;
+	if (px->framing == PROXY_BODY_NONE) {
+		keep = 0;
+	} else if (px->framing == PROXY_BODY_LENGTH) {
+		keep = MIN(n, (size_t)px->resp_left);
+		px->resp_left -= keep;
+		if (px->resp_left == 0) px->eof = 1;
+	} else if (px->framing == PROXY_BODY_CHUNKED) {
+		ssize_t k = chunk_scan(&px->chunk, client->buf + start, n);
+		if (k == -1) return -1;
+		keep = k;
+		if (chunk_done(&px->chunk)) px->eof = 1;
+	}
+	if (keep < n) {// 上游多发了数据 连接状态不可信 不再复用
+		px->reusable = 0;
+		client->buf_len -= n - keep;
+	}
+	if (client->header_out && keep) {// 第一次发送之后新增的字节单独计入在途
+		client->inflight += keep;
+		metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, keep);
+	}
+	return 0;
+}
+
+// 解析并改写buf开头上游的响应头 换成代理自己的Connection头
+// 返回1表示完成 0表示还不完整 -1表示格式错误或放不下
+static int rewrite_response_head(Client *client) {
+	ProxyState *px = &client->proxy;
+	char *buf = client->buf;
+	for (;;) {
+		char *head_end = memmem(buf, client->buf_len, "\r\n\r\n", 4);
+		if (!head_end) return client->buf_len + PROXY_HEADER_RESERVE >= server_options.buf_size ? -1 : 0;
+		size_t head_len = head_end + 4 - buf;
+		if (head_len < 12 || memcmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ') return -1;
+		int status = 0;
+		for (int i = 9; i < 12; i++) {
+			if (buf[i] < '0' || buf[i] > '9') return -1;
+			status = status * 10 + buf[i] - '0';
+		}
+		if (status >= 100 && status < 200 && status != 101) {// 丢掉100 Continue等中间响应
+			memmove(buf, buf + head_len, client->buf_len - head_len);
+			client->buf_len -= head_len;
+			continue;
+		}
+		if (status == 101) return -1; // 不转发Upgrade 不应该出现
+
+		// 状态行和除了逐跳头以外的响应头复制到out
+		char *out = head_scratch();
+		if (!out) return -1;
+		const char *eol = memchr(buf, '\n', head_len);
+		size_t out_len = eol + 1 - buf;
+		memcpy(out, buf, out_len);
+		off_t content_length = -1;
+		int chunked = 0, conn_close = buf[7] == '0', conn_keep = 0, to_chunked = 0;
+		for (const char *p = eol + 1; p < head_end + 2; ) {
+			eol = memchr(p, '\n', head_end + 2 - p);
+			size_t line_len = eol - p;
+			if (line_len && p[line_len - 1] == '\r') line_len--;
+			const char *colon = memchr(p, ':', line_len);
+			if (!colon) return -1;
+			const char *v = colon + 1, *v_end = p + line_len;
+			while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+			size_t name_len = colon - p, v_len = v_end - v;
+			if (name_is(p, name_len, "Content-Length")) {
+				content_length = 0;
+				for (size_t i = 0; i < v_len; i++) {
+					if (v[i] < '0' || v[i] > '9' || content_length > ((off_t)1 << 50)) return -1;
+					content_length = content_length * 10 + v[i] - '0';
+				}
+			} else if (name_is(p, name_len, "Transfer-Encoding")) {
+				chunked = v_len >= 7 && strncasecmp(v_end - 7, "chunked", 7) == 0;
+			} else if (name_is(p, name_len, "Connection")) {
+				char value[64];
+				snprintf(value, sizeof(value), "%.*s", (int)v_len, v);
+				if (strcasestr(value, "close")) conn_close = 1;
+				if (strcasestr(value, "keep-alive")) conn_keep = 1;
+			}
+			if (!hop_by_hop(p, name_len)) {
+				memcpy(out + out_len, p, eol + 1 - p);
+				out_len += eol + 1 - p;
+			}
+			p = eol + 1;
+		}
+
+		if (px->head_only || status == 204 || status == 304) {
+			px->framing = PROXY_BODY_NONE;
+		} else if (chunked) {
+			px->framing = PROXY_BODY_CHUNKED;
+			chunk_scanner_init(&px->chunk);
+		} else if (content_length >= 0) {
+			px->framing = PROXY_BODY_LENGTH;
+			px->resp_left = content_length;
+		} else {// 响应体以上游关闭为界 转成分块编码发给客户端 客户端的连接不用跟着关闭
+			px->framing = PROXY_BODY_CLOSE;
+			to_chunked = client->keep_alive && out_len + 28 < (size_t)server_options.buf_size;
+			if (to_chunked) {
+				memcpy(out + out_len, "Transfer-Encoding: chunked\r\n", 28);
+				out_len += 28;
+			} else {
+				client->keep_alive = 0;
+			}
+		}
+		// HTTP/1.0的上游默认不保持连接
+		px->reusable = px->framing != PROXY_BODY_CLOSE && (buf[7] == '0' ? conn_keep : !conn_close);
+
+		int n = snprintf(out + out_len, server_options.buf_size - out_len, "Connection: %s\r\n\r\n",
+						 client->keep_alive ? "keep-alive" : "close");
+		size_t body_len = client->buf_len - head_len;
+		if (out_len + n + body_len > server_options.buf_size) return -1;
+		memmove(buf + out_len + n, buf + head_len, body_len);
+		memcpy(buf, out, out_len + n);
+		client->buf_len = out_len + n + body_len;
+		client->status = status;
+		px->header_done = 1;
+		if (to_chunked) start_chunked(client, out_len + n);
+		if (px->framing == PROXY_BODY_NONE || (px->framing == PROXY_BODY_LENGTH && px->resp_left == 0)) px->eof = 1;
+		return account_body(client, out_len + n, body_len) == -1 ? -1 : 1;
+	}
+}
+
+// ----------------------转发-----------------------
+
+void proxy_start(Client *client, int route) {
+	ProxyState *px = &client->proxy;
+	px->fd = -1;
+	px->route = route;
+	px->tried = 0;
+	px->body_sent = 0;
+	px->resp_started = 0;
+	px->header_done = 0;
+	px->eof = 0;
+	px->reusable = 0;
+	px->framing = PROXY_BODY_CLOSE;
+	px->resp_piped = 0;
+	px->head_only = client->req.method_len == 4 && memcmp(client->req.method, "HEAD", 4) == 0;
+	px->deadline_ns = metrics_now_ns() + (uint64_t)server_options.proxy_timeout_ms * 1000000ull;
+	client->buf_len = 0;
+	client->file_offset = -1;
+	client->status = 0;
+	if (build_request_head(client) == -1) {
+		set_error_response(client, 500, internal_error);
+		return;
+	}
+	if (upstream_acquire(*server.epoll_fd, client) == -1) {
+		set_error_response(client, 502, bad_gateway);
+		return;
+	}
+	px->active = 1;
+	px_loop.pending++;
+}
+
+// 上游连接出错或提前关闭 请求还没被上游处理时换连接重发:
+// 连接失败的换下一个后端 空闲池里的旧连接失败的换一个新连接
+// 返回0表示已经重新发起 -1表示不能重试
+static int upstream_retry(int epoll_fd, Client *client, int connect_failed) {
+	ProxyState *px = &client->proxy;
+	if (px->resp_started || px->body_sent > 0) return -1;
+	int b = px->backend, reused = px->reused;
+	upstream_release(epoll_fd, client, 0);
+	if (build_request_head(client) == -1) return -1;
+	if (connect_failed) {
+		px->tried |= 1ull << (b - routes[px->route].first);
+		return upstream_acquire(epoll_fd, client);
+	}
+	if (!reused) return -1;
+	if (upstream_connect(epoll_fd, client, b) == 0) return 0;
+	px->tried |= 1ull << (b - routes[px->route].first);
+	return upstream_acquire(epoll_fd, client);
+}
+
+// 上游出错 还没发过响应头时改成错误响应 否则只能关闭连接 返回-1表示客户端连接已经关闭
+static int proxy_fail(int epoll_fd, Client *client, int status, const char *response) {
+	ProxyState *px = &client->proxy;
+	upstream_release(epoll_fd, client, 0);
+	px->eof = 1;
+	client->keep_alive = 0;
+	if (client->header_out) {
+		request_end(client);
+		finish_response(epoll_fd, client, 0);
+		return -1;
+	}
+	set_error_response(client, status, response);
+	px->header_done = 1;
+	return 0;
+}
+
+void proxy_detach(int epoll_fd, Client *client) {
+	upstream_release(epoll_fd, client, 0);
+	request_end(client);
+}
+
+// 上游读写出错或者提前关闭 能重试就重试 否则返回错误响应 返回-1表示客户端连接已经关闭
+static int upstream_error(int epoll_fd, Client *client, int connect_failed) {
+	ProxyState *px = &client->proxy;
+	if (connect_failed) log_warn("proxy connect %s failed: %s", backends[px->backend].name, strerror(errno));
+	if (upstream_retry(epoll_fd, client, connect_failed) == 0) return 0;
+	if (!connect_failed) log_warn("proxy upstream %s failed: %.*s", backends[px->backend].name,
+								  (int)client->req.uri_len, client->req.uri);
+	return proxy_fail(epoll_fd, client, 502, bad_gateway);
+}
+
+int proxy_splice_body(Client *client) {
+	ProxyState *px = &client->proxy;
+	return px->active && px->fd != -1 && px->body_left > 0 && !px->resp_piped &&
+		   client->req_len == client->req_consumed && relay_acquire(&client->relay) == 0;
+}
+
+// 响应体能否经管道直接splice给客户端: 响应头已经发完 请求体已经转发完(管道空出来了)
+// 分块编码要逐字节检查响应在哪里结束 只能走缓冲区
+static int splice_response_ok(Client *client) {
+	ProxyState *px = &client->proxy;
+	if (px->resp_piped) return 1;
+	if (!px->header_done || !client->header_out || client->buf_len > 0 || px->eof ||
+		px->body_left > 0 || client->relay.pending > 0) return 0;
+	if ((px->framing != PROXY_BODY_LENGTH && px->framing != PROXY_BODY_CLOSE) || client->chunked) return 0;
+	if (relay_acquire(&client->relay) == -1) return 0;
+	px->resp_piped = 1;
+	return 1;
+}
+
+// 响应体从上游经管道转发给客户端 不经过写缓冲区
+// 返回-1表示客户端连接已经关闭 0表示需要等事件或者响应已经完整
+static int splice_response(int epoll_fd, Client *client) {
+	ProxyState *px = &client->proxy;
+	Relay *relay = &client->relay;
+	for (;;) {
+		if (relay->pending > 0) {
+			ssize_t n = relay_drain(relay, client->fd);
+			if (n > 0) {
+				account_sent(client, n);
+				continue;
+			}
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+			proxy_detach(epoll_fd, client);
+			finish_response(epoll_fd, client, 0);
+			return -1;
+		}
+		if (px->eof) return 0;
+		size_t want = px->framing == PROXY_BODY_LENGTH ? MIN((off_t)RELAY_CHUNK, px->resp_left) : RELAY_CHUNK;
+		ssize_t n = relay_fill(relay, px->fd, want);
+		if (n > 0) {
+			client->inflight += n;
+			metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, n);
+			if (px->framing == PROXY_BODY_LENGTH && (px->resp_left -= n) == 0) px->eof = 1;
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if (n == 0 && px->framing == PROXY_BODY_CLOSE) {// 上游关闭 没有长度的响应到此结束
+			px->eof = 1;
+			px->reusable = 0;
+			return 0;
+		}
+		// 响应体没收完上游就断了 响应头已经发出 只能关闭客户端连接
+		return upstream_error(epoll_fd, client, 0);
+	}
+}
+
+// 在客户端和上游之间搬运数据 客户端socket或上游连接有事件时调用 不会阻塞
+// 请求头和请求体写给上游 响应读到buf 改写响应头后发给客户端
+// buf满了就不再读上游 上游写满socket后自然停下 形成背压
+// 返回1表示响应已经发完 可以继续处理下一个请求 返回0表示还在进行中或者连接已经关闭
+int proxy_pump(int epoll_fd, Client *client) {
+	ProxyState *px = &client->proxy;
+	int fd = client->fd;
+
+	while (px->fd != -1) {
+		int up = px->fd;
+		if (px->connecting) {
+			int ret = connect_status(px);
+			if (ret == 1) break;
+			if (ret == -1) {
+				if (upstream_error(epoll_fd, client, 1) == -1) return 0;
+				continue;
+			}
+			px->connecting = 0;
+		}
+
+		// 请求头在buf里 发完之前不读响应
+		if (px->head_sent < px->head_len) {
+			ssize_t n = send(up, client->buf + px->head_sent, px->head_len - px->head_sent, MSG_NOSIGNAL);
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			if (n <= 0) {
+				if (upstream_error(epoll_fd, client, 0) == -1) return 0;
+				continue;
+			}
+			px->head_sent += n;
+			continue;
+		}
+
+		// 请求体从req_buf写给上游 写出去的部分删掉 请求头保留到记录完访问日志
+		while (px->body_left > 0) {
+			size_t avail = MIN(client->req_len - client->req_consumed, (size_t)px->body_left);
+			if (avail == 0) break;
+			char *body = client->req_buf + client->req_consumed;
+			ssize_t n = send(up, body, avail, MSG_NOSIGNAL);
+			if (n > 0) {
+				memmove(body, body + n, client->req_len - client->req_consumed - n);
+				client->req_len -= n;
+				px->body_left -= n;
+				px->body_sent += n;
+				continue;
+			}
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			// 上游不再读请求体(比如已经返回了错误) 剩下的请求体没法确定边界 响应后关闭连接
+			client->keep_alive = 0;
+			px->reusable = 0;
+			px->body_left = 0;
+		}
+
+		// req_buf里的请求体发完后 剩下的从客户端socket经管道直接splice给上游
+		while (!px->resp_piped && (client->relay.pending > 0 || proxy_splice_body(client))) {
+			if (client->relay.pending > 0) {
+				ssize_t n = relay_drain(&client->relay, up);
+				if (n > 0) {
+					px->body_sent += n;
+					continue;
+				}
+				if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+				// 和上面一样 上游不再读请求体 管道里剩下的数据随管道一起丢掉
+				client->keep_alive = 0;
+				px->reusable = 0;
+				px->body_left = 0;
+				relay_release(&client->relay);
+				break;
+			}
+			ssize_t n = relay_fill(&client->relay, client->fd, MIN((off_t)RELAY_CHUNK, px->body_left));
+			if (n > 0) {
+				metrics_inc(COUNTER_BYTES_RECV, n);
+				px->body_left -= n;
+				continue;
+			}
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			// 客户端在请求体发完之前关闭了连接
+			proxy_detach(epoll_fd, client);
+			finish_response(epoll_fd, client, 0);
+			return 0;
+		}
+
+		// 响应头发完之后 响应体直接从上游经管道splice给客户端
+		if (splice_response_ok(client)) {
+			if (splice_response(epoll_fd, client) == -1) return 0;
+			break;
+		}
+
+		// 读取响应 写缓冲区满了就停下等客户端
+		size_t limit = px->header_done ? server_options.buf_size : server_options.buf_size - PROXY_HEADER_RESERVE;
+		int drained = 0;
+		while (!px->eof && client->buf_len < limit) {
+			size_t want = limit - client->buf_len;
+			if (px->header_done && px->framing == PROXY_BODY_LENGTH) want = MIN(want, (size_t)px->resp_left);
+			ssize_t n = recv(up, client->buf + client->buf_len, want, 0);
+			if (n > 0) {
+				px->resp_started = 1;
+				size_t start = client->buf_len;
+				client->buf_len += n;
+				int ret = px->header_done ? (account_body(client, start, n) == -1 ? -1 : 1)
+										  : rewrite_response_head(client);
+				if (ret == -1) {
+					log_warn("bad upstream response from %s: %.*s", backends[px->backend].name,
+							 (int)client->req.uri_len, client->req.uri);
+					if (proxy_fail(epoll_fd, client, 502, bad_gateway) == -1) return 0;
+					break;
+				}
+				if (ret == 1) limit = server_options.buf_size;
+				continue;
+			}
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				drained = 1;
+				break;
+			}
+			// 上游关闭 没有长度的响应到此结束
+			if (px->header_done && px->framing == PROXY_BODY_CLOSE) {
+				px->eof = 1;
+				px->reusable = 0;
+				break;
+			}
+			if (upstream_error(epoll_fd, client, 0) == -1) return 0;
+			break;
+		}
+		if (px->fd != up) continue; // 换了连接重发或者已经失败
+
+		if (px->header_done && client->buf_len > 0) {
+			int ret = send_response(client);
+			if (ret == -1) {
+				proxy_detach(epoll_fd, client);
+				finish_response(epoll_fd, client, 0);
+				return 0;
+			}
+			if (ret == 0) break; // 客户端发不动了 等可写事件
+		}
+		if (drained || px->eof) break;
+	}
+
+	// 上游已经失败 把错误响应发出去
+	if (px->fd == -1 && px->header_done && client->buf_len > 0 && send_response(client) == -1) {
+		request_end(client);
+		finish_response(epoll_fd, client, 0);
+		return 0;
+	}
+
+	// 响应全部发完 结束这个请求 上游连接放回空闲池
+	if (px->eof && px->header_done && client->buf_len == 0 && (!px->resp_piped || client->relay.pending == 0)) {
+		// 请求体没读完(或者还有一部分留在管道里) 无法继续解析后面的请求
+		int body_done = px->body_left == 0 && client->relay.pending == 0;
+		int ret = send_response_end(client);
+		if (ret == 0) {// 结束块还没发出去 上游已经关闭 不再关注它的事件
+			if (px->fd != -1) up_set_interest(epoll_fd, px, 0);
+			set_interest(epoll_fd, client, EPOLLOUT);
+			return 0;
+		}
+		if (!body_done) client->keep_alive = 0;
+		upstream_release(epoll_fd, client, px->reusable && body_done);
+		request_end(client);
+		finish_response(epoll_fd, client, ret == 1);
+		return client->fd == fd;
+	}
+
+	// 上游连接: 连接中或者请求没发完时等可写 之后等响应 写缓冲区满了暂停读
+	if (px->fd != -1) {
+		uint32_t events = 0;
+		if (px->connecting || px->head_sent < px->head_len ||
+			(px->body_left > 0 && client->req_len > client->req_consumed) ||
+			(!px->resp_piped && client->relay.pending > 0)) events |= EPOLLOUT;
+		// 管道里的响应体写给客户端之前不再从上游读
+		if (!px->connecting && px->head_sent == px->head_len && !px->eof && client->buf_len < server_options.buf_size &&
+			!(px->resp_piped && client->relay.pending > 0)) events |= EPOLLIN;
+		up_set_interest(epoll_fd, px, events);
+	}
+	// 客户端socket: 一直读(检测断开 接收后续的请求体) 有待发数据时写
+	// 请求体直接splice给上游时 只在管道空了并且请求头发完之后读
+	uint32_t events = 0;
+	if (proxy_splice_body(client)) {
+		if (client->relay.pending == 0 && !px->connecting && px->head_sent == px->head_len) events |= EPOLLIN;
+	} else if (client->req_len < server_options.buf_size) {
+		events |= EPOLLIN;
+	}
+	if (px->header_done && (client->buf_len > 0 || (px->resp_piped && client->relay.pending > 0))) events |= EPOLLOUT;
+	set_interest(epoll_fd, client, events);
+	return 0;
+}
+
+// 检查当前循环中超时的代理请求 只在有请求进行中时调用
+void proxy_sweep(int epoll_fd) {
+	uint64_t now = metrics_now_ns();
+	for (int i = 0; i < server_options.max_clients && px_loop.pending > 0; i++) {
+		Client *client = &server.clients[i];
+		if (client->fd == -1 || !client->proxy.active || client->proxy.fd == -1) continue;
+		if (now < client->proxy.deadline_ns) continue;
+		log_warn("proxy timeout: %.*s", (int)client->req.uri_len, client->req.uri);
+		if (proxy_fail(epoll_fd, client, 504, gateway_timeout) == -1) continue;
+		if (proxy_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef PROXY_H
+#define PROXY_H
+#include <stdint.h>
+#include <sys/types.h>
+#include "request.h"
+#include "chunked.h"
+
+#define PROXY_MAX_ROUTES 32     // 路由条数上限
+#define PROXY_MAX_BACKENDS 64   // 所有路由的后端总数上限
+#define PROXY_IDLE_MAX 32       // 每个事件循环对每个后端最多保留的空闲连接
+#define PROXY_TIMEOUT_MS 30000  // 默认超时 从转发请求到响应结束
+#define PROXY_HEADER_RESERVE 64 // 改写响应头时额外需要的空间
+
+// 一个路由有多个后端时的负载均衡方式
+typedef enum{
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN      // 选当前事件循环中进行中请求最少的后端
+} proxy_balance;
+
+// 响应体的边界
+typedef enum{
+    PROXY_BODY_NONE,        // 没有响应体(HEAD/204/304)
+    PROXY_BODY_LENGTH,      // Content-Length
+    PROXY_BODY_CHUNKED,     // Transfer-Encoding: chunked 原样转发
+    PROXY_BODY_CLOSE        // 读到上游关闭为止 这种响应之后两边的连接都不能复用
+} proxy_framing;
+
+// 请求转发给上游时的状态 active为0表示当前请求不是代理请求
+// 请求头发出去之前放在客户端的写缓冲区buf里 发完之后buf用来放响应
+typedef struct{
+    int active;
+    int fd;                 // 上游连接 -1表示已经归还或关闭
+    int route;
+    int backend;            // 在所有后端中的下标
+    uint64_t tried;         // 路由内已经连接失败的后端 按路由内的偏移记位
+    int connecting;         // 非阻塞connect还没完成
+    int reused;             // 连接来自空闲池 对端可能已经关闭 没收到响应前失败可以换新连接重发
+    uint32_t events;        // 上游连接当前在epoll中注册的事件
+    size_t head_len;        // 改写后的请求头长度
+    size_t head_sent;
+    off_t body_left;        // 还没转发给上游的请求体字节数
+    off_t body_sent;
+    int resp_started;       // 收到过响应的字节
+    int header_done;        // buf开头的响应头已经改写完 之后buf里的内容可以直接发送
+    int head_only;          // HEAD请求 响应没有响应体
+    int eof;                // 响应已经完整
+    int reusable;           // 响应结束后上游连接可以放回空闲池
+    proxy_framing framing;
+    off_t resp_left;        // PROXY_BODY_LENGTH时还没收到的响应体字节数
+    ChunkScanner chunk;
+    int resp_piped;         // 响应体经管道splice给客户端 管道里的数据属于响应(否则属于请求体)
+    uint64_t deadline_ns;
+} ProxyState;
+
+// 解析路由表并设置负载均衡方式 spec形如
+// "/api/=127.0.0.1:8081,127.0.0.1:8082;/app/=unix:/tmp/app.sock"
+// 返回路由条数 格式错误或后端地址无法解析返回-1
+int proxy_load(const char *spec, proxy_balance balance);
+// "round-robin"/"least-conn" 不认识返回-1
+int proxy_parse_balance(const char *s);
+// 请求URI最长匹配的路由 没有匹配返回-1
+int proxy_route(const HttpRequest *req);
+
+#endif
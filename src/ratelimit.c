@@ -0,0 +1,170 @@
+#include "server.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define RATE_GROUPS (RATE_TABLE_SIZE / RATE_PROBE)
+
+// 一个来源地址 conns为0时可以被同组的新地址替换
+typedef struct{
+	uint8_t addr[16];       // IPv6地址 IPv4存成::ffff:a.b.c.d
+	int used;
+	int conns;
+	TokenBucket reqs, bytes;
+	uint64_t last_ns;       // 最后一次连接或请求 替换时选最久没用的
+} RateEntry;
+
+static RateEntry table[RATE_TABLE_SIZE];
+static pthread_mutex_t group_locks[RATE_GROUPS] = { [0 ... RATE_GROUPS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+// 每个监听socket的状态 限制值在Listener里
+static struct{
+	pthread_mutex_t lock;
+	atomic_int conns;
+	TokenBucket reqs, bytes;
+} per_listener[MAX_LISTENERS] = { [0 ... MAX_LISTENERS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+
+// 按rate补充令牌 最多burst个 第一次用时是满的
+static void refill(TokenBucket *b, double rate, double burst, uint64_t now) {
+	if (!b->stamp_ns) b->tokens = burst;
+	else b->tokens = MIN(burst, b->tokens + rate * (now - b->stamp_ns) / 1e9);
+	b->stamp_ns = now;
+}
+
+// 请求数的桶取一个令牌 rate为0表示不限制
+static int take(TokenBucket *b, double rate, double burst, uint64_t now) {
+	if (rate <= 0) return 1;
+	refill(b, rate, burst, now);
+	if (b->tokens < 1) return 0;
+	b->tokens -= 1;
+	return 1;
+}
+
+// 字节数的桶是不是还欠着 最多攒一秒的量
+static int in_debt(TokenBucket *b, double rate, uint64_t now) {
+	if (rate <= 0) return 0;
+	refill(b, rate, rate, now);
+	return b->tokens < 0;
+}
+
+static void charge(TokenBucket *b, double rate, size_t n, uint64_t now) {
+	refill(b, rate, rate, now);
+	b->tokens -= n;
+}
+
+static int addr_key(const struct sockaddr *sa, uint8_t key[16]) {
+	if (sa->sa_family == AF_INET6) {
+		memcpy(key, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+		return 0;
+	}
+	if (sa->sa_family != AF_INET) return -1;
+	memset(key, 0, 10);
+	key[10] = key[11] = 0xff;
+	memcpy(key + 12, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+	return 0;
+}
+
+// FNV-1a
+static uint32_t addr_hash(const uint8_t key[16]) {
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 16; i++) h = (h ^ key[i]) * 16777619u;
+	return h;
+}
+
+// 在组里找地址 没有时占一个空位或者替换最久没用的空闲项 组里都有连接时返回NULL(不限制)
+static RateEntry *find_or_insert(size_t group, const uint8_t key[16], uint64_t now) {
+	RateEntry *g = &table[group * RATE_PROBE], *victim = NULL;
+	for (int i = 0; i < RATE_PROBE; i++) {
+		RateEntry *e = &g[i];
+		if (e->used && memcmp(e->addr, key, 16) == 0) {
+			e->last_ns = now;
+			return e;
+		}
+		if (!e->used) {
+			if (!victim || victim->used) victim = e;
+		} else if (e->conns == 0 && (!victim || (victim->used && e->last_ns < victim->last_ns))) {
+			victim = e;
+		}
+	}
+	if (!victim) return NULL;
+	memset(victim, 0, sizeof(*victim));
+	memcpy(victim->addr, key, 16);
+	victim->used = 1;
+	victim->last_ns = now;
+	return victim;
+}
+
+int rate_connect(const struct sockaddr *sa, int listener, int *slot) {
+	*slot = RATE_NO_SLOT;
+	Listener *l = &listeners[listener];
+	if (l->max_conns > 0 && atomic_fetch_add(&per_listener[listener].conns, 1) >= l->max_conns) {
+		atomic_fetch_sub(&per_listener[listener].conns, 1);
+		return -1;
+	}
+	int limit = server_options.ip_conns;
+	uint8_t key[16];
+	if ((!limit && !server_options.ip_rate && !server_options.ip_bandwidth) || addr_key(sa, key) == -1) return 0;
+	size_t group = (addr_hash(key) & (RATE_TABLE_SIZE - 1)) / RATE_PROBE;
+	pthread_mutex_lock(&group_locks[group]);
+	RateEntry *e = find_or_insert(group, key, metrics_now_ns());
+	if (e && limit > 0 && e->conns >= limit) {
+		pthread_mutex_unlock(&group_locks[group]);
+		if (l->max_conns > 0) atomic_fetch_sub(&per_listener[listener].conns, 1);
+		return -1;
+	}
+	if (e) {
+		e->conns++;
+		*slot = e - table;
+	}
+	pthread_mutex_unlock(&group_locks[group]);
+	return 0;
+}
+
+void rate_disconnect(int slot, int listener) {
+	if (listeners[listener].max_conns > 0) atomic_fetch_sub(&per_listener[listener].conns, 1);
+	if (slot == RATE_NO_SLOT) return;
+	pthread_mutex_t *lock = &group_locks[slot / RATE_PROBE];
+	pthread_mutex_lock(lock);
+	table[slot].conns--;
+	pthread_mutex_unlock(lock);
+}
+
+int rate_request(int slot, int listener) {
+	Listener *l = &listeners[listener];
+	int rate = server_options.ip_rate, bandwidth = server_options.ip_bandwidth;
+	int ok = 1;
+	uint64_t now = metrics_now_ns();
+	if (slot != RATE_NO_SLOT && (rate > 0 || bandwidth > 0)) {
+		int burst = server_options.ip_burst > 0 ? server_options.ip_burst : rate;
+		pthread_mutex_t *lock = &group_locks[slot / RATE_PROBE];
+		RateEntry *e = &table[slot];
+		pthread_mutex_lock(lock);
+		e->last_ns = now;
+		ok = !in_debt(&e->bytes, bandwidth, now) && take(&e->reqs, rate, burst, now);
+		pthread_mutex_unlock(lock);
+	}
+	if (ok && (l->rate > 0 || l->bandwidth > 0)) {
+		pthread_mutex_lock(&per_listener[listener].lock);
+		ok = !in_debt(&per_listener[listener].bytes, l->bandwidth, now) &&
+			 take(&per_listener[listener].reqs, l->rate, l->rate, now);
+		pthread_mutex_unlock(&per_listener[listener].lock);
+	}
+	return ok ? 0 : -1;
+}
+
+void rate_sent(int slot, int listener, size_t n) {
+	Listener *l = &listeners[listener];
+	int bandwidth = server_options.ip_bandwidth;
+	int per_ip = slot != RATE_NO_SLOT && bandwidth > 0;
+	if (!per_ip && l->bandwidth <= 0) return;
+	uint64_t now = metrics_now_ns();
+	if (per_ip) {
+		pthread_mutex_t *lock = &group_locks[slot / RATE_PROBE];
+		pthread_mutex_lock(lock);
+		charge(&table[slot].bytes, bandwidth, n, now);
+		pthread_mutex_unlock(lock);
+	}
+	if (l->bandwidth > 0) {
+		pthread_mutex_lock(&per_listener[listener].lock);
+		charge(&per_listener[listener].bytes, l->bandwidth, n, now);
+		pthread_mutex_unlock(&per_listener[listener].lock);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// 按来源IP和按监听socket的限流 都是令牌桶 所有事件循环共享
+//   并发连接数: accept之后检查 超过时回503(Retry-After)后关闭 不占用客户端槽位
+//   请求数/秒:  开始处理请求前检查 超过时回429
+//   字节数/秒:  发送后扣除 可以扣成负数 欠着的时候下一个请求回429
+// 来源IP的限制是配置项ip_conns ip_rate ip_burst ip_bandwidth(可以重新加载) 监听socket的限制是监听地址的选项conns= rate= bw=
+// 来源地址的表按组线性探测 每组RATE_PROBE项共用一把锁 查找和插入都是常数时间
+// IPv4和IPv4映射的IPv6地址算同一个来源 Unix socket的连接只受监听socket的限制
+
+#define RATE_TABLE_SIZE 16384   // 来源地址表的项数 2的幂
+#define RATE_PROBE 8            // 每组的项数 一个地址只在它的组里找
+#define RATE_NO_SLOT (-1)       // 连接没有对应的来源地址表项(不限制或者组里没有空位)
+
+typedef struct{
+    double tokens;
+    uint64_t stamp_ns;          // 上次补充令牌的时间 0表示还没用过(满的)
+} TokenBucket;
+
+// 新连接 超过并发连接数限制时返回-1 否则在*slot中返回来源地址表项 断开时交给rate_disconnect
+int rate_connect(const struct sockaddr *sa, int listener, int *slot);
+void rate_disconnect(int slot, int listener);
+// 开始处理一个请求 超过请求数或者字节数限制时返回-1
+int rate_request(int slot, int listener);
+// 发出了n字节
+void rate_sent(int slot, int listener, size_t n);
+
+#endif
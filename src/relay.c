@@ -0,0 +1,56 @@
+#define _GNU_SOURCE // splice pipe2 F_SETPIPE_SZ
+#include "server.h"
+
+// 每个事件循环的空闲管道栈 管道只在借出它的循环中使用 不需要加锁
+static __thread int pool[RELAY_POOL_MAX][2];
+static __thread int pool_count;
+
+int relay_acquire(Relay *r) {
+	if (r->rfd != -1) return 0;
+	if (!server_options.splice) return -1;
+	int fds[2];
+	if (pool_count > 0) {
+		pool_count--;
+		fds[0] = pool[pool_count][0];
+		fds[1] = pool[pool_count][1];
+	} else {
+		if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+			log_warn("pipe2 failed, falling back to buffered copy: %s", strerror(errno));
+			return -1;
+		}
+		// 管道越大每次splice搬得越多 受/proc/sys/fs/pipe-max-size限制 失败不影响使用
+		fcntl(fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+	}
+	r->rfd = fds[0];
+	r->wfd = fds[1];
+	r->pending = 0;
+	return 0;
+}
+
+void relay_release(Relay *r) {
+	if (r->rfd == -1) return;
+	if (r->pending == 0 && pool_count < RELAY_POOL_MAX) {
+		pool[pool_count][0] = r->rfd;
+		pool[pool_count][1] = r->wfd;
+		pool_count++;
+	} else {// 残留的数据没法清掉 直接关闭
+		close(r->rfd);
+		close(r->wfd);
+	}
+	relay_init(r);
+}
+
+ssize_t relay_fill(Relay *r, int in, size_t len) {
+	ssize_t n = splice(in, NULL, r->wfd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0) r->pending += n;
+	return n;
+}
+
+ssize_t relay_drain(Relay *r, int out) {
+	ssize_t n = splice(r->rfd, NULL, out, NULL, r->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		r->pending -= n;
+		metrics_inc(COUNTER_BYTES_SPLICED, n);
+	}
+	return n;
+}
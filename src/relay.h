@@ -0,0 +1,33 @@
+#ifndef RELAY_H
+#define RELAY_H
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RELAY_PIPE_SIZE (256 * 1024) // 尝试把管道容量调大 失败时用默认的64KB
+#define RELAY_POOL_MAX 64            // 每个事件循环缓存的空闲管道数
+#define RELAY_CHUNK (1 << 20)        // 不知道总长度时每次最多splice进管道的字节数
+
+// socket→管道→socket的搬运 数据只在内核中移动 不复制到用户态
+// 管道从当前事件循环的池中借用 请求结束后归还
+// pending不为0时管道里还有没写出去的数据 写完之前不能往里面读新数据
+typedef struct{
+	int rfd, wfd;           // 管道的读写端 -1表示没有管道
+	size_t pending;         // 已经splice进管道还没写出去的字节数
+} Relay;
+
+static inline void relay_init(Relay *r) {
+	r->rfd = r->wfd = -1;
+	r->pending = 0;
+}
+
+// 确保r有一个管道 没有启用splice或者创建失败返回-1 调用方回退到缓冲区复制
+int relay_acquire(Relay *r);
+// 把管道还给当前循环的池 里面还有数据时直接关闭
+void relay_release(Relay *r);
+// 从in最多读len字节到管道 只能在pending为0时调用
+// 返回读到的字节数 0表示in已经关闭 -1表示出错(EAGAIN表示in暂时没有数据)
+ssize_t relay_fill(Relay *r, int in, size_t len);
+// 把管道里的数据写到out 返回写出的字节数 -1表示出错(EAGAIN表示out暂时写不进去)
+ssize_t relay_drain(Relay *r, int out);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+    测量经服务器转发的大块数据的吞吐 用来比较splice和缓冲区复制两条路径
+    一个keep-alive连接上重复发同一个请求 边发请求体边收响应 避免双方缓冲区都满了互相等待
+
+    默认POST -s MB的请求体 服务器(回显或者转发给上游)返回的响应体全部读完算一轮
+    -g 时发GET 只测响应体(比如代理到一个返回大文件的上游)
+
+    先用LISO_SPLICE=0启动服务器跑一次 再用默认设置跑一次 比较两次的GB/s
+
+    用法: ./relay_bench [-h 地址] [-p 端口] [-u URI] [-s MB] [-n 轮数] [-g]
+*/
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CHUNK (256 * 1024)
+#define HEAD_MAX 8192
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// 发一个请求并读完响应 返回读到的响应体字节数 出错返回-1
+static long long one_round(int fd, const char *head, size_t head_len, const char *body, long long body_len) {
+    static char in[CHUNK];
+    size_t head_sent = 0;
+    long long body_sent = 0, resp_left = -1, resp_body = 0;
+    size_t in_len = 0;
+    while (resp_left != 0) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (head_sent < head_len || body_sent < body_len) pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, 10000) <= 0) return -1;
+        if (pfd.revents & POLLOUT) {
+            ssize_t n;
+            if (head_sent < head_len) {
+                n = send(fd, head + head_sent, head_len - head_sent, MSG_NOSIGNAL);
+                if (n > 0) head_sent += n;
+            } else {
+                size_t want = body_len - body_sent < CHUNK ? body_len - body_sent : CHUNK;
+                n = send(fd, body, want, MSG_NOSIGNAL);
+                if (n > 0) body_sent += n;
+            }
+            if (n == -1 && errno != EAGAIN) return -1;
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t n = recv(fd, in + in_len, sizeof(in) - in_len, 0);
+        if (n <= 0) return -1;
+        if (resp_left >= 0) {
+            resp_left -= n;
+            resp_body += n;
+            continue;
+        }
+        // 还在读响应头
+        in_len += n;
+        char *end = memmem(in, in_len, "\r\n\r\n", 4);
+        if (!end) {
+            if (in_len >= HEAD_MAX) return -1;
+            continue;
+        }
+        char *cl = memmem(in, end - in, "Content-Length:", 15);
+        if (!cl || strncmp(in, "HTTP/1.1 200", 12) != 0) return -1;
+        resp_left = atoll(cl + 15);
+        size_t extra = in + in_len - (end + 4);
+        resp_left -= extra;
+        resp_body = extra;
+        in_len = 0;
+    }
+    return resp_body;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1", *port = "9999", *uri = "/";
+    long long size_mb = 64;
+    int rounds = 10, get = 0, opt;
+    while ((opt = getopt(argc, argv, "h:p:u:s:n:g")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'u': uri = optarg; break;
+        case 's': size_mb = atoll(optarg); break;
+        case 'n': rounds = atoi(optarg); break;
+        case 'g': get = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-u uri] [-s MB] [-n rounds] [-g]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (size_mb < 1 || rounds < 1) {
+        fprintf(stderr, "bad -s/-n\n");
+        return 1;
+    }
+    long long body_len = get ? 0 : size_mb << 20;
+    char head[1024];
+    int head_len = get ? snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", uri, host)
+                       : snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n"
+                                  "Content-Length: %lld\r\n\r\n", uri, host, body_len);
+    static char body[CHUNK];
+    memset(body, 'x', sizeof(body));
+
+    int fd = connect_to(host, port);
+    if (fd == -1) {
+        perror("connect");
+        return 1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    long long sent = 0, received = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < rounds; i++) {
+        long long n = one_round(fd, head, head_len, body, body_len);
+        if (n == -1) {
+            fprintf(stderr, "round %d failed\n", i);
+            return 1;
+        }
+        sent += body_len;
+        received += n;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    // 请求体和响应体同时在两个方向上传输 按较大的一个方向计算吞吐
+    long long moved = sent > received ? sent : received;
+    printf("%s %s: %d rounds, %.1f MB sent, %.1f MB received in %.3f s, %.2f GB/s\n", get ? "GET" : "POST", uri,
+           rounds, sent / 1048576.0, received / 1048576.0, secs, moved / secs / 1e9);
+    close(fd);
+    return 0;
+}
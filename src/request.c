@@ -0,0 +1,112 @@
+#include "request.h"
+#include <string.h>
+#include <strings.h>
+
+// 常见请求头的名字 下标与header_id对应
+static const struct{
+    const char *name;
+    size_t len;
+} header_names[HEADER_COUNT] = {
+    [HEADER_CONNECTION]        = { "Connection", 10 },
+    [HEADER_HOST]              = { "Host", 4 },
+    [HEADER_CONTENT_LENGTH]    = { "Content-Length", 14 },
+    [HEADER_CONTENT_TYPE]      = { "Content-Type", 12 },
+    [HEADER_TRANSFER_ENCODING] = { "Transfer-Encoding", 17 },
+    [HEADER_RANGE]             = { "Range", 5 },
+    [HEADER_IF_MODIFIED_SINCE] = { "If-Modified-Since", 17 },
+    [HEADER_ACCEPT_ENCODING]   = { "Accept-Encoding", 15 },
+    [HEADER_REFERER]           = { "Referer", 7 },
+    [HEADER_USER_AGENT]        = { "User-Agent", 10 },
+    [HEADER_UPGRADE]           = { "Upgrade", 7 },
+    [HEADER_EXPECT]            = { "Expect", 6 },
+    [HEADER_HTTP2_SETTINGS]    = { "HTTP2-Settings", 14 },
+};
+
+// 先比较长度和首字母 绝大多数不关心的请求头在这里就被排除
+static int match_header(const char *name, size_t len) {
+    char first = name[0] | 0x20;
+    for (int i = 0; i < HEADER_COUNT; i++) {
+        if (header_names[i].len == len && (header_names[i].name[0] | 0x20) == first &&
+            strncasecmp(header_names[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 解析请求行 "方法 路径 版本"
+static void parse_request_line(const char *line, size_t len, HttpRequest *req) {
+    const char *end = line + len;
+    const char *sp1 = memchr(line, ' ', len);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', end - sp1 - 1) : NULL;
+    req->line = line;
+    req->line_len = len;
+    if (!sp1 || !sp2) {
+        req->malformed = 1;
+        return;
+    }
+    req->method = line;
+    req->method_len = sp1 - line;
+    req->uri = sp1 + 1;
+    req->uri_len = sp2 - sp1 - 1;
+    req->version = sp2 + 1;
+    req->version_len = end - sp2 - 1;
+}
+
+int parse_request(const char *buf, size_t len, HttpRequest *req) {
+    memset(req, 0, sizeof(*req));
+    const char *p = buf, *end = buf + len;
+    int line_no = 0;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) return 0; // 还没收完整
+        const char *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+        size_t line_len = line_end - p;
+
+        if (line_len == 0) { // 空行 请求头结束
+            if (line_no == 0) { // 请求行前的空行按RFC 7230忽略
+                p = eol + 1;
+                continue;
+            }
+            req->head_len = eol + 1 - buf;
+            return (int)req->head_len;
+        }
+
+        if (line_no++ == 0) {
+            parse_request_line(p, line_len, req);
+        } else {
+            const char *colon = memchr(p, ':', line_len);
+            if (colon && colon > p) {
+                int id = match_header(p, colon - p);
+                if (id != -1) {
+                    if (id == HEADER_CONTENT_LENGTH && req->headers[id].value) req->duplicate_length = 1;
+                    const char *v = colon + 1, *v_end = line_end;
+                    while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+                    while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+                    req->headers[id].value = v;
+                    req->headers[id].len = v_end - v;
+                }
+            }
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+int header_equals(const HttpRequest *req, header_id id, const char *s) {
+    const HeaderValue *h = &req->headers[id];
+    return h->len == strlen(s) && strncasecmp(h->value, s, h->len) == 0;
+}
+
+off_t request_content_length(const HttpRequest *req) {
+    const HeaderValue *h = &req->headers[HEADER_CONTENT_LENGTH];
+    if (req->duplicate_length) return -1; // 转发时两份都会带上 上游可能取另一个
+    if (h->len == 0) return 0;
+    off_t n = 0;
+    for (size_t i = 0; i < h->len; i++) {
+        if (h->value[i] < '0' || h->value[i] > '9' || n > ((off_t)1 << 50)) return -1;
+        n = n * 10 + (h->value[i] - '0');
+    }
+    return n;
+}
@@ -0,0 +1,54 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+#include <stddef.h>
+#include <sys/types.h>
+
+// 处理请求时需要用到的常见请求头 解析时直接填到固定槽位 之后O(1)读取
+typedef enum{
+    HEADER_CONNECTION,
+    HEADER_HOST,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_RANGE,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_REFERER,
+    HEADER_USER_AGENT,
+    HEADER_UPGRADE,
+    HEADER_EXPECT,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_COUNT
+} header_id;
+
+// 指向读缓冲区中的原始数据 不以\0结尾 len为0表示请求中没有这个头
+typedef struct{
+    const char *value;
+    size_t len;
+} HeaderValue;
+
+// 解析出的请求 所有指针都指向读缓冲区 请求处理完之前缓冲区不能被改动
+typedef struct{
+    const char *line;    // 请求行 记录访问日志用
+    size_t line_len;     // 请求行长度(不含\r\n)
+    const char *method;
+    size_t method_len;
+    const char *uri;
+    size_t uri_len;
+    const char *version;
+    size_t version_len;
+    size_t head_len;     // 请求行+请求头+\r\n\r\n的长度
+    int malformed;       // 请求行不是"方法 路径 版本"三段
+    int duplicate_length; // Content-Length出现了不止一次 请求边界不可信
+    HeaderValue headers[HEADER_COUNT];
+} HttpRequest;
+
+// 在buf中解析一个请求的请求行和请求头 只扫描一遍
+// 返回请求头的总长度(包含\r\n\r\n和请求行前被忽略的空行) 请求头还不完整时返回0
+int parse_request(const char *buf, size_t len, HttpRequest *req);
+// 请求头的值是否等于s(不区分大小写)
+int header_equals(const HttpRequest *req, header_id id, const char *s);
+// 解析Content-Length 没有时返回0 格式错误或者出现多次返回-1
+off_t request_content_length(const HttpRequest *req);
+
+#endif
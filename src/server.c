@@ -1,7 +1,12 @@
+#define _GNU_SOURCE // memmem
 #include "server.h"
+#include <sys/ioctl.h>
+#include <linux/sockios.h> // SIOCOUTQ
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+char ROOT_DIR[4096];
+__thread Server server;
 char *bad_request = "HTTP/1.1 400 Bad request\r\n\r\n";
 char *not_implemented = "HTTP/1.1 501 Not Implemented\r\n\r\n";
 
@@ -11,6 +16,16 @@ const char *v_not_supported = "HTTP/1.1 505 HTTP Version not supported\r\n\r\n";
 
 // 500 Internal server error 处理内部错误
 const char *internal_error = "HTTP/1.1 500 Internal server error\r\n\r\n";
+// 请求(含请求体)超出缓冲区 响应后关闭连接
+const char *request_too_large = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+// CGI相关的错误 脚本输出不合法 并发数已满 超时
+const char *bad_gateway = "HTTP/1.1 502 Bad Gateway\r\n\r\n";
+const char *service_unavailable = "HTTP/1.1 503 Service Unavailable\r\n\r\n";
+const char *gateway_timeout = "HTTP/1.1 504 Gateway Timeout\r\n\r\n";
+const char *too_many_requests = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+// 超过连接数限制 还没有占用槽位 直接写在新连接上
+static const char too_many_connections[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 
 // http的最长url
 const int PATH_MAX = 2083;
@@ -20,25 +35,6 @@ int set_nonblocking(int fd) {
     if (flags == -1) return -1;
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
-// 获取文件扩展名并确定MIME类型
-const char* get_mime_type(const char *filename) {
-    const char *dot = strrchr(filename, '.');
-    if (!dot) return "application/octet-stream";
-    
-    if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0) return "text/html";
-    if (strcmp(dot, ".txt") == 0) return "text/plain";
-    if (strcmp(dot, ".css") == 0) return "text/css";
-    if (strcmp(dot, ".js") == 0) return "application/javascript";
-    if (strcmp(dot, ".json") == 0) return "application/json";
-    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(dot, ".png") == 0) return "image/png";
-    if (strcmp(dot, ".gif") == 0) return "image/gif";
-    if (strcmp(dot, ".svg") == 0) return "image/svg+xml";
-    if (strcmp(dot, ".pdf") == 0) return "application/pdf";
-    
-    return "application/octet-stream";
-}
-
 // 获取当前时间的RFC1123格式字符串
 void get_current_time_rfc1123(char *buf, size_t buf_size) {
     time_t now = time(NULL);
@@ -59,52 +55,228 @@ void get_file_mod_time_rfc1123(const char *filename, char *buf, size_t buf_size)
     }
 }
 
-// 获取请求头中的字符串信息
-char* get_header_value(const char *headers, const char *key) {
-    char search_key[128];
-    snprintf(search_key, sizeof(search_key), "\r\n%s: ", key);
-    
-    char *start = strstr(headers, search_key);
-    if (!start) return NULL;
-    
-    start += strlen(search_key);
-    char *end = strstr(start, "\r\n");
-    if (!end) return NULL;
-    
-    size_t len = end - start;
-    char *value = malloc(len + 1);
-    memcpy(value, start, len);
-    value[len] = '\0';
-    return value;
+// 打开请求路径对应的文件并获取状态 统计stat/open/fstat的耗时
+// 成功返回文件fd 文件不存在返回-1(404) 打开或获取状态失败返回-2(500)
+int open_request_file(const char *path, char *full_path, size_t full_path_size,
+					  struct stat *st, const char **mime_type) {
+	uint64_t start_ns = metrics_now_ns();
+	int file_fd;
+	if (strcmp(path, METRICS_URI) == 0) {
+		// 指标快照写在memfd里 后面和普通文件一样发送
+		full_path[0] = '\0';
+		*mime_type = METRICS_CONTENT_TYPE;
+		file_fd = metrics_render_fd();
+		if (file_fd == -1) return -2;
+	} else {
+		if (strcmp(path, "/") == 0) {  
+			// 访问根目录，返回 index.html  
+			snprintf(full_path, full_path_size, "%s/index.html", ROOT_DIR);  
+		} else {   
+			// 防止目录穿越攻击在之前读出path的时候已经做过
+			snprintf(full_path, full_path_size, "%s%s", ROOT_DIR, path);  
+		}  
+		// 使用 stat 判断文件是否存在且是普通文件  
+		if (stat(full_path, st) == -1 || !S_ISREG(st->st_mode)) {
+			log_debug("file not found: %s", full_path);
+			return -1;
+		}
+		*mime_type = mime_lookup(full_path);
+		// 打开文件
+		file_fd = open(full_path, O_RDONLY | O_CLOEXEC);
+		if (file_fd == -1) return -2;
+	}
+	// 使用文件描述符获取状态
+	if (fstat(file_fd, st) == -1) {
+		close(file_fd);
+		return -2;
+	}
+	metrics_observe_since(PHASE_FILE_OPEN, start_ns);
+	return file_fd;
 }
 
-void close_client(int epoll_fd, Client *clients, int *fd_to_index, int fd) {
-    if (fd_to_index[fd] != -1) {
-        printf("Client %s:%d disconnected\n", 
-               clients[fd_to_index[fd]].ipstr, 
-               clients[fd_to_index[fd]].port);
-        fd_to_index[fd] = -1;
-    }
-    if (fd != -1) {
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-        close(fd);
-    }
+// 客户端IP只在写日志时才需要 第一次用到时再格式化 accept路径上不做inet_ntop
+const char *client_host(Client *client) {
+	if (client->ipstr[0]) return client->ipstr;
+	PeerAddr *peer = &client->peer;
+	if (peer->sa.sa_family == AF_UNIX) return "unix:";
+	if (peer->sa.sa_family == AF_INET) {
+		inet_ntop(AF_INET, &peer->in.sin_addr, client->ipstr, sizeof(client->ipstr));
+	} else if (IN6_IS_ADDR_V4MAPPED(&peer->in6.sin6_addr)) {// 双栈监听时的IPv4客户端 ::ffff:a.b.c.d
+		inet_ntop(AF_INET, &peer->in6.sin6_addr.s6_addr[12], client->ipstr, sizeof(client->ipstr));
+	} else {
+		inet_ntop(AF_INET6, &peer->in6.sin6_addr, client->ipstr, sizeof(client->ipstr));
+	}
+	return client->ipstr;
+}
+
+int client_port(Client *client) {
+	switch (client->peer.sa.sa_family) {
+	case AF_INET: return ntohs(client->peer.in.sin_port);
+	case AF_INET6: return ntohs(client->peer.in6.sin6_port);
+	default: return 0;
+	}
+}
 
+// 从epoll中删除CGI管道并关闭
+static void cgi_close_pipe(int epoll_fd, int *fd) {
+	if (*fd == -1) return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+	server.fd_to_index[*fd] = -1;
+	close(*fd);
+	*fd = -1;
+}
+
+// 结束CGI脚本 关闭管道并回收子进程 请求的其余状态不变
+// kill_now: 超时 出错或者客户端断开时直接杀掉 输出正常结束时让脚本自己退出 见cgi_release
+static void cgi_finish(int epoll_fd, Client *client, int kill_now) {
+	CgiProcess *proc = &client->cgi.proc;
+	if (proc->pid == 0) return;
+	cgi_close_pipe(epoll_fd, &proc->in_fd);
+	cgi_close_pipe(epoll_fd, &proc->out_fd);
+	cgi_release(proc, kill_now);
+	(*server.cgi_active)--;
+}
+
+// 释放槽位 放回空闲栈
+static void release_slot(int idx) {
+	(*server.current_clients)--;
+	server.free_slots[server_options.max_clients - *server.current_clients - 1] = idx;
+}
+
+void close_client(int epoll_fd, Client *clients, int *fd_to_index, int fd) {
+    if (fd == -1) return;
 	int idx = fd_to_index[fd];
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    if (idx == -1) return;
+
 	Client *client = &clients[idx];
-	// 关闭fd
-	if (client->file_fd != -1) {
+    log_debug("Client %s:%d disconnected", client_host(client), client_port(client));
+    fd_to_index[fd] = -1;
+	// 关闭fd 工作线程还在读时等任务完成再关
+	if (client->file_fd != -1 && !client->io.pending) {
 		close(client->file_fd);
 		client->file_fd = -1;
 	}
+	if (client->map) {
+		filemap_put(client->map);
+		client->map = NULL;
+	}
+	zerocopy_release(&client->zc);
+	// 还在运行的CGI脚本直接结束
+	if (client->cgi.active) {
+		cgi_finish(epoll_fd, client, 1);
+		client->cgi.active = 0;
+	}
+	if (client->fcgi.active) fcgi_detach(epoll_fd, client);
+	if (client->proxy.active) proxy_detach(epoll_fd, client);
+	relay_release(&client->relay);
+	client->echo_left = 0;
+	h2_free(client);
+	// 没发完的字节不再算在途
+	metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, -client->inflight);
+	client->inflight = 0;
+	client->fd = -1;
+	metrics_gauge_add(GAUGE_OPEN_CONNECTIONS, -1);
+	metrics_gauge_add(GAUGE_OUTPUT_QUEUED, -(int64_t)client->out_queued);
+	client->out_queued = 0;
+	rate_disconnect(client->rate_slot, client->listener);
+	client->rate_slot = RATE_NO_SLOT;
+	// 工作线程还在往这个槽位的缓冲区里读 任务完成后再放回空闲栈
+	if (client->io.pending) return;
+	release_slot(idx);
 }
 
-void handle_signal(int sig) {
-    printf("\nClosing server socket...byebye\n");
-    if (global_sock != -1) {
-        close(global_sock);
-    }
-    exit(EXIT_SUCCESS);
+// 每个事件循环的全部状态 数组按server_options的大小在init_loop中分配 通过server结构体里的指针访问
+typedef struct{
+	int epoll_fd, current_clients, fd_table_size, cgi_active;
+	struct epoll_event *events;
+	Client *clients;
+	int *free_slots;
+	char *buffers;      // 所有客户端的读写缓冲区 每个客户端2 * buf_size
+} EventLoop;
+
+// 初始化调用线程的事件循环 监听socket由所有循环共享
+// 多个循环时用EPOLLEXCLUSIVE注册监听socket 新连接只唤醒其中一个循环 不会惊群
+// 按CPU分流的监听地址每个循环注册自己的socket 不需要EPOLLEXCLUSIVE
+// index为0表示主线程的循环 由它处理信号 调用前线程已经绑定了CPU 下面分配的内存都在本地NUMA节点
+static int init_loop(int index) {
+	int max_clients = server_options.max_clients;
+	size_t buf_size = server_options.buf_size;
+	EventLoop *loop = calloc(1, sizeof(EventLoop));
+	if (!loop) return -1;
+	loop->events = malloc(server_options.max_events * sizeof(struct epoll_event));
+	loop->clients = calloc(max_clients, sizeof(Client));
+	loop->free_slots = malloc(max_clients * sizeof(int));
+	// 缓冲区只在用到时才占用物理内存
+	loop->buffers = malloc(max_clients * buf_size * 2);
+	if (!loop->events || !loop->clients || !loop->free_slots || !loop->buffers) return -1;
+	// fd_to_index按进程能打开的fd上限分配 多个循环共享同一个fd空间
+	struct rlimit rl;
+	int fd_table_size = max_clients * 2;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > (rlim_t)fd_table_size) {
+		fd_table_size = rl.rlim_cur > (1 << 20) ? (1 << 20) : (int)rl.rlim_cur;
+	}
+	int *fd_to_index = malloc(fd_table_size * sizeof(int));
+	if (!fd_to_index) return -1;
+	memset(fd_to_index, -1, fd_table_size * sizeof(int));
+	// 初始化Clients槽位可用 空闲栈从槽位0开始分配
+	for(int i = 0; i < max_clients; i++){
+		loop->clients[i].fd = -1;
+		loop->clients[i].file_fd = -1;
+		loop->clients[i].buf = loop->buffers + i * buf_size * 2;
+		loop->clients[i].req_buf = loop->clients[i].buf + buf_size;
+		relay_init(&loop->clients[i].relay);
+		zerocopy_init(&loop->clients[i].zc);
+		loop->clients[i].io.owner = &loop->clients[i];
+		loop->clients[i].task.owner = &loop->clients[i];
+		loop->free_slots[i] = max_clients - 1 - i;
+	}
+	loop->fd_table_size = fd_table_size;
+
+	// 初始化epoll 把所有监听socket放入event_poll中
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	for (int i = 0; i < listener_count; i++) {
+		struct epoll_event ev;
+		int fd = listener_fd(&listeners[i], index);
+		ev.events = EPOLLIN;
+		if (server_options.loops > 1 && listeners[i].group == 1) ev.events |= EPOLLEXCLUSIVE;
+		ev.data.fd = fd;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			log_error("epoll_ctl add listener %s failed: %s", listeners[i].name, strerror(errno));
+			return -1;
+		}
+		fd_to_index[fd] = FD_INDEX_LISTENER(i);
+	}
+	if (lifecycle_loop_init(loop->epoll_fd, fd_to_index, index == 0) == -1 ||
+		fileio_loop_init(loop->epoll_fd, fd_to_index) == -1 || task_loop_init(loop->epoll_fd, fd_to_index) == -1) {
+		log_error("lifecycle_loop_init/fileio_loop_init/task_loop_init failed: %s", strerror(errno));
+		return -1;
+	}
+
+	// 把上面完成初始化的所有值都赋给Server结构体
+	server.epoll_fd = &loop->epoll_fd;
+	server.events = loop->events;
+	server.fd_to_index = fd_to_index;
+	server.fd_table_size = &loop->fd_table_size;
+	server.current_clients = &loop->current_clients;
+	server.clients = loop->clients;
+	server.free_slots = loop->free_slots;
+	server.cgi_active = &loop->cgi_active;
+	server.loop = index;
+	return 0;
+}
+
+// 额外的事件循环线程 arg是循环的下标
+static void *loop_main(void *arg) {
+	int index = (int)(intptr_t)arg;
+	affinity_pin(index);
+	if (init_loop(index) == -1) {
+		log_error("init_loop failed");
+		return NULL;
+	}
+	while (handle_events() == 0) {}
+	return NULL;
 }
 
 void init_server(){
@@ -116,1318 +288,1182 @@ void init_server(){
     // }
 
 
-	// 注册信号处理器 回调handle_signal关闭socket
-	signal(SIGINT, handle_signal); // 处理CTRL+C产生的信号 
-    signal(SIGTERM, handle_signal);// 处理KILL产生的信号 
-    int sock, epoll_fd;
-    struct sockaddr_in addr;
-    struct epoll_event ev, events[MAX_EVENTS];
-    
-    // 使用固定大小的客户端数组
-    Client clients[MAX_CLIENTS];
-    int fd_to_index[MAX_CLIENTS * 2]; // 扩大映射表范围
-    memset(fd_to_index, -1, sizeof(fd_to_index));
-	// 初始化Clients槽位可用
-	for(int i = 0; i < MAX_CLIENTS; i++){
-		clients[i].fd = -1;
-	}
-    
-    int current_clients = 0;
-
-    // 初始化TCP套接字
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-	global_sock = sock;  // 将套接字保存到全局变量 处理信号时使用
-	// 允许端口复用 避免TCP一直占用端口重启后监听失败
-	int reuse = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    set_nonblocking(sock);
-
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(ECHO_PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
-
-    bind(sock, (struct sockaddr*)&addr, sizeof(addr));
-    listen(sock, MAX_CLIENTS);
-
-    // 初始化epoll
-    epoll_fd = epoll_create1(0);
-    ev.events = EPOLLIN;
-    ev.data.fd = sock;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev); // 将服务端client放入event_poll中
-	
-	// 把上面完成初始化的所有值都赋给Server结构体
-	int port = ECHO_PORT;
-	server.epoll_fd = &epoll_fd;
-	server.sock = &sock;
-	server.ev = &ev;
-	server.addr = &addr;
-	server.events = events;
-	server.fd_to_index = fd_to_index;
-	server.port = &port;
-	server.current_clients = &current_clients;
-	server.clients = clients;
+	// SIGINT/SIGTERM/SIGHUP/SIGUSR2已经在lifecycle_init中屏蔽 由主循环的signalfd处理
+	signal(SIGPIPE, SIG_IGN); // CGI脚本提前退出时写管道会产生SIGPIPE 改为返回EPIPE
+
+	// 绑定CPU的配置 决定下面每个TCP监听地址开几个socket
+	if (affinity_init() == -1) exit(EXIT_FAILURE);
+
+	// 初始化监听socket 可以有多个IPv4/IPv6地址 还可以监听Unix socket 本机的上下游不用经过TCP/IP协议栈
+	char default_listen[32];
+	snprintf(default_listen, sizeof(default_listen), "*:%d", server_options.port);
+	if (listener_open(server_options.listen ? server_options.listen : default_listen) == -1 ||
+		(server_options.unix_listen && listener_open_unix(server_options.unix_listen) == -1)) {
+		listener_close_all();
+		exit(EXIT_FAILURE);
+	}
+	listener_close_inherited();
+
+	// 打开和读文件的工作线程 所有事件循环共用
+	if (fileio_init(server_options.io_threads) == -1) {
+		log_error("fileio_init failed");
+		exit(EXIT_FAILURE);
+	}
+	// CPU工作线程 所有事件循环共用 互相偷任务
+	if (task_init(server_options.cpu_threads) == -1) {
+		log_error("task_init failed");
+		exit(EXIT_FAILURE);
+	}
+
+	// 额外的事件循环线程 各自有独立的epoll和客户端数组 新线程继承创建者的CPU集合 主线程最后才绑定
+	for (int i = 1; i < server_options.loops; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, loop_main, (void *)(intptr_t)i) != 0) {
+			log_error("pthread_create failed for loop %d", i);
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(tid);
+	}
+	affinity_pin(0);
+	if (init_loop(0) == -1) {
+		log_error("init_loop failed");
+		exit(EXIT_FAILURE);
+	}
+
+	char names[MAX_LISTENERS * 130] = "";
+	size_t names_len = 0;
+	for (int i = 0; i < listener_count; i++) {
+		names_len += snprintf(names + names_len, sizeof(names) - names_len, "%s%s", i ? ", " : "", listeners[i].name);
+	}
+    log_info("Server running on %s (%d epoll loop(s)), author:shr1mp", names, server_options.loops);
+	lifecycle_ready();
+}
+
+// 只有关注的事件变化时才调用epoll_ctl 避免每个请求都多一次系统调用
+int set_interest(int epoll_fd, Client *client, uint32_t events) {
+	if (client->events == events) return 0;
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = client->fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+		log_error("epoll_ctl mod failed: %s", strerror(errno));
+		return -1;
+	}
+	client->events = events;
+	return 0;
+}
+
+// 把固定的错误响应放入写缓冲区 错误响应没有响应体
+// 原样发送 CGI/FastCGI/代理转换完响应头还没发出去就失败时 之前开始的分块编码要取消
+void set_error_response(Client *client, int status, const char *response) {
+	size_t resp_len = strlen(response);
+	client->chunked = 0;
+	client->head_left = 0;
+	chunk_writer_init(&client->chunk);
+	memcpy(client->buf, response, resp_len);
+	client->buf_len = resp_len;
+	client->file_offset = -1;
+	client->status = status;
+}
+
+// 启动CGI脚本 两个管道注册到当前的epoll中(边沿触发 cgi_pump每次都读写到EAGAIN为止)
+// 失败时设置对应的错误响应 cgi.active保持为0
+static void start_cgi(Client *client) {
+	CgiState *cgi = &client->cgi;
+	CgiRequest creq = {
+		.req = &client->req,
+		.head = client->req_buf,
+		.head_len = client->req.head_len,
+		.remote_addr = client_host(client),
+		.remote_port = client_port(client),
+		.server_port = listeners[client->listener].port,
+		.content_length = cgi->body_left,
+	};
+	int ret = cgi_spawn(&creq, server_options.cgi_max_per_script, &cgi->proc);
+	if (ret == -1) {
+		set_error_response(client, 404, not_found);
+		return;
+	}
+	if (ret == -2) {
+		log_warn("cgi script busy: %.*s", (int)client->req.uri_len, client->req.uri);
+		set_error_response(client, 503, service_unavailable);
+		return;
+	}
+	if (ret == 0 && (cgi->proc.in_fd >= *server.fd_table_size || cgi->proc.out_fd >= *server.fd_table_size)) {
+		cgi_release(&cgi->proc, 1);
+		ret = -3;
+	}
+	if (ret != 0) {
+		log_error("cgi_spawn failed: %s", strerror(errno));
+		set_error_response(client, 500, internal_error);
+		return;
+	}
+
+	int epoll_fd = *server.epoll_fd;
+	int idx = server.fd_to_index[client->fd];
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLET;
+	ev.data.fd = cgi->proc.in_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cgi->proc.in_fd, &ev);
+	server.fd_to_index[cgi->proc.in_fd] = idx;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = cgi->proc.out_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cgi->proc.out_fd, &ev);
+	server.fd_to_index[cgi->proc.out_fd] = idx;
+	(*server.cgi_active)++;
+
+	cgi->active = 1;
+	CO_RESET(&cgi->co);
+	cgi->eof = 0;
+	cgi->head_only = client->req.method_len == 4 && memcmp(client->req.method, "HEAD", 4) == 0;
+	cgi->deadline_ns = metrics_now_ns() + (uint64_t)server_options.cgi_timeout_ms * 1000000ull;
+	client->buf_len = 0;
+	client->file_offset = -1;
+	client->status = 0;
+	// 没有请求体 直接关闭stdin 脚本读到EOF
+	if (cgi->body_left == 0) cgi_close_pipe(epoll_fd, &cgi->proc.in_fd);
+}
+
+// 读文件的下一块到dst 返回1表示读到了 0表示交给了工作线程 -1表示出错
+static int read_file_chunk(Client *client, char *dst, size_t len) {
+	ssize_t n = fileio_pread(&client->io, client->file_fd, dst, len, client->file_offset);
+	if (n == IO_PENDING) return 0;
+	if (n <= 0) {// 文件读取错误(或文件被截断)
+		log_error("read file failed! file_offset -> %ld, file_size -> %ld", (long)client->file_offset, (long)client->file_size);
+		return -1;
+	}
+	client->buf_len += n;
+	client->file_offset += n;
+	return 1;
+}
+
+// 文件已经打开(file_fd为open_request_file的返回值) 生成响应头并读第一块放在响应头后面
+static void respond_file(Client *client, int file_fd, const struct stat *st, const char *mime_type, const char *last_modified) {
+	if (file_fd < 0) {// 文件不存在返回404 其余失败返回500
+		if (file_fd == -1) set_error_response(client, 404, not_found);
+		else set_error_response(client, 500, internal_error);
+		return;
+	}
+
+	// 动态构造响应头
+	char date_buf[64];
+	get_current_time_rfc1123(date_buf, sizeof(date_buf));
+	int headers_len = snprintf(client->buf, server_options.buf_size,
+		"HTTP/1.1 200 OK\r\n"
+		"Server: liso/1.1\r\n"
+		"Date: %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %ld\r\n"
+		"Last-Modified: %s\r\n"
+		"Connection: %s\r\n\r\n",  // 动态设置
+		date_buf,
+		mime_type,
+		st->st_size,
+		last_modified,
+		client->keep_alive ? "keep-alive" : "close");
+	// 处理响应头缓冲区溢出
+	if (headers_len >= server_options.buf_size) {
+		close(file_fd);
+		log_error("response headers too long: %.*s", (int)client->req.uri_len, client->req.uri);
+		set_error_response(client, 500, internal_error);
+		return;
+	}
+	client->buf_len = headers_len;
+	client->status = 200;
+
+	// HEAD不需要文件内容
+	if (client->req.method_len == 4 && memcmp(client->req.method, "HEAD", 4) == 0) {
+		close(file_fd);
+		client->file_offset = -1;
+		return;
+	}
+	// GET方法需要发送文件内容 先读第一块放在响应头后面 文件比缓冲区小时整个响应都在缓冲区里
+	client->file_fd = file_fd;
+	client->file_size = st->st_size;
+	client->file_offset = 0;
+	if (client->file_size == 0) return;
+	if (server_options.mmap && (client->map = filemap_get(file_fd, st))) {// 之后直接从映射发送 不再需要fd
+		close(file_fd);
+		client->file_fd = -1;
+		return;
+	}
+	fileio_advise_stream(file_fd, client->file_size);
+	if (read_file_chunk(client, client->buf + headers_len, MIN(server_options.buf_size - headers_len, client->file_size)) == -1) {
+		close(file_fd);
+		client->file_fd = -1;
+		set_error_response(client, 500, internal_error);
+	}
+}
+
+static void file_io_done(int epoll_fd, Client *client);
+
+// 指标快照要格式化所有计数器和直方图 在CPU工作线程上生成 结果和异步打开文件一样放在io里
+static void metrics_task_run(Task *task) {
+	fileio_open(&((Client *)task->owner)->io);
+}
+
+static void metrics_task_done(int epoll_fd, Task *task) {
+	file_io_done(epoll_fd, task->owner);
+}
+
+// 根据已经解析好的client->req生成响应 响应头(和文件的第一块)放在client->buf中 静态文件可能交给工作线程 client->io.pending时还没生成
+static void handle_request(Client *client) {
+	HttpRequest *req = &client->req;
+	client->keep_alive = header_equals(req, HEADER_CONNECTION, "keep-alive");
+	if (server_draining) client->keep_alive = 0; // 排空中 这个响应发完就关闭
+	// 来源IP或者监听socket超过了请求数/字节数限制
+	if (rate_request(client->rate_slot, client->listener) == -1) {
+		metrics_inc(COUNTER_RATE_LIMITED, 1);
+		set_error_response(client, 429, too_many_requests);
+		return;
+	}
+
+	// 验证请求行基本结构 校验是否有空格分割的三个部分 路径以 / 开头
+	if (req->malformed || req->uri_len == 0 || req->uri[0] != '/' || req->uri_len >= (size_t)PATH_MAX) {
+		set_error_response(client, 400, bad_request);
+		return;
+	}
+	// 提取路径
+	char path[PATH_MAX];
+	memcpy(path, req->uri, req->uri_len);
+	path[req->uri_len] = '\0';
+	// 验证路径合法性 防止目录穿越
+	if (strstr(path, "..")) {
+		set_error_response(client, 400, bad_request);
+		return;
+	}
+	// 方法验证 转发给上游的请求由上游决定支持哪些方法
+	int is_get = req->method_len == 3 && memcmp(req->method, "GET", 3) == 0;
+	int is_head = req->method_len == 4 && memcmp(req->method, "HEAD", 4) == 0;
+	int is_post = req->method_len == 4 && memcmp(req->method, "POST", 4) == 0;
+	int route = proxy_route(req);
+	if (!is_get && !is_head && !is_post && route == -1) {
+		set_error_response(client, 501, not_implemented);
+		return;
+	}
+	// 严格协议版本检查
+	if (req->version_len != 8 || memcmp(req->version, "HTTP/1.1", 8) != 0) {
+		if (memmem(req->line, req->line_len, "HTTP/", 5)) {
+			set_error_response(client, 505, v_not_supported);
+		} else {
+			set_error_response(client, 400, bad_request);
+		}
+		return;
+	}
+	log_debug("Generate the response to client %s:%d%s(fd=%d)", client_host(client), client_port(client), path, client->fd);
+
+	// 没有请求体的GET/HEAD可以升级到h2c 这个请求的响应在HTTP/2的流1上发送
+	if ((is_get || is_head) && route == -1 && request_content_length(req) == 0 && server_options.h2 &&
+		h2_upgrade_requested(req) && !fcgi_match(req) && !cgi_match(req) && h2_start(client, 1) == 0) {
+		return;
+	}
+
+	if (route != -1) {// 反向代理 转发给路由表中的上游
+		proxy_start(client, route);
+		return;
+	}
+	if (fcgi_match(req)) {// 交给常驻的FastCGI worker
+		fcgi_start(client);
+		return;
+	}
+	if (cgi_match(req)) {// 动态内容交给CGI脚本
+		start_cgi(client);
+		return;
+	}
+
+	if (is_post) {// 处理Post请求 把整个请求(请求头和请求体)echo回去
+		// 放不进缓冲区的请求体还没收到 由echo_pump边收边发 缓冲区里先放响应头和已经收到的部分
+		size_t req_total_len = client->req_consumed;
+		off_t body_left = request_content_length(req) - (off_t)(req_total_len - req->head_len);
+		int header_len = snprintf(client->buf, server_options.buf_size,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: %s\r\n\r\n",
+			req_total_len + (size_t)body_left,
+			client->keep_alive ? "keep-alive" : "close");
+		// 缓冲区安全检查
+		if ((size_t)header_len + req_total_len > server_options.buf_size) {
+			set_error_response(client, 500, request_too_large);
+			client->keep_alive = 0;
+			return;
+		}
+		memcpy(client->buf + header_len, client->req_buf, req_total_len);
+		client->buf_len = header_len + req_total_len;
+		client->file_offset = -1;
+		client->status = 200;
+		client->echo_left = body_left;
+		return;
+	}
+
+	// 指标快照交给CPU工作线程 io.pending的时候和等文件任务一样 槽位和buf都不会被使用
+	if (task_enabled() && strcmp(path, METRICS_URI) == 0) {
+		client->buf_len = 0;
+		client->io.op = FILE_JOB_OPEN;
+		client->io.path = METRICS_URI;
+		client->io.pending = 1;
+		client->task.run = metrics_task_run;
+		client->task.done = metrics_task_done;
+		task_submit(&client->task);
+		return;
+	}
+	// 处理GET/HEAD stat和open可能要等磁盘 交给工作线程 完成后在file_io_done中接着调用respond_file
+	// 路径先放进写缓冲区 完成之前写缓冲区不会被使用
+	if (fileio_enabled() && req->uri_len < server_options.buf_size && strcmp(path, METRICS_URI) != 0) {
+		memcpy(client->buf, path, req->uri_len + 1);
+		client->buf_len = 0;
+		client->io.op = FILE_JOB_OPEN;
+		client->io.path = client->buf;
+		fileio_submit(&client->io);
+		return;
+	}
+	struct stat st;
+	char full_path[PATH_MAX];
+	const char *mime_type;
+	int file_fd = open_request_file(path, full_path, sizeof(full_path), &st, &mime_type);
+	char last_modified[128];
+	if (file_fd >= 0) get_file_mod_time_rfc1123(full_path, last_modified, sizeof(last_modified));
+	respond_file(client, file_fd, &st, mime_type, last_modified);
+}
+
+void account_sent(Client *client, size_t n) {
+	metrics_inc(COUNTER_BYTES_SENT, n);
+	client->out_unchecked += n;
+	rate_sent(client->rate_slot, client->listener, n);
+	metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, -(int64_t)n);
+	client->inflight -= n;
+	client->bytes_sent += n;
+}
+
+void start_chunked(Client *client, size_t head_len) {
+	client->chunked = 1;
+	client->head_left = head_len;
+	chunk_writer_init(&client->chunk);
+}
 
+// 分块编码的响应 响应头原样发送 之后写缓冲区中的数据每次作为一块 块头和数据一起写
+static int send_chunked(Client *client) {
+	while (client->buf_len > 0) {
+		ssize_t sent;
+		if (client->head_left > 0) {
+			sent = send(client->fd, client->buf, client->head_left, MSG_NOSIGNAL | MSG_MORE);
+			if (sent > 0) client->head_left -= sent;
+		} else {
+			sent = chunk_send(client->fd, &client->chunk, client->buf, client->buf_len);
+		}
+		if (sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		account_sent(client, sent);
+		if (!client->header_out) {
+			client->header_out = 1;
+			metrics_observe_since(PHASE_FIRST_BYTE, client->req_start_ns);
+		}
+		memmove(client->buf, client->buf + sent, client->buf_len - sent);
+		client->buf_len -= sent;
+	}
+	return 1;
+}
+
+int send_response_end(Client *client) {
+	if (!client->chunked) return 1;
+	return chunk_finish(client->fd, &client->chunk);
+}
+
+// 响应头和映射中剩下的文件内容一次sendmsg发出 返回值同send
+// 文件内容用MSG_ZEROCOPY发送时响应头先单独复制发出 buf会被复用 不能让内核引用
+static ssize_t send_mapped(Client *client) {
+	size_t file_left = client->file_size - client->file_offset;
+	int zerocopy = zerocopy_use(&client->zc, client->fd, client->map, file_left);
+	struct iovec iov[2];
+	int n = 0;
+	if (client->buf_len) iov[n++] = (struct iovec){ client->buf, client->buf_len };
+	if (!client->buf_len || !zerocopy) iov[n++] = (struct iovec){ (char *)client->map->data + client->file_offset, file_left };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+	if (client->buf_len && zerocopy) return sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_MORE);
+	if (!zerocopy) return sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+	if (sent >= 0) {
+		client->zc.sent++;
+	} else if (errno == ENOBUFS) {// 超过了optmem限制 这次复制发送
+		sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	}
+	return sent;
+}
+
+// 尽量把当前响应发送出去 缓冲区发完后继续从文件读下一块
+// 返回1表示发送完毕 0表示内核发送缓冲区满了需要等可写事件 -1表示出错
+int send_response(Client *client) {
+	// 第一次发送 统计响应状态码并把整个响应计入在途字节
+	if (!client->header_out) {
+		metrics_count_status(client->status);
+		client->inflight = client->buf_len;
+		if (client->file_offset != -1) client->inflight += client->file_size - client->file_offset;
+		metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, client->inflight);
+	}
+	if (client->chunked) return send_chunked(client);
+	for (;;) {
+		ssize_t sent = client->map ? send_mapped(client) : send(client->fd, client->buf, client->buf_len, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		log_debug("sent = %zd", sent);
+		account_sent(client, sent);
+		if (!client->header_out) {
+			client->header_out = 1;
+			metrics_observe_since(PHASE_FIRST_BYTE, client->req_start_ns);
+		}
+		if (client->map) {// 先发出去的是buf里的响应头 其余的是文件内容
+			size_t from_buf = MIN((size_t)sent, client->buf_len);
+			memmove(client->buf, client->buf + from_buf, client->buf_len - from_buf);
+			client->buf_len -= from_buf;
+			client->file_offset += sent - from_buf;
+			if (client->buf_len == 0 && client->file_offset >= client->file_size) return 1;
+			continue;
+		}
+		if ((size_t)sent < client->buf_len) {// 本次发送缓冲区没写完 下次从剩下的部分开始
+			memmove(client->buf, client->buf + sent, client->buf_len - sent);
+			client->buf_len -= sent;
+			continue;
+		}
+		client->buf_len = 0;
+		if (client->file_offset == -1 || client->file_offset >= client->file_size) return 1; // 全部发送完
+		// 缓冲区写完了 但文件还没发送完 读取下一块 要等磁盘时交给工作线程 先返回0
+		// 读取错误(或文件被截断)时响应头已经发出去了 只能关闭连接
+		int ret = read_file_chunk(client, client->buf, MIN(server_options.buf_size, client->file_size - client->file_offset));
+		if (ret != 1) return ret;
+	}
+}
+
+// 响应发送完毕(或发送出错) 记录访问日志 然后根据keep-alive决定关闭连接还是继续处理下一个请求
+void finish_response(int epoll_fd, Client *client, int ok) {
+	HttpRequest *req = &client->req;
+	metrics_observe_since(PHASE_LAST_BYTE, client->req_start_ns);
+	log_access(client_host(client), req->line, req->line_len, client->status, client->bytes_sent,
+			   req->headers[HEADER_REFERER].value, req->headers[HEADER_REFERER].len,
+			   req->headers[HEADER_USER_AGENT].value, req->headers[HEADER_USER_AGENT].len);
+	if (!ok || !client->keep_alive) {
+		close_client(epoll_fd, server.clients, server.fd_to_index, client->fd);
+		return;
+	}
+	// 重置响应状态
+	metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, -client->inflight);
+	client->inflight = 0;
+	client->responding = 0;
+	client->buf_len = 0;
+	client->file_offset = -1;
+	client->file_size = 0;
+	client->header_out = 0;
+	client->status = 0;
+	client->bytes_sent = 0;
+	client->chunked = 0;
+	CO_RESET(&client->respond);
+	if (client->file_fd != -1) {
+		close(client->file_fd);
+		client->file_fd = -1;
+	}
+	if (client->map) {// 还有MSG_ZEROCOPY的发送没完成时先不释放
+		zerocopy_retire(&client->zc, client->map);
+		client->map = NULL;
+	}
+	relay_release(&client->relay);
+	// 丢掉已经处理完的请求 后面pipeline的请求移到缓冲区开头 之后client->req不再有效
+	client->req_len -= client->req_consumed;
+	memmove(client->req_buf, client->req_buf + client->req_consumed, client->req_len);
+	client->req_consumed = 0;
+	memset(req, 0, sizeof(*req));
+	// 缓冲区中的下一个请求从现在开始计时
+	client->req_start_ns = client->req_len ? metrics_now_ns() : 0;
+}
+
+// CGI脚本出错或超时 还没发过响应头时改成错误响应 否则只能关闭连接
+// 脚本随之结束(proc.pid为0) cgi_pump不再等响应头 直接发buf里的错误响应
+static void cgi_fail(int epoll_fd, Client *client, int status, const char *response) {
+	CgiState *cgi = &client->cgi;
+	cgi_finish(epoll_fd, client, 1);
+	cgi->eof = 1;
+	client->keep_alive = 0;
+	if (client->header_out) return;
+	set_error_response(client, status, response);
+}
+
+// 请求体写给脚本 写出去的部分从req_buf中删掉 请求头保留到记录完访问日志
+static void cgi_write_body(int epoll_fd, Client *client) {
+	CgiState *cgi = &client->cgi;
+	CgiProcess *proc = &cgi->proc;
+	while (proc->in_fd != -1) {
+		size_t avail = MIN(client->req_len - client->req_consumed, (size_t)cgi->body_left);
+		if (cgi->body_left == 0) {
+			cgi_close_pipe(epoll_fd, &proc->in_fd);
+			break;
+		}
+		if (avail == 0) break;
+		char *body = client->req_buf + client->req_consumed;
+		ssize_t n = write(proc->in_fd, body, avail);
+		if (n > 0) {
+			memmove(body, body + n, client->req_len - client->req_consumed - n);
+			client->req_len -= n;
+			cgi->body_left -= n;
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		// 脚本不再读stdin 剩下的请求体没法确定边界 响应后关闭连接
+		cgi_close_pipe(epoll_fd, &proc->in_fd);
+		client->keep_alive = 0;
+	}
+}
+
+// 脚本stdout读到buf 直到buf里有limit字节 返回1表示管道已经读空(EAGAIN)
+// buf满了就不再读 脚本写满管道后自然阻塞 形成背压
+static int cgi_read_output(int epoll_fd, Client *client, size_t limit) {
+	CgiState *cgi = &client->cgi;
+	CgiProcess *proc = &cgi->proc;
+	while (proc->out_fd != -1 && client->buf_len < limit) {
+		ssize_t n = read(proc->out_fd, client->buf + client->buf_len, limit - client->buf_len);
+		if (n > 0) {
+			client->buf_len += n;
+			if (client->header_out) {// 第一次发送之后新增的字节单独计入在途
+				client->inflight += n;
+				metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, n);
+			}
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		// 读到EOF(或出错) 脚本输出结束
+		cgi_close_pipe(epoll_fd, &proc->out_fd);
+		cgi->eof = 1;
+	}
+	return 0;
+}
+
+// 挂起前设置客户端socket的事件: 一直读(检测断开 接收后续的请求体) sending时有待发数据要写
+static void cgi_wait(int epoll_fd, Client *client, int sending) {
+	uint32_t events = 0;
+	if (client->req_len < server_options.buf_size) events |= EPOLLIN;
+	if (sending && client->buf_len > 0) events |= EPOLLOUT;
+	set_interest(epoll_fd, client, events);
+}
+
+// 在客户端和CGI脚本之间搬运数据 客户端socket或者任意一个管道有事件时调用 不会阻塞
+// 请求体每次都先写给脚本 响应按"转换响应头 -> 边读边发响应体 -> 发结束块"写成协程 挂起的位置在cgi->co
+// 管道是边沿触发的 每次继续都读到EAGAIN或者buf满为止 buf发空之后接着读
+// 返回1表示响应已经发完 可以继续处理下一个请求 返回0表示还在进行中或者连接已经关闭
+static int cgi_pump(int epoll_fd, Client *client) {
+	CgiState *cgi = &client->cgi;
+	int fd = client->fd, ret = 0;
+	cgi_write_body(epoll_fd, client);
+	CO_BEGIN(&cgi->co);
+	// 响应头转换之前要给HTTP响应头留出空间 脚本出错或超时后buf里已经是错误响应
+	while (cgi->proc.pid != 0) {
+		cgi_read_output(epoll_fd, client, server_options.buf_size - CGI_HEADER_RESERVE);
+		int chunked = !cgi->head_only;
+		ret = cgi_translate_header(client->buf, &client->buf_len, server_options.buf_size, &client->keep_alive,
+								   &client->status, &(off_t){0}, &chunked);
+		if (ret == 0 && cgi->eof) ret = -1;
+		if (ret == -1) {
+			log_warn("bad cgi response: %.*s", (int)client->req.uri_len, client->req.uri);
+			cgi_fail(epoll_fd, client, 502, bad_gateway);
+			break;
+		}
+		if (ret == 1) {
+			if (chunked) start_chunked(client, (char *)memmem(client->buf, client->buf_len, "\r\n\r\n", 4) + 4 - client->buf);
+			if (cgi->head_only) {// HEAD只要响应头 丢掉响应体并结束脚本
+				char *head_end = memmem(client->buf, client->buf_len, "\r\n\r\n", 4);
+				client->buf_len = head_end + 4 - client->buf;
+				cgi_finish(epoll_fd, client, 0);
+				cgi->eof = 1;
+			}
+			break;
+		}
+		// 响应头还不完整 等脚本继续输出
+		cgi_wait(epoll_fd, client, 0);
+		CO_YIELD(&cgi->co, 0);
+	}
+	// 响应体 客户端发不动或者管道读空时挂起
+	for (;;) {
+		int drained = cgi_read_output(epoll_fd, client, server_options.buf_size);
+		if (client->buf_len > 0 && send_response(client) == -1) {
+			cgi_finish(epoll_fd, client, 1);
+			cgi->active = 0;
+			finish_response(epoll_fd, client, 0);
+			return 0;
+		}
+		if (cgi->eof && client->buf_len == 0) break;
+		if (drained || client->buf_len > 0) {
+			cgi_wait(epoll_fd, client, 1);
+			CO_YIELD(&cgi->co, 0);
+		}
+	}
+	// 输出全部发完 结束块还没发出去时等可写
+	while ((ret = send_response_end(client)) == 0) {
+		set_interest(epoll_fd, client, EPOLLOUT);
+		CO_YIELD(&cgi->co, 0);
+	}
+	CO_END(&cgi->co);
+	if (cgi->body_left > 0) client->keep_alive = 0; // 请求体没读完 无法继续解析后面的请求
+	cgi_finish(epoll_fd, client, 0);
+	cgi->active = 0;
+	finish_response(epoll_fd, client, ret == 1);
+	return client->fd == fd;
+}
+
+// 检查当前循环中超时的CGI脚本 只在有CGI运行时调用
+static void cgi_sweep(int epoll_fd) {
+	uint64_t now = metrics_now_ns();
+	for (int i = 0; i < server_options.max_clients && *server.cgi_active > 0; i++) {
+		Client *client = &server.clients[i];
+		if (client->fd == -1 || !client->cgi.active || client->cgi.proc.pid == 0) continue;
+		if (now < client->cgi.deadline_ns) continue;
+		log_warn("cgi timeout: %.*s", (int)client->req.uri_len, client->req.uri);
+		cgi_fail(epoll_fd, client, 504, gateway_timeout);
+		if (client->header_out) {// 响应已经发出一部分 只能关闭连接
+			client->cgi.active = 0;
+			finish_response(epoll_fd, client, 0);
+			continue;
+		}
+		cgi_pump(epoll_fd, client);
+	}
+}
 
-    printf("Server running on port %d (single-threaded epoll), author:shr1mp\n", *server.port);
+// 放不进缓冲区的POST请求体边收边回显 响应头和请求头已经在写缓冲区里
+// 启用splice时请求体socket→管道→socket都在内核中完成 否则直接收到写缓冲区再发出去
+// 返回1表示响应已经发完 可以继续处理下一个请求 返回0表示还在进行中或者连接已经关闭
+static int echo_pump(int epoll_fd, Client *client) {
+	int fd = client->fd;
+	int ret;
+	for (;;) {
+		// 和请求头一起收到的那部分请求体先挪到写缓冲区
+		size_t n = MIN(client->req_len - client->req_consumed, (size_t)client->echo_left);
+		n = MIN(n, server_options.buf_size - client->buf_len);
+		if (n > 0) {
+			char *body = client->req_buf + client->req_consumed;
+			memcpy(client->buf + client->buf_len, body, n);
+			memmove(body, body + n, client->req_len - client->req_consumed - n);
+			client->req_len -= n;
+			client->buf_len += n;
+			client->echo_left -= n;
+			if (client->header_out) {// 第一次发送之后新增的字节单独计入在途
+				client->inflight += n;
+				metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, n);
+			}
+		}
+		if (client->buf_len > 0) {
+			ret = send_response(client);
+			if (ret == 1) continue;
+			break;
+		}
+		if (client->relay.pending > 0) {// 管道里的请求体写回客户端
+			ssize_t k = relay_drain(&client->relay, fd);
+			if (k > 0) {
+				account_sent(client, k);
+				continue;
+			}
+			ret = k == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+			break;
+		}
+		if (client->echo_left == 0) {
+			ret = 1;
+			break;
+		}
+		if (client->req_len > client->req_consumed) continue;
+
+		// 继续从socket收请求体 拿不到管道时收到写缓冲区
+		ssize_t k;
+		if (relay_acquire(&client->relay) == 0) {
+			k = relay_fill(&client->relay, fd, MIN((off_t)RELAY_CHUNK, client->echo_left));
+		} else {
+			k = recv(fd, client->buf, MIN((off_t)server_options.buf_size, client->echo_left), 0);
+			if (k > 0) client->buf_len = k;
+		}
+		if (k > 0) {
+			metrics_inc(COUNTER_BYTES_RECV, k);
+			client->echo_left -= k;
+			client->inflight += k;
+			metrics_gauge_add(GAUGE_BYTES_IN_FLIGHT, k);
+			continue;
+		}
+		// 读到EOF说明客户端在请求体发完之前关闭了连接
+		ret = k == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		break;
+	}
+
+	if (ret != 0) {
+		finish_response(epoll_fd, client, ret == 1);
+		return ret == 1 && client->fd == fd;
+	}
+	// 有待发的数据时只等可写 否则只等请求体 两者不会同时需要
+	set_interest(epoll_fd, client, client->buf_len > 0 || client->relay.pending > 0 ? EPOLLOUT : EPOLLIN);
+	return 0;
+}
+
+// 内核发送队列里的字节数 同时更新GAUGE_OUTPUT_QUEUED
+// TCP只算还没发出去的(和TCP_NOTSENT_LOWAT一致) Unix socket是对端还没读走的
+static size_t sample_output(Client *client) {
+	int queued = 0;
+	unsigned long req = client->peer.sa.sa_family == AF_UNIX ? SIOCOUTQ : SIOCOUTQNSD;
+	if (ioctl(client->fd, req, &queued) == -1) queued = 0;
+	metrics_gauge_add(GAUGE_OUTPUT_QUEUED, (int64_t)queued - (int64_t)client->out_queued);
+	client->out_queued = queued;
+	client->out_unchecked = queued;
+	return queued;
 }
 
-void handle_events(){
+// 对端读得慢时 发送队列超过out_high就不再读新请求 不然会一直生成发不出去的响应
+// 发出的字节累计到out_high才查一次 大多数请求不多一次系统调用
+// TCP连接用TCP_NOTSENT_LOWAT让EPOLLOUT等到还没发出的字节少于out_low才到达
+static int output_backpressure(int epoll_fd, Client *client) {
+	int high = server_options.out_high;
+	if (high <= 0 || client->out_unchecked <= (size_t)high || sample_output(client) <= (size_t)high) return 0;
+	int low = server_options.out_low;
+	if (client->peer.sa.sa_family != AF_UNIX) setsockopt(client->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &low, sizeof(low));
+	client->out_paused = 1;
+	metrics_inc(COUNTER_OUTPUT_PAUSED, 1);
+	set_interest(epoll_fd, client, EPOLLOUT);
+	return 1;
+}
+
+// 暂停后第一次EPOLLOUT 恢复系统默认的TCP_NOTSENT_LOWAT
+// Unix socket没有低水位 可写时队列可能还在out_high以上 再发out_high字节之后才重新检查 不会反复暂停
+static void output_resume(Client *client) {
+	int unset = 0;
+	client->out_paused = 0;
+	if (client->peer.sa.sa_family != AF_UNIX) setsockopt(client->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unset, sizeof(unset));
+	sample_output(client);
+	client->out_unchecked = 0;
+}
+
+// 静态文件和固定的响应 按"等文件打开 -> 发送 -> 等读盘或者等可写 -> 再发送 -> 结束"顺序写成协程
+// 挂起的位置记在client->respond 工作线程完成(file_io_done)和EPOLLOUT都只是让它从挂起的地方继续
+// 返回1表示响应发完且连接还在 接着处理下一个请求 返回0表示挂起了或者连接已经关闭
+static int static_response(int epoll_fd, Client *client) {
+	FileJob *job = &client->io;
+	int ret = 0, fd = client->fd;
+	CO_BEGIN(&client->respond);
+	for (;;) {
+		// 打开文件或者读下一块还在工作线程中 这期间不关注任何事件
+		if (job->pending) {
+			set_interest(epoll_fd, client, 0);
+			CO_YIELD(&client->respond, 0);
+			if (job->pending) continue; // 不是file_io_done叫醒的
+			if (job->op == FILE_JOB_OPEN) {
+				respond_file(client, job->fd, &job->st, job->mime_type, job->last_modified);
+				continue; // 第一块可能也要等磁盘
+			}
+			if (job->ret > 0) {
+				client->buf_len += job->ret;
+				client->file_offset += job->ret;
+			} else if (!client->header_out) {// 第一块读取失败 还可以返回500
+				log_error("read file failed: %s", job->ret == -1 ? strerror(job->err) : "file truncated");
+				close(client->file_fd);
+				client->file_fd = -1;
+				set_error_response(client, 500, internal_error);
+			} else {
+				log_error("read file failed: %s", job->ret == -1 ? strerror(job->err) : "file truncated");
+				ret = -1;
+				break;
+			}
+		}
+		// 大多数响应一次就能发完 不需要再等一轮可写事件
+		ret = send_response(client);
+		if (ret != 0) break;
+		if (job->pending) continue;
+		set_interest(epoll_fd, client, EPOLLOUT);
+		CO_YIELD(&client->respond, 0);
+	}
+	CO_END(&client->respond);
+	finish_response(epoll_fd, client, ret == 1);
+	return client->fd == fd;
+}
+
+// 依次处理读缓冲区中的完整请求 pipeline的请求按顺序处理 前一个响应发送完才处理下一个
+// 每次最多处理server_options.max_pipeline个 剩下的等下一轮epoll_wait 避免一个连接占住事件循环
+void process_requests(int epoll_fd, Client *client) {
+	int handled = 0;
+	while (!client->responding) {
+		if (output_backpressure(epoll_fd, client)) return;
+		if (client->req_len == 0) {
+			set_interest(epoll_fd, client, EPOLLIN);
+			return;
+		}
+		// prior knowledge 连接一开始就是HTTP/2的连接前言
+		int preface = server_options.h2 && handled == 0 ? h2_preface(client->req_buf, client->req_len) : 0;
+		if (preface == -1) {
+			set_interest(epoll_fd, client, EPOLLIN);
+			return;
+		}
+		if (preface == 1) {
+			if (h2_start(client, 0) == -1) {
+				close_client(epoll_fd, server.clients, server.fd_to_index, client->fd);
+				return;
+			}
+			h2_handle(epoll_fd, client, EPOLLIN);
+			return;
+		}
+		if (handled == server_options.max_pipeline) {
+			// 连接一直可写 注册EPOLLOUT相当于排到本轮其他连接之后继续处理
+			set_interest(epoll_fd, client, EPOLLOUT);
+			return;
+		}
+		int head_len = parse_request(client->req_buf, client->req_len, &client->req);
+		if (head_len == 0) {
+			if (client->req_len < server_options.buf_size) {// 请求不完整时保持读取
+				set_interest(epoll_fd, client, EPOLLIN);
+				return;
+			}
+			// 缓冲区已满仍无完整头 无法再分辨请求边界 响应后关闭连接
+			set_error_response(client, 400, bad_request);
+			client->keep_alive = 0;
+			client->req_consumed = client->req_len;
+		} else {
+			off_t body_len = request_content_length(&client->req);
+			int te = client->req.headers[HEADER_TRANSFER_ENCODING].value != NULL;
+			if (body_len == -1 || (te && client->req.headers[HEADER_CONTENT_LENGTH].value)) {
+				// Content-Length格式错误/重复 或者和Transfer-Encoding同时出现 请求边界也无法确定
+				set_error_response(client, 400, bad_request);
+				client->keep_alive = 0;
+				client->req_consumed = client->req_len;
+			} else if (te) {// 请求体只按Content-Length划分 分块编码的请求体不知道在哪结束 不能当作下一个请求解析
+				set_error_response(client, 501, not_implemented);
+				client->keep_alive = 0;
+				client->req_consumed = client->req_len;
+			} else if (proxy_route(&client->req) != -1 || fcgi_match(&client->req) || cgi_match(&client->req)) {
+				// 代理/CGI/FastCGI的请求体边收边转发 不需要整个放进缓冲区
+				log_debug("Received cgi request:\n%.*s", head_len, client->req_buf);
+				metrics_inc(COUNTER_REQUESTS, 1);
+				metrics_observe_since(PHASE_HEADER_PARSE, client->req_start_ns);
+				client->req_consumed = head_len;
+				if (proxy_route(&client->req) != -1) client->proxy.body_left = body_len;
+				else if (fcgi_match(&client->req)) client->fcgi.body_left = body_len;
+				else client->cgi.body_left = body_len;
+				handle_request(client);
+				if (!client->cgi.active && !client->fcgi.active && !client->proxy.active) {// 没有转发出去 返回错误响应 跳过请求体
+					if ((size_t)(head_len + body_len) <= client->req_len) client->req_consumed += body_len;
+					else client->keep_alive = 0;
+					client->cgi.body_left = 0;
+					client->fcgi.body_left = 0;
+					client->proxy.body_left = 0;
+				}
+			} else if (head_len + body_len > server_options.buf_size &&
+					   client->req.method_len == 4 && memcmp(client->req.method, "POST", 4) == 0) {
+				// 放不进缓冲区的POST请求体不再拒绝 边收边回显
+				log_debug("Received request:\n%.*s", head_len, client->req_buf);
+				metrics_inc(COUNTER_REQUESTS, 1);
+				metrics_observe_since(PHASE_HEADER_PARSE, client->req_start_ns);
+				client->req_consumed = head_len;
+				handle_request(client);
+				if (client->echo_left == 0) client->keep_alive = 0; // 返回了错误响应 请求体没法跳过
+			} else if (head_len + body_len > server_options.buf_size) {// 请求体放不进缓冲区
+				set_error_response(client, 500, request_too_large);
+				client->keep_alive = 0;
+				client->req_consumed = client->req_len;
+			} else if ((size_t)(head_len + body_len) > client->req_len) {// 请求体还没收完
+				set_interest(epoll_fd, client, EPOLLIN);
+				return;
+			} else {
+				log_debug("Received request:\n%.*s", head_len, client->req_buf);
+				metrics_inc(COUNTER_REQUESTS, 1);
+				metrics_observe_since(PHASE_HEADER_PARSE, client->req_start_ns);
+				client->req_consumed = head_len + body_len;
+				handle_request(client);
+			}
+		}
+		if (client->h2) {// 升级到了HTTP/2 之后的数据都按帧处理
+			h2_handle(epoll_fd, client, EPOLLIN);
+			return;
+		}
+		handled++;
+		client->responding = 1;
+		if (client->cgi.active) {// CGI的响应随脚本输出陆续发送
+			if (cgi_pump(epoll_fd, client) == 1) continue;
+			return;
+		}
+		if (client->fcgi.active) {// FastCGI的响应随worker的STDOUT记录陆续发送
+			if (fcgi_pump(epoll_fd, client) == 1) continue;
+			return;
+		}
+		if (client->proxy.active) {// 上游的响应边收边发
+			if (proxy_pump(epoll_fd, client) == 1) continue;
+			return;
+		}
+		if (client->echo_left > 0) {// 请求体边收边回显
+			if (echo_pump(epoll_fd, client) == 1) continue;
+			return;
+		}
+
+		if (!static_response(epoll_fd, client)) return;
+	}
+}
+
+// 第li个监听socket可读 一次最多accept server_options.accept_batch个连接
+// accept4直接设置非阻塞 省去两次fcntl 客户端地址先原样保存 写日志时才格式化
+// 不接受的新连接 读掉已经到达的请求(不然close会发RST 对端可能收不到响应) 回503后关闭
+static void reject_connection(int sock) {
+	char scratch[4096];
+	while (recv(sock, scratch, sizeof(scratch), MSG_DONTWAIT) > 0) {}
+	if (send(sock, too_many_connections, sizeof(too_many_connections) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+		log_debug("send 503 failed: %s", strerror(errno));
+	}
+	close(sock);
+}
+
+static void accept_clients(int epoll_fd, int li) {
+	int sock = listener_fd(&listeners[li], server.loop);
+	Client *clients = server.clients;
+	int *fd_to_index = server.fd_to_index;
+	for (int n = 0; n < server_options.accept_batch; n++) {
+		uint64_t accept_start_ns = metrics_now_ns();
+		PeerAddr cli_addr;
+		socklen_t cli_len = sizeof(cli_addr);
+		int client_sock = accept4(sock, &cli_addr.sa, &cli_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue; // 连接在accept前被对端重置
+			// EAGAIN说明已经取完了(多个循环时也可能被别的循环取走) 其他错误输出日志
+			if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("accept failed: %s", strerror(errno));
+			return;
+		}
+
+		// 检查是否超过最大客户端数
+		if (*server.current_clients >= server_options.max_clients || client_sock >= *server.fd_table_size) {
+			log_warn("Too many clients, rejecting,client fd: %d", client_sock);
+			reject_connection(client_sock);
+			metrics_inc(COUNTER_REJECTED, 1);
+			continue;
+		}
+		// 来源IP或者监听socket的连接数超过限制
+		int rate_slot;
+		if (rate_connect(&cli_addr.sa, li, &rate_slot) == -1) {
+			log_debug("connection limit reached, rejecting fd: %d", client_sock);
+			reject_connection(client_sock);
+			metrics_inc(COUNTER_RATE_LIMITED, 1);
+			continue;
+		}
+
+		// 从空闲栈顶取一个槽位 O(1)
+		int client_index = server.free_slots[server_options.max_clients - *server.current_clients - 1];
+		(*server.current_clients)++;
+
+		// 初始化客户端信息
+		Client *client = &clients[client_index];
+		client->fd = client_sock;
+		client->peer = cli_addr;
+		if (listeners[li].family == AF_UNIX) client->peer.sa.sa_family = AF_UNIX; // Unix socket的对端地址没有意义 只记下类型
+		client->listener = li;
+		client->rate_slot = rate_slot;
+		client->out_unchecked = 0;
+		client->out_paused = 0;
+		CO_RESET(&client->respond);
+		client->ipstr[0] = '\0';
+		client->buf_len = 0;
+		client->req_len = 0;
+		client->req_consumed = 0;
+		client->responding = 0;
+		client->file_fd = -1;
+		client->file_offset = -1;
+		client->header_out = 0;
+		client->req_start_ns = 0;
+		client->inflight = 0;
+		client->status = 0;
+		client->bytes_sent = 0;
+		client->chunked = 0;
+		memset(&client->req, 0, sizeof(client->req));
+		fd_to_index[client_sock] = client_index;
+
+		log_debug("New client: %s:%d (fd=%d)", client_host(client), client_port(client), client_sock);
+
+		metrics_inc(COUNTER_ACCEPTED, 1);
+		metrics_gauge_add(GAUGE_OPEN_CONNECTIONS, 1);
+
+		// 监听可读事件
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = client_sock;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) == -1) {
+			log_error("epoll_ctl add failed: %s", strerror(errno));
+			close_client(epoll_fd, clients, fd_to_index, client_sock);
+			continue;
+		}
+		client->events = EPOLLIN;
+		metrics_observe_since(PHASE_ACCEPT, accept_start_ns);
+	}
+}
+
+// 排空时每轮调用 第一次从epoll中去掉监听socket(连接留给新进程或者不再接受)
+// 空闲的keep-alive连接直接关闭 HTTP/2连接发GOAWAY 返回1表示这个循环可以退出
+// 超过drain_timeout_ms还没结束的连接直接关闭
+static int drain_step(int epoll_fd) {
+	static __thread int listeners_removed;
+	int *fd_to_index = server.fd_to_index;
+	if (!listeners_removed) {
+		for (int i = 0; i < listener_count; i++) {
+			if (listeners[i].fd == -1) continue;
+			int fd = listener_fd(&listeners[i], server.loop);
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			fd_to_index[fd] = -1;
+		}
+		listeners_removed = 1;
+		lifecycle_listeners_removed();
+	}
+	if (lifecycle_drain_expired() && *server.current_clients > 0) {
+		log_warn("drain timeout, closing %d connection(s) in progress", *server.current_clients);
+		for (int i = 0; i < server_options.max_clients && *server.current_clients > 0; i++) {
+			if (server.clients[i].fd != -1) close_client(epoll_fd, server.clients, fd_to_index, server.clients[i].fd);
+		}
+	}
+	for (int i = 0; i < server_options.max_clients && *server.current_clients > 0; i++) {
+		Client *client = &server.clients[i];
+		if (client->fd == -1) continue;
+		if (client->h2) {
+			h2_drain(epoll_fd, client);
+		} else if (!client->responding && client->req_len == 0 && !client->cgi.active && !client->fcgi.active &&
+				   !client->proxy.active && client->echo_left == 0 && client->relay.pending == 0) {
+			close_client(epoll_fd, server.clients, fd_to_index, client->fd);
+		}
+	}
+	int empty = *server.current_clients == 0 && *server.cgi_active == 0 && fcgi_pending() == 0 && proxy_pending() == 0;
+	return lifecycle_loop_done(empty);
+}
+
+// 工作线程完成了client的打开/读文件任务 接着生成或者发送响应
+static void file_io_done(int epoll_fd, Client *client) {
+	FileJob *job = &client->io;
+	job->pending = 0;
+	if (client->fd == -1) {// 等待期间连接已经关闭 槽位现在才能重用
+		if (job->op == FILE_JOB_OPEN && job->fd >= 0) close(job->fd);
+		if (client->file_fd != -1) {
+			close(client->file_fd);
+			client->file_fd = -1;
+		}
+		release_slot(client - server.clients);
+		return;
+	}
+	if (static_response(epoll_fd, client)) process_requests(epoll_fd, client);
+}
+
+int handle_events(){
 	// 取出服务器变量
 	int epoll_fd = *server.epoll_fd;
-	int sock = *server.sock;
 	int *fd_to_index = server.fd_to_index;
-	int current_clients = *server.current_clients;
-	struct epoll_event ev = *server.ev;
 	struct epoll_event *events = server.events;
 	Client *clients = server.clients;
 
-	
-	// 监听事件发生 并调用对应的处理器
-	int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+	// 监听事件发生 并调用对应的处理器 有CGI/FastCGI/代理请求在进行(或者有脚本还没回收)时每秒醒来检查一次超时
+	// 排空时每DRAIN_POLL_MS检查一次连接是否都结束了
+	int timed = *server.cgi_active > 0 || cgi_exiting() > 0 || fcgi_pending() > 0 || proxy_pending() > 0;
+	int draining = atomic_load_explicit(&server_draining, memory_order_relaxed);
+	int nfds = epoll_wait(epoll_fd, events, server_options.max_events, draining ? DRAIN_POLL_MS : timed ? 1000 : -1);
         for (int i = 0; i < nfds; i++) {
             int fd = events[i].data.fd;
-            
+
+			int idx = fd_to_index[fd];
+			if (idx == FD_INDEX_CONTROL) {// 信号 唤醒 升级通知
+				lifecycle_handle(epoll_fd, fd_to_index, fd);
+				continue;
+			}
+			if (idx == FD_INDEX_IO) {// 工作线程完成了文件任务
+				for (FileJob *job = fileio_completed(), *next; job; job = next) {
+					next = job->next;
+					file_io_done(epoll_fd, job->owner);
+				}
+				continue;
+			}
+			if (idx == FD_INDEX_TASK) {// CPU工作线程完成了任务
+				task_complete(epoll_fd);
+				continue;
+			}
             // 新客户端连接 当服务端socket被epoll_wait返回时(即可读时) 注意 有连接处于keep-alive状态会使得epoll每次都返回服务端socket的fd
-            if (fd == sock) {
-                struct sockaddr_in cli_addr;
-                socklen_t cli_len = sizeof(cli_addr);
-                int client_sock = accept(sock, (struct sockaddr*)&cli_addr, &cli_len);
-                
-                if (client_sock == -1) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK){// 如果是keep-alive，accept会返回这两个状态 直接继续循环就可以
-						continue;
-					}
-					// 是新连接 如果连接错误输出错误日志
-                    perror("accept failed");
-                    continue;
-                }
-
-                // 检查是否超过最大客户端数
-                if (current_clients >= MAX_CLIENTS) {
-                    fprintf(stderr, "Too many clients, rejecting,client fd: %d\n", client_sock);
-                    close(client_sock);
-                    continue;
-                }
-
-                // 找到空闲的客户端槽位
-                int client_index = -1;
-                for (int j = 0; j < MAX_CLIENTS; j++) {
-                    if (clients[j].fd == -1) {
-                        client_index = j;
-                        break;
-                    }
-                }
-
-                if (client_index == -1) {
-                    fprintf(stderr, "No available client slot\n");
-                    close(client_sock);
-                    continue;
-                }
-
-                // 初始化客户端信息
-                set_nonblocking(client_sock);
-                Client *client = &clients[client_index];
-                client->fd = client_sock;
-                client->buf_len = 0;
-				client->temp_request_buf_on = 0;
-                inet_ntop(AF_INET, &cli_addr.sin_addr, client->ipstr, INET_ADDRSTRLEN);// 获取IP地址并设置
-                client->port = ntohs(cli_addr.sin_port);// 获取端口并设置
-                fd_to_index[client_sock] = client_index; // fd会重复利用 这里应该是不会越界 fd_to_index的大小已经是两倍
-                current_clients++;
-
-                printf("New client: %s:%d (fd=%d)\n", client->ipstr, client->port, client_sock);
-
-                // 监听可读事件
-                ev.events = EPOLLIN;
-                ev.data.fd = client_sock;
-                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev);
+            if (idx <= FD_INDEX_LISTENER(0)) {
+				accept_clients(epoll_fd, FD_INDEX_LISTENER(0) - idx);
+                continue;
             }
-            // 客户端可读事件
-            else if (events[i].events & EPOLLIN) {
-				int idx = fd_to_index[fd];
-				Client *client = &clients[idx];
-				ssize_t readret = recv(fd, client->buf + client->buf_len, BUF_SIZE - client->buf_len, 0);
-				int request_count = 0;
-				if (readret > 0) {
-					client->buf_len += readret;
-					client->buf[client->buf_len] = '\0';
-			
-					// 混合处理逻辑核心
-					char *current_ptr = client->buf;
-					
-					// 循环检测完整请求头
-					while ((request_count < MAX_PIPELINE_REQUESTS) && 
-						  (current_ptr = strstr(current_ptr, "\r\n\r\n"))) {
-						request_count++;
-						current_ptr += 4; // 移动到下一个请求起始位置
-					}
-				}else if (readret <= 0 && errno != EAGAIN) { // 没有能读到的了 关闭连接
+			if (idx <= FD_INDEX_PROXY(0)) {// 空闲池中的上游连接
+				proxy_handle_idle(epoll_fd, FD_INDEX_PROXY(0) - idx, fd);
+				continue;
+			}
+			if (idx <= FD_INDEX_FCGI(0)) {// 到FastCGI worker的连接
+				fcgi_handle_conn(epoll_fd, FD_INDEX_FCGI(0) - idx, events[i].events);
+				continue;
+			}
+			if (idx == -1 || idx >= server_options.max_clients) continue;
+			Client *client = &clients[idx];
+			if (client->h2 && fd == client->fd) {// HTTP/2连接的所有事件交给h2_handle
+				h2_handle(epoll_fd, client, events[i].events);
+				continue;
+			}
+			// MSG_ZEROCOPY的完成通知也报告为EPOLLERR 读完通知后socket没有出错就当作没有这个事件
+			if (fd == client->fd && (events[i].events & EPOLLERR) && client->zc.state != 0) {
+				if (zerocopy_reap(&client->zc, fd) == -1) {
 					close_client(epoll_fd, clients, fd_to_index, fd);
-					clients[idx].fd = -1;
-					current_clients--;
-				}
-				if (request_count > 1)// pipeline请求 新逻辑
-				{
-					printf("Pipeline %d requests...\n",request_count);
-					char *current_ptr = client->buf;
-					// 建立缓冲区 存储每个请求
-					// char *pipeline_requests = malloc(client->buf_len + request_count);
-					char *pipeline_requests = malloc(client->buf_len + request_count);
-					char *pipeline_requests_ptr = pipeline_requests;
-					int temp = request_count;
-					// 一个一个把请求放在缓冲区中 这里使用pipeline_requests_ptr来迭代处理
-					while (temp-- > 0){
-						if(temp == request_count - 1 && client->temp_request_buf_on == 1){// 第一次的pipeline请求 并且上次的请求没有处理完(开启了临时请求缓冲区)
-							printf("\n\n\n\n\n\n\nUSE TEMPBUF\n\n\n\n\n\n\n\n");
-							// 将上次未处理完的内容填充到client->buf的前端
-							memmove(client->buf + client->temp_request_buf_size,client->buf, BUF_SIZE - client->temp_request_buf_size);
-							memcpy(client->buf,client->temp_request_buf,client->temp_request_buf_size);
-						}
-						char *request_end = strstr(current_ptr, "\r\n\r\n"); // 获取当前请求
-						if (!request_end) break;
-
-						// 计算单个请求长度
-						size_t request_len = request_end - current_ptr + 4;
-
-						// 生成独立请求缓冲区
-						char *single_request = malloc(request_len + 1);
-						memcpy(single_request, current_ptr, request_len);
-						single_request[request_len] = '\0';
-
-						// 将独立请求缓冲区中的内容放在pipeline_requests中
-						memcpy(pipeline_requests_ptr, single_request, request_len + 1);
-
-						// 移动处理指针
-						current_ptr += request_len;
-						pipeline_requests_ptr += request_len;
-						// 存储这个请求的大小
-						client->last_request_len = request_len;
-						// 释放内存
-						free(single_request);
-					}
-					// 处理完毕后 看看后面是否还有多余的没解析完的请求
-					if(strstr(current_ptr,"\r\n")){
-						printf("\n\n\n\n\n\n\nTEMP BUF ON...\n\n\n\n\n\n\n");
-						// 启用临时缓冲区
-						client->temp_request_buf_on = 1;
-						// 记录多余内容的大小
-						int exceeded_size = BUF_SIZE - (current_ptr - client->buf);
-						client->temp_request_buf_size = exceeded_size;
-						// 把多余的请求内容放在临时缓冲区
-						memcpy(client->temp_request_buf, current_ptr, exceeded_size);
-
-					}
-
-					// printf("pipeline_requests: \n %s \n",pipeline_requests);
-					// 一个一个处理请求 这里使用pipeline_requests_ptrr来迭代处理
-					char* pipeline_requests_ptrr = pipeline_requests;
-					client->file_offset = -1; // 设置为一次可以全发送完
-					char* client_response_buf = malloc(BUF_SIZE);
-					int client_response_buf_len = 0;
-					char* client_response_buf_ptr = client_response_buf;
-					
-					int total_count = request_count;
-					while(request_count-- > 0){
-						char* request_start = pipeline_requests_ptrr;
-						char* request_end = strstr(pipeline_requests_ptrr,"\r\n\r\n");
-						if (!request_end)
-						{
-							break;
-						}
-						
-						int request_len = request_end - request_start + 4;
-						*request_end = '\0';
-						printf("request %d is:\n%s\n",total_count - request_count,request_start);
-						*request_end = '\r';
-						// 开始处理请求
-							// 严格解析请求行
-							char *line_end = strstr(request_start, "\r\n");
-							if (!line_end) {// 找不到请求行
-								size_t resp_len = strlen(bad_request);
-									// 将错误响应写入缓冲区
-									// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-									if (client_response_buf_len + resp_len > BUF_SIZE) {
-										client_response_buf_len = BUF_SIZE;
-										client_response_buf[BUF_SIZE] = '\0';
-										// 切换为写事件
-										ev.events = EPOLLOUT;
-										ev.data.fd = fd;
-										if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-											perror("epoll_ctl");
-										}
-										continue;// 跳过后续while(1)中的处理
-
-									}
-									pipeline_requests_ptrr += request_len;
-									// 还没到缓冲区大小限制
-									memcpy(client_response_buf_ptr, bad_request, resp_len);
-									client_response_buf_len += resp_len;
-									client_response_buf_ptr += resp_len;
-									// printf("client_response_buf1: \n%s\n",client_response_buf);
-									continue;;// 跳过后续while(1)中的处理
-									
-							}
-							// 截断协议并验证：这里先只验证 路径 和 协议
-							// ------------------------开始验证---------------------------------
-							*line_end = '\0';// 截断协议用于下面验证
-
-							// 分割请求行各部分
-							char *method_end0 = strchr(request_start, ' ');
-							char *path_start0 = method_end0 ? method_end0 + 1 : NULL;
-							char *path_end0 = strchr(method_end0 ? method_end0 + 1 : request_start, ' ');
-							char *proto_start0 = path_end0 ? path_end0 + 1 : NULL;
-
-							// 验证请求行基本结构
-							if (!method_end0 || !path_end0 || !proto_start0 || // 校验是否有空格分割的三个部分
-								(proto_start0 - client->buf) >= BUF_SIZE ||  // 防止越界
-								strncmp(path_start0, "/", 1) != 0 // 校验路径以 / 开头
-							) {
-								size_t resp_len = strlen(bad_request);
-								// 将错误响应写入缓冲区
-								// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-								if (client_response_buf_len + resp_len > BUF_SIZE) {
-									client_response_buf_len = BUF_SIZE;
-									client_response_buf[BUF_SIZE] = '\0';
-									// 切换为写事件
-									ev.events = EPOLLOUT;
-									ev.data.fd = fd;
-									if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-										perror("epoll_ctl");
-									}
-									// printf("client_response_buf2: \n%s\n",client_response_buf);
-									continue;// 跳过后续while(1)中的处理
-
-								}
-								pipeline_requests_ptrr += request_len;
-								// 还没到缓冲区大小限制
-								memcpy(client_response_buf_ptr, bad_request, resp_len);
-								client_response_buf_len += resp_len;
-								client_response_buf_ptr += resp_len;
-								continue;// 跳过后续while(1)中的处理
-							}
-
-							*line_end = '\r';// 把截断的协议字符串复原
-							// ------------------------结束验证---------------------------------
-							// 提取path:
-							// 提取路径
-							size_t path_len = path_end0 - path_start0;
-							char *path = malloc(path_len + 1);  // +1 为了结尾的\0
-							memcpy(path, path_start0, path_len);
-							path[path_len] = '\0';  // 结束
-							
-							// 验证路径合法性
-							if (strstr(path, "..")) {
-								size_t resp_len = strlen(bad_request);
-								// 将错误响应写入缓冲区
-								// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-								if (client_response_buf_len + resp_len > BUF_SIZE) {
-									client_response_buf_len = BUF_SIZE;
-									client_response_buf[BUF_SIZE] = '\0';
-									// 切换为写事件
-									ev.events = EPOLLOUT;
-									ev.data.fd = fd;
-									if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-										perror("epoll_ctl");
-									}
-									// printf("client_response_buf3: \n%s\n",client_response_buf);
-									continue;// 跳过后续while(1)中的处理
-
-								}
-								pipeline_requests_ptrr += request_len;
-								// 还没到缓冲区大小限制
-								memcpy(client_response_buf_ptr, bad_request, resp_len);
-								client_response_buf_len += resp_len;
-								client_response_buf_ptr += resp_len;
-								// printf("client_response_buf4: \n%s\n",client_response_buf);
-								continue;// 跳过后续while(1)中的处理
-							}
-							// 方法截断并验证
-							if (!method_end0) {
-								size_t resp_len = strlen(bad_request);
-								// 将错误响应写入缓冲区
-								// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-								if (client_response_buf_len + resp_len > BUF_SIZE) {
-									client_response_buf_len = BUF_SIZE;
-									client_response_buf[BUF_SIZE] = '\0';
-									// 切换为写事件
-									ev.events = EPOLLOUT;
-									ev.data.fd = fd;
-									if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-										perror("epoll_ctl");
-									}
-									// printf("client_response_buf5: \n%s\n",client_response_buf);
-									continue;// 跳过后续while(1)中的处理
-
-								}
-								pipeline_requests_ptrr += request_len;
-								// 还没到缓冲区大小限制
-								memcpy(client_response_buf_ptr, bad_request, resp_len);
-								client_response_buf_len += resp_len;
-								client_response_buf_ptr += resp_len;
-								// printf("client_response_buf6: \n%s\n",client_response_buf);
-								continue;// 跳过后续while(1)中的处理
-							}
-							// 提取方法（安全拷贝）
-							char method[16] = {0};
-							strncpy(method, request_start, method_end0 - request_start);
-							method[15] = '\0'; // 强制截断防止溢出
-							// 方法验证
-							if (strcmp(method, "GET") != 0 && 
-								strcmp(method, "HEAD") != 0 && 
-								strcmp(method, "POST") != 0) 
-							{
-								size_t resp_len = strlen(not_implemented);
-								// 将错误响应写入缓冲区
-								// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-								if (client_response_buf_len + resp_len > BUF_SIZE) {
-									client_response_buf_len = BUF_SIZE;
-									client_response_buf[BUF_SIZE] = '\0';
-									// 切换为写事件
-									ev.events = EPOLLOUT;
-									ev.data.fd = fd;
-									if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-										perror("epoll_ctl");
-									}
-									// printf("client_response_buf7: \n%s\n",client_response_buf);
-									continue;// 跳过后续while(1)中的处理
-
-								}
-								pipeline_requests_ptrr += request_len;
-								// 还没到缓冲区大小限制
-								memcpy(client_response_buf_ptr, not_implemented, resp_len);
-								client_response_buf_len += resp_len;
-								client_response_buf_ptr += resp_len;
-								// printf("client_response_buf8: \n%s\n",client_response_buf);
-								continue;// 跳过后续while(1)中的处理
-							}
-						
-
-							// 严格协议版本检查
-							char *method_end = strchr(request_start, ' ');
-							char *path_start = method_end ? method_end + 1 : NULL;
-							char *path_end = path_start ? strchr(path_start, ' ') : NULL;
-							char *proto_start = path_end ? path_end + 1 : NULL;
-							if (!proto_start || !line_end || (line_end - proto_start) < 8 || 
-							strncmp(proto_start, "HTTP/1.1", 8) != 0 || 
-							((line_end - proto_start) > 8  && (proto_start[8] != '\r'))) {
-									// 协议版本不是 HTTP/1.1
-									if (strstr(request_start, "HTTP/")) {
-										size_t resp_len = strlen(v_not_supported);
-										// 将错误响应写入缓冲区
-										// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-										if (client_response_buf_len + resp_len > BUF_SIZE) {
-											printf("error6\n");
-											client_response_buf_len = BUF_SIZE;
-											client_response_buf[BUF_SIZE] = '\0';
-											// 切换为写事件
-											ev.events = EPOLLOUT;
-											ev.data.fd = fd;
-											if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-												perror("epoll_ctl");
-											}
-											// printf("client_response_buf9: \n%s\n",client_response_buf);
-											continue;// 跳过后续while(1)中的处理
-
-										}
-										pipeline_requests_ptrr += request_len;
-										// 还没到缓冲区大小限制
-										memcpy(client_response_buf_ptr, v_not_supported, resp_len);
-										client_response_buf_len += resp_len;
-										client_response_buf_ptr += resp_len;
-										// printf("client_response_buf10: \n%s\n",client_response_buf);
-										continue;// 跳过后续while(1)中的处理
-									}else {
-										size_t resp_len = strlen(not_implemented);
-										// 将错误响应写入缓冲区
-										// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-										if (client_response_buf_len + resp_len > BUF_SIZE) {
-											printf("error7\n");
-											client_response_buf_len = BUF_SIZE;
-											client_response_buf[BUF_SIZE] = '\0';
-											// 切换为写事件
-											ev.events = EPOLLOUT;
-											ev.data.fd = fd;
-											if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-												perror("epoll_ctl");
-											}
-											// printf("client_response_buf11: \n%s\n",client_response_buf);
-											continue;// 跳过后续while(1)中的处理
-
-										}
-										pipeline_requests_ptrr += request_len;
-										// 还没到缓冲区大小限制
-										memcpy(client_response_buf_ptr, not_implemented, resp_len);
-										client_response_buf_len += resp_len;
-										client_response_buf_ptr += resp_len;
-										// printf("client_response_buf12: \n%s\n",client_response_buf);
-										continue;// 跳过后续while(1)中的处理
-									}
-							}
-							// 读取请求头
-							char q_headers[BUF_SIZE];
-							int q_headers_len;
-							if (request_end) {
-								// 计算请求头长度（包含最后的 \r\n\r\n）
-								size_t headers_total_len = request_end - request_start + 4;
-								
-								// 将头信息复制到专用缓冲区
-								memcpy(q_headers, request_start, headers_total_len);
-								q_headers_len = headers_total_len;
-								q_headers[q_headers_len] = '\0';
-								
-								// // 剩余数据是请求体（如果有）这里假定pipeline请求没有请求体
-								// size_t body_len = request_end - headers_total_len;
-								// memmove(request_start, request_start + headers_total_len, body_len);
-								// client_response_buf_len= body_len;
-							}
-
-							char query_headers[4096]; // 获取请求头中的keep_alive部分
-							memcpy(query_headers, q_headers, q_headers_len + 1); // +1 复制终止符
-							size_t copy_len = MIN(q_headers_len, sizeof(query_headers)-1);
-							query_headers[copy_len] = '\0';
-							char *connection = get_header_value(query_headers, "Connection");
-							client->keep_alive = (connection && strcasecmp(connection, "keep-alive") == 0);
-							if(!connection){// 如果没有 默认关闭连接
-								client->keep_alive = 0;
-							}
-							// 构造响应printf("New client: %s:%d (fd=%d)\n", client->ipstr, client->port, client_sock);
-							printf("Generate the response to client %s:%d%s(fd=%d)\n", client->ipstr, client->port, path, client->fd);
-							// 处理GET/HEAD 
-							if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
-								// 获取文件元数据
-								struct stat st;
-								char full_path[PATH_MAX];
-
-								if (strcmp(path, "/") == 0) {  
-									// 访问根目录，返回 index.html  
-									snprintf(full_path, sizeof(full_path), "%s/index.html", ROOT_DIR);  
-								} else {   
-									// 防止目录穿越攻击在之前读出path的时候已经做过
-									snprintf(full_path, sizeof(full_path), "%s%s", ROOT_DIR, path);  
-								}  
-
-								// 使用 stat 判断文件是否存在且是普通文件  
-								if (stat(full_path, &st) == -1 || !S_ISREG(st.st_mode)) {  
-									printf("file not found\n"); // 记录日志
-									size_t resp_len = strlen(not_found);
-										// 将错误响应写入缓冲区
-										// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-										if (client_response_buf_len + resp_len > BUF_SIZE) {;
-											client_response_buf_len = BUF_SIZE;
-											client_response_buf[BUF_SIZE] = '\0';
-											// 切换为写事件
-											ev.events = EPOLLOUT;
-											ev.data.fd = fd;
-											if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-												perror("epoll_ctl");
-											}
-											// printf("client_response_buf13: \n%s\n",client_response_buf);
-											continue;// 跳过后续while(1)中的处理
-
-										}
-										pipeline_requests_ptrr += request_len;
-										// 还没到缓冲区大小限制
-										memcpy(client_response_buf_ptr, not_found, resp_len);
-										client_response_buf_len += resp_len;
-										client_response_buf_ptr += resp_len;
-										// printf("client_response_buf14: \n%s\n",client_response_buf);
-										continue;// 跳过后续while(1)中的处理
-									
-								}  
-
-								// 打开文件
-								int file_fd = open(full_path, O_RDONLY);
-								if (file_fd == -1) {// 打开失败 返回错误
-									printf("file not found\n"); // 记录日志
-									size_t resp_len = strlen(internal_error);
-										// 将错误响应写入缓冲区
-										// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-										if (client_response_buf_len + resp_len > BUF_SIZE) {
-											client_response_buf_len = BUF_SIZE;
-											client_response_buf[BUF_SIZE] = '\0';
-											// 切换为写事件
-											ev.events = EPOLLOUT;
-											ev.data.fd = fd;
-											if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-												perror("epoll_ctl");
-											}
-											// printf("client_response_buf15: \n%s\n",client_response_buf);
-											continue;// 跳过后续while(1)中的处理
-
-										}
-										pipeline_requests_ptrr += request_len;
-										// 还没到缓冲区大小限制
-										memcpy(client_response_buf_ptr, internal_error, resp_len);
-										client_response_buf_len += resp_len;
-										client_response_buf_ptr += resp_len;
-										// printf("client_response_buf16: \n%s\n",client_response_buf);
-										continue;// 跳过后续while(1)中的处理
-								}
-
-								
-								// 使用文件描述符获取状态
-								if (fstat(file_fd, &st) == -1) { // 获取失败
-									printf("file not found\n"); // 记录日志
-									size_t resp_len = strlen(internal_error);
-										// 将错误响应写入缓冲区
-										// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-										if (client_response_buf_len + resp_len > BUF_SIZE) {
-											printf("error10\n");
-											client_response_buf_len = BUF_SIZE;
-											client_response_buf[BUF_SIZE] = '\0';
-											// 切换为写事件
-											ev.events = EPOLLOUT;
-											ev.data.fd = fd;
-											if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-												perror("epoll_ctl");
-											}
-											// printf("client_response_buf17: \n%s\n",client_response_buf);
-											continue;// 跳过后续while(1)中的处理
-
-										}
-										pipeline_requests_ptrr += request_len;
-										// 还没到缓冲区大小限制
-										memcpy(client_response_buf_ptr, internal_error, resp_len);
-										client_response_buf_len += resp_len;
-										client_response_buf_ptr += resp_len;
-										// printf("client_response_buf18: \n%s\n",client_response_buf);
-										continue;// 跳过后续while(1)中的处理
-								}
-
-								// 动态构造响应头
-								char headers[512];
-								// 获取文件信息
-								const char *mime_type = get_mime_type(full_path);
-								// 获取时间信息
-								char date_buf[64];
-								get_current_time_rfc1123(date_buf, sizeof(date_buf));
-								char last_modified[128];
-								get_file_mod_time_rfc1123(full_path, last_modified, sizeof(last_modified));
-								const char *connection_header = client->keep_alive ? "keep-alive" : "close";
-								int headers_len = snprintf(headers, sizeof(headers),
-									"HTTP/1.1 200 OK\r\n"
-									"Server: liso/1.1\r\n"
-									"Date: %s\r\n"
-									"Content-Type: %s\r\n"
-									"Content-Length: %ld\r\n"
-									"Last-Modified: %s\r\n"
-									"Connection: %s\r\n\r\n",  // 动态设置
-									date_buf,
-									mime_type,
-									st.st_size,
-									last_modified,
-									connection_header);
-								// 处理响应头缓冲区溢出
-								if (headers_len >= (int)sizeof(headers)) {
-									printf("file not found\n"); // 记录日志
-									size_t resp_len = strlen(internal_error);
-										// 将错误响应写入缓冲区
-										// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-										if (client_response_buf_len + resp_len > BUF_SIZE) {
-											printf("error11\n");
-											client_response_buf_len = BUF_SIZE;
-											client_response_buf[BUF_SIZE] = '\0';
-											// 切换为写事件
-											ev.events = EPOLLOUT;
-											ev.data.fd = fd;
-											if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-												perror("epoll_ctl");
-											}
-											// printf("client_response_buf19: \n%s\n",client_response_buf);
-											continue;// 跳过后续while(1)中的处理
-
-										}
-										pipeline_requests_ptrr += request_len;
-										// 还没到缓冲区大小限制
-										memcpy(client_response_buf_ptr, internal_error, resp_len);
-										client_response_buf_len += resp_len;
-										client_response_buf_ptr += resp_len;
-										// printf("client_response_buf20: \n%s\n",client_response_buf);
-										continue;// 跳过后续while(1)中的处理
-								}
-								// 填充响应缓冲区
-								memcpy(client_response_buf_ptr, headers, headers_len);
-								client_response_buf_len += headers_len;
-								client_response_buf_ptr += headers_len;
-							
-
-								// GET方法需要发送文件内容（HEAD不发送）
-								// 这里管线化比较难实现 直接不返回文件
-								// if (strcmp(method, "GET") == 0) {
-								// 	// 先设置文件状态
-								// 	client->file_fd = file_fd;
-								// 	client->file_offset = 0;
-								// 	client->file_size = st.st_size;
-								// 	client->header_out = 0;
-									
-								// 	// 开始读取
-								// 	ssize_t bytes_read = pread(file_fd, client_response_buf_ptr + headers_len, MIN(BUF_SIZE - headers_len, client->file_size), client->file_offset);
-								// 	if (bytes_read > 0) { // 读取成功 
-								// 		if(client->file_size <= BUF_SIZE - headers_len){// 文件大小比缓冲区大小要小
-								// 			client->buf_len += bytes_read; // 直接加上 然后设置offset为-1 表示已经发送完 在写事件时直接发送即可
-								// 			client->file_offset = -1;
-								// 		}else{// 文件大小比缓冲区大小要大 设置偏移量为读取的大小，并在可写事件时继续发送
-								// 			// 不做处理 等可写时发送
-								// 		}
-								// 	} else if (bytes_read == -1) {// 读取文件失败
-								// 		size_t resp_len = strlen(internal_error);
-								// 		// 将错误响应写入缓冲区
-								// 		// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-								// 		if (client_response_buf_len + resp_len > BUF_SIZE) {
-								// 			printf("error12\n");
-								// 			client_response_buf_len = BUF_SIZE;
-								// 			client_response_buf[BUF_SIZE] = '\0';
-								// 			// 切换为写事件
-								// 			ev.events = EPOLLOUT;
-								// 			ev.data.fd = fd;
-								// 			if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								// 				perror("epoll_ctl");
-								// 			}
-								// 			// printf("client_response_buf21: \n%s\n",client_response_buf);
-								// 			continue;// 跳过后续while(1)中的处理
-
-								// 		}
-								// 		pipeline_requests_ptrr += request_len;
-								// 		// 还没到缓冲区大小限制
-								// 		memcpy(client_response_buf_ptr, internal_error, resp_len);
-								// 		client_response_buf_len += resp_len;
-								// 		client_response_buf_ptr += resp_len;
-								// 		// printf("client_response_buf22: \n%s\n",client_response_buf);
-								// 		continue;// 跳过后续while(1)中的处理
-								// 	}
-								// }else{// HEAD 不返回文件
-								// 	client->file_offset = -1;
-								// }
-								client->file_offset = -1;
-							}else if(strcmp(method, "POST") == 0){// 处理Post请求 直接echo回去
-								// TODO: 
-								size_t req_total_len = request_end - request_start + 4; // 包含\r\n\r\n
-								char header[128];
-								int header_len = snprintf(header, sizeof(header),
-									"HTTP/1.1 200 OK\r\n"
-									"Content-Length: %zd\r\n"
-									"Connection: close\r\n\r\n",  // 简化处理，每次关闭连接
-									req_total_len);
-						
-								// 移动原始请求数据(放在响应头后)
-								memmove(client->buf + header_len, client->buf, req_total_len);
-								// 添加响应头
-								memcpy(client->buf, header, header_len);
-								// 更新缓冲区长度
-								client->buf_len = header_len + req_total_len;
-								
-								
-							}else{// 出错
-								size_t resp_len = strlen(internal_error);
-								// 将错误响应写入缓冲区
-								// 比缓冲区大小大了 直接截断(忽略了当前请求) 然后切换到写事件 发送
-								if (client_response_buf_len + resp_len > BUF_SIZE) {
-									printf("error13\n");
-									client_response_buf_len = BUF_SIZE;
-									client_response_buf[BUF_SIZE] = '\0';
-									// 切换为写事件
-									ev.events = EPOLLOUT;
-									ev.data.fd = fd;
-									if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-										perror("epoll_ctl");
-									}
-									// printf("client_response_buf23: \n%s\n",client_response_buf);
-									continue;// 跳过后续while(1)中的处理
-
-								}
-								// 还没到缓冲区大小限制
-								pipeline_requests_ptrr += request_len;
-								memcpy(client_response_buf_ptr, internal_error, resp_len);
-								client_response_buf_len += resp_len;
-								client_response_buf_ptr += resp_len;
-								// printf("client_response_buf24: \n%s\n",client_response_buf);
-								continue;// 跳过后续while(1)中的处理
-							}
-							// 成功后迭代读取请求时的指针
-							pipeline_requests_ptrr += request_len;
-							free(path); // 释放路径内存
-							// printf("client_response_buf25: \n%s\n",client_response_buf);
-							printf("\n\n\n\nhere\n\n\n\n");
-							printf("reqeust_count = %d\n",request_count);
-							continue;
-						
-					}
-					printf("total client_response_buf: \n%s\n",client_response_buf);
-					free(pipeline_requests);// 释放内存
-					// 将要写的内容拷贝到缓冲区
-					memcpy(client->buf, client_response_buf, client_response_buf_len);
-					client->buf_len = client_response_buf_len;
-					// 切换为写事件
-					printf("change to writeable...\n");
-					ev.events = EPOLLOUT;
-					ev.data.fd = fd;
-					if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-						perror("epoll_ctl");
-					}
-					continue;  // 跳过后续处理
-					
-				}
-				else{ // 只有单个请求 走原本的逻辑处理单个请求即可
-					printf("Single request...\n");
-					printf("\n\n%s\n\n",client->buf);
-					char *request_end = strstr(client->buf, "\r\n\r\n"); // 检测完整HTTP头
-					if (!request_end) {
-						// 请求不完整时保持读取
-						if (client->buf_len == BUF_SIZE) { // 缓冲区已满仍无完整头
-							size_t resp_len = strlen(bad_request);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, bad_request, resp_len);
-							client->buf_len = resp_len;
-							
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-						}
-						continue;
-					}
-					*request_end = '\0';
-					printf("Received request:\n%s\n",client->buf);
-					*request_end = '\r';
-					// 严格解析请求行
-					char *line_end = strstr(client->buf, "\r\n");
-					if (!line_end) {// 找不到请求行
-						size_t resp_len = strlen(bad_request);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, bad_request, resp_len);
-							client->buf_len = resp_len;
-							
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-					}
-					// 截断协议并验证：这里先只验证 路径 和 协议
-					// ------------------------开始验证---------------------------------
-					*line_end = '\0';// 截断协议用于下面验证
-
-
-					// 分割请求行各部分
-					char *method_end0 = strchr(client->buf, ' ');
-					char *path_start0 = method_end0 ? method_end0 + 1 : NULL;
-					char *path_end0 = strchr(method_end0 ? method_end0 + 1 : client->buf, ' ');
-					char *proto_start0 = path_end0 ? path_end0 + 1 : NULL;
-
-					// 验证请求行基本结构
-					if (!method_end0 || !path_end0 || !proto_start0 || // 校验是否有空格分割的三个部分
-						(proto_start0 - client->buf) >= BUF_SIZE ||  // 防止越界
-						strncmp(path_start0, "/", 1) != 0 // 校验路径以 / 开头
-					) {
-							size_t resp_len = strlen(bad_request);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, bad_request, resp_len);
-							client->buf_len = resp_len;
-							
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-					}
-
-					*line_end = '\r';// 把截断的协议字符串复原
-					// ------------------------结束验证---------------------------------
-					// 提取path:
-					// 提取路径
-					size_t path_len = path_end0 - path_start0;
-					char *path = malloc(path_len + 1);  // +1 为了结尾的\0
-					memcpy(path, path_start0, path_len);
-					path[path_len] = '\0';  // 结束
-					
-					// 验证路径合法性
-					if (strstr(path, "..")) {
-						size_t resp_len = strlen(bad_request);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, bad_request, resp_len);
-							client->buf_len = resp_len;
-							
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue; // 跳过后续处理
-					}
-					// 方法截断并验证
-					if (!method_end0) {
-						size_t resp_len = strlen(bad_request);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, bad_request, resp_len);
-							client->buf_len = resp_len;
-							
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-					}
-			
-					// 提取方法（安全拷贝）
-					char method[16] = {0};
-					strncpy(method, client->buf, method_end0 - client->buf);
-					method[15] = '\0'; // 强制截断防止溢出
-			
-					// 方法验证
-					if (strcmp(method, "GET") != 0 && 
-						strcmp(method, "HEAD") != 0 && 
-						strcmp(method, "POST") != 0) 
-					{
-						size_t resp_len = strlen(not_implemented);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, not_implemented, resp_len);
-							client->buf_len = resp_len;
-							
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-					}
-
-				
-
-					// 严格协议版本检查
-					char *method_end = strchr(client->buf, ' ');
-					char *path_start = method_end ? method_end + 1 : NULL;
-					char *path_end = path_start ? strchr(path_start, ' ') : NULL;
-					char *proto_start = path_end ? path_end + 1 : NULL;
-					if (!proto_start || !line_end || (line_end - proto_start) < 8 || 
-					strncmp(proto_start, "HTTP/1.1", 8) != 0 || 
-					((line_end - proto_start) > 8  && (proto_start[8] != '\r'))) {
-						 	// 协议版本不是 HTTP/1.1
-							 if (strstr(client->buf, "HTTP/")) {
-								size_t resp_len = strlen(v_not_supported);
-								memcpy(client->buf, v_not_supported, resp_len);
-								client->buf_len = resp_len;
-							}else {
-								size_t resp_len = strlen(bad_request);
-								memcpy(client->buf, bad_request, resp_len);
-								client->buf_len = resp_len;
-							}
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-					}
-
-					// 读取请求头
-					char q_headers[BUF_SIZE];
-					int q_headers_len;
-					if (request_end) {
-						// 计算请求头长度（包含最后的 \r\n\r\n）
-						size_t headers_total_len = request_end - client->buf + 4;
-						
-						// 将头信息复制到专用缓冲区
-						memcpy(q_headers, client->buf, headers_total_len);
-						q_headers_len = headers_total_len;
-						q_headers[q_headers_len] = '\0';
-						
-						// 剩余数据是请求体（如果有）
-						size_t body_len = client->buf_len - headers_total_len;
-						memmove(client->buf, client->buf + headers_total_len, body_len);
-						client->buf_len = body_len;
-					}
-
-					char query_headers[4096]; // 获取请求头中的keep_alive部分
-					memcpy(query_headers, q_headers, q_headers_len + 1); // +1 复制终止符
-					size_t copy_len = MIN(q_headers_len, sizeof(query_headers)-1);
-					query_headers[copy_len] = '\0';
-					char *connection = get_header_value(query_headers, "Connection");
-					client->keep_alive = (connection && strcasecmp(connection, "keep-alive") == 0);
-					if(!connection){// 如果没有 默认关闭连接
-						client->keep_alive = 0;
-					}
-					// 构造响应printf("New client: %s:%d (fd=%d)\n", client->ipstr, client->port, client_sock);
-					printf("Generate the response to client %s:%d%s(fd=%d)\n", client->ipstr, client->port, path, client->fd);
-					// 处理GET/HEAD 
-					if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
-						// 获取文件元数据
-						struct stat st;
-						char full_path[PATH_MAX];
-
-						if (strcmp(path, "/") == 0) {  
-							// 访问根目录，返回 index.html  
-							snprintf(full_path, sizeof(full_path), "%s/index.html", ROOT_DIR);  
-						} else {   
-							// 防止目录穿越攻击在之前读出path的时候已经做过
-							snprintf(full_path, sizeof(full_path), "%s%s", ROOT_DIR, path);  
-						}  
-
-						// 使用 stat 判断文件是否存在且是普通文件  
-						if (stat(full_path, &st) == -1 || !S_ISREG(st.st_mode)) {  
-							// 文件不存在，返回错误响应  
-							size_t resp_len = strlen(not_found);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, not_found, resp_len);
-							client->buf_len = resp_len;
-							printf("file not found\n"); // 记录日志
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-						}  
-
-						// 打开文件
-						int file_fd = open(full_path, O_RDONLY);
-						if (file_fd == -1) {// 打开失败 返回错误
-							size_t resp_len = strlen(internal_error);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, internal_error, resp_len);
-							client->buf_len = resp_len;
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-						}
-
-						
-						// 使用文件描述符获取状态
-						if (fstat(file_fd, &st) == -1) { // 获取失败
-							close(file_fd);
-							size_t resp_len = strlen(internal_error);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, internal_error, resp_len);
-							client->buf_len = resp_len;
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-						}
-
-						// 动态构造响应头
-						char headers[512];
-						// 获取文件信息
-						const char *mime_type = get_mime_type(full_path);
-						// 获取时间信息
-						char date_buf[64];
-						get_current_time_rfc1123(date_buf, sizeof(date_buf));
-						char last_modified[128];
-						get_file_mod_time_rfc1123(full_path, last_modified, sizeof(last_modified));
-						const char *connection_header = client->keep_alive ? "keep-alive" : "close";
-						int headers_len = snprintf(headers, sizeof(headers),
-							"HTTP/1.1 200 OK\r\n"
-							"Server: liso/1.1\r\n"
-							"Date: %s\r\n"
-							"Content-Type: %s\r\n"
-							"Content-Length: %ld\r\n"
-							"Last-Modified: %s\r\n"
-							"Connection: %s\r\n\r\n",  // 动态设置
-							date_buf,
-							mime_type,
-							st.st_size,
-							last_modified,
-							connection_header);
-						// 处理响应头缓冲区溢出
-						if (headers_len >= (int)sizeof(headers)) {
-							close(file_fd);
-							size_t resp_len = strlen(internal_error);
-							// 将错误响应写入缓冲区
-							if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-							memcpy(client->buf, internal_error, resp_len);
-							client->buf_len = resp_len;
-							// 切换为写事件
-							ev.events = EPOLLOUT;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl");
-							}
-							continue;  // 跳过后续处理
-						}
-						// 填充响应缓冲区
-						memcpy(client->buf, headers, headers_len);
-						client->buf_len = headers_len;
-
-						// GET方法需要发送文件内容（HEAD不发送）
-						if (strcmp(method, "GET") == 0) {
-							// 先设置文件状态
-							client->file_fd = file_fd;
-							client->file_offset = 0;
-							client->file_size = st.st_size;
-							client->header_out = 0;
-							
-							// 开始读取
-							ssize_t bytes_read = pread(file_fd, client->buf + headers_len, MIN(BUF_SIZE - headers_len, client->file_size), client->file_offset);
-							if (bytes_read > 0) { // 读取成功 
-								if(client->file_size <= BUF_SIZE - headers_len){// 文件大小比缓冲区大小要小
-									client->buf_len += bytes_read; // 直接加上 然后设置offset为-1 表示已经发送完 在写事件时直接发送即可
-									client->file_offset = -1;
-								}else{// 文件大小比缓冲区大小要大 设置偏移量为读取的大小，并在可写事件时继续发送
-									// 不做处理 等可写时发送
-								}
-							} else if (bytes_read == -1) {// 读取文件失败
-								size_t resp_len = strlen(internal_error);
-								// 将错误响应写入缓冲区
-								if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-								memcpy(client->buf, internal_error, resp_len);
-								client->buf_len = resp_len;
-								// 切换为写事件
-								ev.events = EPOLLOUT;
-								ev.data.fd = fd;
-								if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-									perror("epoll_ctl");
-								}
-								continue;  // 跳过后续处理
-							}
-						}else{
-							client->file_offset = -1;
-						}
-						
-					}else if(strcmp(method, "POST") == 0){// 处理Post请求 直接echo回去
-						size_t req_total_len = request_end - client->buf + 4; // 包含\r\n\r\n
-						char header[128];
-						int header_len = snprintf(header, sizeof(header),
-							"HTTP/1.1 200 OK\r\n"
-							"Content-Length: %zd\r\n"
-							"Connection: close\r\n\r\n",  // 简化处理，每次关闭连接
-							req_total_len);
-				
-						// 缓冲区安全检查
-						if ((size_t)header_len + req_total_len > BUF_SIZE) {
-							const char *server_error = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-							size_t resp_len = strlen(server_error);
-								// 将错误响应写入缓冲区
-								if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-								memcpy(client->buf, server_error, resp_len);
-								client->buf_len = resp_len;
-								
-								// 切换为写事件
-								ev.events = EPOLLOUT;
-								ev.data.fd = fd;
-								if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-									perror("epoll_ctl");
-								}
-								continue;  // 跳过后续处理
-						}
-				
-						// 移动原始请求数据(放在响应头后)
-						memmove(client->buf + header_len, client->buf, req_total_len);
-						// 添加响应头
-						memcpy(client->buf, header, header_len);
-						// 更新缓冲区长度
-						client->buf_len = header_len + req_total_len;
-						
-						
-					}else{// 出错
-						size_t resp_len = strlen(bad_request);
-						// 将错误响应写入缓冲区
-						if (resp_len > BUF_SIZE) resp_len = BUF_SIZE;  // 防溢出
-						memcpy(client->buf, bad_request, resp_len);
-						client->buf_len = resp_len;
-						// 切换为写事件
-						ev.events = EPOLLOUT;
-						ev.data.fd = fd;
-						if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-							perror("epoll_ctl");
-						}
-						continue;  // 跳过后续处理
-					}
-
-					free(path); // 释放路径内存
-					// 切换为写模式
-					ev.events = EPOLLOUT;
-					ev.data.fd = fd;
-					epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+					continue;
 				}
+				events[i].events &= ~EPOLLERR;
+				if (!events[i].events) continue;
 			}
-            // 客户端可写事件
-            else if (events[i].events & EPOLLOUT) {
-				printf("writeable...\n");
-                int idx = fd_to_index[fd];
-                if (idx == -1 || idx >= MAX_CLIENTS) continue;
-                
-                Client *client = &clients[idx];
-
-				if(client->file_offset == -1){// 可以一次发送完 直接发送完
-					printf("once send\n");
-					ssize_t sent = send(fd, client->buf, client->buf_len, 0);
-
-					if (sent > 0) {
-						printf("sent > 0 and sent = %d\n",sent);
-						if (sent < client->buf_len) {// 本次发送缓冲区没写完 继续监听可写事件
-							printf("not send completely...\n");
-							memmove(client->buf, client->buf + sent, client->buf_len - sent);
-							client->buf_len -= sent;
-						} else {// 写完了
-							printf("send completely successful...\n");
-							// 根据keep-alive决定是否关闭连接
-							if (!client->keep_alive) {
-								close_client(epoll_fd, clients, fd_to_index, fd);
-							} else {
-								// 完全重置客户端状态
-								client->buf_len = 0;
-								client->file_offset = -1;
-								client->file_size = 0;
-								client->header_out = 0;
-								if (client->file_fd != -1) {
-									close(client->file_fd);
-									client->file_fd = -1;
-								}
-								
-								// 重新注册EPOLLIN事件
-								ev.events = EPOLLIN;
-								ev.data.fd = fd;
-								if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-									perror("epoll_ctl mod failed");
-									close_client(epoll_fd, clients, fd_to_index, fd);
-								}
-							}
-						}
-					}
-					else if (sent == -1 && errno != EAGAIN) {
-						// 根据keep-alive决定是否关闭连接
-						if (!client->keep_alive) {
-							close_client(epoll_fd, clients, fd_to_index, fd);
-						} else {
-							// 完全重置客户端状态
-							client->buf_len = 0;
-							client->file_offset = -1;
-							client->file_size = 0;
-							client->header_out = 0;
-							if (client->file_fd != -1) {
-								close(client->file_fd);
-								client->file_fd = -1;
-							}
-							
-							// 重新注册EPOLLIN事件
-							ev.events = EPOLLIN;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl mod failed");
-								close_client(epoll_fd, clients, fd_to_index, fd);
-							}
-						}
-					}
+
+            // 客户端可读事件 读到的数据追加在读缓冲区后面 再从头按顺序处理请求
+            if (fd == client->fd && (events[i].events & EPOLLIN)) {
+				// 请求体由echo_pump/proxy_pump直接从socket读走 不经过读缓冲区
+				if (client->echo_left > 0) {
+					if (echo_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+					continue;
+				}
+				if (proxy_splice_body(client)) {
+					if (proxy_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+					continue;
 				}
-                else{ // 无法直接发送完 分批次发送 发完一次后重置状态然后继续监听可写事件
-					ssize_t sent = send(fd, client->buf, client->buf_len, 0); // 这里如果是第一次发送 就是先发送了响应头
-					if (sent > 0) {// 发送成功
-						if (sent < client->buf_len) {// 本次发送缓冲区没写完 继续监听可写事件
-							memmove(client->buf, client->buf + sent, client->buf_len - sent);
-							client->buf_len -= sent;
-							client->file_offset += sent;
-						} else {// 写完了 但是文件可能尚未发送完成
-							if(client->header_out){
-								client->file_offset += sent;// 更新已发送的文件字节数
-							}else{
-								client->header_out = 1;
-							}
-							
-							// 如果文件已发送完成
-							if(client->file_offset >= client->file_size){
-								printf("Complete ! file_offset - >%zd , file_size -> %ld\n",client->file_offset, client->file_size);
-								
-								// 根据keep-alive决定是否关闭连接
-								if (!client->keep_alive) {
-									close_client(epoll_fd, clients, fd_to_index, fd);
-								} else {
-									// 完全重置客户端状态
-									client->buf_len = 0;
-									client->file_offset = -1;
-									client->file_size = 0;
-									client->header_out = 0;
-									if (client->file_fd != -1) {
-										close(client->file_fd);
-										client->file_fd = -1;
-									}
-									
-									// 重新注册EPOLLIN事件
-									ev.events = EPOLLIN;
-									ev.data.fd = fd;
-									if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-										perror("epoll_ctl mod failed");
-										close_client(epoll_fd, clients, fd_to_index, fd);
-									}
-								}
-							}else{// 文件还没发送完
-								// 缓冲区大小置0
-								client->buf_len = 0;
-								
-								 // 计算剩余需要读取的字节数
-								off_t remaining = client->file_size - client->file_offset;
-								size_t to_read = MIN(BUF_SIZE, remaining);
-								
-								// 从文件读取下一块数据
-								ssize_t bytes_read = pread(client->file_fd, client->buf, to_read, client->file_offset);
-								printf("bytes_read = %ld \n", bytes_read);
-								if (bytes_read > 0) {
-									client->buf_len = bytes_read;
-									
-								} else if (bytes_read == -1 && errno != EAGAIN) {
-									printf("bytes_read failed! file_offset - >%zd , file_size -> %ld \n ",client->file_offset, client->file_size);
-									// 文件读取错误 直接关闭连接
-									close_client(epoll_fd, clients, fd_to_index, fd);
-								}
-
-							}
-
-							
-						}
-					}
-					else if (sent == -1 && errno != EAGAIN) {
-						// 根据keep-alive决定是否关闭连接
-						if (!client->keep_alive) {
-							close_client(epoll_fd, clients, fd_to_index, fd);
-						} else {
-							// 完全重置客户端状态
-							client->buf_len = 0;
-							client->file_offset = -1;
-							client->file_size = 0;
-							client->header_out = 0;
-							if (client->file_fd != -1) {
-								close(client->file_fd);
-								client->file_fd = -1;
-							}
-							
-							// 重新注册EPOLLIN事件
-							ev.events = EPOLLIN;
-							ev.data.fd = fd;
-							if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
-								perror("epoll_ctl mod failed");
-								close_client(epoll_fd, clients, fd_to_index, fd);
-							}
-						}
-					}
+				if (client->req_len == 0) client->req_start_ns = metrics_now_ns(); // 新请求开始
+				ssize_t readret = recv(fd, client->req_buf + client->req_len, server_options.buf_size - client->req_len, 0);
+				if (readret > 0) {
+					metrics_inc(COUNTER_BYTES_RECV, readret);
+					client->req_len += readret;
+				} else if (readret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) { // 对端关闭或出错 关闭连接
+					close_client(epoll_fd, clients, fd_to_index, fd);
+					continue;
+				} else { // 暂时没有数据
+					continue;
 				}
+				if (client->cgi.active && cgi_pump(epoll_fd, client) == 0) continue;
+				if (client->fcgi.active && fcgi_pump(epoll_fd, client) == 0) continue;
+				if (client->proxy.active && proxy_pump(epoll_fd, client) == 0) continue;
+				process_requests(epoll_fd, client);
+			}
+			// 客户端断开
+			else if (fd == client->fd && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+				close_client(epoll_fd, clients, fd_to_index, fd);
+			}
+			// CGI管道或者客户端可写 搬运数据
+			else if (client->cgi.active) {
+				if (cgi_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+			}
+			// worker的响应在写缓冲区里 客户端可写
+			else if (client->fcgi.active) {
+				if (fcgi_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+			}
+			// 上游连接或者客户端可写 搬运数据
+			else if (client->proxy.active) {
+				if (proxy_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+			}
+			// 回显的请求体在写缓冲区或管道里 客户端可写
+			else if (client->echo_left > 0 || client->relay.pending > 0) {
+				if (echo_pump(epoll_fd, client) == 1) process_requests(epoll_fd, client);
+			}
+            // 客户端可写事件 继续发送没发完的响应 发完后接着处理缓冲区中pipeline的请求
+            else if (fd == client->fd && (events[i].events & EPOLLOUT)) {
+				log_debug("writeable...");
+				if (client->out_paused) output_resume(client);
+				if (client->responding && !static_response(epoll_fd, client)) continue;
+				process_requests(epoll_fd, client);
             }
-			
+			// 只有EPOLLERR/EPOLLHUP 连接已经不可用
+			else if (fd == client->fd) {
+				close_client(epoll_fd, clients, fd_to_index, fd);
+			}
         }
+	if (*server.cgi_active > 0) cgi_sweep(epoll_fd);
+	if (cgi_exiting() > 0) cgi_reap();
+	if (fcgi_pending() > 0) fcgi_sweep(epoll_fd);
+	if (proxy_pending() > 0) proxy_sweep(epoll_fd);
+	if (atomic_load_explicit(&server_draining, memory_order_relaxed)) return drain_step(epoll_fd) ? -1 : 0;
+	return 0;
 }
@@ -16,60 +16,257 @@
 #include <unistd.h>    // 提供 fstat() 等系统调用
 #include <time.h>
 #include <libgen.h>  // dirname()
+#include <stdint.h>
+#include <netinet/tcp.h> // TCP_DEFER_ACCEPT
+#include <pthread.h>
+#include <sys/resource.h>
+#include "metrics.h"
+#include "log.h"
+#include "mime.h"
+#include "request.h"
+#include "cgi.h"
+#include "fastcgi.h"
+#include "proxy.h"
+#include "relay.h"
+#include "h2.h"
+#include "affinity.h"
+#include "listener.h"
+#include "config.h"
+#include "lifecycle.h"
+#include "fileio.h"
+#include "filemap.h"
+#include "zerocopy.h"
+#include "ratelimit.h"
+#include "task.h"
+#include "coro.h"
 
-#define BUF_SIZE 4096 // 缓冲区大小
+// 以下是默认值 都可以通过配置文件 环境变量或命令行修改 见config.c
+#define BUF_SIZE 4096 // 每个连接读/写缓冲区的大小 也是HTTP/1.1请求(含请求体)的上限
 #define ECHO_PORT 9999 // 服务器监听的端口
-#define MAX_CLIENTS 1024  // 最大客户端数量
+#define MAX_CLIENTS 1024  // 每个事件循环的最大客户端数量
 #define MAX_EVENTS 1024 // event_poll最大事件数量
-#define MAX_PIPELINE_REQUESTS 30 // 最大的pipeline请求个数
-#define MAX_REQUEST_SIZE 1024 // 最大单个pipeline请求的大小
+#define ACCEPT_BATCH 64 // 监听socket每次可读时最多accept的连接数 避免连接风暴时饿死已有连接
+#define LISTEN_BACKLOG 4096 // listen的backlog 实际上限还受net.core.somaxconn限制
+#define DEFER_ACCEPT_SECS 1 // TCP_DEFER_ACCEPT 客户端发来第一个数据包后才唤醒accept 0表示关闭
+#define MAX_PIPELINE_REQUESTS 30 // 一个连接每轮事件循环最多处理的pipeline请求个数
+#define OUT_HIGH_WATER (1 << 20) // 连接的发送队列超过这么多字节时暂停处理它的请求
+#define OUT_LOW_WATER (256 << 10) // 暂停后发送队列降到这么多字节以下再恢复
+#define FD_INDEX_FCGI(conn) (-2 - (conn)) // 到FastCGI worker的连接在fd_to_index中的值 与客户端下标区分
+#define FD_INDEX_PROXY(backend) (FD_INDEX_FCGI(FCGI_MAX_CONNS) - (backend)) // 空闲池中的上游连接
+#define FD_INDEX_LISTENER(i) (FD_INDEX_PROXY(PROXY_MAX_BACKENDS) - (i)) // 监听socket
+#define FD_INDEX_CONTROL FD_INDEX_LISTENER(MAX_LISTENERS) // 信号 唤醒和升级通知 见lifecycle.c
+#define FD_INDEX_IO (FD_INDEX_CONTROL - 1) // 文件任务的完成通知 见fileio.c
+#define FD_INDEX_TASK (FD_INDEX_IO - 1) // CPU任务的完成通知 见task.c
 
-char ROOT_DIR[4096];
-static volatile int global_sock = -1;
+extern char ROOT_DIR[4096];
+
+// CGI请求的状态 active为0表示当前请求不是CGI
+typedef struct{
+	int active;
+	CgiProcess proc;	// 脚本进程 脚本结束(或出错改成错误响应)后pid为0
+	off_t body_left;	// 还没写给脚本的请求体字节数
+	Coro co;			// cgi_pump挂起的位置 0表示还没开始
+	int eof;			// 脚本的输出已经读完
+	int head_only;		// HEAD请求 转换完响应头就结束脚本
+	uint64_t deadline_ns;
+} CgiState;
+
+// 客户端地址 accept时原样保存 从Unix socket连进来的只记下sa_family为AF_UNIX
+typedef union{
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+} PeerAddr;
 
 // 客户端连接状态
 typedef struct{
     int fd;              // 套接字
-    char buf[BUF_SIZE];  // 读/写缓冲区
+    char *buf;           // 写缓冲区 存放待发送的响应 大小为server_options.buf_size
     size_t buf_len;      // 缓冲区当前数据长度
-    char ipstr[INET_ADDRSTRLEN]; // 客户端IP地址
-    int port;            // 客户端端口
+    char *req_buf;       // 读缓冲区 可能同时有多个pipeline的请求 大小为server_options.buf_size
+    size_t req_len;      // 读缓冲区当前数据长度
+    PeerAddr peer;       // 客户端地址
+    int listener;        // 接受这个连接的监听socket在listeners中的下标
+    char ipstr[INET6_ADDRSTRLEN]; // 格式化后的客户端IP 第一次用到时才格式化 空串表示还没格式化
 	int current_clients;
 	int keep_alive; 	 // 持久连接
+	uint32_t events;	 // 当前在epoll中注册的事件
 	// 新增文件传输相关字段
     int file_fd;            // 当前传输的文件描述符
-    off_t file_offset;      // 当前文件偏移量
+    off_t file_offset;      // 下一次pread的文件偏移量 -1或者不小于file_size表示文件已经都读进buf
     off_t file_size;        // 文件总大小
-	int header_out; 		// 响应头是否发送
-	char temp_request_buf[BUF_SIZE/2]; 	// 临时请求缓冲区 用于pipeline时读取下面的没发完的请求
-	int temp_request_buf_on;			// 是否开启临时请求缓冲区
-	int temp_request_buf_size;			// 临时请求缓冲区中的内容大小
-	int last_request_len;				// 上一个解析出的pipeline请求的大小
+	int header_out; 		// 响应头(第一个字节)是否已发送
+	int responding;			// 当前请求的响应是否还在发送 发完前不处理后面的请求
+	HttpRequest req;		// 当前请求 指针指向req_buf 响应发送完之前有效
+	size_t req_consumed;	// 当前请求(含请求体)在req_buf中的长度 响应发完后丢弃
+	uint64_t req_start_ns;				// 当前请求第一个字节到达的时间 用于统计各阶段耗时
+	off_t inflight;						// 已计入bytes_in_flight但还没发出去的字节数
+	int status;							// 当前响应的状态码
+	off_t bytes_sent;					// 当前响应已发送的字节数
+	CgiState cgi;						// 当前请求是CGI时的状态
+	FcgiState fcgi;						// 当前请求交给FastCGI worker时的状态
+	ProxyState proxy;					// 当前请求转发给上游时的状态
+	off_t echo_left;					// 放不进缓冲区的POST请求体还没回显的字节数 不为0时请求体边收边发
+	Relay relay;						// 请求体/响应体在socket之间splice时借用的管道
+	H2Conn *h2;							// 切换到HTTP/2之后的连接状态 NULL表示HTTP/1.1
+	int chunked;						// 长度未知的响应体按分块编码发送 不用靠关闭连接结束响应
+	size_t head_left;					// 分块编码时写缓冲区开头还没发出去的响应头 原样发送
+	ChunkWriter chunk;
+	FileJob io;							// 交给工作线程的打开/读文件任务 io.pending时槽位和buf不能重用
+	Task task;							// 交给CPU工作线程的任务 结果放在io里 提交时同样设置io.pending
+	Coro respond;						// 静态文件/固定响应的协程(static_response)挂起的位置 0表示不在发送中
+	FileMap *map;						// 文件从共享映射发送 不为NULL时file_fd为-1 file_offset是映射中下一个要发的位置
+	ZeroCopy zc;						// 从映射MSG_ZEROCOPY发送的完成通知 没完成时映射的引用留在zc.retired
+	int rate_slot;						// 来源地址在限流表中的位置 RATE_NO_SLOT表示不按来源限制
+	size_t out_unchecked;				// 上次查看发送队列之后发出的字节(加上当时队列里的) 超过out_high才再查一次
+	size_t out_queued;					// 上次查看时内核发送队列里的字节数 计入GAUGE_OUTPUT_QUEUED
+	int out_paused;						// 发送队列超过out_high 不再读新请求 等EPOLLOUT(队列降到out_low以下)
 } Client;
 
-// 存储服务端的一些必要信息
+// 启动参数 由config_load从配置文件 环境变量和命令行依次覆盖默认值 校验之后只读
+// 事件循环每个请求都要读的放在最前面 同在一个缓存行里
+typedef struct{
+	int buf_size;      // 每个连接读/写缓冲区的大小
+	int max_pipeline;  // 一个连接每轮事件循环最多处理的pipeline请求个数
+	int max_clients;   // 每个事件循环的最大客户端数量
+	int max_events;    // 每次epoll_wait最多返回的事件数
+	int accept_batch;  // 每次最多accept的连接数
+	int splice;              // POST回显和代理的请求体/响应体用splice转发 0表示都走缓冲区复制
+	int h2;                  // 接受h2c(prior knowledge和Upgrade) 0表示只说HTTP/1.1
+	int mmap;                // 静态文件从共享的mmap映射直接发送 0表示分块pread到buf
+	int zerocopy_min;        // 从映射发送时剩下的文件内容不少于这么多字节就用MSG_ZEROCOPY 0表示不用
+	int cgi_max_per_script; // 每个CGI脚本最多同时运行的进程数
+	int cgi_timeout_ms;     // CGI脚本超时时间
+	int fcgi_conns;          // 每个事件循环到worker的连接数
+	int fcgi_reqs_per_conn;  // 每个连接上同时进行的请求数
+	int fcgi_timeout_ms;     // FastCGI请求超时时间
+	int proxy_timeout_ms;    // 反向代理请求超时时间
+	int drain_timeout_ms;    // 排空时等进行中的响应的最长时间 0表示一直等
+	int ip_conns;            // 每个来源IP的并发连接数上限 0表示不限制
+	int ip_rate;             // 每个来源IP每秒的请求数上限
+	int ip_burst;            // 每个来源IP可以一次用掉的请求数 0表示同ip_rate
+	int ip_bandwidth;        // 每个来源IP每秒发送的字节数上限
+	int out_high;            // 连接的发送队列超过这么多字节时暂停读请求 0表示不限制
+	int out_low;             // 暂停后发送队列降到这么多字节以下恢复
+	// 下面的只在启动时使用
+	int port;          // 没有指定listen时双栈监听的端口
+	int backlog;       // listen的backlog 监听地址没有指定backlog=时使用
+	int defer_accept;  // TCP_DEFER_ACCEPT的秒数 0表示关闭 监听地址没有指定defer=时使用
+	int loops;         // 事件循环线程数 大于1时每个线程一个epoll 共享监听socket
+	int io_threads;    // 打开和读文件的工作线程数 0表示在事件循环里同步执行
+	int cpu_threads;   // 生成指标快照等CPU工作的线程数 0表示在事件循环里直接执行
+	int warmup_max_size; // 启动时预读静态文件目录中不超过这个大小的文件 0表示不预读
+	const char *listen;      // 监听地址列表 格式见listener_open NULL表示双栈监听port
+	const char *unix_listen; // 额外监听的Unix socket 逗号分隔 @开头的在抽象命名空间 NULL表示只监听TCP
+	const char *cpus;        // 事件循环绑定的CPU列表 格式见affinity.h NULL表示不绑定
+	const char *root;        // 静态文件目录 NULL表示可执行文件所在目录下的static_site
+	const char *fcgi_socket; // FastCGI worker的Unix socket路径 NULL表示不启用
+	const char *proxy;       // 反向代理路由表 格式见proxy_load NULL表示不启用
+	const char *proxy_balance; // 反向代理的负载均衡策略 round-robin或least-conn
+	const char *mime_types;  // mime.types文件
+	const char *log_level;   // error|warn|info|debug
+	const char *log_format;  // common|combined|json
+} ServerOptions;
+// 只有config.c通过server_config修改 其他地方经server_options只读访问 写入会编译失败
+extern ServerOptions server_config;
+#define server_options (*(const ServerOptions *)&server_config)
+
+// 存储服务端的一些必要信息 每个事件循环线程一份
 typedef struct{
-	int *sock; // 服务端socket
 	int *epoll_fd; // epoll多路复用池
-	struct epoll_event *ev, *events; // 服务端epoll属性 ev是单个 events是数组
-	struct sockaddr_in *addr; // 服务端IP地址
-    int *port; // 服务端端口
+	struct epoll_event *events; // epoll_wait返回的事件数组
 	Client *clients; // 连接的客户端的数组
 	int *fd_to_index;// fd和客户端数组映射关系 数组
+	int *fd_table_size; // fd_to_index的大小 按RLIMIT_NOFILE分配
 	int *current_clients; // 当前客户端个数
+	int *free_slots; // 空闲槽位栈 栈顶在free_slots[server_options.max_clients - *current_clients - 1]
+	int *cgi_active; // 正在运行的CGI个数 不为0时epoll_wait定时醒来检查超时
+	int loop; // 第几个事件循环 0是主线程的 按CPU分流时用它找自己的监听socket
 } Server;
-Server server;// 创建Server结构体对象
+extern __thread Server server;// 当前线程的事件循环 定义在server.c
 
 // ----------------------函数声明-----------------------
-// 初始化服务器
+// 初始化服务器 创建监听socket 启动server_options.loops - 1个额外的事件循环线程
+// 并初始化调用线程自己的事件循环
 void init_server();
-// 监听并处理事件
-void handle_events();
+// 监听并处理事件 排空完成后返回-1 事件循环应当退出
+int handle_events();
 // 设置fd为非阻塞模式
 int set_nonblocking(int fd);
 // 关闭客户端连接并输出日志
 void close_client(int epoll_fd, Client *clients, int *fd_to_index, int fd);
-// 处理信号 在关闭时输出日志
-void handle_signal(int sig);
+
+// 以下供CGI/FastCGI在事件循环中推进请求
+// 只有关注的事件变化时才调用epoll_ctl
+int set_interest(int epoll_fd, Client *client, uint32_t events);
+// 把固定的错误响应放入写缓冲区
+void set_error_response(Client *client, int status, const char *response);
+// 发送当前响应 返回1表示发送完毕 0表示需要等可写事件 -1表示出错
+int send_response(Client *client);
+// 写缓冲区开头head_len字节的响应头已经准备好 之后的响应体按分块编码发送
+void start_chunked(Client *client, size_t head_len);
+// 响应体都发完后调用 分块编码时发送结束块 返回1表示发完 0表示需要等可写事件 -1表示出错
+int send_response_end(Client *client);
+// 不经过写缓冲区(splice)发给客户端的n个字节 计入发送统计
+void account_sent(Client *client, size_t n);
+// 响应结束 记录访问日志 关闭连接或准备处理下一个请求
+void finish_response(int epoll_fd, Client *client, int ok);
+// 依次处理读缓冲区中pipeline的请求
+void process_requests(int epoll_fd, Client *client);
+// 格式化后的客户端IP IPv4映射的IPv6地址按IPv4显示 Unix socket为"unix:"
+const char *client_host(Client *client);
+// 客户端端口 Unix socket为0
+int client_port(Client *client);
+// 打开请求路径对应的文件(或者指标快照) 成功返回fd 文件不存在返回-1 其他失败返回-2
+int open_request_file(const char *path, char *full_path, size_t full_path_size,
+					  struct stat *st, const char **mime_type);
+void get_current_time_rfc1123(char *buf, size_t buf_size);
+void get_file_mod_time_rfc1123(const char *filename, char *buf, size_t buf_size);
+extern const char *not_found, *internal_error, *bad_gateway, *service_unavailable, *gateway_timeout, *too_many_requests;
+
+// ----------------------FastCGI fastcgi.c-----------------------
+// URI是否以FCGI_PREFIX开头(且启用了FastCGI)
+int fcgi_match(const HttpRequest *req);
+// 把请求交给连接池中的一个连接 连接都满时排队 失败时设置错误响应 fcgi.active保持为0
+void fcgi_start(Client *client);
+// 在客户端和worker之间搬运数据 客户端socket有事件时调用 返回1表示响应已经发完
+int fcgi_pump(int epoll_fd, Client *client);
+// 到worker的连接conn有事件
+void fcgi_handle_conn(int epoll_fd, int conn, uint32_t events);
+// 客户端断开 中止它在worker上的请求
+void fcgi_detach(int epoll_fd, Client *client);
+// 当前循环中进行中的FastCGI请求数 不为0时需要定时检查超时
+int fcgi_pending(void);
+// 超时的请求返回504
+void fcgi_sweep(int epoll_fd);
+
+// ----------------------反向代理 proxy.c-----------------------
+// 把请求转发给路由route的一个上游 失败时设置错误响应 proxy.active保持为0
+void proxy_start(Client *client, int route);
+// 在客户端和上游之间搬运数据 客户端socket或上游连接有事件时调用 返回1表示响应已经发完
+int proxy_pump(int epoll_fd, Client *client);
+// 剩下的请求体是否直接从客户端socket splice给上游 是的话事件循环不再把客户端的数据读到req_buf
+int proxy_splice_body(Client *client);
+// 客户端断开 关闭它正在使用的上游连接
+void proxy_detach(int epoll_fd, Client *client);
+// 空闲池中属于后端backend的上游连接有事件
+void proxy_handle_idle(int epoll_fd, int backend, int fd);
+// 当前循环中进行中的代理请求数 不为0时需要定时检查超时
+int proxy_pending(void);
+// 超时的请求返回504
+void proxy_sweep(int epoll_fd);
+
+// ----------------------HTTP/2 h2.c-----------------------
+// 请求是否要求升级到h2c(Upgrade: h2c 带有合法的HTTP2-Settings)
+int h2_upgrade_requested(const HttpRequest *req);
+// 把连接切换到HTTP/2 upgrade为1时先回101 当前请求作为流1处理
+// 读缓冲区中剩下的数据交给HTTP/2 失败返回-1 连接保持HTTP/1.1
+int h2_start(Client *client, int upgrade);
+// HTTP/2连接上的事件 读帧 处理 按流量控制窗口发送响应
+void h2_handle(int epoll_fd, Client *client, uint32_t events);
+// 连接关闭时释放HTTP/2状态
+void h2_free(Client *client);
+// 排空时调用 发送GOAWAY 不再接受新的流 已有的流结束后关闭连接
+void h2_drain(int epoll_fd, Client *client);
 
 #endif  
\ No newline at end of file
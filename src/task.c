@@ -0,0 +1,203 @@
+#include "server.h"
+#include <sys/eventfd.h>
+
+#define DEQUE_MASK (TASK_DEQUE_SIZE - 1)
+
+// 每个事件循环的完成栈 工作线程压入 事件循环整个取走
+struct TaskLoop{
+	_Atomic(Task *) done;
+	int event_fd;
+};
+
+// 工作线程的双端队列 bottom只有自己改 top由自己和偷的一方用CAS推进
+typedef struct{
+	atomic_long top;
+	atomic_long bottom;
+	_Atomic(Task *) slots[TASK_DEQUE_SIZE];
+} Deque;
+
+static Deque *deques;
+static int thread_count;
+
+// 事件循环提交的任务先压进这里 工作线程一次全部取走 只有压入和整个交换 没有ABA问题
+static _Atomic(Task *) injected;
+// 已经提交还没被工作线程取走执行的任务数 为0时工作线程才睡眠
+static atomic_long queued;
+static atomic_int sleepers;
+static pthread_mutex_t sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
+
+static __thread struct TaskLoop *task_loop;
+
+// 只有队列的主人调用
+static int deque_push(Deque *d, Task *task) {
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	if (b - t >= TASK_DEQUE_SIZE) return -1;
+	atomic_store_explicit(&d->slots[b & DEQUE_MASK], task, memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_release); // 偷的一方看到新的bottom时也能看到任务
+	return 0;
+}
+
+// 主人从队尾取 只剩一个时和偷的一方抢top
+static Task *deque_pop(Deque *d) {
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (t > b) {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+	Task *task = atomic_load_explicit(&d->slots[b & DEQUE_MASK], memory_order_relaxed);
+	if (t == b) {
+		if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) task = NULL;
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+	return task;
+}
+
+// 别的工作线程从队头偷 CAS失败(被主人或者别人抢先)时返回NULL
+static Task *deque_steal(Deque *d) {
+	long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b) return NULL;
+	Task *task = atomic_load_explicit(&d->slots[t & DEQUE_MASK], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return NULL;
+	return task;
+}
+
+static void wake_one(void) {
+	if (atomic_load(&sleepers) == 0) return;
+	pthread_mutex_lock(&sleep_lock);
+	pthread_cond_signal(&sleep_cond);
+	pthread_mutex_unlock(&sleep_lock);
+}
+
+static void finish(Task *task) {
+	struct TaskLoop *loop = task->loop;
+	Task *head = atomic_load_explicit(&loop->done, memory_order_relaxed);
+	do {
+		task->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&loop->done, &head, task, memory_order_release, memory_order_relaxed));
+	// 栈原来是空的才需要唤醒 不空时事件循环已经被唤醒过 还没来得及取
+	if (head) return;
+	uint64_t one = 1;
+	if (write(loop->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) log_error("task wake failed: %s", strerror(errno));
+}
+
+static void run(Task *task) {
+	atomic_fetch_sub(&queued, 1);
+	task->run(task);
+	finish(task);
+}
+
+// 把注入栈里的任务整批放进自己的队列 按提交的顺序 返回第一个直接执行
+// 多出来的任务留在队列里 还有线程在睡的话叫醒一个来偷
+static Task *take_injected(Deque *d) {
+	Task *list = atomic_exchange_explicit(&injected, NULL, memory_order_acquire);
+	if (!list) return NULL;
+	Task *ordered = NULL;
+	while (list) {
+		Task *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+	Task *first = ordered;
+	int pushed = 0;
+	for (Task *task = first->next, *next; task; task = next) {
+		next = task->next;
+		if (deque_push(d, task) == 0) pushed++;
+		else run(task);
+	}
+	if (pushed) wake_one();
+	return first;
+}
+
+static void *worker_main(void *arg) {
+	int self = (int)(intptr_t)arg;
+	Deque *d = &deques[self];
+	unsigned int seed = self + 1;
+	for (;;) {
+		Task *task = deque_pop(d);
+		if (!task) task = take_injected(d);
+		// 从随机的一个开始 所有工作线程都看一遍
+		for (int i = 0, start = rand_r(&seed) % thread_count; !task && i < thread_count; i++) {
+			int victim = (start + i) % thread_count;
+			if (victim != self) task = deque_steal(&deques[victim]);
+		}
+		if (task) {
+			run(task);
+			continue;
+		}
+		// sleepers先于queued 和task_submit的顺序相反 两边至少有一边能看到对方
+		pthread_mutex_lock(&sleep_lock);
+		atomic_fetch_add(&sleepers, 1);
+		while (atomic_load(&queued) == 0) pthread_cond_wait(&sleep_cond, &sleep_lock);
+		atomic_fetch_sub(&sleepers, 1);
+		pthread_mutex_unlock(&sleep_lock);
+	}
+	return NULL;
+}
+
+int task_init(int threads) {
+	if (threads <= 0) return 0;
+	deques = calloc(threads, sizeof(Deque));
+	if (!deques) return -1;
+	thread_count = threads;
+	for (int i = 0; i < threads; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, worker_main, (void *)(intptr_t)i) != 0) return -1;
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+int task_enabled(void) {
+	return thread_count > 0;
+}
+
+int task_loop_init(int epoll_fd, int *fd_to_index) {
+	if (!task_enabled()) return 0;
+	struct TaskLoop *loop = calloc(1, sizeof(*loop));
+	if (!loop) return -1;
+	loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->event_fd == -1) return -1;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = loop->event_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev) == -1) return -1;
+	fd_to_index[loop->event_fd] = FD_INDEX_TASK;
+	task_loop = loop;
+	return 0;
+}
+
+void task_submit(Task *task) {
+	task->loop = task_loop;
+	atomic_fetch_add(&queued, 1);
+	Task *head = atomic_load_explicit(&injected, memory_order_relaxed);
+	do {
+		task->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&injected, &head, task, memory_order_release, memory_order_relaxed));
+	wake_one();
+}
+
+void task_complete(int epoll_fd) {
+	uint64_t v;
+	if (read(task_loop->event_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) log_error("task eventfd read failed: %s", strerror(errno));
+	Task *list = atomic_exchange_explicit(&task_loop->done, NULL, memory_order_acquire);
+	Task *ordered = NULL;
+	while (list) {
+		Task *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+	// done里可能再次提交同一个任务 先记下next
+	for (Task *task = ordered, *next; task; task = next) {
+		next = task->next;
+		task->done(epoll_fd, task);
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef TASK_H
+#define TASK_H
+
+// 吃CPU的工作交给一组CPU工作线程 不占着事件循环 其他连接照常处理
+// 事件循环提交的任务先放进全局的注入栈 空闲的工作线程整批取走放进自己的双端队列
+// 自己从队尾取 别的工作线程没事做时从队头偷 偷的一方只用CAS 不加锁(Chase-Lev)
+// 任务完成后挂到提交它的事件循环的完成栈上 通过eventfd唤醒(fd_to_index中为FD_INDEX_TASK)
+// 提交者在完成回调之前不碰任务用到的字段 Client本身不需要锁
+
+#define TASK_THREADS 0          // cpu_threads的默认值 0表示不启用 任务在事件循环里直接执行
+#define TASK_MAX_THREADS 256
+#define TASK_DEQUE_SIZE 1024    // 每个工作线程双端队列的容量 2的幂 满了时直接执行
+
+struct TaskLoop;
+
+// 一个任务 嵌在提交者(Client)里 每个提交者同时最多一个
+typedef struct Task{
+    void (*run)(struct Task *task);                 // 在工作线程上执行
+    void (*done)(int epoll_fd, struct Task *task);  // 回到提交它的事件循环之后执行
+    void *owner;
+    struct TaskLoop *loop;      // 提交它的事件循环
+    struct Task *next;          // 注入栈和完成栈
+} Task;
+
+// 启动threads个工作线程 0表示不启用 失败返回-1
+int task_init(int threads);
+int task_enabled(void);
+// 调用线程的事件循环创建完成栈的eventfd并加入epoll
+int task_loop_init(int epoll_fd, int *fd_to_index);
+// 提交任务 之后在这个事件循环里调用task->done
+void task_submit(Task *task);
+// eventfd可读时调用 依次执行已经完成的任务的done
+void task_complete(int epoll_fd);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+    比较回环TCP和Unix socket上的请求延迟
+    两种连接各建一个keep-alive连接 依次发同一个小请求 一个请求的响应读完再发下一个
+    每个请求从发出到响应读完的时间记下来 最后输出平均值 p50 p99 和每秒请求数
+
+    先用LISO_UNIX=/tmp/liso.sock(或者@liso)启动服务器 再运行
+    -w 预热的请求数 不计入结果
+
+    用法: ./uds_bench [-h 地址] [-p 端口] [-s socket路径] [-u URI] [-n 请求数] [-w 预热数]
+*/
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define IN_MAX (64 * 1024)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_tcp(const char *host, const char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// @开头的在抽象命名空间
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) return -1;
+    socklen_t addr_len = sizeof(addr);
+    if (path[0] == '@') {
+        memcpy(addr.sun_path + 1, path + 1, len - 1);
+        addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+    } else {
+        memcpy(addr.sun_path, path, len);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&addr, addr_len) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// 发一个请求并读完响应(必须带Content-Length) 成功返回0
+static int one_request(int fd, const char *head, size_t head_len) {
+    static char in[IN_MAX];
+    if (send(fd, head, head_len, MSG_NOSIGNAL) != (ssize_t)head_len) return -1;
+    size_t in_len = 0;
+    long long left = -1;
+    while (left != 0) {
+        ssize_t n = recv(fd, in + in_len, left >= 0 ? sizeof(in) : sizeof(in) - in_len, 0);
+        if (n <= 0) return -1;
+        if (left >= 0) {
+            left -= n;
+            continue;
+        }
+        in_len += n;
+        char *end = memmem(in, in_len, "\r\n\r\n", 4);
+        if (!end) {
+            if (in_len == sizeof(in)) return -1;
+            continue;
+        }
+        char *cl = memmem(in, end - in, "Content-Length:", 15);
+        if (!cl || strncmp(in, "HTTP/1.1 200", 12) != 0) return -1;
+        left = atoll(cl + 15) - (long long)(in + in_len - (end + 4));
+        in_len = 0;
+    }
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 在fd上跑warmup + n个请求 输出统计 失败返回-1
+static int run(const char *name, int fd, const char *head, size_t head_len, int n, int warmup, uint64_t *lat) {
+    if (fd == -1) {
+        fprintf(stderr, "%s: connect failed\n", name);
+        return -1;
+    }
+    for (int i = 0; i < warmup; i++) {
+        if (one_request(fd, head, head_len) == -1) {
+            fprintf(stderr, "%s: warmup request %d failed\n", name, i);
+            return -1;
+        }
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        if (one_request(fd, head, head_len) == -1) {
+            fprintf(stderr, "%s: request %d failed\n", name, i);
+            return -1;
+        }
+        lat[i] = now_ns() - t;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    close(fd);
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++) sum += lat[i];
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%-24s avg %7.1fus  p50 %7.1fus  p99 %7.1fus  %9.0f req/s\n", name,
+           sum / 1e3 / n, lat[n / 2] / 1e3, lat[(size_t)n * 99 / 100] / 1e3, n / secs);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1", *port = "9999", *path = "/tmp/liso.sock", *uri = "/";
+    int n = 20000, warmup = 1000, opt;
+    while ((opt = getopt(argc, argv, "h:p:s:u:n:w:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 's': path = optarg; break;
+        case 'u': uri = optarg; break;
+        case 'n': n = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-s unix-path|@name] [-u uri] [-n requests] [-w warmup]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n < 1 || warmup < 0) {
+        fprintf(stderr, "bad -n/-w\n");
+        return 1;
+    }
+    char head[1024];
+    int head_len = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", uri, host);
+    uint64_t *lat = malloc(n * sizeof(*lat));
+    if (!lat) return 1;
+
+    char tcp_name[128], unix_name[128];
+    snprintf(tcp_name, sizeof(tcp_name), "tcp %s:%s", host, port);
+    snprintf(unix_name, sizeof(unix_name), "unix %s", path);
+    if (run(tcp_name, connect_tcp(host, port), head, head_len, n, warmup, lat) == -1 ||
+        run(unix_name, connect_unix(path), head, head_len, n, warmup, lat) == -1) {
+        return 1;
+    }
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "server.h"
+#include <linux/errqueue.h>
+
+int zerocopy_use(ZeroCopy *zc, int fd, FileMap *map, size_t len) {
+	int min = server_options.zerocopy_min;
+	if (zc->state < 0 || min <= 0 || len < (size_t)min) return 0;
+	// 上一个响应的映射还在等通知 这次复制发送 不然要同时记住两个映射
+	if (zc->retired && zc->retired != map) return 0;
+	if (zc->state == 0) {
+		int one = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {// Unix socket等不支持
+			zc->state = -1;
+			return 0;
+		}
+		zc->state = 1;
+	}
+	return 1;
+}
+
+static void release_retired(ZeroCopy *zc) {
+	if (zc->retired && (int32_t)(zc->done - zc->retire_at) >= 0) {
+		filemap_put(zc->retired);
+		zc->retired = NULL;
+	}
+}
+
+int zerocopy_reap(ZeroCopy *zc, int fd) {
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+	for (;;) {
+		struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+			struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) return -1;
+			// [ee_info, ee_data]这一段发送已经完成 通知按顺序到达
+			zc->done = err->ee_data + 1;
+			// 内核最后还是复制了(如回环或者网卡不支持) 这个连接之后直接复制发送
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc->state = -1;
+		}
+	}
+	release_retired(zc);
+	// 错误队列读完了 EPOLLERR还可能是socket本身出错
+	int so_error = 0;
+	socklen_t len = sizeof(so_error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &len) == -1 || so_error) return -1;
+	return 0;
+}
+
+void zerocopy_retire(ZeroCopy *zc, FileMap *map) {
+	if (!zerocopy_pending(zc)) {
+		filemap_put(map);
+		return;
+	}
+	if (!zc->retired) {
+		zc->retired = map;
+		zc->retire_at = zc->sent;
+		return;
+	}
+	// 同一个映射只留一个引用 等到最后一次发送完成 不同的映射这次没有用过MSG_ZEROCOPY
+	if (zc->retired == map) zc->retire_at = zc->sent;
+	filemap_put(map);
+}
+
+void zerocopy_release(ZeroCopy *zc) {
+	if (zc->retired) filemap_put(zc->retired);
+	zerocopy_init(zc);
+}
@@ -0,0 +1,42 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+#include <stdint.h>
+#include <stddef.h>
+#include "filemap.h"
+
+// 从共享映射发送文件时用MSG_ZEROCOPY 内核直接引用映射的页 不复制到socket缓冲区
+// 内核按sendmsg的顺序从0编号 发完后通过socket的错误队列通知(EPOLLERR) 见zerocopy_reap
+// 还有没完成的发送时 响应结束也不释放映射的引用 先放在retired 通知追上之后再释放
+// 只对映射中的文件内容用 响应头在buf里 buf马上会被复用 总是复制发送
+
+// 每个连接的状态
+typedef struct{
+    int state;              // 0 还没启用 1 已经设置SO_ZEROCOPY -1 这个连接不用(不支持 或者内核实际还是复制了)
+    uint32_t sent;          // 带MSG_ZEROCOPY的sendmsg次数
+    uint32_t done;          // 内核已经通知完成的个数
+    FileMap *retired;       // 已经结束的响应的映射 done追上retire_at后释放
+    uint32_t retire_at;
+} ZeroCopy;
+
+static inline void zerocopy_init(ZeroCopy *zc) {
+    zc->state = 0;
+    zc->sent = zc->done = 0;
+    zc->retired = NULL;
+    zc->retire_at = 0;
+}
+
+static inline int zerocopy_pending(const ZeroCopy *zc) {
+    return zc->sent != zc->done;
+}
+
+// 这次从map发送len字节要不要带MSG_ZEROCOPY 不够zerocopy_min或者还有别的映射在等通知时不用
+// 第一次用时设置SO_ZEROCOPY
+int zerocopy_use(ZeroCopy *zc, int fd, FileMap *map, size_t len);
+// 读完错误队列中的完成通知 释放可以释放的映射 socket真的出错时返回-1
+int zerocopy_reap(ZeroCopy *zc, int fd);
+// 响应结束 代替filemap_put 还有没完成的发送时留到通知之后
+void zerocopy_retire(ZeroCopy *zc, FileMap *map);
+// 连接关闭 内核还在用的页已经被它自己引用 映射可以直接释放
+void zerocopy_release(ZeroCopy *zc);
+
+#endif